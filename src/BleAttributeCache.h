@@ -0,0 +1,236 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleWatchdog.h"
+#if BLE_RADIO_CENTRAL
+
+/** Client-side cache of remote attribute values.
+ *  A fresh entry answers a read locally instead of costing an ATT round trip of one
+ *  or more connection intervals. Entries are refreshed by notifications, dropped when
+ *  we write the attribute and expire after BLE_CACHE_TTL_MS.
+ *  Entries are keyed by connection and attribute handle, and are shared between the
+ *  host task (notifications) and update() (reads), so access is guarded.
+ */
+#ifndef BLE_CACHE_ENTRIES
+#define BLE_CACHE_ENTRIES 16
+#endif
+#ifndef BLE_CACHE_MAX_VALUE
+/** Larger values are always read remotely */
+#define BLE_CACHE_MAX_VALUE 64
+#endif
+#ifndef BLE_CACHE_TTL_MS
+#define BLE_CACHE_TTL_MS 5000
+#endif
+
+struct BleCacheStats
+{
+    /** Reads answered locally: each one is a round trip saved */
+    uint32_t hits;
+    /** Reads that went to the peer */
+    uint32_t misses;
+    /** Entries refreshed by a notification */
+    uint32_t notifications;
+    /** Entries dropped because we wrote the attribute */
+    uint32_t invalidations;
+    /** Entries found stale on read */
+    uint32_t expirations;
+    /** Reads that came back empty, left uncached */
+    uint32_t failures;
+    /** Hits per 1000 reads */
+    uint32_t hitRate() const
+    {
+        uint32_t reads = hits + misses;
+        return reads ? (uint32_t)((uint64_t)hits * 1000 / reads) : 0;
+    }
+};
+
+class BleAttributeCache
+{
+    struct Entry
+    {
+        uint32_t ts;
+        uint16_t conn;
+        uint16_t handle;
+        uint8_t size;
+        bool used;
+        uint8_t data[BLE_CACHE_MAX_VALUE];
+    };
+    Entry m_entries[BLE_CACHE_ENTRIES];
+    BleCacheStats m_stats;
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    Entry *find(uint16_t conn, uint16_t handle)
+    {
+        for (size_t i = 0; i < BLE_CACHE_ENTRIES; ++i)
+        {
+            if (m_entries[i].used && m_entries[i].conn == conn && m_entries[i].handle == handle)
+            {
+                return &m_entries[i];
+            }
+        }
+        return nullptr;
+    }
+    /** Call with the lock held */
+    void store(uint16_t conn, uint16_t handle, const uint8_t *data, size_t size, uint32_t now)
+    {
+        Entry *pEntry = find(conn, handle);
+        if (size > BLE_CACHE_MAX_VALUE)
+        {
+            if (nullptr != pEntry)
+            {
+                pEntry->used = false;
+            }
+            return;
+        }
+        if (nullptr == pEntry)
+        {
+            /** Take a free entry, else evict the least recently refreshed one */
+            pEntry = &m_entries[0];
+            for (size_t i = 0; i < BLE_CACHE_ENTRIES; ++i)
+            {
+                if (!m_entries[i].used)
+                {
+                    pEntry = &m_entries[i];
+                    break;
+                }
+                if (now - m_entries[i].ts > now - pEntry->ts)
+                {
+                    pEntry = &m_entries[i];
+                }
+            }
+        }
+        pEntry->conn = conn;
+        pEntry->handle = handle;
+        pEntry->size = (uint8_t)size;
+        pEntry->ts = now;
+        pEntry->used = true;
+        memcpy(pEntry->data, data, size);
+    }
+    /** Returns true and fills value on a fresh hit. The entry is copied out under the
+     *  lock and into the string after it, which may allocate
+     */
+    bool lookup(uint16_t conn, uint16_t handle, std::string *value, uint32_t now)
+    {
+        uint8_t data[BLE_CACHE_MAX_VALUE];
+        size_t size = 0;
+        bool hit = false;
+        portENTER_CRITICAL(&m_lock);
+        Entry *pEntry = find(conn, handle);
+        if (nullptr != pEntry)
+        {
+            if (BLE_CACHE_TTL_MS > now - pEntry->ts)
+            {
+                size = pEntry->size;
+                memcpy(data, pEntry->data, size);
+                hit = true;
+                ++m_stats.hits;
+            }
+            else
+            {
+                pEntry->used = false;
+                ++m_stats.expirations;
+            }
+        }
+        if (!hit)
+        {
+            ++m_stats.misses;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        if (hit)
+        {
+            value->assign((const char *)data, size);
+        }
+        return hit;
+    }
+    /** Caches a value read from the peer. NimBLE returns an empty value when a read fails,
+     *  so empty values aren't cached: a failure is retried on the next read instead of
+     *  being served for BLE_CACHE_TTL_MS
+     */
+    void fill(uint16_t conn, uint16_t handle, const std::string &value, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        if (value.empty())
+        {
+            ++m_stats.failures;
+        }
+        else
+        {
+            store(conn, handle, (const uint8_t *)value.data(), value.length(), now);
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+
+public:
+    void begin()
+    {
+        memset(m_entries, 0, sizeof(m_entries));
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    /** Reads a characteristic, locally if the cached value is fresh */
+    std::string read(NimBLERemoteCharacteristic *pChr, uint32_t now)
+    {
+        uint16_t conn = pChr->getRemoteService()->getClient()->getConnId();
+        std::string value;
+        if (!lookup(conn, pChr->getHandle(), &value, now))
+        {
+            value = ble_watched(BLE_OP_READ, conn, [&]
+                                { return pChr->readValue(); });
+            fill(conn, pChr->getHandle(), value, now);
+        }
+        return value;
+    }
+    /** Reads a descriptor, locally if the cached value is fresh */
+    std::string read(NimBLEClient *pClient, NimBLERemoteDescriptor *pDsc, uint32_t now)
+    {
+        uint16_t conn = pClient->getConnId();
+        std::string value;
+        if (!lookup(conn, pDsc->getHandle(), &value, now))
+        {
+            value = ble_watched(BLE_OP_READ, conn, [&]
+                                { return pDsc->readValue(); });
+            fill(conn, pDsc->getHandle(), value, now);
+        }
+        return value;
+    }
+    /** A notification carries the characteristic's new value. Called from the host task */
+    void notified(NimBLERemoteCharacteristic *pChr, const uint8_t *data, size_t size, uint32_t now)
+    {
+        uint16_t conn = pChr->getRemoteService()->getClient()->getConnId();
+        portENTER_CRITICAL(&m_lock);
+        store(conn, pChr->getHandle(), data, size, now);
+        ++m_stats.notifications;
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** We wrote the attribute, so the cached value no longer holds */
+    void invalidate(uint16_t conn, uint16_t handle)
+    {
+        portENTER_CRITICAL(&m_lock);
+        Entry *pEntry = find(conn, handle);
+        if (nullptr != pEntry)
+        {
+            pEntry->used = false;
+            ++m_stats.invalidations;
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Drops everything cached for a connection */
+    void drop(uint16_t conn)
+    {
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < BLE_CACHE_ENTRIES; ++i)
+        {
+            if (m_entries[i].conn == conn)
+            {
+                m_entries[i].used = false;
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    BleCacheStats stats()
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCacheStats result = m_stats;
+        portEXIT_CRITICAL(&m_lock);
+        return result;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
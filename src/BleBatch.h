@@ -0,0 +1,307 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleHistogram.h"
+#include "BleBoundValue.h"
+
+/** Packs many small timestamped samples into one notification instead of spending a
+ *  notification, and its ATT and link layer overhead, on each. The peripheral fills a frame
+ *  as samples come and sends it when the next one wouldn't fit the smallest subscriber's
+ *  MTU, or when its oldest sample has waited BLE_BATCH_LATENCY_MS.
+ *
+ *  Frame: [version][count][u32 first ts][u32 sent ts] then per sample
+ *  [varint ms since previous sample][zigzag varint change from previous value].
+ *  The first sample's deltas are from the first ts and 0. Timestamps are the sender's
+ *  BleClock; a receiver places samples on its own clock by their age when the frame was sent.
+ */
+#ifndef BLE_BATCH_LATENCY_MS
+#define BLE_BATCH_LATENCY_MS 200
+#endif
+#ifndef BLE_BATCH_QUEUE_SIZE
+/** Sample frames buffered between the host task and the central's update(), apart from
+ *  other notifications so a burst of samples can't crowd out configuration acks
+ */
+#define BLE_BATCH_QUEUE_SIZE (2 * NIMBLE_MAX_CONNECTIONS)
+#endif
+#define BLE_BATCH_VERSION 1
+#define BLE_BATCH_HEADER_SIZE 10
+/** Two varints of up to 5 bytes */
+#define BLE_BATCH_SAMPLE_MAX 10
+
+struct BleSample
+{
+    uint32_t ts;
+    int32_t value;
+};
+/** Receives a sample from a peer, with ts on the receiver's BleClock. Runs from update() */
+typedef void (*BleSampleHandler)(const NimBLEAddress &peer, const BleSample &sample, void *state);
+
+inline size_t ble_put_varint(uint8_t *p, uint32_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80)
+    {
+        p[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    p[size++] = (uint8_t)value;
+    return size;
+}
+/** Returns the bytes used, 0 if the varint runs past end */
+inline size_t ble_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (size_t i = 0; i < 5 && p + i < end; ++i)
+    {
+        result |= (uint32_t)(p[i] & 0x7F) << (7 * i);
+        if (0 == (p[i] & 0x80))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+/** Small changes either way encode small */
+inline uint32_t ble_zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+inline int32_t ble_unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+inline void ble_batch_put_u32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+inline uint32_t ble_batch_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+inline bool ble_batch_is_frame(const uint8_t *data, size_t size)
+{
+    return size >= BLE_BATCH_HEADER_SIZE && BLE_BATCH_VERSION == data[0];
+}
+
+/** Walks the samples of a received frame in place, without copying or allocating */
+class BleBatchReader
+{
+    const uint8_t *m_p;
+    const uint8_t *m_end;
+    uint8_t m_left;
+    BleSample m_last;
+    uint32_t m_sentTS;
+
+public:
+    /** Returns false if data isn't a frame */
+    bool begin(const uint8_t *data, size_t size)
+    {
+        if (!ble_batch_is_frame(data, size))
+        {
+            return false;
+        }
+        m_left = data[1];
+        m_last.ts = ble_batch_get_u32(data + 2);
+        m_last.value = 0;
+        m_sentTS = ble_batch_get_u32(data + 6);
+        m_p = data + BLE_BATCH_HEADER_SIZE;
+        m_end = data + size;
+        return true;
+    }
+    /** The samples left to read */
+    size_t count() const
+    {
+        return m_left;
+    }
+    /** How long before the frame was sent a sample was taken, in ms */
+    uint32_t age(const BleSample &sample) const
+    {
+        return m_sentTS - sample.ts;
+    }
+    /** Reads the next sample. Returns false at the end, or if the frame is truncated */
+    bool next(BleSample *pSample)
+    {
+        if (0 == m_left)
+        {
+            return false;
+        }
+        uint32_t delta, change;
+        size_t used = ble_get_varint(m_p, m_end, &delta);
+        if (0 == used)
+        {
+            m_left = 0;
+            return false;
+        }
+        size_t more = ble_get_varint(m_p + used, m_end, &change);
+        if (0 == more)
+        {
+            m_left = 0;
+            return false;
+        }
+        m_p += used + more;
+        --m_left;
+        m_last.ts += delta;
+        m_last.value = (int32_t)((uint32_t)m_last.value + (uint32_t)ble_unzigzag(change));
+        *pSample = m_last;
+        return true;
+    }
+};
+
+#if BLE_RADIO_PERIPHERAL
+struct BleBatchStats
+{
+    uint32_t samples;
+    uint32_t frames;
+    /** Frames sent because the next sample wouldn't fit, the rest went on the deadline */
+    uint32_t full;
+    /** Bytes of frames sent, headers included */
+    uint32_t bytes;
+    /** Samples in frames no one was subscribed to */
+    uint32_t unsent;
+    /** From a frame's oldest sample to its notification, in ms */
+    BleLatencyHistogram latency;
+};
+
+/** Builds frames in the buffer of a bound characteristic, so reads see the frame being
+ *  filled and each frame is queued as bulk traffic when it is done. Call from the loop task
+ */
+class BleSampleBatcher
+{
+    BleBoundValue *m_pBound;
+    NimBLEServer *m_pServer;
+    uint32_t m_latency;
+    /** Frame size the subscribers can take, set as each frame starts */
+    size_t m_limit;
+    size_t m_size;
+    uint8_t m_count;
+    uint32_t m_firstTS;
+    BleSample m_last;
+    BleBatchStats m_stats;
+
+    /** Returns false, without touching the buffer, if nobody is subscribed */
+    bool start(uint32_t now)
+    {
+        m_limit = m_pBound->payload(m_pServer);
+        if (0 == m_limit)
+        {
+            return false;
+        }
+        if (m_limit > m_pBound->capacity())
+        {
+            m_limit = m_pBound->capacity();
+        }
+        uint8_t *p = m_pBound->edit();
+        p[0] = BLE_BATCH_VERSION;
+        p[1] = 0;
+        ble_batch_put_u32(p + 2, now);
+        ble_batch_put_u32(p + 6, now);
+        m_pBound->commit(BLE_BATCH_HEADER_SIZE);
+        m_size = BLE_BATCH_HEADER_SIZE;
+        m_count = 0;
+        m_firstTS = now;
+        m_last.ts = now;
+        m_last.value = 0;
+        return true;
+    }
+
+public:
+    void begin(BleBoundValue *pBound, NimBLEServer *pServer, uint32_t latency = BLE_BATCH_LATENCY_MS)
+    {
+        m_pBound = pBound;
+        m_pServer = pServer;
+        m_latency = latency;
+        m_size = 0;
+        m_count = 0;
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    BleBoundValue *bound() const
+    {
+        return m_pBound;
+    }
+    bool enabled() const
+    {
+        return nullptr != m_pBound && m_pBound->capacity() >= BLE_BATCH_HEADER_SIZE + BLE_BATCH_SAMPLE_MAX;
+    }
+    /** Adds a sample taken at now, sending the frame first if it wouldn't fit.
+     *  Returns false, having spent nothing on encoding, while nobody is subscribed
+     */
+    bool add(int32_t value, uint32_t now)
+    {
+        if (!enabled() || (0 == m_count && !start(now)))
+        {
+            return false;
+        }
+        uint8_t sample[BLE_BATCH_SAMPLE_MAX];
+        size_t size = ble_put_varint(sample, now - m_last.ts);
+        size += ble_put_varint(sample + size, ble_zigzag((int32_t)((uint32_t)value - (uint32_t)m_last.value)));
+        if (m_size + size > m_limit || 255 == m_count)
+        {
+            ++m_stats.full;
+            flush(now);
+            return add(value, now);
+        }
+        uint8_t *p = m_pBound->edit();
+        memcpy(p + m_size, sample, size);
+        p[1] = ++m_count;
+        m_pBound->commit(m_size + size);
+        m_size += size;
+        m_last.ts = now;
+        m_last.value = value;
+        ++m_stats.samples;
+        return true;
+    }
+    /** Sends the frame if its oldest sample is due */
+    void update(uint32_t now)
+    {
+        if (m_count && now - m_firstTS >= m_latency)
+        {
+            flush(now);
+        }
+    }
+    /** Sends what has been batched, if anything */
+    void flush(uint32_t now)
+    {
+        if (0 == m_count)
+        {
+            return;
+        }
+        ble_batch_put_u32(m_pBound->edit() + 6, now);
+        m_pBound->commit(m_size);
+        /** Copied, as the next frame starts in the same buffer */
+        if (m_pBound->publish(m_pServer, BLE_QOS_BULK, true))
+        {
+            ++m_stats.frames;
+            m_stats.bytes += m_size;
+            m_stats.latency.record(now - m_firstTS);
+        }
+        else
+        {
+            m_stats.unsent += m_count;
+        }
+        m_count = 0;
+    }
+    const BleBatchStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE batching: "));
+        out.print(m_stats.samples);
+        out.print(F(" samples in "));
+        out.print(m_stats.frames);
+        out.print(F(" frames ("));
+        out.print(m_stats.full);
+        out.print(F(" full), "));
+        out.print(m_stats.bytes);
+        out.print(F("B, "));
+        out.print(m_stats.unsent);
+        out.println(F(" unsent"));
+        out.print(F("BLE batch latency "));
+        m_stats.latency.report(out, F("ms"));
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
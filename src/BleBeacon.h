@@ -0,0 +1,431 @@
+#pragma once
+#include "BleRadioConfig.h"
+
+/** A diagnostics summary broadcast in the scan response, so a collector can watch many
+ *  peripherals without connecting to any. It travels as service data under the session
+ *  service UUID, which leaves 13 bytes:
+ *
+ *  [version << 4 | page][sequence][flags][10 byte page body]
+ *
+ *  The pages take turns, one per BLE_BEACON_ROTATE_MS. sequence counts changes to any
+ *  page's content, so a collector can tell fresh data from a repeat. Multi-byte fields are
+ *  little endian. Collectors need an active scan to receive scan responses.
+ */
+#define BLE_BEACON_VERSION 1
+#define BLE_BEACON_SIZE 13
+#define BLE_BEACON_HEADER_SIZE 3
+#define BLE_BEACON_BODY_SIZE (BLE_BEACON_SIZE - BLE_BEACON_HEADER_SIZE)
+#ifndef BLE_BEACON_ROTATE_MS
+/** How long each page is advertised. Several advertising intervals, so scanners catch it */
+#define BLE_BEACON_ROTATE_MS 1000
+#endif
+#ifndef BLE_BEACON_LOW_HEAP
+/** Below this many bytes of free heap the beacon flags low memory */
+#define BLE_BEACON_LOW_HEAP 16384
+#endif
+
+enum BleBeaconPage : uint8_t
+{
+    /** Uptime, heap, connections, last reset and stalls */
+    BLE_BEACON_STATUS = 0,
+    /** RPC requests and errors, notifications sent */
+    BLE_BEACON_TRAFFIC,
+    /** Bytes supplied by the application, only sent once it sets them */
+    BLE_BEACON_USER,
+    BLE_BEACON_PAGES
+};
+enum BleBeaconFlag : uint8_t
+{
+    BLE_BEACON_CONNECTED = 0x01,
+    BLE_BEACON_LOW_MEMORY = 0x02,
+    BLE_BEACON_STALLED = 0x04,
+    BLE_BEACON_RPC_ERRORS = 0x08,
+    /** The last reset was a panic, watchdog or brownout */
+    BLE_BEACON_BAD_RESET = 0x10
+};
+
+struct BleBeaconStatus
+{
+    uint32_t uptimeMinutes;
+    uint16_t minFreeHeapKiB;
+    uint8_t connections;
+    uint8_t resetReason;
+    uint16_t stalls;
+};
+struct BleBeaconTraffic
+{
+    uint32_t rpcRequests;
+    uint16_t rpcErrors;
+    uint32_t notifications;
+};
+
+inline void ble_beacon_put(uint8_t *p, uint32_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        p[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+inline uint32_t ble_beacon_get(const uint8_t *p, size_t size)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+    return value;
+}
+/** Page bodies, also how beacons are stored by BleTimeSeries */
+inline void ble_beacon_put_status(uint8_t *body, const BleBeaconStatus &status)
+{
+    ble_beacon_put(body, status.uptimeMinutes, 4);
+    ble_beacon_put(body + 4, status.minFreeHeapKiB, 2);
+    body[6] = status.connections;
+    body[7] = status.resetReason;
+    ble_beacon_put(body + 8, status.stalls, 2);
+}
+inline void ble_beacon_get_status(const uint8_t *body, BleBeaconStatus *status)
+{
+    status->uptimeMinutes = ble_beacon_get(body, 4);
+    status->minFreeHeapKiB = (uint16_t)ble_beacon_get(body + 4, 2);
+    status->connections = body[6];
+    status->resetReason = body[7];
+    status->stalls = (uint16_t)ble_beacon_get(body + 8, 2);
+}
+inline void ble_beacon_put_traffic(uint8_t *body, const BleBeaconTraffic &traffic)
+{
+    ble_beacon_put(body, traffic.rpcRequests, 4);
+    ble_beacon_put(body + 4, traffic.rpcErrors, 2);
+    ble_beacon_put(body + 6, traffic.notifications, 4);
+}
+inline void ble_beacon_get_traffic(const uint8_t *body, BleBeaconTraffic *traffic)
+{
+    traffic->rpcRequests = ble_beacon_get(body, 4);
+    traffic->rpcErrors = (uint16_t)ble_beacon_get(body + 4, 2);
+    traffic->notifications = ble_beacon_get(body + 6, 4);
+}
+
+#if BLE_RADIO_PERIPHERAL
+struct BleBeaconStats
+{
+    /** Times the scan response was replaced, and times a page's content changed */
+    uint32_t updates;
+    uint32_t changes;
+};
+
+/** Builds the pages and rotates them through the scan response. A page is only
+ *  re-encoded when its inputs change, and the advertisement only rewritten when the page
+ *  to show differs from what is on air
+ */
+class BleBeaconEncoder
+{
+    uint8_t m_bodies[BLE_BEACON_PAGES][BLE_BEACON_BODY_SIZE];
+    /** What the scan response currently holds */
+    uint8_t m_air[BLE_BEACON_SIZE];
+    uint32_t m_rotateTS;
+    uint8_t m_page;
+    uint8_t m_sequence;
+    uint8_t m_flags;
+    bool m_user;
+    bool m_onAir;
+    BleBeaconStats m_stats;
+
+    void set(uint8_t page, const uint8_t *body)
+    {
+        if (0 != memcmp(m_bodies[page], body, BLE_BEACON_BODY_SIZE))
+        {
+            memcpy(m_bodies[page], body, BLE_BEACON_BODY_SIZE);
+            ++m_sequence;
+            ++m_stats.changes;
+        }
+    }
+    void show(uint8_t page)
+    {
+        uint8_t beacon[BLE_BEACON_SIZE];
+        beacon[0] = (uint8_t)(BLE_BEACON_VERSION << 4 | page);
+        beacon[1] = m_sequence;
+        beacon[2] = m_flags;
+        memcpy(beacon + BLE_BEACON_HEADER_SIZE, m_bodies[page], BLE_BEACON_BODY_SIZE);
+        if (m_onAir && 0 == memcmp(beacon, m_air, sizeof(beacon)))
+        {
+            return;
+        }
+        NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
+        if (nullptr == pAdvertising)
+        {
+            return;
+        }
+        /** Setting the response data is one HCI command, it doesn't restart advertising */
+        NimBLEAdvertisementData response;
+        response.setServiceData(BleSessionService::uuid().toNimBLE(), std::string((const char *)beacon, sizeof(beacon)));
+        pAdvertising->setScanResponseData(response);
+        memcpy(m_air, beacon, sizeof(beacon));
+        m_onAir = true;
+        ++m_stats.updates;
+    }
+
+public:
+    void begin()
+    {
+        memset(m_bodies, 0, sizeof(m_bodies));
+        memset(m_air, 0, sizeof(m_air));
+        m_rotateTS = 0;
+        m_page = 0;
+        m_sequence = 0;
+        m_flags = 0;
+        m_user = false;
+        m_onAir = false;
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    /** Whether it is time for the next page. Gather the inputs to update() only then */
+    bool due(uint32_t now) const
+    {
+        return !m_onAir || BLE_BEACON_ROTATE_MS <= now - m_rotateTS;
+    }
+    /** Sets the application's page */
+    void user(const uint8_t *data, size_t size)
+    {
+        uint8_t body[BLE_BEACON_BODY_SIZE];
+        memset(body, 0, sizeof(body));
+        memcpy(body, data, size < sizeof(body) ? size : sizeof(body));
+        set(BLE_BEACON_USER, body);
+        m_user = true;
+    }
+    /** Refreshes the pages and puts the next one on air */
+    void update(uint32_t now, uint8_t flags, const BleBeaconStatus &status, const BleBeaconTraffic &traffic)
+    {
+        uint8_t body[BLE_BEACON_BODY_SIZE];
+        ble_beacon_put_status(body, status);
+        set(BLE_BEACON_STATUS, body);
+        ble_beacon_put_traffic(body, traffic);
+        set(BLE_BEACON_TRAFFIC, body);
+        if (flags != m_flags)
+        {
+            m_flags = flags;
+            ++m_sequence;
+            ++m_stats.changes;
+        }
+        if (m_onAir)
+        {
+            m_page = (m_page + 1) % (m_user ? BLE_BEACON_PAGES : BLE_BEACON_USER);
+        }
+        m_rotateTS = now;
+        show(m_page);
+    }
+    const BleBeaconStats &stats() const
+    {
+        return m_stats;
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
+
+#if BLE_RADIO_CENTRAL
+#ifndef BLE_BEACON_ENTRIES
+#define BLE_BEACON_ENTRIES 32
+#endif
+
+/** Everything heard from one peripheral's beacon, merged across pages */
+struct BleBeaconReport
+{
+    ble_addr_t address;
+    uint8_t version;
+    uint8_t sequence;
+    uint8_t flags;
+    /** Bit n set once page n has been received */
+    uint8_t pages;
+    int8_t rssi;
+    uint32_t seenTS;
+    BleBeaconStatus status;
+    BleBeaconTraffic traffic;
+    uint8_t user[BLE_BEACON_BODY_SIZE];
+    /** The last beacon received, and whether it brought news not yet taken */
+    uint8_t raw[BLE_BEACON_SIZE];
+    /** The sequence each page was last received with */
+    uint8_t pageSequence[BLE_BEACON_PAGES];
+    bool fresh;
+    bool used;
+    NimBLEAddress getAddress() const
+    {
+        return NimBLEAddress(address);
+    }
+};
+struct BleBeaconTableStats
+{
+    uint32_t decoded;
+    /** Beacons too short or of a version this build doesn't know */
+    uint32_t rejected;
+};
+
+/** Decodes one beacon into report. Returns false if it isn't one this build understands */
+inline bool ble_beacon_decode(const uint8_t *data, size_t size, BleBeaconReport *report)
+{
+    if (size < BLE_BEACON_SIZE || BLE_BEACON_VERSION != data[0] >> 4)
+    {
+        return false;
+    }
+    uint8_t page = data[0] & 0x0F;
+    const uint8_t *body = data + BLE_BEACON_HEADER_SIZE;
+    switch (page)
+    {
+    case BLE_BEACON_STATUS:
+        ble_beacon_get_status(body, &report->status);
+        break;
+    case BLE_BEACON_TRAFFIC:
+        ble_beacon_get_traffic(body, &report->traffic);
+        break;
+    case BLE_BEACON_USER:
+        memcpy(report->user, body, BLE_BEACON_BODY_SIZE);
+        break;
+    default:
+        /** A page added by a later build: keep the header, skip the body */
+        break;
+    }
+    report->version = data[0] >> 4;
+    report->sequence = data[1];
+    report->flags = data[2];
+    if (page < 8)
+    {
+        report->pages |= (uint8_t)(1 << page);
+    }
+    return true;
+}
+
+/** The latest beacon of each peripheral heard. Fed from scan results on the host task;
+ *  the least recently heard peripheral is replaced when the table is full
+ */
+class BleBeaconTable
+{
+    BleBeaconReport m_reports[BLE_BEACON_ENTRIES];
+    BleBeaconTableStats m_stats;
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    /** Call with the lock held */
+    BleBeaconReport *find(const NimBLEAddress &address, bool create, uint32_t now)
+    {
+        BleBeaconReport *pOldest = nullptr;
+        for (size_t i = 0; i < BLE_BEACON_ENTRIES; ++i)
+        {
+            BleBeaconReport &report = m_reports[i];
+            if (report.used && report.address.type == address.getType() &&
+                0 == memcmp(report.address.val, address.getNative(), sizeof(report.address.val)))
+            {
+                return &report;
+            }
+            if (nullptr == pOldest || !report.used ||
+                (pOldest->used && now - report.seenTS > now - pOldest->seenTS))
+            {
+                pOldest = &report;
+            }
+        }
+        if (!create)
+        {
+            return nullptr;
+        }
+        memset(pOldest, 0, sizeof(BleBeaconReport));
+        pOldest->address.type = address.getType();
+        memcpy(pOldest->address.val, address.getNative(), sizeof(pOldest->address.val));
+        pOldest->used = true;
+        return pOldest;
+    }
+
+public:
+    void begin()
+    {
+        memset(m_reports, 0, sizeof(m_reports));
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    /** Records a beacon from a scan result. Returns true if the address wasn't known */
+    bool received(const NimBLEAddress &address, int rssi, const uint8_t *data, size_t size, uint32_t now)
+    {
+        BleBeaconReport report;
+        portENTER_CRITICAL(&m_lock);
+        BleBeaconReport *pReport = find(address, false, now);
+        bool added = nullptr == pReport;
+        /** Decoded aside first, so a beacon this build can't read evicts nobody */
+        if (added)
+        {
+            memset(&report, 0, sizeof(report));
+        }
+        else
+        {
+            report = *pReport;
+        }
+        if (!ble_beacon_decode(data, size, &report))
+        {
+            ++m_stats.rejected;
+            portEXIT_CRITICAL(&m_lock);
+            return false;
+        }
+        if (added)
+        {
+            pReport = find(address, true, now);
+            report.address = pReport->address;
+            report.used = true;
+        }
+        /** News is a page not seen before, or seen before the sequence last moved */
+        uint8_t page = data[0] & 0x0F;
+        if (page < BLE_BEACON_PAGES && (pReport->pages != report.pages || report.pageSequence[page] != report.sequence))
+        {
+            report.pageSequence[page] = report.sequence;
+            memcpy(report.raw, data, BLE_BEACON_SIZE);
+            report.fresh = true;
+        }
+        report.rssi = (int8_t)rssi;
+        report.seenTS = now;
+        *pReport = report;
+        ++m_stats.decoded;
+        portEXIT_CRITICAL(&m_lock);
+        return added;
+    }
+    /** Copies the report for address. Returns false if no beacon has been heard from it */
+    bool get(const NimBLEAddress &address, BleBeaconReport *report)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleBeaconReport *pReport = find(address, false, 0);
+        if (nullptr != pReport)
+        {
+            *report = *pReport;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return nullptr != pReport;
+    }
+    /** Copies the report in slot index, for iterating. Returns false if the slot is empty */
+    bool get(size_t index, BleBeaconReport *report)
+    {
+        if (index >= BLE_BEACON_ENTRIES)
+        {
+            return false;
+        }
+        portENTER_CRITICAL(&m_lock);
+        *report = m_reports[index];
+        portEXIT_CRITICAL(&m_lock);
+        return report->used;
+    }
+    /** Like get(index), but only returns a report with news since it was last taken */
+    bool take(size_t index, BleBeaconReport *report)
+    {
+        if (index >= BLE_BEACON_ENTRIES)
+        {
+            return false;
+        }
+        portENTER_CRITICAL(&m_lock);
+        BleBeaconReport &slot = m_reports[index];
+        bool fresh = slot.used && slot.fresh;
+        if (fresh)
+        {
+            *report = slot;
+            slot.fresh = false;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return fresh;
+    }
+    static constexpr size_t capacity()
+    {
+        return BLE_BEACON_ENTRIES;
+    }
+    const BleBeaconTableStats &stats() const
+    {
+        return m_stats;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,274 @@
+#pragma once
+#include <atomic>
+#include "BleRadioConfig.h"
+#include "BleTraffic.h"
+#if BLE_RADIO_PERIPHERAL
+
+/** A characteristic whose value lives in an application owned buffer.
+ *  The application edits the buffer in place between edit() and commit(), which costs no
+ *  copy or allocation however often it changes. publish() queues a reference per
+ *  subscriber on BleTraffic and the value is copied as each notification goes out, so
+ *  publishing again before then sends only the latest value. Reads and notifications take
+ *  a consistent snapshot; the sequence counter commit() bumps (a seqlock) lets them retry
+ *  if they race an edit.
+ *  Writes reach the application as a span over the received bytes.
+ */
+#ifndef BLE_BOUND_MAX
+#define BLE_BOUND_MAX 4
+#endif
+#ifndef BLE_BOUND_READ_RETRIES
+/** Snapshot attempts before a read settles for a value an edit was changing */
+#define BLE_BOUND_READ_RETRIES 100
+#endif
+
+/** A view of bytes owned by someone else, valid only as long as they say */
+struct BleSpan
+{
+    const uint8_t *data;
+    size_t size;
+};
+/** Receives a write to a bound characteristic. Runs on the NimBLE host task; value is only
+ *  valid for the duration of the call
+ */
+typedef void (*BleBoundWriteHandler)(uint16_t conn, BleSpan value, void *state);
+
+struct BleBoundStats
+{
+    uint32_t reads;
+    /** Reads that had to retry because an edit was in progress */
+    uint32_t readRetries;
+    /** Reads that ran out of retries */
+    uint32_t tornReads;
+    uint32_t notifications;
+    uint32_t writes;
+};
+
+class BleBoundValue
+{
+    NimBLECharacteristic *m_pChr;
+    /** The server of the last publish(), for the MTUs its notifications go out at */
+    NimBLEServer *m_pServer;
+    uint8_t *m_data;
+    size_t m_capacity;
+    size_t m_size;
+    /** Odd while an edit is in progress */
+    std::atomic<uint32_t> m_sequence;
+    BleBoundWriteHandler m_onWrite;
+    void *m_state;
+    /** Connections subscribed to notifications, maintained from the host task */
+    uint16_t m_subscribers[NIMBLE_MAX_CONNECTIONS];
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+    BleBoundStats m_stats;
+
+    /** Copies up to capacity bytes of the value into out, retrying while an edit races it.
+     *  Returns the size copied
+     */
+    size_t snapshot(uint8_t *out, size_t capacity)
+    {
+        size_t size = 0;
+        for (size_t attempt = 0; attempt < BLE_BOUND_READ_RETRIES; ++attempt)
+        {
+            uint32_t before = m_sequence.load(std::memory_order_acquire);
+            if (0 == (before & 1))
+            {
+                size = m_size < capacity ? m_size : capacity;
+                memcpy(out, m_data, size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (before == m_sequence.load(std::memory_order_relaxed))
+                {
+                    return size;
+                }
+            }
+            ++m_stats.readRetries;
+        }
+        ++m_stats.tornReads;
+        return size;
+    }
+    /** The most a notification to conn can carry */
+    size_t room(uint16_t conn) const
+    {
+        uint16_t mtu = m_pServer->getPeerMTU(conn);
+        size_t size = mtu > 3 ? mtu - 3 : 0;
+        return size < BLE_FRAME_MAX_SIZE ? size : BLE_FRAME_MAX_SIZE;
+    }
+    /** Sends a published notification from BleTraffic, with the value as it is now */
+    static bool notify(uint16_t conn, void *target, const uint8_t *data, size_t size)
+    {
+        (void)data;
+        (void)size;
+        BleBoundValue *pValue = (BleBoundValue *)target;
+        uint8_t frame[BLE_FRAME_MAX_SIZE];
+        size = pValue->snapshot(frame, pValue->room(conn));
+        return ble_traffic_notify(conn, pValue->m_pChr, frame, size);
+    }
+
+public:
+    void bind(NimBLECharacteristic *pChr, uint8_t *buffer, size_t capacity, size_t size, BleBoundWriteHandler onWrite, void *state)
+    {
+        m_pChr = pChr;
+        m_pServer = nullptr;
+        m_data = buffer;
+        m_capacity = capacity;
+        m_size = size < capacity ? size : capacity;
+        m_sequence = 0;
+        m_onWrite = onWrite;
+        m_state = state;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            m_subscribers[i] = BLE_HS_CONN_HANDLE_NONE;
+        }
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    NimBLECharacteristic *characteristic() const
+    {
+        return m_pChr;
+    }
+    const uint8_t *data() const
+    {
+        return m_data;
+    }
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+    /** Copies the connections subscribed to notifications into conns, which holds
+     *  NIMBLE_MAX_CONNECTIONS. Returns how many there are
+     */
+    size_t subscribers(uint16_t *conns)
+    {
+        size_t count = 0;
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (BLE_HS_CONN_HANDLE_NONE != m_subscribers[i])
+            {
+                conns[count++] = m_subscribers[i];
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return count;
+    }
+    /** The most a notification can carry to every subscriber: the smallest ATT payload
+     *  of their MTUs. 0 without subscribers
+     */
+    size_t payload(NimBLEServer *pServer)
+    {
+        uint16_t subscribers[NIMBLE_MAX_CONNECTIONS];
+        size_t count = this->subscribers(subscribers);
+        size_t smallest = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint16_t mtu = pServer->getPeerMTU(subscribers[i]);
+            if (mtu > 3 && (0 == smallest || mtu - 3u < smallest))
+            {
+                smallest = mtu - 3;
+            }
+        }
+        return smallest;
+    }
+    /** Starts an edit and returns the buffer to change in place. Keep edits short: a read
+     *  arriving meanwhile spins until commit()
+     */
+    uint8_t *edit()
+    {
+        m_sequence.fetch_add(1, std::memory_order_acq_rel);
+        return m_data;
+    }
+    /** Ends an edit, setting how many bytes of the buffer are the value */
+    void commit(size_t size)
+    {
+        m_size = size < m_capacity ? size : m_capacity;
+        m_sequence.fetch_add(1, std::memory_order_release);
+    }
+    /** Queues a notification of the buffer for every subscriber, as traffic of class
+     *  traffic. The value must stay bound while notifications are queued. With copy each
+     *  notification holds the value as it is now, for values that are messages rather than
+     *  state and are refilled straight away. Returns the number of connections queued for
+     */
+    size_t publish(NimBLEServer *pServer, uint8_t traffic = BLE_QOS_INTERACTIVE, bool copy = false)
+    {
+        uint16_t subscribers[NIMBLE_MAX_CONNECTIONS];
+        portENTER_CRITICAL(&m_lock);
+        memcpy(subscribers, m_subscribers, sizeof(subscribers));
+        portEXIT_CRITICAL(&m_lock);
+        m_pServer = pServer;
+        size_t sent = 0;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            uint16_t conn = subscribers[i];
+            if (BLE_HS_CONN_HANDLE_NONE == conn)
+            {
+                continue;
+            }
+            /** By reference, what it takes now is for scheduling; it goes at the size it has then */
+            size_t size = room(conn);
+            size = size < m_size ? size : m_size;
+            if (copy ? BleTraffic::instance().send(conn, traffic, ble_traffic_notify, m_pChr, m_data, size)
+                     : BleTraffic::instance().queue(conn, traffic, notify, this, size))
+            {
+                ++sent;
+            }
+        }
+        m_stats.notifications += sent;
+        return sent;
+    }
+    /** Serves a read with a consistent snapshot. Called from the host task */
+    void read()
+    {
+        ++m_stats.reads;
+        for (size_t attempt = 0; attempt < BLE_BOUND_READ_RETRIES; ++attempt)
+        {
+            uint32_t before = m_sequence.load(std::memory_order_acquire);
+            if (0 == (before & 1))
+            {
+                m_pChr->setValue(m_data, m_size);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (before == m_sequence.load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+            }
+            ++m_stats.readRetries;
+        }
+        ++m_stats.tornReads;
+    }
+    /** Tracks which connections want notifications. Called from the host task */
+    void subscribed(uint16_t conn, uint16_t subValue)
+    {
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (m_subscribers[i] == conn)
+            {
+                m_subscribers[i] = BLE_HS_CONN_HANDLE_NONE;
+            }
+        }
+        if (subValue & 1)
+        {
+            for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+            {
+                if (BLE_HS_CONN_HANDLE_NONE == m_subscribers[i])
+                {
+                    m_subscribers[i] = conn;
+                    break;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Delivers a write. Called from the host task */
+    void written(uint16_t conn, const uint8_t *data, size_t size)
+    {
+        ++m_stats.writes;
+        if (nullptr != m_onWrite)
+        {
+            BleSpan value = {data, size};
+            m_onWrite(conn, value, m_state);
+        }
+    }
+    const BleBoundStats &stats() const
+    {
+        return m_stats;
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
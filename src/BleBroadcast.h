@@ -0,0 +1,286 @@
+#pragma once
+#include <atomic>
+#include "BleRadioConfig.h"
+#include "BleWatchdog.h"
+#include "BleEnergy.h"
+#include "BleFrameQueue.h"
+#if BLE_RADIO_CENTRAL
+
+/** Writes a frame to a characteristic of every connected peer at once. The central
+ *  broadcasts configuration edits this way, each peer getting the delta it needs.
+ *  Each write is an acknowledged ATT write issued straight to the NimBLE host, so they
+ *  all proceed in parallel and the whole set takes about as long as the slowest link.
+ *  Failed writes are retried after a backoff that doubles each attempt; once every peer
+ *  has succeeded or run out of attempts the results are handed to the callback from
+ *  update(), even when there were no peers to write to.
+ */
+#ifndef BLE_BROADCAST_RETRIES
+/** Attempts per peer, the first included */
+#define BLE_BROADCAST_RETRIES 3
+#endif
+#ifndef BLE_BROADCAST_TIMEOUT_MS
+#define BLE_BROADCAST_TIMEOUT_MS 5000
+#endif
+#ifndef BLE_BROADCAST_BACKOFF_MS
+/** Wait before the first retry of a failed write */
+#define BLE_BROADCAST_BACKOFF_MS 50
+#endif
+
+struct BleBroadcastResult
+{
+    NimBLEAddress address;
+    /** 0 on success, otherwise the NimBLE return code of the last attempt */
+    int status;
+    /** From the first attempt being issued to the write completing */
+    uint32_t latency;
+    uint8_t attempts;
+};
+typedef void (*BleBroadcastCallback)(const BleBroadcastResult *results, size_t count, void *state);
+
+class BleBroadcast
+{
+    enum : uint8_t
+    {
+        IDLE = 0,
+        PENDING,
+        SUCCEEDED,
+        FAILED
+    };
+    struct Target
+    {
+        std::atomic<uint8_t> state;
+        std::atomic<int> rc;
+        std::atomic<uint32_t> doneTS;
+        uint16_t conn;
+        uint16_t handle;
+        uint16_t size;
+        uint8_t data[BLE_FRAME_MAX_SIZE];
+    };
+    /** A write's callback argument: the round's generation above the target's index */
+    static constexpr uintptr_t INDEX_BITS = 4;
+    static constexpr uintptr_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static_assert(NIMBLE_MAX_CONNECTIONS <= INDEX_MASK + 1, "BLE broadcast tag can't index every connection");
+    Target m_targets[NIMBLE_MAX_CONNECTIONS];
+    BleBroadcastResult m_results[NIMBLE_MAX_CONNECTIONS];
+    size_t m_count;
+    /** Between prepare() and the callback, with or without targets */
+    bool m_running;
+    uint32_t m_startTS;
+    /** Tags callbacks so a late one from an earlier broadcast is ignored. The tag keeps
+     *  the low 28 bits, which could only alias after 2^28 rounds; NimBLE completes every
+     *  write within the 30s ATT timeout
+     */
+    uint32_t m_generation;
+    BleBroadcastCallback m_callback;
+    void *m_state;
+
+    uintptr_t tag() const
+    {
+        return ((uintptr_t)m_generation << INDEX_BITS) & ~INDEX_MASK;
+    }
+    static int onWritten(uint16_t conn, const ble_gatt_error *error, ble_gatt_attr *attr, void *arg)
+    {
+        (void)conn;
+        (void)attr;
+        uintptr_t tag = (uintptr_t)arg;
+        BleBroadcast *pThis = instance();
+        size_t index = tag & INDEX_MASK;
+        if (nullptr == pThis || (tag & ~INDEX_MASK) != pThis->tag() || index >= pThis->m_count)
+        {
+            return 0;
+        }
+        Target &target = pThis->m_targets[index];
+        target.rc = error->status;
+        target.doneTS = BleClock::now();
+        target.state = (0 == error->status) ? SUCCEEDED : FAILED;
+        return 0;
+    }
+    void issue(size_t index, uint32_t now)
+    {
+        Target &target = m_targets[index];
+        ++m_results[index].attempts;
+        target.state = PENDING;
+        int rc = ble_gattc_write_flat(target.conn, target.handle, target.data, target.size, onWritten, (void *)(tag() | index));
+        if (0 != rc)
+        {
+            target.rc = rc;
+            target.doneTS = now;
+            target.state = FAILED;
+            return;
+        }
+        /** Every attempt the host takes goes on air, retries included */
+        BleEnergy::instance().transferred(target.conn, target.size, true);
+    }
+    /** Hands the results to the callback and readies the next round */
+    template <typename Written>
+    void finish(Written written)
+    {
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            m_results[i].status = m_targets[i].rc;
+            m_results[i].latency = m_targets[i].doneTS - m_startTS;
+            if (SUCCEEDED == m_targets[i].state)
+            {
+                written(m_targets[i].conn, m_targets[i].handle);
+            }
+            m_targets[i].state = IDLE;
+        }
+        size_t count = m_count;
+        /** Bump the generation so stragglers from this round are ignored */
+        ++m_generation;
+        m_count = 0;
+        m_running = false;
+        if (nullptr != m_callback)
+        {
+            BleWatchdogScope watch(BLE_OP_CALLBACK);
+            m_callback(m_results, count, m_state);
+        }
+    }
+    /** The host callback's argument carries the round and target, so the instance is kept here */
+    static BleBroadcast *&instance()
+    {
+        static BleBroadcast *s_instance = nullptr;
+        return s_instance;
+    }
+
+public:
+    /** The wait before retrying a write that has failed attempts times */
+    static uint32_t backoff(uint8_t attempts)
+    {
+        return (uint32_t)BLE_BROADCAST_BACKOFF_MS << (attempts - 1);
+    }
+    void begin()
+    {
+        instance() = this;
+        m_count = 0;
+        m_running = false;
+        m_callback = nullptr;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            m_targets[i].state = IDLE;
+        }
+    }
+    bool busy() const
+    {
+        return m_running;
+    }
+    /** Starts a broadcast. Add the peers with target() then call start() */
+    bool prepare(BleBroadcastCallback callback, void *state)
+    {
+        if (busy())
+        {
+            return false;
+        }
+        m_count = 0;
+        m_running = true;
+        m_callback = callback;
+        m_state = state;
+        ++m_generation;
+        return true;
+    }
+    /** Adds a peer and the frame to write to its characteristic */
+    bool target(NimBLEClient *pClient, NimBLERemoteCharacteristic *pChr, const uint8_t *data, size_t size)
+    {
+        if (!busy() || m_count >= NIMBLE_MAX_CONNECTIONS || size > BLE_FRAME_MAX_SIZE || size + 3 > pClient->getMTU())
+        {
+            return false;
+        }
+        Target &target = m_targets[m_count];
+        target.conn = pClient->getConnId();
+        target.handle = pChr->getHandle();
+        target.size = (uint16_t)size;
+        memcpy(target.data, data, size);
+        target.state = IDLE;
+        m_results[m_count].address = pClient->getPeerAddress();
+        m_results[m_count].status = 0;
+        m_results[m_count].latency = 0;
+        m_results[m_count].attempts = 0;
+        ++m_count;
+        return true;
+    }
+    /** Issues every write without waiting. Returns the number of peers targeted */
+    size_t start()
+    {
+        m_startTS = BleClock::now();
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            issue(i, m_startTS);
+        }
+        return m_count;
+    }
+    /** Retries failures and reports once every peer has finished.
+     *  Calls written() for each peer whose characteristic was overwritten
+     */
+    template <typename Written>
+    void update(uint32_t now, Written written)
+    {
+        if (!m_running)
+        {
+            return;
+        }
+        bool done = true;
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            Target &target = m_targets[i];
+            uint8_t state = target.state;
+            if (PENDING == state && BLE_BROADCAST_TIMEOUT_MS < now - m_startTS)
+            {
+                target.rc = BLE_HS_ETIMEOUT;
+                target.doneTS = now;
+                target.state = state = FAILED;
+            }
+            if (FAILED == state && m_results[i].attempts < BLE_BROADCAST_RETRIES &&
+                BLE_BROADCAST_TIMEOUT_MS > now - m_startTS)
+            {
+                if (backoff(m_results[i].attempts) <= now - target.doneTS)
+                {
+                    issue(i, now);
+                    state = target.state;
+                }
+                if (FAILED == state)
+                {
+                    /** Still to be retried */
+                    done = false;
+                }
+            }
+            if (PENDING == state)
+            {
+                done = false;
+            }
+        }
+        if (!done)
+        {
+            return;
+        }
+        finish(written);
+    }
+    /** Ends a running broadcast as the radio goes off: writes still outstanding fail with
+     *  BLE_HS_ENOTCONN and the callback has the results straight away
+     */
+    void cancel()
+    {
+        if (!m_running)
+        {
+            return;
+        }
+        uint32_t now = BleClock::now();
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            Target &target = m_targets[i];
+            uint8_t state = target.state;
+            if (IDLE == state || PENDING == state)
+            {
+                target.rc = BLE_HS_ENOTCONN;
+                target.doneTS = now;
+                target.state = FAILED;
+            }
+        }
+        /** The peers' attributes are going with their clients, so none is marked written */
+        finish([](uint16_t conn, uint16_t handle)
+               {
+                   (void)conn;
+                   (void)handle;
+               });
+    }
+};
+#endif // BLE_RADIO_CENTRAL
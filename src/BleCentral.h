@@ -0,0 +1,1108 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BlePeer.h"
+#include "BleAttributeCache.h"
+#include "BleBroadcast.h"
+#include "BleScheduler.h"
+#include "BleLinkQuality.h"
+#include "BleHealth.h"
+#include "BleLiveness.h"
+#include "BleBeacon.h"
+#include "BleStartup.h"
+#include "BleTimeSeries.h"
+#include "BleEnergy.h"
+#include "BleWatchdog.h"
+#include "BleEvents.h"
+#if BLE_RADIO_CENTRAL
+
+#ifndef BLE_SCAN_INTERVAL
+/** Scan interval and window, in ms */
+#define BLE_SCAN_INTERVAL 45
+#endif
+#ifndef BLE_SCAN_WINDOW
+#define BLE_SCAN_WINDOW 15
+#endif
+#ifndef BLE_SCAN_SETUP_INTERVAL
+/** The scan interval while a new link is discovered and subscribed, leaving the radio more
+ *  time for its connection events. Equal to BLE_SCAN_INTERVAL keeps the duty cycle
+ */
+#define BLE_SCAN_SETUP_INTERVAL 90
+#endif
+#ifndef BLE_SCAN_DURING_SETUP
+/** Keep scanning through discovery, reads and subscribes; NimBLE only needs the scan
+ *  stopped to initiate a connection. 0 keeps it stopped for the whole setup
+ */
+#define BLE_SCAN_DURING_SETUP 1
+#endif
+#ifndef BLE_CONFIG_DESCRIPTOR_LOG
+/** Look up and log the configuration characteristic's descriptor on connect. It is only
+ *  informational, and costs a descriptor discovery on every first connect
+ */
+#define BLE_CONFIG_DESCRIPTOR_LOG 0
+#endif
+#ifndef BLE_SCAN_DUPLICATES
+/** Report every advertisement, not just the first from each device, so diagnostics beacons
+ *  stay current. 0 saves host CPU when nobody reads beacons()
+ */
+#define BLE_SCAN_DUPLICATES 1
+#endif
+#ifndef BLE_BOOT_DEFER_SCAN
+/** Start scanning on the first update() rather than in on(), after any peers restored from
+ *  a warm reset have been reconnected. 0 scans from on()
+ */
+#define BLE_BOOT_DEFER_SCAN 1
+#endif
+
+struct BleScanStats
+{
+    uint32_t startTS;
+    /** Advertisements reported */
+    uint32_t results;
+    /** Configuration service advertisers not seen before */
+    uint32_t discovered;
+    /** How long each connect left us not scanning, in ms */
+    BleLatencyHistogram dark;
+    /** New configuration service advertisers per hour */
+    uint32_t discoveryRate(uint32_t now) const
+    {
+        uint32_t elapsed = now - startTS;
+        return elapsed ? (uint32_t)((uint64_t)discovered * 3600000 / elapsed) : 0;
+    }
+};
+
+/** The central role: scans for configuration service advertisers, connects to them and
+ *  subscribes to their configuration characteristic
+ */
+class BleCentral :
+    NimBLEClientCallbacks,
+    NimBLEAdvertisedDeviceCallbacks
+{
+    uint32_t m_scanTime;
+    BlePeerTable m_peers;
+    /** RPC responses from the host task waiting for update(), room for every peer's full
+     *  window of pipelined requests
+     */
+    BleFrameRing<BLE_RPC_QUEUE_SIZE> m_responses;
+    /** Configuration acks and other notifications waiting for update() */
+    BleFrameQueue m_inbox;
+    /** Sample frames waiting for update() */
+    BleFrameRing<BLE_BATCH_QUEUE_SIZE> m_samples;
+    /** The master configuration pushed to every peer */
+    BleConfig m_config;
+    BleAttributeCache m_cache;
+    BleBroadcast m_broadcast;
+    /** Picks which advertisers get a connection slot */
+    BleScheduler m_scheduler;
+    /** Filtered RSSI and notification loss per address */
+    BleLinkQuality m_link;
+    BleHealth m_health;
+    BleLiveness m_liveness;
+    /** Diagnostics beacons heard while scanning */
+    BleBeaconTable m_beacons;
+    /** Notifications and beacons logged to flash, once the application opens it */
+    BleTimeSeries m_store;
+    /** Where decoded samples go */
+    BleSampleHandler m_onSample;
+    void *m_sampleState;
+    /** Shared by every peer's RPC client */
+    BleCompressStats m_compress;
+    BleScanStats m_scanStats;
+    /** When the scan was paused for a connect, valid while m_paused */
+    uint32_t m_pausedTS;
+    bool m_paused;
+    /** Scanning with the setup interval */
+    bool m_setupScan;
+    /** on() left starting the scan to update() */
+    bool m_scanDeferred;
+    /** Between on() and off(), when update() keeps the scan running */
+    bool m_scanOn;
+    /** Every advertiser found costs a scan request */
+    bool m_activeScan;
+    /** Tells the application's handlers, if any, about a link */
+    void dispatch(uint8_t type, NimBLEClient *pClient, uint16_t conn, NimBLERemoteCharacteristic *pChr = nullptr,
+                  const uint8_t *pData = nullptr, size_t length = 0)
+    {
+        BleEvents &events = BleEvents::instance();
+        if (!events.wanted(type))
+        {
+            return;
+        }
+        BleEvent event = ble_event(type, conn, true);
+        event.address = pClient->getPeerAddress();
+        event.remote = pChr;
+        event.data = pData;
+        event.size = length;
+        events.dispatch(event);
+    }
+    void onResult(NimBLEAdvertisedDevice *advertisedDevice)
+    {
+        ++m_scanStats.results;
+        BleEvents &events = BleEvents::instance();
+        if (events.wanted(BLE_EVENT_DISCOVERED))
+        {
+            BleEvent event = ble_event(BLE_EVENT_DISCOVERED, BLE_HS_CONN_HANDLE_NONE, true);
+            event.address = advertisedDevice->getAddress();
+            event.device = advertisedDevice;
+            event.rssi = advertisedDevice->getRSSI();
+            events.dispatch(event);
+        }
+        if (m_activeScan && advertisedDevice->isConnectable())
+        {
+            BleEnergy::instance().scanRequested();
+        }
+        uint32_t now = BleClock::now();
+        /** Duplicates are reported so beacons stay current, so only new devices are logged */
+        bool found = false;
+        if (advertisedDevice->haveServiceData())
+        {
+            std::string beacon = advertisedDevice->getServiceData(BleSessionService::uuid().toNimBLE());
+            if (!beacon.empty())
+            {
+                found = m_beacons.received(advertisedDevice->getAddress(), advertisedDevice->getRSSI(),
+                                           (const uint8_t *)beacon.data(), beacon.length(), now);
+            }
+        }
+        if (advertisedDevice->isAdvertisingService(BleConfigurationService::uuid().toNimBLE()))
+        {
+            /** update() decides whether it gets a slot. Links too weak to hold aren't offered one */
+            int rssi = m_link.scanned(advertisedDevice->getAddress(), advertisedDevice->getRSSI(), now);
+            if (rssi >= BLE_LINK_MIN_RSSI)
+            {
+                if (m_scheduler.seen(advertisedDevice->getAddress(), rssi, now))
+                {
+                    Serial.println(F("BLE Found Configuration Service"));
+                    ++m_scanStats.discovered;
+                    found = true;
+                }
+            }
+        }
+        if (found)
+        {
+            Serial.print(F("BLE Advertised Device found: "));
+            Serial.println(advertisedDevice->toString().c_str());
+        }
+    }
+    void onConnect(NimBLEClient *pClient)
+    {
+        Serial.println(F("BLE Connected"));
+        /** After connection we should change the parameters if we don't need fast response times.
+         *  These settings are 150ms interval, 0 latency, 450ms timout.
+         *  Timeout should be a multiple of the interval, minimum is 100ms.
+         *  I find a multiple of 3-5 * the interval works best for quick response/reconnect.
+         *  Min interval: 120 * 1.25ms = 150, Max interval: 120 * 1.25ms = 150, 0 latency, 60 * 10ms = 600ms timeout
+         */
+        pClient->updateConnParams(120, 120, 0, 60);
+    }
+
+    /** Leaves the scan to update(): from the host task it could start one paused for a
+     *  connect, or that on() deferred
+     */
+    void onDisconnect(NimBLEClient *pClient)
+    {
+        Serial.print(pClient->getPeerAddress().toString().c_str());
+        Serial.println(F(" BLE Disconnected"));
+    }
+
+    /** Called when the peripheral requests a change to the connection parameters.
+     *  Return true to accept and apply them or false to reject and keep
+     *  the currently used parameters. Default will return true.
+     */
+    bool onConnParamsUpdateRequest(NimBLEClient *pClient, const ble_gap_upd_params *params)
+    {
+        (void)pClient;
+        if (params->itvl_min < 24)
+        { /** 1.25ms units */
+            return false;
+        }
+        else if (params->itvl_max > 40)
+        { /** 1.25ms units */
+            return false;
+        }
+        else if (params->latency > 2)
+        { /** Number of intervals allowed to skip */
+            return false;
+        }
+        else if (params->supervision_timeout > 100)
+        { /** 10ms units */
+            return false;
+        }
+
+        return true;
+    }
+
+    void onAuthenticationComplete(ble_gap_conn_desc *desc)
+    {
+        if (!desc->sec_state.encrypted)
+        {
+            Serial.println(F("BLE Encrypt connection failed - disconnecting"));
+            /** Find the client with the connection handle provided in desc */
+            NimBLEDevice::getClientByID(desc->conn_handle)->disconnect();
+            return;
+        }
+    };
+
+    /** Session characteristic notifications carry RPC responses */
+    void onRpcNotify(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify)
+    {
+        (void)isNotify;
+        NimBLEClient *pClient = pRemoteCharacteristic->getRemoteService()->getClient();
+        m_liveness.heard(m_peers, pClient, false);
+        uint16_t conn = pClient->getConnId();
+        BleEnergy::instance().transferred(conn, length, false);
+        dispatch(BLE_EVENT_NOTIFIED, pClient, conn, pRemoteCharacteristic, pData, length);
+        if (!ble_rpc_is_frame(pData, length, BLE_RPC_RESPONSE) || !m_responses.push(BLE_FRAME_RPC, conn, pData, length))
+        {
+            m_health.dropped(BLE_FRAME_RPC);
+        }
+    }
+    /** Samples characteristic notifications carry sample frames, decoded in update() */
+    void onSamplesNotify(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify)
+    {
+        (void)isNotify;
+        NimBLEClient *pClient = pRemoteCharacteristic->getRemoteService()->getClient();
+        m_liveness.heard(m_peers, pClient, false);
+        uint16_t conn = pClient->getConnId();
+        BleEnergy::instance().transferred(conn, length, false);
+        dispatch(BLE_EVENT_NOTIFIED, pClient, conn, pRemoteCharacteristic, pData, length);
+        if (!ble_batch_is_frame(pData, length) || !m_samples.push(BLE_FRAME_SAMPLES, conn, pData, length))
+        {
+            m_health.dropped(BLE_FRAME_SAMPLES);
+        }
+    }
+    /** Configuration characteristic notifications carry acks; anything else goes to the
+     *  event handlers, which log it by default
+     */
+    void onConfigNotify(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify)
+    {
+        (void)isNotify;
+        NimBLEClient *pClient = pRemoteCharacteristic->getRemoteService()->getClient();
+        /** A lone 0x00 is a keep-alive ping from older peripherals. Like any notification it
+         *  only proves the peer is alive
+         */
+        bool keepAlive = 1 == length && 0 == pData[0];
+        m_liveness.heard(m_peers, pClient, keepAlive);
+        BleEnergy::instance().transferred(pClient->getConnId(), length, false);
+        if (keepAlive)
+        {
+            return;
+        }
+        /** The notified value is the characteristic's value, acks included */
+        m_cache.notified(pRemoteCharacteristic, pData, length, BleClock::now());
+        if (ble_config_is_ack(pData, length))
+        {
+            uint16_t conn = pClient->getConnId();
+            if (!m_inbox.push(BLE_FRAME_CONFIG, conn, pData, length))
+            {
+                m_health.dropped(BLE_FRAME_CONFIG);
+            }
+            return;
+        }
+        if (m_store.enabled() && !m_inbox.push(BLE_FRAME_DATA, pClient->getConnId(), pData, length))
+        {
+            m_health.dropped(BLE_FRAME_DATA);
+        }
+        dispatch(BLE_EVENT_NOTIFIED, pClient, pClient->getConnId(), pRemoteCharacteristic, pData, length);
+    }
+
+    /** Callback to process the results of the last scan or restart it */
+    static void onScanEnded(NimBLEScanResults results)
+    {
+        (void)results;
+        Serial.println(F("BLE Scan Ended"));
+    }
+    /** Stops the scan, which NimBLE can't run while it initiates a connection */
+    void pauseScan()
+    {
+        NimBLEScan *pScan = NimBLEDevice::getScan();
+        if (!m_paused && pScan->isScanning())
+        {
+            pScan->stop();
+            m_paused = true;
+            m_pausedTS = BleClock::now();
+        }
+    }
+    /** Scans again, at the reduced setup duty cycle if setup, and accounts the time dark */
+    void resumeScan(bool setup)
+    {
+        NimBLEScan *pScan = NimBLEDevice::getScan();
+        if (setup != m_setupScan)
+        {
+            /** The new interval applies from the next start */
+            pScan->stop();
+            pScan->setInterval(setup ? BLE_SCAN_SETUP_INTERVAL : BLE_SCAN_INTERVAL);
+            pScan->setWindow(BLE_SCAN_WINDOW);
+            m_setupScan = setup;
+        }
+        if (!pScan->isScanning() && pScan->start(m_scanTime, onScanEnded))
+        {
+            m_scanDeferred = false;
+            BleStartup::instance().scanning();
+        }
+        if (m_paused)
+        {
+            m_paused = false;
+            m_scanStats.dark.record(BleClock::now() - m_pausedTS);
+        }
+    }
+    /** Starts the scan on() configured */
+    bool startScan()
+    {
+        NimBLEScan *pScan = NimBLEDevice::getScan();
+        m_scanDeferred = false;
+        if (pScan->isScanning())
+        {
+            return true;
+        }
+        uint32_t startTS = micros();
+        /** Start scanning for advertisers for the scan time specified (in seconds) 0 = forever
+         *  Optional callback for when scanning stops.
+         */
+        if (!pScan->start(m_scanTime, onScanEnded))
+        {
+            Serial.println(F("BLE Scan error"));
+            return false;
+        }
+        BleStartup::instance().phase(BLE_BOOT_SCAN, startTS);
+        BleStartup::instance().scanning();
+        Serial.println(F("BLE Scan started"));
+        return true;
+    }
+    /** Saves the connected peers to RTC memory, for restore() after a warm reset */
+    void persist()
+    {
+        BleWarmRecord &record = g_bleWarmRecord;
+        memset(&record, 0, sizeof(record));
+        record.magic = BLE_WARM_RECORD_MAGIC;
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            BlePeer &peer = m_peers[i];
+            if (nullptr == peer.client || !peer.client->isConnected() || peer.evicting || peer.dead)
+            {
+                continue;
+            }
+            NimBLEAddress address = peer.client->getPeerAddress();
+            record.peers[record.count].type = address.getType();
+            memcpy(record.peers[record.count].val, address.getNative(), sizeof(record.peers[0].val));
+            record.rssi[record.count] = (int8_t)m_link.rssi(address, BLE_LINK_MIN_RSSI);
+            ++record.count;
+        }
+        record.checksum = ble_warm_checksum(record);
+    }
+    /** Offers the peers connected before a watchdog or panic reset to the scheduler, which
+     *  connects them without waiting to scan them. Returns how many
+     */
+    size_t restore(uint32_t now)
+    {
+        esp_reset_reason_t reason = esp_reset_reason();
+        if (ESP_RST_POWERON == reason || ESP_RST_UNKNOWN == reason || !ble_warm_valid())
+        {
+            return 0;
+        }
+        for (size_t i = 0; i < g_bleWarmRecord.count; ++i)
+        {
+            m_scheduler.seen(NimBLEAddress(g_bleWarmRecord.peers[i]), g_bleWarmRecord.rssi[i], now);
+        }
+        return g_bleWarmRecord.count;
+    }
+    /** Connects with the scan stopped only for the connection itself */
+    bool connect(NimBLEClient *pClient, const NimBLEAddress &address, bool deleteAttributes)
+    {
+        pauseScan();
+        bool connected = ble_watched(BLE_OP_CONNECT, address, [&]
+                                     { return pClient->connect(address, deleteAttributes); });
+#if BLE_SCAN_DURING_SETUP
+        resumeScan(true);
+#endif
+        return connected;
+    }
+    /** Handles the provisioning of clients and connects / interfaces with the server */
+    bool connectToServer(const NimBLEAddress &address)
+    {
+        NimBLEClient *pClient = nullptr;
+
+        /** Check if we have a client we should reuse first **/
+        if (NimBLEDevice::getClientListSize())
+        {
+            /** Special case when we already know this device, we send false as the
+         *  second argument in connect() to prevent refreshing the service database.
+         *  This saves considerable time and power.
+         */
+            pClient = NimBLEDevice::getClientByPeerAddress(address);
+            if (pClient)
+            {
+                if (!connect(pClient, address, false))
+                {
+                    Serial.println(F("BLE Reconnect failed"));
+                    return false;
+                }
+                Serial.println(F("BLE Reconnected client"));
+            }
+            /** We don't already have a client that knows this device,
+         *  we will check for a client that is disconnected that we can use.
+         */
+            else
+            {
+                pClient = NimBLEDevice::getDisconnectedClient();
+            }
+        }
+
+        /** No client to reuse? Create a new one. */
+        if (!pClient)
+        {
+            if (NimBLEDevice::getClientListSize() >= NIMBLE_MAX_CONNECTIONS)
+            {
+                Serial.println(F("BLE Max clients reached - no more connections available"));
+                return false;
+            }
+
+            pClient = NimBLEDevice::createClient();
+
+            Serial.println(F("BLE New client created"));
+
+            pClient->setClientCallbacks((NimBLEClientCallbacks *)this, false);
+            /** Set initial connection parameters: These settings are 15ms interval, 0 latency, 120ms timout.
+         *  These settings are safe for 3 clients to connect reliably, can go faster if you have less
+         *  connections. Timeout should be a multiple of the interval, minimum is 100ms.
+         *  Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
+         */
+            pClient->setConnectionParams(12, 12, 0, 51);
+            /** Set how long we are willing to wait for the connection to complete (seconds), default is 30. */
+            pClient->setConnectTimeout(5);
+
+            if (!connect(pClient, address, true))
+            {
+                /** Created a client but failed to connect, don't need to keep it as it has no data */
+                NimBLEDevice::deleteClient(pClient);
+                Serial.println(F("BLE Failed to connect, deleted client"));
+                return false;
+            }
+        }
+
+        if (!pClient->isConnected())
+        {
+            if (!connect(pClient, address, true))
+            {
+                Serial.println(F("BLE Failed to connect"));
+                return false;
+            }
+        }
+
+        Serial.print(F("BLE Connected to: "));
+        Serial.println(pClient->getPeerAddress().toString().c_str());
+        Serial.print(F("BLE RSSI: "));
+        Serial.println(pClient->getRssi());
+        BlePeer *pPeer = m_peers.add(pClient);
+        if (nullptr == pPeer)
+        {
+            Serial.println(F("BLE No peer slot available"));
+            pClient->disconnect();
+            return false;
+        }
+        dispatch(BLE_EVENT_CONNECTED, pClient, pPeer->conn);
+        /** Attributes are discovered by UUID as they are first used; a reconnect with the
+         *  attribute database kept discovers nothing
+         */
+        BleDiscoveryScope discovery;
+
+        /** Now we can read/write/subscribe the charateristics of the services we are interested in */
+        BleConfigurationService::ClientTable config;
+        NimBLERemoteCharacteristic *pChr = nullptr;
+
+        if (ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                        { return BleConfigurationService::find(pClient, config); }))
+        { /** make sure it's not null */
+            pChr = ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                               { return config.get<BleConfigurationCharacteristic>(); });
+
+            if (pChr)
+            { /** make sure it's not null */
+                /** The value is the peer's last ack: the configuration epoch and version it holds */
+                std::string value;
+                if (pChr->canRead())
+                {
+                    value = m_cache.read(pChr, BleClock::now());
+                    if (ble_config_is_ack((const uint8_t *)value.data(), value.length()))
+                    {
+                        Serial.print(F("BLE "));
+                        Serial.print(pChr->getUUID().toString().c_str());
+                        Serial.print(F(" configuration version: "));
+                        Serial.print(ble_config_ack_version((const uint8_t *)value.data()));
+                        if (ble_config_ack_epoch((const uint8_t *)value.data()) != m_config.epoch())
+                        {
+                            Serial.print(F(" of another epoch"));
+                        }
+                        Serial.println();
+                    }
+                }
+
+#if BLE_CONFIG_DESCRIPTOR_LOG
+                NimBLERemoteDescriptor *pDsc = ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                                                           { return BleDescriptorDef<BleConfigurationDescUuid>::find(pChr); });
+                if (pDsc)
+                { /** make sure it's not null */
+                    Serial.print(F("BLE Descriptor: "));
+                    Serial.print(pDsc->getUUID().toString().c_str());
+                    Serial.print(F("BLE  Value: "));
+                    Serial.println(m_cache.read(pClient, pDsc, BleClock::now()).c_str());
+                }
+#endif
+
+                /** update() sends only the entries changed since the version the peer holds */
+                if (pChr->canWrite() || pChr->canWriteNoResponse())
+                {
+                    pPeer->config.begin(pChr);
+                    pPeer->config.received(m_config, (const uint8_t *)value.data(), value.length());
+                }
+                auto notify = [this](NimBLERemoteCharacteristic *pChr, uint8_t *pData, size_t length, bool isNotify)
+                { onConfigNotify(pChr, pData, length, isNotify); };
+
+                /** registerForNotify() has been deprecated and replaced with subscribe() / unsubscribe().
+             *  Subscribe parameter defaults are: notifications=true, notifyCallback=nullptr, response=false.
+             *  Unsubscribe parameter defaults are: response=false.
+             */
+                if (pChr->canNotify())
+                {
+                    //if(!pChr->registerForNotify(notifyCB)) {
+                    if (!ble_watched(BLE_OP_SUBSCRIBE, pPeer->conn, [&]
+                                     { return pChr->subscribe(true, notify); }))
+                    {
+                        /** Disconnect if subscribe failed */
+                        pClient->disconnect();
+                        return false;
+                    }
+                }
+                else if (pChr->canIndicate())
+                {
+                    /** Send false as first argument to subscribe to indications instead of notifications */
+                    //if(!pChr->registerForNotify(notifyCB, false)) {
+                    if (!ble_watched(BLE_OP_SUBSCRIBE, pPeer->conn, [&]
+                                     { return pChr->subscribe(false, notify); }))
+                    {
+                        /** Disconnect if subscribe failed */
+                        pClient->disconnect();
+                        return false;
+                    }
+                }
+            }
+        }
+        else
+        {
+            Serial.println(F("BLE Configuration service not found."));
+        }
+
+        /** The session service carries RPC. Its characteristic needs an encrypted link,
+         *  and we write requests without response so secure the link up front
+         */
+        BleSessionService::ClientTable session;
+        NimBLERemoteCharacteristic *pRpcChr = nullptr;
+        if (ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                        { return BleSessionService::find(pClient, session); }))
+        {
+            pRpcChr = ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                                  { return session.get<BleSessionCharacteristic>(); });
+            auto notify = [this](NimBLERemoteCharacteristic *pChr, uint8_t *pData, size_t length, bool isNotify)
+            { onRpcNotify(pChr, pData, length, isNotify); };
+            if (pRpcChr && (!pRpcChr->canNotify() ||
+                            !ble_watched(BLE_OP_SECURE, pPeer->conn, [&]
+                                         { return pClient->secureConnection(); }) ||
+                            !ble_watched(BLE_OP_SUBSCRIBE, pPeer->conn, [&]
+                                         { return pRpcChr->subscribe(true, notify); })))
+            {
+                Serial.println(F("BLE Session RPC unavailable"));
+                pRpcChr = nullptr;
+            }
+        }
+        /** Batched samples ride the secured link too; peers without them just don't send any */
+        NimBLERemoteCharacteristic *pSamplesChr = nullptr;
+        if (nullptr != pRpcChr)
+        {
+            pSamplesChr = ble_watched(BLE_OP_DISCOVER, pPeer->conn, [&]
+                                      { return session.get<BleSamplesCharacteristic>(); });
+        }
+        if (nullptr != pSamplesChr && pSamplesChr->canNotify())
+        {
+            auto notifySamples = [this](NimBLERemoteCharacteristic *pChr, uint8_t *pData, size_t length, bool isNotify)
+            { onSamplesNotify(pChr, pData, length, isNotify); };
+            if (!ble_watched(BLE_OP_SUBSCRIBE, pPeer->conn, [&]
+                             { return pSamplesChr->subscribe(true, notifySamples); }))
+            {
+                Serial.println(F("BLE Samples unavailable"));
+            }
+        }
+        pPeer->rpc.begin(pRpcChr, &m_compress);
+        /** The answer turns on compression for this link, if the peer supports it */
+        pPeer->rpc.negotiate();
+
+        return true;
+    }
+    /** Hands a frame's samples to the application, timed by their age when it was sent */
+    void samples(const NimBLEAddress &address, const uint8_t *data, size_t size, uint32_t now)
+    {
+        BleBatchReader reader;
+        if (nullptr == m_onSample || !reader.begin(data, size))
+        {
+            return;
+        }
+        BleSample sample;
+        while (reader.next(&sample))
+        {
+            BleSample local = {now - reader.age(sample), sample.value};
+            m_onSample(address, local, m_sampleState);
+        }
+    }
+    /** Hands a frame from the host task to its peer's protocol */
+    void route(const BleFrame *pFrame)
+    {
+        m_health.received(pFrame->size, m_responses.size() + m_inbox.size() + m_samples.size());
+        BlePeer *pPeer = m_peers.find(pFrame->conn);
+        if (nullptr != pPeer)
+        {
+            pPeer->activeTS = BleClock::now();
+            if (BLE_FRAME_RPC == pFrame->channel)
+            {
+                int32_t latency = pPeer->rpc.received(pFrame->data, pFrame->size);
+                if (latency >= 0)
+                {
+                    m_link.requests(pPeer->client->getPeerAddress(), 1, 0, pPeer->activeTS);
+                }
+                m_health.rpc(latency, 0);
+            }
+            else if (BLE_FRAME_CONFIG == pFrame->channel)
+            {
+                m_health.config(pPeer->config.received(m_config, pFrame->data, pFrame->size));
+            }
+            else if (BLE_FRAME_SAMPLES == pFrame->channel)
+            {
+                m_store.append(pPeer->client->getPeerAddress(), BLE_TS_NOTIFY, pFrame->data, pFrame->size, pPeer->activeTS);
+                samples(pPeer->client->getPeerAddress(), pFrame->data, pFrame->size, pPeer->activeTS);
+            }
+            else
+            {
+                m_store.append(pPeer->client->getPeerAddress(), BLE_TS_NOTIFY, pFrame->data, pFrame->size, pPeer->activeTS);
+            }
+        }
+    }
+    /** Routes queued frames, pushes configuration changes and retires peers whose link has gone */
+    void updatePeers()
+    {
+        BleFrame *pFrame;
+        while (nullptr != (pFrame = m_responses.front()))
+        {
+            route(pFrame);
+            m_responses.pop();
+        }
+        while (nullptr != (pFrame = m_inbox.front()))
+        {
+            route(pFrame);
+            m_inbox.pop();
+        }
+        while (nullptr != (pFrame = m_samples.front()))
+        {
+            route(pFrame);
+            m_samples.pop();
+        }
+        uint32_t now = BleClock::now();
+        /** RSSI of every connected link is sampled together, once per BLE_LINK_SAMPLE_MS */
+        bool sample = m_link.due(now);
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            BlePeer &peer = m_peers[i];
+            if (nullptr == peer.client)
+            {
+                continue;
+            }
+            if (!peer.client->isConnected())
+            {
+                m_scheduler.disconnected(peer.client->getPeerAddress(), hasBacklog(peer), now);
+                m_health.disconnected();
+                peer.rpc.end();
+                m_cache.drop(peer.conn);
+                BleTraffic::instance().disconnected(peer.conn);
+                dispatch(BLE_EVENT_DISCONNECTED, peer.client, peer.conn);
+                m_peers.remove(&peer);
+                persist();
+                continue;
+            }
+            if (sample)
+            {
+                m_link.sample(peer.client, now);
+            }
+            size_t expired = peer.rpc.expire(now);
+            m_link.requests(peer.client->getPeerAddress(), 0, expired, now);
+            m_health.rpc(-1, expired);
+            if (!m_liveness.update(peer, now))
+            {
+                Serial.println(F("BLE Peer stopped responding - disconnecting"));
+                peer.client->disconnect();
+                continue;
+            }
+            size_t frames = peer.config.update(m_config, now);
+            if (frames)
+            {
+                m_health.sent(frames);
+                m_cache.invalidate(peer.conn, peer.config.characteristic()->getHandle());
+            }
+            if (hasBacklog(peer))
+            {
+                peer.activeTS = now;
+            }
+        }
+        if (m_health.due(now))
+        {
+            m_health.check(m_peers);
+        }
+        if (m_store.enabled())
+        {
+            /** Beacon pages are stored as they change, not every time they are heard */
+            BleBeaconReport report;
+            for (size_t i = 0; i < m_beacons.capacity(); ++i)
+            {
+                if (m_beacons.take(i, &report))
+                {
+                    m_store.append(report.getAddress(), BLE_TS_BEACON, report.raw, sizeof(report.raw), report.seenTS);
+                }
+            }
+            m_store.update(now);
+        }
+    }
+    /** Whether a peer has configuration or RPC traffic outstanding */
+    bool hasBacklog(const BlePeer &peer) const
+    {
+        return peer.rpc.pending() ||
+               (nullptr != peer.config.characteristic() && !peer.config.synced(m_config));
+    }
+    /** Hands a free slot to the best waiting candidate, or frees one by evicting the weakest
+     *  connected peer when the candidate clearly outranks it or the peer has gone idle
+     */
+    void schedule(uint32_t now)
+    {
+        size_t occupied = 0;
+        BlePeer *pVictim = nullptr;
+        int32_t victimScore = 0;
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            BlePeer &peer = m_peers[i];
+            if (nullptr == peer.client)
+            {
+                continue;
+            }
+            if (peer.evicting)
+            {
+                /** Wait for the slot being freed before deciding anything else */
+                m_scheduler.occupancy(m_peers.capacity(), m_peers.capacity(), now);
+                return;
+            }
+            ++occupied;
+            NimBLEAddress peerAddress = peer.client->getPeerAddress();
+            bool backlog = hasBacklog(peer);
+            m_scheduler.refresh(peerAddress, backlog, m_link.rssi(peerAddress, BLE_LINK_MIN_RSSI));
+            int32_t score = m_scheduler.score(peerAddress, now - peer.activeTS, now);
+            if (!backlog && (nullptr == pVictim || score < victimScore))
+            {
+                pVictim = &peer;
+                victimScore = score;
+            }
+        }
+        m_scheduler.occupancy(occupied, m_peers.capacity(), now);
+        NimBLEAddress address;
+        int32_t score;
+        if (!m_scheduler.next(now, &address, &score))
+        {
+            return;
+        }
+        if (occupied >= m_peers.capacity())
+        {
+            uint32_t idle = (nullptr != pVictim) ? now - pVictim->activeTS : 0;
+            if (nullptr != pVictim && m_scheduler.evictable(victimScore, now - pVictim->connectedTS, idle, score))
+            {
+                Serial.print(F("BLE Evicting "));
+                Serial.println(pVictim->client->getPeerAddress().toString().c_str());
+                m_scheduler.evicted(BLE_SCHED_MAX_IDLE_MS <= idle);
+                pVictim->evicting = true;
+                pVictim->client->disconnect();
+            }
+            return;
+        }
+        /** Found a device we want to connect to, do it now. Scanning carries on except
+         *  while the connection is initiated; new advertisers queue in the scheduler
+         */
+        if (connectToServer(address))
+        {
+            m_scheduler.connected(address, BleClock::now());
+            BleStartup::instance().connected();
+            persist();
+            Serial.println(F("BLE Success! we should now be getting notifications, scanning for more!"));
+        }
+        else
+        {
+            m_scheduler.failed(address, BleClock::now());
+            Serial.println(F("BLE Failed to connect, starting scan"));
+        }
+
+        resumeScan(false);
+    }
+
+public:
+    bool begin()
+    {
+        m_scanTime = 0;
+        m_peers.begin();
+        m_responses.clear();
+        m_inbox.clear();
+        m_samples.clear();
+        m_config.begin();
+        m_cache.begin();
+        m_broadcast.begin();
+        m_scheduler.begin();
+        m_link.begin();
+        m_health.begin(m_responses.capacity() + m_inbox.capacity() + m_samples.capacity());
+        BleDiscovery::instance().begin();
+        m_liveness.begin();
+        m_beacons.begin();
+        memset(&m_compress, 0, sizeof(m_compress));
+        memset(&m_scanStats, 0, sizeof(m_scanStats));
+        m_scanStats.startTS = BleClock::now();
+        m_paused = false;
+        m_setupScan = false;
+        m_scanDeferred = false;
+        m_scanOn = false;
+        m_activeScan = false;
+        return true;
+    }
+    bool on(bool activeScan)
+    {
+        /** create new scan */
+        NimBLEScan *pScan = NimBLEDevice::getScan();
+        if (nullptr == pScan)
+        {
+            Serial.println(F("BLE Error creating scan object"));
+            return false;
+        }
+        /** create a callback that gets called when advertisers are found */
+        pScan->setAdvertisedDeviceCallbacks((NimBLEAdvertisedDeviceCallbacks *)this, BLE_SCAN_DUPLICATES);
+        pScan->setDuplicateFilter(!BLE_SCAN_DUPLICATES);
+
+        /** Set scan interval (how often) and window (how long) in milliseconds */
+        pScan->setInterval(BLE_SCAN_INTERVAL);
+        pScan->setWindow(BLE_SCAN_WINDOW);
+
+        /** Active scan will gather scan response data from advertisers
+         *  but will use more energy from both devices
+         */
+        pScan->setActiveScan(activeScan);
+        m_activeScan = activeScan;
+
+        BleStartup &startup = BleStartup::instance();
+        uint32_t startTS = micros();
+        size_t restored = restore(BleClock::now());
+        startup.phase(BLE_BOOT_RESTORE, startTS);
+        startup.restored(restored);
+        if (restored)
+        {
+            Serial.print(F("BLE Reconnecting "));
+            Serial.print(restored);
+            Serial.println(F(" peers from before reset"));
+        }
+        m_scanOn = true;
+#if BLE_BOOT_DEFER_SCAN
+        m_scanDeferred = true;
+        return true;
+#else
+        return startScan();
+#endif
+    }
+    /** Stops update() from restarting the scan and lets go of the peers' clients before
+     *  NimBLEDevice::deinit() deletes them: their pending calls fail with
+     *  BLE_RPC_DISCONNECTED, a running broadcast reports and the application hears of
+     *  each disconnect
+     */
+    void off()
+    {
+        uint32_t now = BleClock::now();
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            BlePeer &peer = m_peers[i];
+            if (nullptr == peer.client)
+            {
+                continue;
+            }
+            m_scheduler.disconnected(peer.client->getPeerAddress(), hasBacklog(peer), now);
+            m_health.disconnected();
+            peer.rpc.end();
+            m_cache.drop(peer.conn);
+            BleTraffic::instance().disconnected(peer.conn);
+            dispatch(BLE_EVENT_DISCONNECTED, peer.client, peer.conn);
+            m_peers.remove(&peer);
+        }
+        m_broadcast.cancel();
+        m_responses.clear();
+        m_inbox.clear();
+        m_samples.clear();
+        m_scanOn = false;
+        m_scanDeferred = false;
+        m_paused = false;
+    }
+    /** The configuration pushed to peers. Edits reach each peer as a delta on the next update() */
+    BleConfig &config()
+    {
+        return m_config;
+    }
+    /** Calls a method on a connected peer's session service. The callback runs from update().
+     *  Returns the request id, or -1 if the request couldn't be queued
+     */
+    int call(const NimBLEAddress &address, uint8_t method, const uint8_t *data, size_t size, BleRpcCallback callback, void *state, uint8_t traffic)
+    {
+        BlePeer *pPeer = m_peers.find(address);
+        if (nullptr == pPeer || !pPeer->client->isConnected())
+        {
+            return -1;
+        }
+        int id = pPeer->rpc.call(method, data, size, callback, state, traffic);
+        if (id >= 0)
+        {
+            pPeer->activeTS = BleClock::now();
+            /** The request overwrote the peer's session characteristic value */
+            m_cache.invalidate(pPeer->conn, pPeer->rpc.characteristic()->getHandle());
+        }
+        return id;
+    }
+    /** Reads a characteristic of a connected peer, from the cache when it is fresh */
+    template <typename Service, typename Chr>
+    bool read(const NimBLEAddress &address, std::string *value)
+    {
+        BlePeer *pPeer = m_peers.find(address);
+        if (nullptr == pPeer || !pPeer->client->isConnected())
+        {
+            return false;
+        }
+        typename Service::ClientTable table;
+        Service::find(pPeer->client, table);
+        NimBLERemoteCharacteristic *pChr = table.template get<Chr>();
+        if (nullptr == pChr || !pChr->canRead())
+        {
+            return false;
+        }
+        *value = m_cache.read(pChr, BleClock::now());
+        return true;
+    }
+    BleCacheStats cacheStats()
+    {
+        return m_cache.stats();
+    }
+    /** Sets how strongly a peripheral is favoured for a connection slot */
+    bool priority(const NimBLEAddress &address, int8_t priority)
+    {
+        return m_scheduler.priority(address, priority);
+    }
+    BleScheduler &scheduler()
+    {
+        return m_scheduler;
+    }
+    BleLinkQuality &link()
+    {
+        return m_link;
+    }
+    BleHealth &health()
+    {
+        return m_health;
+    }
+    BleLiveness &liveness()
+    {
+        return m_liveness;
+    }
+    BleBeaconTable &beacons()
+    {
+        return m_beacons;
+    }
+    /** Sets a peer's share of each traffic class against the other connections */
+    bool weight(const NimBLEAddress &address, uint8_t weight)
+    {
+        BlePeer *pPeer = m_peers.find(address);
+        return nullptr != pPeer && BleTraffic::instance().weight(pPeer->conn, weight);
+    }
+    /** Delivers every peer's samples to handler from update() */
+    void onSample(BleSampleHandler handler, void *state)
+    {
+        m_onSample = handler;
+        m_sampleState = state;
+    }
+    BleTimeSeries &store()
+    {
+        return m_store;
+    }
+    const BleCompressStats &compressStats() const
+    {
+        return m_compress;
+    }
+    const BleScanStats &scanStats() const
+    {
+        return m_scanStats;
+    }
+    /** Sets a configuration entry and writes it to every connected peer in parallel,
+     *  each as the delta that peer needs, instead of waiting for update() to queue it.
+     *  Peers whose delta needs more than one frame get it from update(). The callback gets
+     *  each peer's result from update() once all are done. Returns the number of peers
+     *  written to, or -1 if a broadcast is already running or the entry can't be set
+     */
+    int broadcast(const char *key, const uint8_t *value, size_t size, BleBroadcastCallback callback, void *state)
+    {
+        if (m_broadcast.busy() || !m_config.set(key, value, size))
+        {
+            return -1;
+        }
+        m_broadcast.prepare(callback, state);
+        uint32_t now = BleClock::now();
+        uint8_t frame[BLE_FRAME_MAX_SIZE];
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            BlePeer &peer = m_peers[i];
+            NimBLERemoteCharacteristic *pChr = peer.config.characteristic();
+            if (nullptr == peer.client || !peer.client->isConnected() || nullptr == pChr || !pChr->canWrite() ||
+                peer.config.synced(m_config))
+            {
+                continue;
+            }
+            size_t frameSize = peer.config.frame(m_config, frame);
+            if (0 != frameSize && m_broadcast.target(peer.client, pChr, frame, frameSize))
+            {
+                peer.config.sent(m_config, now);
+            }
+        }
+        return (int)m_broadcast.start();
+    }
+    /** Reports the scan and every link's connection events over the last elapsed ms */
+    void account(uint32_t elapsed, uint32_t now)
+    {
+        BleEnergy &energy = BleEnergy::instance();
+        NimBLEScan *pScan = NimBLEDevice::getScan();
+        if (!m_paused && pScan->isScanning())
+        {
+            energy.scanned(elapsed, m_setupScan ? BLE_SCAN_SETUP_INTERVAL : BLE_SCAN_INTERVAL, BLE_SCAN_WINDOW);
+        }
+        for (size_t i = 0; i < m_peers.capacity(); ++i)
+        {
+            const BlePeer &peer = m_peers[i];
+            if (nullptr != peer.client)
+            {
+                energy.connected(peer.conn, elapsed, now);
+            }
+        }
+    }
+    void update()
+    {
+        updatePeers();
+        m_broadcast.update(BleClock::now(), [this](uint16_t conn, uint16_t handle)
+                           { m_cache.invalidate(conn, handle); });
+        schedule(BleClock::now());
+        if (m_scanDeferred)
+        {
+            startScan();
+        }
+        else if (m_scanOn && !m_paused && !NimBLEDevice::getScan()->isScanning())
+        {
+            /** Something stopped the scan behind our back; run it again as it was */
+            resumeScan(m_setupScan);
+        }
+    }
+};
+#endif // BLE_RADIO_CENTRAL
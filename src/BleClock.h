@@ -0,0 +1,36 @@
+#pragma once
+#include <Arduino.h>
+
+/** Returns the current time in milliseconds */
+typedef uint32_t (*BleClockSource)(void *state);
+
+/** The time base for every BLE timestamp, timeout and throttle. It reads millis() unless
+ *  another source is installed, such as BleVirtualClock for runs in simulated time
+ */
+class BleClock
+{
+    struct Source
+    {
+        BleClockSource source;
+        void *state;
+    };
+    /** A function local static so every translation unit shares one source */
+    static Source &installed()
+    {
+        static Source source = {nullptr, nullptr};
+        return source;
+    }
+
+public:
+    static uint32_t now()
+    {
+        const Source &source = installed();
+        return (nullptr != source.source) ? source.source(source.state) : millis();
+    }
+    /** Replaces the time source. Pass null to go back to millis() */
+    static void use(BleClockSource source, void *state = nullptr)
+    {
+        installed().source = source;
+        installed().state = state;
+    }
+};
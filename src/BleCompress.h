@@ -0,0 +1,321 @@
+#pragma once
+#include <Arduino.h>
+#include "BleClock.h"
+
+/** A small LZSS codec for frame payloads, with no heap. By default the window is the frame
+ *  itself, so every frame decodes alone and a lost notification costs nothing more than
+ *  itself. A BleLzStream carries the window across the frames of one transfer instead.
+ *
+ *  Stream: a control byte, then up to 8 items, its bits LSB first.
+ *  A 0 bit is a literal byte, a 1 bit a match: [distance - 1][length - 3],
+ *  copying length bytes (3 to 258) from distance bytes back (1 to 256)
+ */
+#define BLE_LZ_MIN_MATCH 3
+#define BLE_LZ_MAX_MATCH 258
+#define BLE_LZ_WINDOW 256
+#ifndef BLE_LZ_MIN_SIZE
+/** Payloads smaller than this aren't worth trying to compress */
+#define BLE_LZ_MIN_SIZE 32
+#endif
+#ifndef BLE_LZ_STREAM_FRAMES
+/** Frames a stream runs before its window restarts, which bounds what one lost frame costs */
+#define BLE_LZ_STREAM_FRAMES 16
+#endif
+#ifndef BLE_LZ_STREAM_IDLE_MS
+/** A pause this long ends a transfer, and the next frame restarts the window */
+#define BLE_LZ_STREAM_IDLE_MS 1000
+#endif
+
+/** Compresses the size bytes at in + start, which may match back into the start bytes
+ *  before them. Returns false if the result wouldn't fit capacity
+ */
+inline bool ble_lz_compress_from(const uint8_t *in, size_t start, size_t size, uint8_t *out, size_t capacity, size_t *outSize)
+{
+    size_t end = start + size;
+    size_t pos = start;
+    size_t written = 0;
+    size_t control = 0;
+    uint8_t bit = 8;
+    while (pos < end)
+    {
+        if (8 == bit)
+        {
+            if (written >= capacity)
+            {
+                return false;
+            }
+            control = written;
+            out[written++] = 0;
+            bit = 0;
+        }
+        size_t bestLength = 0;
+        size_t bestDistance = 0;
+        size_t limit = end - pos < BLE_LZ_MAX_MATCH ? end - pos : BLE_LZ_MAX_MATCH;
+        size_t window = pos < BLE_LZ_WINDOW ? pos : BLE_LZ_WINDOW;
+        for (size_t distance = 1; distance <= window && bestLength < limit; ++distance)
+        {
+            const uint8_t *candidate = in + pos - distance;
+            size_t length = 0;
+            /** Matches may run into the bytes they produce, which encodes runs */
+            while (length < limit && candidate[length] == in[pos + length])
+            {
+                ++length;
+            }
+            if (length > bestLength)
+            {
+                bestLength = length;
+                bestDistance = distance;
+            }
+        }
+        if (bestLength >= BLE_LZ_MIN_MATCH)
+        {
+            if (written + 2 > capacity)
+            {
+                return false;
+            }
+            out[control] |= (uint8_t)(1 << bit);
+            out[written++] = (uint8_t)(bestDistance - 1);
+            out[written++] = (uint8_t)(bestLength - BLE_LZ_MIN_MATCH);
+            pos += bestLength;
+        }
+        else
+        {
+            if (written >= capacity)
+            {
+                return false;
+            }
+            out[written++] = in[pos++];
+        }
+        ++bit;
+    }
+    *outSize = written;
+    return true;
+}
+/** Compresses size bytes into out. Returns false if the result wouldn't fit capacity,
+ *  so pass capacity = size - 1 to only accept output that is actually smaller
+ */
+inline bool ble_lz_compress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity, size_t *outSize)
+{
+    return ble_lz_compress_from(in, 0, size, out, capacity, outSize);
+}
+/** Expands a compressed payload whose matches may reach back into the historySize bytes of
+ *  history before it. Returns false if it is malformed or exceeds capacity
+ */
+inline bool ble_lz_decompress_from(const uint8_t *in, size_t size, const uint8_t *history, size_t historySize,
+                                   uint8_t *out, size_t capacity, size_t *outSize)
+{
+    size_t pos = 0;
+    size_t written = 0;
+    while (pos < size)
+    {
+        uint8_t control = in[pos++];
+        for (uint8_t bit = 0; bit < 8 && pos < size; ++bit)
+        {
+            if (0 == (control & (1 << bit)))
+            {
+                if (written >= capacity)
+                {
+                    return false;
+                }
+                out[written++] = in[pos++];
+                continue;
+            }
+            if (pos + 2 > size)
+            {
+                return false;
+            }
+            size_t distance = (size_t)in[pos] + 1;
+            size_t length = (size_t)in[pos + 1] + BLE_LZ_MIN_MATCH;
+            pos += 2;
+            if (distance > written + historySize || written + length > capacity)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < length; ++i, ++written)
+            {
+                out[written] = distance <= written ? out[written - distance] : history[historySize + written - distance];
+            }
+        }
+    }
+    *outSize = written;
+    return true;
+}
+/** Expands a compressed payload. Returns false if it is malformed or exceeds capacity */
+inline bool ble_lz_decompress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity, size_t *outSize)
+{
+    return ble_lz_decompress_from(in, size, nullptr, 0, out, capacity, outSize);
+}
+
+/** What compression has bought on one side of a link */
+struct BleCompressStats
+{
+    /** Payload bytes offered for compression and bytes actually sent for them */
+    uint32_t plainBytes;
+    uint32_t sentBytes;
+    uint32_t compressed;
+    /** Compressed frames that could match into the frames before them in their transfer */
+    uint32_t streamed;
+    /** Frames sent uncompressed because they didn't shrink */
+    uint32_t incompressible;
+    /** CPU time spent compressing, measured with micros() */
+    uint32_t encodeMicros;
+    uint32_t decompressed;
+    uint32_t decodeErrors;
+    /** Sent bytes per 1000 payload bytes, below 1000 means airtime saved */
+    uint32_t ratio() const
+    {
+        return plainBytes ? (uint32_t)((uint64_t)sentBytes * 1000 / plainBytes) : 1000;
+    }
+    /** Encoder cost in microseconds per KiB of payload */
+    uint32_t microsPerKiB() const
+    {
+        return plainBytes ? (uint32_t)((uint64_t)encodeMicros * 1024 / plainBytes) : 0;
+    }
+    /** Effective throughput relative to sending uncompressed, in permille. Uncompressed
+     *  frames carry the same payload in their full size, so this is the inverse of ratio()
+     */
+    uint32_t gain() const
+    {
+        return sentBytes ? (uint32_t)((uint64_t)plainBytes * 1000 / sentBytes) : 1000;
+    }
+};
+
+/** Compresses a payload if that makes it smaller. Returns the size to send, and sets
+ *  *compressed to whether out holds the compressed form; otherwise send in unchanged
+ */
+inline size_t ble_lz_encode(const uint8_t *in, size_t size, uint8_t *out, size_t capacity, bool *compressed, BleCompressStats *pStats)
+{
+    *compressed = false;
+    if (size < BLE_LZ_MIN_SIZE)
+    {
+        return size;
+    }
+    uint32_t startTS = micros();
+    size_t outSize = 0;
+    size_t limit = size - 1 < capacity ? size - 1 : capacity;
+    *compressed = ble_lz_compress(in, size, out, limit, &outSize);
+    pStats->encodeMicros += micros() - startTS;
+    pStats->plainBytes += size;
+    if (*compressed)
+    {
+        ++pStats->compressed;
+        pStats->sentBytes += outSize;
+        return outSize;
+    }
+    ++pStats->incompressible;
+    pStats->sentBytes += size;
+    return size;
+}
+
+/** One direction of a transfer compressed as a stream: the last BLE_LZ_WINDOW bytes of plain
+ *  payload, which the next frame may match back into. Both ends keep the same window as long
+ *  as every frame arrives and in order. Each frame carries a sequence number, 0 where the
+ *  window restarts, so a receiver that misses one refuses the rest until the next restart.
+ *  A sender that knows a frame didn't go out restarts straight away.
+ */
+struct BleLzStream
+{
+    uint8_t history[BLE_LZ_WINDOW];
+    uint16_t length;
+    /** The sequence number of the next frame */
+    uint8_t sequence;
+    /** Frames since the window restarted, and when the last one was sent */
+    uint8_t frames;
+    uint32_t lastTS;
+
+    void restart()
+    {
+        length = 0;
+        sequence = 0;
+        frames = 0;
+    }
+    /** Takes a frame's plain payload into the window */
+    void append(uint8_t sent, const uint8_t *data, size_t size)
+    {
+        size_t take = size < BLE_LZ_WINDOW ? size : BLE_LZ_WINDOW;
+        size_t keep = length + take > BLE_LZ_WINDOW ? BLE_LZ_WINDOW - take : length;
+        memmove(history, history + length - keep, keep);
+        memcpy(history + keep, data + size - take, take);
+        length = (uint16_t)(keep + take);
+        /** 0 only ever marks a restart */
+        sequence = (255 == sent) ? 1 : (uint8_t)(sent + 1);
+    }
+};
+
+/** Compresses a payload against the window of its transfer, like ble_lz_encode(). A stream
+ *  frame is [sequence][compressed]; a payload sent uncompressed stays out of the window
+ */
+inline size_t ble_lz_stream_encode(BleLzStream *pStream, const uint8_t *in, size_t size, uint8_t *out, size_t capacity, bool *compressed, BleCompressStats *pStats)
+{
+    *compressed = false;
+    if (size < BLE_LZ_MIN_SIZE || capacity < 2)
+    {
+        return size;
+    }
+    uint32_t startTS = micros();
+    uint32_t now = BleClock::now();
+    /** The window followed by the payload, so matches can run from one into the other */
+    uint8_t joined[2 * BLE_LZ_WINDOW];
+    if (pStream->frames >= BLE_LZ_STREAM_FRAMES || BLE_LZ_STREAM_IDLE_MS <= now - pStream->lastTS ||
+        pStream->length + size > sizeof(joined))
+    {
+        pStream->restart();
+    }
+    const uint8_t *source = in;
+    size_t start = 0;
+    if (pStream->length)
+    {
+        start = pStream->length;
+        memcpy(joined, pStream->history, start);
+        memcpy(joined + start, in, size);
+        source = joined;
+    }
+    size_t outSize = 0;
+    size_t limit = size - 2 < capacity - 1 ? size - 2 : capacity - 1;
+    *compressed = ble_lz_compress_from(source, start, size, out + 1, limit, &outSize);
+    pStats->encodeMicros += micros() - startTS;
+    pStats->plainBytes += size;
+    if (!*compressed)
+    {
+        ++pStats->incompressible;
+        pStats->sentBytes += size;
+        return size;
+    }
+    out[0] = pStream->sequence;
+    pStream->append(out[0], in, size);
+    ++pStream->frames;
+    pStream->lastTS = now;
+    ++pStats->compressed;
+    if (start)
+    {
+        ++pStats->streamed;
+    }
+    pStats->sentBytes += outSize + 1;
+    return outSize + 1;
+}
+/** Expands a stream frame. Returns false if it is malformed or follows a frame that never
+ *  arrived; the stream then refuses frames until the sender restarts it
+ */
+inline bool ble_lz_stream_decode(BleLzStream *pStream, const uint8_t *in, size_t size, uint8_t *out, size_t capacity, size_t *outSize)
+{
+    if (0 == size)
+    {
+        return false;
+    }
+    if (0 == in[0])
+    {
+        pStream->restart();
+    }
+    else if (in[0] != pStream->sequence)
+    {
+        pStream->restart();
+        return false;
+    }
+    if (!ble_lz_decompress_from(in + 1, size - 1, pStream->history, pStream->length, out, capacity, outSize))
+    {
+        pStream->restart();
+        return false;
+    }
+    pStream->append(in[0], out, *outSize);
+    return true;
+}
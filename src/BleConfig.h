@@ -0,0 +1,530 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleWatchdog.h"
+#include "BleTraffic.h"
+#include "BleFrameQueue.h"
+
+/** Versioned key/value configuration carried by the configuration service.
+ *  Every change bumps the version and stamps the entry with it, so a peer that has
+ *  acknowledged version N only needs the entries stamped after N. Those are packed
+ *  into as few MTU-sized delta frames as they fit in; the peer acknowledges the last
+ *  one by notifying its new version.
+ *  Versions count from 0 again whenever the master restarts, so they are qualified by
+ *  the master's epoch, drawn at random by begin(). A peer holding another epoch's
+ *  version is resynced from scratch.
+ *
+ *  Delta: ['D'][epoch u32][base u32][target u32][flags][index][entries...]
+ *         entry: [key length][key][value length, 0xFF = removed][value]
+ *         The peer applies it if it holds the epoch at a version of at least base. On
+ *         the frame flagged BLE_CONFIG_LAST its version becomes target. A delta from
+ *         base 0 flagged BLE_CONFIG_FIRST is a full resync, applied whatever the peer
+ *         holds: it clears the peer's table and adopts the epoch. index counts the
+ *         delta's frames from 0, so the peer naks a delta that skips one and ignores the
+ *         rest of it.
+ *  Ack:   ['A'][magic][epoch u32][version u32], notified when a delta completes, and
+ *         the readable value of the peer's characteristic
+ *  Nak:   ['N'][magic][epoch u32][version u32], notified when a frame is rejected; the
+ *         sender resends from the version, or resyncs if the epoch isn't its own
+ */
+#ifndef BLE_CONFIG_MAX_KEYS
+#define BLE_CONFIG_MAX_KEYS 32
+#endif
+#ifndef BLE_CONFIG_MAX_KEY
+#define BLE_CONFIG_MAX_KEY 16
+#endif
+#ifndef BLE_CONFIG_MAX_VALUE
+#define BLE_CONFIG_MAX_VALUE 32
+#endif
+#ifndef BLE_CONFIG_ACK_TIMEOUT_MS
+#define BLE_CONFIG_ACK_TIMEOUT_MS 2000
+#endif
+#define BLE_CONFIG_DELTA 'D'
+#define BLE_CONFIG_ACK 'A'
+#define BLE_CONFIG_NAK 'N'
+/** Second byte of acks and naks, telling them from other notifications */
+#define BLE_CONFIG_MAGIC 0xC7
+#define BLE_CONFIG_LAST 0x01
+#define BLE_CONFIG_FIRST 0x02
+#define BLE_CONFIG_REMOVED 0xFF
+/** Offsets of the flags and the frame index in a delta frame */
+#define BLE_CONFIG_FLAGS 13
+#define BLE_CONFIG_INDEX 14
+#define BLE_CONFIG_DELTA_HEADER 15
+#define BLE_CONFIG_ACK_SIZE 10
+
+inline uint32_t ble_config_u32(const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+inline void ble_config_put_u32(uint8_t *data, uint32_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+    data[2] = (uint8_t)(value >> 16);
+    data[3] = (uint8_t)(value >> 24);
+}
+/** Is the frame an ack or a nak? */
+inline bool ble_config_is_ack(const uint8_t *data, size_t size)
+{
+    return size == BLE_CONFIG_ACK_SIZE && (data[0] == BLE_CONFIG_ACK || data[0] == BLE_CONFIG_NAK) &&
+           data[1] == BLE_CONFIG_MAGIC;
+}
+inline uint32_t ble_config_ack_epoch(const uint8_t *data)
+{
+    return ble_config_u32(data + 2);
+}
+inline uint32_t ble_config_ack_version(const uint8_t *data)
+{
+    return ble_config_u32(data + 6);
+}
+
+/** A configuration table. The central edits its master copy with set()/remove() and
+ *  peers hold a replica kept current with apply()
+ */
+class BleConfig
+{
+    struct Entry
+    {
+        uint32_t version;
+        uint8_t keyLength;
+        /** BLE_CONFIG_REMOVED when the entry is a tombstone */
+        uint8_t valueLength;
+        char key[BLE_CONFIG_MAX_KEY];
+        uint8_t value[BLE_CONFIG_MAX_VALUE];
+    };
+    Entry m_entries[BLE_CONFIG_MAX_KEYS];
+    size_t m_count;
+    uint32_t m_epoch;
+    uint32_t m_version;
+    /** A replica's place in the delta it is receiving: the target it goes to and the
+     *  index of the frame due next. Once a frame is missed the rest of the delta is
+     *  skipped, until a frame with index 0 starts another
+     */
+    uint32_t m_deltaTarget;
+    uint8_t m_next;
+    bool m_skipping;
+
+    Entry *find(const char *key, size_t keyLength)
+    {
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            if (m_entries[i].keyLength == keyLength && 0 == memcmp(m_entries[i].key, key, keyLength))
+            {
+                return &m_entries[i];
+            }
+        }
+        return nullptr;
+    }
+    /** Stores a value at a version.
+     *  Returns 1 if it changed, 0 if it was already set, -1 if it is too big or the table is full
+     */
+    int store(const char *key, size_t keyLength, const uint8_t *value, uint8_t valueLength, uint32_t version)
+    {
+        if (0 == keyLength || keyLength > BLE_CONFIG_MAX_KEY ||
+            (BLE_CONFIG_REMOVED != valueLength && valueLength > BLE_CONFIG_MAX_VALUE))
+        {
+            return -1;
+        }
+        Entry *pEntry = find(key, keyLength);
+        if (nullptr == pEntry)
+        {
+            if (BLE_CONFIG_REMOVED == valueLength)
+            {
+                return 0;
+            }
+            if (m_count >= BLE_CONFIG_MAX_KEYS)
+            {
+                return -1;
+            }
+            pEntry = &m_entries[m_count++];
+            pEntry->keyLength = (uint8_t)keyLength;
+            memcpy(pEntry->key, key, keyLength);
+        }
+        else if (pEntry->valueLength == valueLength &&
+                 (BLE_CONFIG_REMOVED == valueLength || 0 == memcmp(pEntry->value, value, valueLength)))
+        {
+            /** Unchanged, don't resend it */
+            return 0;
+        }
+        pEntry->valueLength = valueLength;
+        if (BLE_CONFIG_REMOVED != valueLength)
+        {
+            memcpy(pEntry->value, value, valueLength);
+        }
+        pEntry->version = version;
+        return 1;
+    }
+    /** Applies a local edit, starting a new version if anything changed */
+    bool edit(const char *key, const uint8_t *value, uint8_t valueLength)
+    {
+        int result = store(key, strlen(key), value, valueLength, m_version + 1);
+        if (result > 0)
+        {
+            ++m_version;
+        }
+        return result >= 0;
+    }
+
+    void writeAck(uint8_t type, uint8_t *ack) const
+    {
+        ack[0] = type;
+        ack[1] = BLE_CONFIG_MAGIC;
+        ble_config_put_u32(ack + 2, m_epoch);
+        ble_config_put_u32(ack + 6, m_version);
+    }
+
+public:
+    /** Empties the table and draws a new epoch. A replica's epoch matches no master, so
+     *  its first delta is a full resync
+     */
+    void begin()
+    {
+        m_count = 0;
+        m_version = 0;
+        m_deltaTarget = 0;
+        m_next = 0;
+        m_skipping = false;
+        /** Never 0, so an epoch read from a blank characteristic can't match */
+        m_epoch = esp_random() | 1;
+    }
+    uint32_t epoch() const
+    {
+        return m_epoch;
+    }
+    uint32_t version() const
+    {
+        return m_version;
+    }
+    /** Writes the ack reporting what the table holds, BLE_CONFIG_ACK_SIZE bytes. A
+     *  replica exposes it as its characteristic's value
+     */
+    void ack(uint8_t *ack) const
+    {
+        writeAck(BLE_CONFIG_ACK, ack);
+    }
+    bool set(const char *key, const uint8_t *value, size_t size)
+    {
+        if (size > BLE_CONFIG_MAX_VALUE)
+        {
+            return false;
+        }
+        return edit(key, value, (uint8_t)size);
+    }
+    bool set(const char *key, const char *value)
+    {
+        return set(key, (const uint8_t *)value, strlen(value));
+    }
+    /** Removes a key. Peers learn of it through a tombstone */
+    bool remove(const char *key)
+    {
+        return edit(key, nullptr, BLE_CONFIG_REMOVED);
+    }
+    /** Returns the value's length, or -1 if the key isn't set */
+    int get(const char *key, const uint8_t **value)
+    {
+        Entry *pEntry = find(key, strlen(key));
+        if (nullptr == pEntry || BLE_CONFIG_REMOVED == pEntry->valueLength)
+        {
+            return -1;
+        }
+        *value = pEntry->value;
+        return pEntry->valueLength;
+    }
+
+    /** Builds the next delta frame for a peer at version since of this epoch, or 0 for a
+     *  full resync, starting from entry *cursor (0 for the first frame). index is the
+     *  frame's place in the delta, from 0. Returns the frame size, or 0 if an entry can't
+     *  fit in capacity. When the frame is flagged BLE_CONFIG_LAST the delta is complete
+     */
+    size_t delta(uint32_t since, size_t *cursor, uint8_t index, uint8_t *frame, size_t capacity) const
+    {
+        if (capacity > BLE_FRAME_MAX_SIZE)
+        {
+            capacity = BLE_FRAME_MAX_SIZE;
+        }
+        if (capacity <= BLE_CONFIG_DELTA_HEADER)
+        {
+            return 0;
+        }
+        size_t size = BLE_CONFIG_DELTA_HEADER;
+        size_t i = *cursor;
+        uint8_t flags = (0 == i) ? BLE_CONFIG_FIRST : 0;
+        for (; i < m_count; ++i)
+        {
+            const Entry &entry = m_entries[i];
+            if (entry.version <= since)
+            {
+                continue;
+            }
+            size_t valueLength = (BLE_CONFIG_REMOVED == entry.valueLength) ? 0 : entry.valueLength;
+            size_t entrySize = 2 + entry.keyLength + valueLength;
+            if (size + entrySize > capacity)
+            {
+                if (size == BLE_CONFIG_DELTA_HEADER)
+                {
+                    return 0;
+                }
+                break;
+            }
+            frame[size++] = entry.keyLength;
+            memcpy(frame + size, entry.key, entry.keyLength);
+            size += entry.keyLength;
+            frame[size++] = entry.valueLength;
+            memcpy(frame + size, entry.value, valueLength);
+            size += valueLength;
+        }
+        *cursor = i;
+        frame[0] = BLE_CONFIG_DELTA;
+        ble_config_put_u32(frame + 1, m_epoch);
+        ble_config_put_u32(frame + 5, since);
+        ble_config_put_u32(frame + 9, m_version);
+        frame[BLE_CONFIG_FLAGS] = flags | ((i >= m_count) ? BLE_CONFIG_LAST : 0);
+        frame[BLE_CONFIG_INDEX] = index;
+        return size;
+    }
+    /** Applies a delta frame to a replica and writes the ack or nak to notify back, which
+     *  holds the replica's epoch and version. Only the end of a delta is acknowledged, and
+     *  only if none of its frames went missing.
+     *  Returns 1 when the delta completed and the ack is due, 0 when the frame applied and
+     *  more are expected or it belongs to a delta already naked, -1 when it was rejected
+     *  and the nak is due
+     */
+    int apply(const uint8_t *frame, size_t size, uint8_t *ack)
+    {
+        writeAck(BLE_CONFIG_NAK, ack);
+        if (size < BLE_CONFIG_DELTA_HEADER || frame[0] != BLE_CONFIG_DELTA)
+        {
+            return -1;
+        }
+        uint32_t epoch = ble_config_u32(frame + 1);
+        uint32_t base = ble_config_u32(frame + 5);
+        uint32_t target = ble_config_u32(frame + 9);
+        uint8_t flags = frame[BLE_CONFIG_FLAGS];
+        uint8_t index = frame[BLE_CONFIG_INDEX];
+        if (0 == index)
+        {
+            m_skipping = false;
+        }
+        else if (m_skipping)
+        {
+            return 0;
+        }
+        else if (index != m_next || target != m_deltaTarget || epoch != m_epoch)
+        {
+            /** One went missing. What came of the delta stays, stamped with its target,
+             *  and is sent again from the version the nak reports
+             */
+            m_skipping = true;
+            return -1;
+        }
+        if (0 == base && (flags & BLE_CONFIG_FIRST))
+        {
+            m_count = 0;
+            m_epoch = epoch;
+            m_version = 0;
+        }
+        else if (epoch != m_epoch || base > m_version)
+        {
+            m_skipping = true;
+            return -1;
+        }
+        size_t i = BLE_CONFIG_DELTA_HEADER;
+        while (i < size)
+        {
+            size_t keyLength = frame[i++];
+            /** room for the key and the value length after it */
+            if (i + keyLength >= size)
+            {
+                m_skipping = true;
+                return -1;
+            }
+            const char *key = (const char *)frame + i;
+            i += keyLength;
+            uint8_t valueLength = frame[i++];
+            size_t stored = (BLE_CONFIG_REMOVED == valueLength) ? 0 : valueLength;
+            if (i + stored > size)
+            {
+                m_skipping = true;
+                return -1;
+            }
+            store(key, keyLength, frame + i, valueLength, target);
+            i += stored;
+        }
+        m_deltaTarget = target;
+        m_next = index + 1;
+        if (0 == (flags & BLE_CONFIG_LAST))
+        {
+            return 0;
+        }
+        m_version = target;
+        /** Tombstones are only needed by a master, drop them */
+        for (size_t j = 0; j < m_count;)
+        {
+            if (BLE_CONFIG_REMOVED == m_entries[j].valueLength)
+            {
+                m_entries[j] = m_entries[--m_count];
+            }
+            else
+            {
+                ++j;
+            }
+        }
+        writeAck(BLE_CONFIG_ACK, ack);
+        return 1;
+    }
+};
+
+#if BLE_RADIO_CENTRAL
+/** Keeps one peer's replica in step with the master configuration */
+class BleConfigSync
+{
+    NimBLERemoteCharacteristic *m_pChr;
+    /** The peer holds our epoch, at version m_acked */
+    bool m_synced;
+    uint32_t m_acked;
+    /** A delta to version m_sent is out and not yet acknowledged */
+    bool m_outstanding;
+    uint32_t m_sent;
+    uint32_t m_sentTS;
+
+public:
+    /** The peer starts out unsynced; pass its readable value to received() to skip what it has */
+    void begin(NimBLERemoteCharacteristic *pChr)
+    {
+        m_pChr = pChr;
+        m_synced = false;
+        m_acked = 0;
+        m_outstanding = false;
+        m_sent = 0;
+        m_sentTS = 0;
+    }
+    /** Whether the peer holds the configuration's current version */
+    bool synced(const BleConfig &config) const
+    {
+        return m_synced && m_acked == config.version();
+    }
+    uint32_t acked() const
+    {
+        return m_acked;
+    }
+    NimBLERemoteCharacteristic *characteristic() const
+    {
+        return m_pChr;
+    }
+    /** The version the peer's next delta starts from. A peer of another epoch, or ahead
+     *  of us, is resynced from scratch
+     */
+    uint32_t since(const BleConfig &config) const
+    {
+        return (!m_synced || m_acked > config.version()) ? 0 : m_acked;
+    }
+    /** Builds the delta the peer is missing as a single frame, for a broadcast.
+     *  Returns its size, or 0 if the delta doesn't fit one frame of the peer's MTU
+     */
+    size_t frame(const BleConfig &config, uint8_t *frame) const
+    {
+        if (nullptr == m_pChr)
+        {
+            return 0;
+        }
+        size_t mtu = m_pChr->getRemoteService()->getClient()->getMTU();
+        size_t cursor = 0;
+        size_t size = config.delta(since(config), &cursor, 0, frame, mtu > 3 ? mtu - 3 : 0);
+        return (0 != size && (frame[BLE_CONFIG_FLAGS] & BLE_CONFIG_LAST)) ? size : 0;
+    }
+    /** Records a delta to the configuration's version as sent by other means */
+    void sent(const BleConfig &config, uint32_t now)
+    {
+        m_outstanding = true;
+        m_sent = config.version();
+        m_sentTS = now;
+    }
+    /** Handles an ack or nak notified by the peer, or its characteristic's value.
+     *  Returns the ms since the delta it acknowledges was sent, or -1 if it acknowledges
+     *  none that was outstanding
+     */
+    int32_t received(const BleConfig &config, const uint8_t *data, size_t size)
+    {
+        if (!ble_config_is_ack(data, size))
+        {
+            return -1;
+        }
+        uint32_t version = ble_config_ack_version(data);
+        if (ble_config_ack_epoch(data) != config.epoch())
+        {
+            /** The peer's version counts from another of our boots, or another master's */
+            m_synced = false;
+            m_outstanding = false;
+            return -1;
+        }
+        if (BLE_CONFIG_NAK == data[0])
+        {
+            /** A frame went missing or the peer lost state; resend from what it holds */
+            m_synced = true;
+            m_acked = version;
+            m_outstanding = false;
+            return -1;
+        }
+        if (m_outstanding && version == m_sent)
+        {
+            m_synced = true;
+            m_acked = version;
+            m_outstanding = false;
+            return (int32_t)(BleClock::now() - m_sentTS);
+        }
+        if (!m_outstanding)
+        {
+            m_synced = true;
+            m_acked = version;
+        }
+        /** Otherwise it is late, for a delta sent again since; wait for that one's */
+        return -1;
+    }
+    /** Queues the entries the peer is missing as control traffic. Returns the number of
+     *  frames queued
+     */
+    size_t update(const BleConfig &config, uint32_t now)
+    {
+        if (nullptr == m_pChr || synced(config))
+        {
+            return 0;
+        }
+        if (m_outstanding && BLE_CONFIG_ACK_TIMEOUT_MS > now - m_sentTS)
+        {
+            return 0;
+        }
+        size_t mtu = m_pChr->getRemoteService()->getClient()->getMTU();
+        size_t capacity = mtu > 3 ? mtu - 3 : 0;
+        /** Write commands pipeline into one connection event; the ack confirms the lot */
+        bool response = !m_pChr->canWriteNoResponse();
+        uint16_t conn = m_pChr->getRemoteService()->getClient()->getConnId();
+        uint32_t since = this->since(config);
+        uint8_t frame[BLE_FRAME_MAX_SIZE];
+        size_t cursor = 0;
+        size_t frames = 0;
+        do
+        {
+            size_t size = config.delta(since, &cursor, (uint8_t)frames, frame, capacity);
+            if (0 == size)
+            {
+                Serial.println(F("BLE Configuration entry does not fit the MTU"));
+                return frames;
+            }
+            /** A partly queued delta is sent again whole, entries apply idempotently */
+            if (!BleTraffic::instance().send(conn, BLE_QOS_CONTROL, response ? ble_traffic_write_response : ble_traffic_write,
+                                             m_pChr, frame, size))
+            {
+                Serial.println(F("BLE Configuration write failed"));
+                return frames;
+            }
+            ++frames;
+            if (frame[BLE_CONFIG_FLAGS] & BLE_CONFIG_LAST)
+            {
+                break;
+            }
+        } while (true);
+        sent(config, now);
+        return frames;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
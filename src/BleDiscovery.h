@@ -0,0 +1,144 @@
+#pragma once
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include "BleHistogram.h"
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+
+/** Looks a peer's attributes up by UUID, one at a time, and counts what that costs.
+ *  NimBLE keeps what it has discovered on the client, so each lookup checks that first;
+ *  only a miss runs a GATT discovery procedure, limited to the UUID, and with it at least
+ *  one ATT request and response. The schema's client tables look characteristics up the
+ *  first time they are asked for, so a connect only discovers what it goes on to use.
+ *  Lookups run from the loop task.
+ */
+struct BleDiscoveryStats
+{
+    uint32_t lookups;
+    /** Answered from NimBLE's attribute cache, without asking the peer */
+    uint32_t cached;
+    /** Discovery procedures run */
+    uint32_t procedures;
+    /** Procedures that found nothing */
+    uint32_t missing;
+    /** Time spent in discovery, in us */
+    uint32_t micros;
+    /** Per connect that had to discover: procedures, and the time they took in ms */
+    BleLatencyHistogram connectProcedures;
+    BleLatencyHistogram connectTime;
+};
+
+class BleDiscovery
+{
+    BleDiscoveryStats m_stats;
+
+    template <typename T>
+    static T *cached(std::vector<T *> *pAttributes, const NimBLEUUID &uuid)
+    {
+        for (T *pAttribute : *pAttributes)
+        {
+            if (pAttribute->getUUID() == uuid)
+            {
+                return pAttribute;
+            }
+        }
+        return nullptr;
+    }
+    template <typename T, typename F>
+    T *lookup(T *pCached, F discover)
+    {
+        ++m_stats.lookups;
+        if (nullptr != pCached)
+        {
+            ++m_stats.cached;
+            return pCached;
+        }
+        uint32_t start = micros();
+        T *pFound = discover();
+        m_stats.micros += micros() - start;
+        ++m_stats.procedures;
+        if (nullptr == pFound)
+        {
+            ++m_stats.missing;
+        }
+        return pFound;
+    }
+
+public:
+    /** The one counter, shared by every lookup */
+    static BleDiscovery &instance()
+    {
+        static BleDiscovery discovery;
+        return discovery;
+    }
+    void begin()
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    NimBLERemoteService *service(NimBLEClient *pClient, const NimBLEUUID &uuid)
+    {
+        return lookup(cached(pClient->getServices(false), uuid), [&]
+                      { return pClient->getService(uuid); });
+    }
+    NimBLERemoteCharacteristic *characteristic(NimBLERemoteService *pSvc, const NimBLEUUID &uuid)
+    {
+        return lookup(cached(pSvc->getCharacteristics(false), uuid), [&]
+                      { return pSvc->getCharacteristic(uuid); });
+    }
+    NimBLERemoteDescriptor *descriptor(NimBLERemoteCharacteristic *pChr, const NimBLEUUID &uuid)
+    {
+        return lookup(cached(pChr->getDescriptors(false), uuid), [&]
+                      { return pChr->getDescriptor(uuid); });
+    }
+    /** Records what one connect spent, if it had to discover anything */
+    void connected(uint32_t procedures, uint32_t micros)
+    {
+        if (procedures)
+        {
+            m_stats.connectProcedures.record(procedures);
+            m_stats.connectTime.record(micros / 1000);
+        }
+    }
+    const BleDiscoveryStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE discovery: "));
+        out.print(m_stats.lookups);
+        out.print(F(" lookups, "));
+        out.print(m_stats.cached);
+        out.print(F(" cached, "));
+        out.print(m_stats.procedures);
+        out.print(F(" procedures ("));
+        out.print(m_stats.missing);
+        out.print(F(" found nothing), "));
+        out.print(m_stats.micros / 1000);
+        out.println(F("ms"));
+        out.print(F("BLE discovery per connect "));
+        m_stats.connectProcedures.report(out, F(" procedures"));
+        out.print(F("BLE discovery time per connect "));
+        m_stats.connectTime.report(out, F("ms"));
+    }
+};
+
+/** Attributes a connect's discovery, from construction to destruction */
+class BleDiscoveryScope
+{
+    uint32_t m_procedures;
+    uint32_t m_micros;
+
+public:
+    BleDiscoveryScope()
+    {
+        const BleDiscoveryStats &stats = BleDiscovery::instance().stats();
+        m_procedures = stats.procedures;
+        m_micros = stats.micros;
+    }
+    ~BleDiscoveryScope()
+    {
+        const BleDiscoveryStats &stats = BleDiscovery::instance().stats();
+        BleDiscovery::instance().connected(stats.procedures - m_procedures, stats.micros - m_micros);
+    }
+};
+#endif // CONFIG_BT_NIMBLE_ROLE_CENTRAL
@@ -0,0 +1,418 @@
+#pragma once
+#include "BleRadioConfig.h"
+
+/** Estimates what the radio costs. Nothing here is measured: radio-on time is derived from
+ *  what the radio is doing (scan duty cycle, advertising events, connection events, bytes
+ *  moved) and turned into charge with a BleEnergyModel of the module's currents. That makes
+ *  the numbers as good as the model, but comparable between configurations, and the same on
+ *  target and under BleVirtualClock.
+ *
+ *  Radio states are sampled from update() every BLE_ENERGY_SAMPLE_MS. Data is counted as it
+ *  is sent and received, per peer address.
+ */
+#ifndef BLE_ENERGY_SAMPLE_MS
+#define BLE_ENERGY_SAMPLE_MS 100
+#endif
+#ifndef BLE_ENERGY_PEERS
+/** Peers accounted separately. The least recently active is replaced */
+#define BLE_ENERGY_PEERS (2 * NIMBLE_MAX_CONNECTIONS)
+#endif
+#ifndef BLE_ADV_INTERVAL_MIN_MS
+/** The advertising interval set by the peripheral, NimBLE's own default range */
+#define BLE_ADV_INTERVAL_MIN_MS 30
+#endif
+#ifndef BLE_ADV_INTERVAL_MAX_MS
+#define BLE_ADV_INTERVAL_MAX_MS 60
+#endif
+/** Link layer framing on the 1M PHY: preamble, access address, header and CRC */
+#define BLE_AIR_PACKET_OVERHEAD 10
+/** L2CAP and ATT headers per ATT PDU */
+#define BLE_AIR_ATT_OVERHEAD 7
+#define BLE_AIR_US_PER_BYTE 8
+#define BLE_AIR_IFS_US 150
+
+/** Currents and timings of the radio, per the module's datasheet */
+struct BleEnergyModel
+{
+    uint16_t txMilliamps;
+    uint16_t rxMilliamps;
+    /** Waking up and settling before each radio event, spent at rxMilliamps */
+    uint16_t eventOverheadUs;
+    /** Link layer payload per packet: 27 without data length extension */
+    uint16_t packetPayload;
+    /** Share of advertising events answered with a scan response, permille */
+    uint16_t scanResponsePermille;
+};
+/** ESP32 at 0 dBm: 130 mA transmitting, 100 mA receiving */
+inline BleEnergyModel ble_energy_esp32()
+{
+    BleEnergyModel model;
+    model.txMilliamps = 130;
+    model.rxMilliamps = 100;
+    model.eventOverheadUs = 300;
+    model.packetPayload = 27;
+    model.scanResponsePermille = 100;
+    return model;
+}
+
+enum BleAirSubsystem : uint8_t
+{
+    BLE_AIR_SCAN = 0,
+    BLE_AIR_ADVERTISING,
+    /** Connection events, whether they carry data or not */
+    BLE_AIR_CONNECTIONS,
+    /** Payload beyond the empty packets of connection events */
+    BLE_AIR_DATA,
+    BLE_AIR_SUBSYSTEMS
+};
+inline const __FlashStringHelper *ble_air_subsystem_name(uint8_t subsystem)
+{
+    switch (subsystem)
+    {
+    case BLE_AIR_SCAN:
+        return F("scan");
+    case BLE_AIR_ADVERTISING:
+        return F("advertising");
+    case BLE_AIR_CONNECTIONS:
+        return F("connections");
+    case BLE_AIR_DATA:
+        return F("data");
+    default:
+        return F("?");
+    }
+}
+
+/** Radio-on time, in us */
+struct BleAirtime
+{
+    uint64_t tx;
+    uint64_t rx;
+};
+struct BleEnergyPeer
+{
+    ble_addr_t address;
+    BleAirtime airtime;
+    uint32_t events;
+    uint32_t txBytes;
+    uint32_t rxBytes;
+    uint32_t activeTS;
+    bool used;
+    NimBLEAddress getAddress() const
+    {
+        return NimBLEAddress(address);
+    }
+};
+
+/** What a configuration would cost, for comparing them before they ship. Leave out what
+ *  doesn't apply
+ */
+struct BleEnergyProfile
+{
+    /** Scan interval and window in ms, 0 when not scanning */
+    uint16_t scanInterval;
+    uint16_t scanWindow;
+    /** Advertising interval in ms, 0 when not advertising; advertising and scan response
+     *  PDU sizes in bytes
+     */
+    uint16_t advInterval;
+    uint8_t advBytes;
+    uint8_t responseBytes;
+    /** Connections, their interval in ms and the slave latency peripherals use */
+    uint8_t connections;
+    uint16_t connInterval;
+    uint8_t connLatency;
+    /** Application data per connection: messages per second, each of this many bytes */
+    uint16_t messagesPerSecond;
+    uint16_t messageBytes;
+    /** Whether this device is the central of its connections */
+    bool central;
+};
+
+class BleEnergy
+{
+    BleEnergyModel m_model;
+    BleAirtime m_subsystems[BLE_AIR_SUBSYSTEMS];
+    BleEnergyPeer m_peers[BLE_ENERGY_PEERS];
+    uint32_t m_startTS;
+    uint32_t m_sampleTS;
+    /** Transfers are counted from the host task */
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    /** Call with the lock held */
+    BleEnergyPeer *peer(const ble_addr_t &address, uint32_t now)
+    {
+        BleEnergyPeer *pOldest = nullptr;
+        for (size_t i = 0; i < BLE_ENERGY_PEERS; ++i)
+        {
+            BleEnergyPeer &entry = m_peers[i];
+            if (entry.used && entry.address.type == address.type &&
+                0 == memcmp(entry.address.val, address.val, sizeof(address.val)))
+            {
+                entry.activeTS = now;
+                return &entry;
+            }
+            if (nullptr == pOldest || !entry.used ||
+                (pOldest->used && now - entry.activeTS > now - pOldest->activeTS))
+            {
+                pOldest = &entry;
+            }
+        }
+        memset(pOldest, 0, sizeof(BleEnergyPeer));
+        pOldest->address = address;
+        pOldest->activeTS = now;
+        pOldest->used = true;
+        return pOldest;
+    }
+    void add(uint8_t subsystem, uint64_t tx, uint64_t rx)
+    {
+        m_subsystems[subsystem].tx += tx;
+        m_subsystems[subsystem].rx += rx;
+    }
+
+public:
+    BleEnergy()
+    {
+        begin(ble_energy_esp32());
+    }
+    /** The one account, shared by both roles */
+    static BleEnergy &instance()
+    {
+        static BleEnergy energy;
+        return energy;
+    }
+    void begin(const BleEnergyModel &model)
+    {
+        m_model = model;
+        memset(m_subsystems, 0, sizeof(m_subsystems));
+        memset(m_peers, 0, sizeof(m_peers));
+        m_startTS = BleClock::now();
+        m_sampleTS = m_startTS;
+    }
+    const BleEnergyModel &model() const
+    {
+        return m_model;
+    }
+    /** Air time of one ATT PDU of size bytes, split into link layer packets */
+    uint32_t pduMicros(size_t size) const
+    {
+        size += BLE_AIR_ATT_OVERHEAD;
+        size_t packets = (size + m_model.packetPayload - 1) / m_model.packetPayload;
+        return (uint32_t)((size + packets * BLE_AIR_PACKET_OVERHEAD) * BLE_AIR_US_PER_BYTE);
+    }
+    /** Radio time of one connection event that carries no data: both sides send an empty
+     *  packet, and both wake up for it
+     */
+    uint32_t eventMicros(BleAirtime *airtime) const
+    {
+        airtime->tx = BLE_AIR_PACKET_OVERHEAD * BLE_AIR_US_PER_BYTE;
+        airtime->rx = BLE_AIR_PACKET_OVERHEAD * BLE_AIR_US_PER_BYTE + BLE_AIR_IFS_US + m_model.eventOverheadUs;
+        return (uint32_t)(airtime->tx + airtime->rx);
+    }
+    /** Returns the ms since the last sample once BLE_ENERGY_SAMPLE_MS have passed, else 0.
+     *  Each role then reports what its radio did over that time
+     */
+    uint32_t sample(uint32_t now)
+    {
+        uint32_t elapsed = now - m_sampleTS;
+        if (elapsed < BLE_ENERGY_SAMPLE_MS)
+        {
+            return 0;
+        }
+        m_sampleTS = now;
+        return elapsed;
+    }
+    /** The receiver was on for window of every interval ms */
+    void scanned(uint32_t elapsed, uint16_t interval, uint16_t window)
+    {
+        if (interval)
+        {
+            portENTER_CRITICAL(&m_lock);
+            add(BLE_AIR_SCAN, 0, (uint64_t)elapsed * 1000 * window / interval);
+            portEXIT_CRITICAL(&m_lock);
+        }
+    }
+    /** An active scan asked an advertiser for its scan response. Its reception is already
+     *  counted in the scan window
+     */
+    void scanRequested()
+    {
+        portENTER_CRITICAL(&m_lock);
+        add(BLE_AIR_SCAN, (12 + BLE_AIR_PACKET_OVERHEAD) * BLE_AIR_US_PER_BYTE, 0);
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Advertising events over elapsed ms: a PDU on each of the three channels, listening
+     *  for requests after each, and sometimes a scan response
+     */
+    void advertised(uint32_t elapsed, uint16_t interval, size_t advBytes, size_t responseBytes)
+    {
+        if (0 == interval)
+        {
+            return;
+        }
+        /** The link layer adds 0 to 10 ms of random delay to each event */
+        uint64_t events = (uint64_t)elapsed / (interval + 5);
+        uint64_t tx = events * 3 * (advBytes + BLE_AIR_PACKET_OVERHEAD) * BLE_AIR_US_PER_BYTE;
+        uint64_t rx = events * (m_model.eventOverheadUs + 3 * BLE_AIR_IFS_US);
+        uint64_t responses = events * m_model.scanResponsePermille / 1000;
+        tx += responses * (responseBytes + BLE_AIR_PACKET_OVERHEAD) * BLE_AIR_US_PER_BYTE;
+        rx += responses * (12 + BLE_AIR_PACKET_OVERHEAD) * BLE_AIR_US_PER_BYTE;
+        portENTER_CRITICAL(&m_lock);
+        add(BLE_AIR_ADVERTISING, tx, rx);
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Connection events of conn over elapsed ms. A peripheral with slave latency is assumed
+     *  to use it, waking every latency + 1 intervals
+     */
+    void connected(uint16_t conn, uint32_t elapsed, uint32_t now)
+    {
+        ble_gap_conn_desc desc;
+        if (0 != ble_gap_conn_find(conn, &desc) || 0 == desc.conn_itvl)
+        {
+            return;
+        }
+        uint32_t period = (uint32_t)desc.conn_itvl * 1250;
+        if (BLE_GAP_ROLE_MASTER != desc.role)
+        {
+            period *= (uint32_t)desc.conn_latency + 1;
+        }
+        uint32_t events = (uint32_t)((uint64_t)elapsed * 1000 / period);
+        BleAirtime event;
+        eventMicros(&event);
+        portENTER_CRITICAL(&m_lock);
+        BleEnergyPeer *pPeer = peer(desc.peer_id_addr, now);
+        pPeer->events += events;
+        pPeer->airtime.tx += event.tx * events;
+        pPeer->airtime.rx += event.rx * events;
+        add(BLE_AIR_CONNECTIONS, event.tx * events, event.rx * events);
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Counts an ATT PDU sent (tx) or received on conn. Safe from the host task */
+    void transferred(uint16_t conn, size_t size, bool tx)
+    {
+        ble_gap_conn_desc desc;
+        if (0 != ble_gap_conn_find(conn, &desc))
+        {
+            return;
+        }
+        uint32_t micros = pduMicros(size);
+        portENTER_CRITICAL(&m_lock);
+        BleEnergyPeer *pPeer = peer(desc.peer_id_addr, BleClock::now());
+        if (tx)
+        {
+            pPeer->txBytes += size;
+            pPeer->airtime.tx += micros;
+            add(BLE_AIR_DATA, micros, 0);
+        }
+        else
+        {
+            pPeer->rxBytes += size;
+            pPeer->airtime.rx += micros;
+            add(BLE_AIR_DATA, 0, micros);
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Charge drawn for airtime, in uAh */
+    uint32_t microampHours(const BleAirtime &airtime) const
+    {
+        /** mA x us = 1e-3 uA x 1e-6 s; 3.6e6 of those make a uAh */
+        return (uint32_t)((airtime.tx * m_model.txMilliamps + airtime.rx * m_model.rxMilliamps) / 3600000);
+    }
+    /** The same charge projected over a day at the rate it accrued since begin(), in uAh */
+    uint32_t perDay(const BleAirtime &airtime, uint32_t now) const
+    {
+        uint32_t elapsed = now - m_startTS;
+        if (0 == elapsed)
+        {
+            return 0;
+        }
+        /** uAh per day = mA x us per ms, times 86400000 ms / 3.6e6 */
+        uint64_t charge = airtime.tx * m_model.txMilliamps + airtime.rx * m_model.rxMilliamps;
+        return (uint32_t)(charge * 24 / elapsed);
+    }
+    const BleAirtime &subsystem(uint8_t subsystem) const
+    {
+        return m_subsystems[subsystem];
+    }
+    /** Copies the account in slot index, for iterating. Returns false if the slot is empty */
+    bool peer(size_t index, BleEnergyPeer *pPeer)
+    {
+        if (index >= BLE_ENERGY_PEERS)
+        {
+            return false;
+        }
+        portENTER_CRITICAL(&m_lock);
+        *pPeer = m_peers[index];
+        portEXIT_CRITICAL(&m_lock);
+        return pPeer->used;
+    }
+    /** What a configuration would draw per day, by subsystem, in uAh. Doesn't touch the
+     *  running account
+     */
+    void estimate(const BleEnergyProfile &profile, uint32_t perDay[BLE_AIR_SUBSYSTEMS]) const
+    {
+        BleEnergy model;
+        model.m_model = m_model;
+        const uint32_t day = 86400000;
+        model.scanned(day, profile.scanInterval, profile.scanWindow);
+        model.advertised(day, profile.advInterval, profile.advBytes, profile.responseBytes);
+        if (profile.connInterval)
+        {
+            uint32_t period = (uint32_t)profile.connInterval * (profile.central ? 1 : profile.connLatency + 1);
+            uint64_t events = (uint64_t)profile.connections * day / period;
+            BleAirtime event;
+            eventMicros(&event);
+            model.add(BLE_AIR_CONNECTIONS, event.tx * events, event.rx * events);
+        }
+        /** Messages go one way, from the peripherals to the central */
+        uint64_t messages = (uint64_t)profile.connections * profile.messagesPerSecond * (day / 1000);
+        uint64_t data = messages * pduMicros(profile.messageBytes);
+        model.add(BLE_AIR_DATA, profile.central ? 0 : data, profile.central ? data : 0);
+        for (size_t i = 0; i < BLE_AIR_SUBSYSTEMS; ++i)
+        {
+            perDay[i] = model.microampHours(model.m_subsystems[i]);
+        }
+    }
+    void report(Print &out)
+    {
+        uint32_t now = BleClock::now();
+        out.print(F("BLE energy over "));
+        out.print((now - m_startTS) / 1000);
+        out.println(F("s, radio-on ms / uAh / projected uAh per day:"));
+        uint32_t total = 0;
+        for (size_t i = 0; i < BLE_AIR_SUBSYSTEMS; ++i)
+        {
+            const BleAirtime &airtime = m_subsystems[i];
+            out.print(F("  "));
+            out.print(ble_air_subsystem_name(i));
+            out.print(F(": "));
+            out.print((uint32_t)((airtime.tx + airtime.rx) / 1000));
+            out.print(F(" / "));
+            out.print(microampHours(airtime));
+            out.print(F(" / "));
+            out.println(perDay(airtime, now));
+            total += perDay(airtime, now);
+        }
+        out.print(F("  total per day: "));
+        out.print(total);
+        out.println(F(" uAh"));
+        BleEnergyPeer entry;
+        for (size_t i = 0; i < BLE_ENERGY_PEERS; ++i)
+        {
+            if (!peer(i, &entry))
+            {
+                continue;
+            }
+            out.print(F("  peer "));
+            out.print(entry.getAddress().toString().c_str());
+            out.print(F(": "));
+            out.print(entry.events);
+            out.print(F(" events, "));
+            out.print(entry.txBytes);
+            out.print(F("B out, "));
+            out.print(entry.rxBytes);
+            out.print(F("B in, "));
+            out.print(microampHours(entry.airtime));
+            out.println(F(" uAh"));
+        }
+    }
+};
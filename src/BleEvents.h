@@ -0,0 +1,189 @@
+#pragma once
+#include "BleRadioConfig.h"
+
+/** Lets the application hook radio events without subclassing anything. Handlers are
+ *  plain functions with a state pointer, kept in a fixed table per event type: dispatch
+ *  is a loop over at most BLE_EVENT_HANDLERS direct calls, allocates nothing, and costs a
+ *  single load when no handler is registered.
+ *
+ *  Handlers run where the event happens. Discovery, notifications, writes, subscriptions
+ *  and the peripheral's connections come from the NimBLE host task, so keep them short
+ *  and hand work to the loop; the central's connections are reported from update().
+ *  Register and remove handlers from setup(), between BleRadio::begin(), which clears
+ *  the table, and BleRadio::on().
+ */
+#ifndef BLE_EVENT_HANDLERS
+/** Handlers per event type */
+#define BLE_EVENT_HANDLERS 4
+#endif
+#ifndef BLE_EVENT_LOG
+/** Registers ble_event_log() at begin(), which prints subscriptions and configuration
+ *  notifications as BleRadio always has
+ */
+#define BLE_EVENT_LOG 1
+#endif
+
+enum BleEventType : uint8_t
+{
+    /** An advertisement was received. Central only */
+    BLE_EVENT_DISCOVERED = 0,
+    BLE_EVENT_CONNECTED,
+    BLE_EVENT_DISCONNECTED,
+    /** A peer notified one of its characteristics. Central only */
+    BLE_EVENT_NOTIFIED,
+    /** A peer wrote one of our characteristics. Peripheral only */
+    BLE_EVENT_WRITTEN,
+    /** A peer changed its subscription to one of our characteristics. Peripheral only */
+    BLE_EVENT_SUBSCRIBED,
+    BLE_EVENTS
+};
+
+/** What happened. Fields that don't apply to the type are null or 0; pointers are only
+ *  valid during the handler
+ */
+struct BleEvent
+{
+    uint8_t type;
+    /** We are the link's central */
+    bool central;
+    /** BLE_HS_CONN_HANDLE_NONE for discoveries */
+    uint16_t conn;
+    NimBLEAddress address;
+#if BLE_RADIO_CENTRAL
+    /** Discoveries: the advertiser, with its RSSI */
+    NimBLEAdvertisedDevice *device;
+    int rssi;
+    /** Notifications: the peer's characteristic */
+    NimBLERemoteCharacteristic *remote;
+#endif
+#if BLE_RADIO_PERIPHERAL
+    /** Writes and subscriptions: our characteristic */
+    NimBLECharacteristic *local;
+#endif
+    const uint8_t *data;
+    size_t size;
+    /** Subscriptions: bit 0 notifications, bit 1 indications */
+    uint16_t subscription;
+};
+typedef void (*BleEventHandler)(const BleEvent &event, void *state);
+
+class BleEvents
+{
+    struct Handler
+    {
+        BleEventHandler handler;
+        void *state;
+    };
+    Handler m_handlers[BLE_EVENTS][BLE_EVENT_HANDLERS];
+    uint8_t m_counts[BLE_EVENTS];
+
+public:
+    /** The one table, shared by both roles */
+    static BleEvents &instance()
+    {
+        static BleEvents events;
+        return events;
+    }
+    void begin()
+    {
+        memset(m_counts, 0, sizeof(m_counts));
+    }
+    /** Adds a handler for an event type. Returns false if the type's table is full */
+    bool on(uint8_t type, BleEventHandler handler, void *state)
+    {
+        if (type >= BLE_EVENTS || nullptr == handler || m_counts[type] >= BLE_EVENT_HANDLERS)
+        {
+            return false;
+        }
+        Handler &entry = m_handlers[type][m_counts[type]++];
+        entry.handler = handler;
+        entry.state = state;
+        return true;
+    }
+    /** Removes a handler from an event type. Returns false if it wasn't registered */
+    bool off(uint8_t type, BleEventHandler handler)
+    {
+        if (type >= BLE_EVENTS)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < m_counts[type]; ++i)
+        {
+            if (m_handlers[type][i].handler == handler)
+            {
+                memmove(&m_handlers[type][i], &m_handlers[type][i + 1], (m_counts[type] - i - 1) * sizeof(Handler));
+                --m_counts[type];
+                return true;
+            }
+        }
+        return false;
+    }
+    /** Whether anyone listens, so callers can skip building the event */
+    bool wanted(uint8_t type) const
+    {
+        return 0 != m_counts[type];
+    }
+    void dispatch(const BleEvent &event) const
+    {
+        const Handler *pHandler = m_handlers[event.type];
+        for (size_t i = 0; i < m_counts[event.type]; ++i, ++pHandler)
+        {
+            pHandler->handler(event, pHandler->state);
+        }
+    }
+};
+
+/** A blank event of a type, for the dispatching code to fill in */
+inline BleEvent ble_event(uint8_t type, uint16_t conn, bool central)
+{
+    BleEvent event = BleEvent();
+    event.type = type;
+    event.central = central;
+    event.conn = conn;
+    return event;
+}
+
+/** Prints subscription changes and notifications of the configuration characteristic */
+inline void ble_event_log(const BleEvent &event, void *state)
+{
+    (void)state;
+#if BLE_RADIO_PERIPHERAL
+    if (BLE_EVENT_SUBSCRIBED == event.type)
+    {
+        Serial.print(F("Client ID: "));
+        Serial.print(event.conn);
+        Serial.print(F(" Address: "));
+        Serial.print(event.address.toString().c_str());
+        switch (event.subscription)
+        {
+        case 0:
+            Serial.print(F(" Unsubscribed to "));
+            break;
+        case 1:
+            Serial.print(F(" Subscribed to notfications for "));
+            break;
+        case 2:
+            Serial.print(F(" Subscribed to indications for "));
+            break;
+        case 3:
+            Serial.print(F(" Subscribed to notifications and indications for "));
+            break;
+        }
+        Serial.println(event.local->getUUID().toString().c_str());
+    }
+#endif
+#if BLE_RADIO_CENTRAL
+    if (BLE_EVENT_NOTIFIED == event.type &&
+        event.remote->getUUID() == BleConfigurationCharacteristic::uuid().toNimBLE())
+    {
+        Serial.print(F("BLE Notification from "));
+        Serial.print(event.address.toString().c_str());
+        Serial.print(F(": Service = "));
+        Serial.print(event.remote->getRemoteService()->getUUID().toString().c_str());
+        Serial.print(F(", Characteristic = "));
+        Serial.print(event.remote->getUUID().toString().c_str());
+        Serial.print(F(", Value = "));
+        Serial.println(std::string((const char *)event.data, event.size).c_str());
+    }
+#endif
+}
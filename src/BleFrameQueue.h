@@ -0,0 +1,94 @@
+#pragma once
+#include <atomic>
+#include <Arduino.h>
+
+#ifndef BLE_FRAME_MAX_SIZE
+/** Largest frame we queue: the ATT payload at the largest MTU NimBLE negotiates */
+#define BLE_FRAME_MAX_SIZE 244
+#endif
+#ifndef BLE_FRAME_QUEUE_SIZE
+/** Frames buffered between the NimBLE host task and update() for protocols that don't
+ *  size their own queue
+ */
+#define BLE_FRAME_QUEUE_SIZE 8
+#endif
+
+/** Which protocol a queued frame belongs to */
+enum BleFrameChannel : uint8_t
+{
+    BLE_FRAME_RPC = 0,
+    BLE_FRAME_CONFIG,
+    /** Other notifications, queued only to be stored */
+    BLE_FRAME_DATA,
+    /** Sample frames, see BleBatch.h */
+    BLE_FRAME_SAMPLES,
+    BLE_FRAME_CHANNELS
+};
+
+struct BleFrame
+{
+    uint16_t conn;
+    uint16_t size;
+    uint8_t channel;
+    uint8_t data[BLE_FRAME_MAX_SIZE];
+};
+
+/** Single producer (the NimBLE host task) single consumer (update()) ring of Size frames */
+template <size_t Size>
+class BleFrameRing
+{
+    static_assert(Size > 0 && Size < 0xFFFF, "BLE frame ring size out of range");
+    /** One slot stays empty to tell a full ring from an empty one */
+    static constexpr size_t SLOTS = Size + 1;
+    BleFrame m_frames[SLOTS];
+    std::atomic<uint16_t> m_head;
+    std::atomic<uint16_t> m_tail;
+
+public:
+    static constexpr size_t capacity()
+    {
+        return Size;
+    }
+    void clear()
+    {
+        m_head = 0;
+        m_tail = 0;
+    }
+    bool push(uint8_t channel, uint16_t conn, const uint8_t *data, size_t size)
+    {
+        uint16_t head = m_head.load(std::memory_order_relaxed);
+        uint16_t next = (head + 1) % SLOTS;
+        if (size > BLE_FRAME_MAX_SIZE || next == m_tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        BleFrame &frame = m_frames[head];
+        frame.conn = conn;
+        frame.size = (uint16_t)size;
+        frame.channel = channel;
+        memcpy(frame.data, data, size);
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+    /** Frames queued */
+    size_t size() const
+    {
+        return (m_head.load(std::memory_order_acquire) + SLOTS - m_tail.load(std::memory_order_acquire)) % SLOTS;
+    }
+    /** The oldest frame, or null when empty. Call pop() when done with it */
+    BleFrame *front()
+    {
+        uint16_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+        return &m_frames[tail];
+    }
+    void pop()
+    {
+        uint16_t tail = m_tail.load(std::memory_order_relaxed);
+        m_tail.store((tail + 1) % SLOTS, std::memory_order_release);
+    }
+};
+typedef BleFrameRing<BLE_FRAME_QUEUE_SIZE> BleFrameQueue;
@@ -0,0 +1,186 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BlePeer.h"
+#include "BleHistogram.h"
+#include "BleFrameQueue.h"
+#if BLE_RADIO_CENTRAL
+
+/** Counters, latency distributions and self checks for the central, so its behaviour with
+ *  many peers, churn and full slots can be judged from a soak run's report
+ */
+#ifndef BLE_HEALTH_CHECK_MS
+/** How often the peer table invariants are checked */
+#define BLE_HEALTH_CHECK_MS 1000
+#endif
+
+struct BleHealthStats
+{
+    uint32_t startTS;
+    uint32_t framesIn;
+    uint32_t bytesIn;
+    uint32_t configFramesOut;
+    uint32_t rpcCompleted;
+    uint32_t rpcTimeouts;
+    uint32_t disconnects;
+    /** Deepest the host task to loop queues have been together, and their room */
+    uint32_t inboxHighWater;
+    uint32_t inboxCapacity;
+    /** Notifications the host task dropped, by channel: malformed, or their queue was full */
+    uint32_t dropped[BLE_FRAME_CHANNELS];
+    /** Lowest free heap seen by the allocator since boot */
+    uint32_t minFreeHeap;
+    uint32_t invariantViolations;
+    /** Request to response */
+    BleLatencyHistogram rpcLatency;
+    /** Configuration delta sent to acked */
+    BleLatencyHistogram configLatency;
+};
+
+class BleHealth
+{
+    BleHealthStats m_stats;
+    uint32_t m_checkTS;
+
+    void violated(const __FlashStringHelper *what)
+    {
+        ++m_stats.invariantViolations;
+        Serial.print(F("BLE Invariant violated: "));
+        Serial.println(what);
+    }
+
+public:
+    void begin(size_t inboxCapacity)
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_stats.inboxCapacity = inboxCapacity;
+        m_stats.startTS = BleClock::now();
+        m_checkTS = m_stats.startTS;
+    }
+    void received(size_t size, size_t queued)
+    {
+        ++m_stats.framesIn;
+        m_stats.bytesIn += size;
+        if (queued > m_stats.inboxHighWater)
+        {
+            m_stats.inboxHighWater = queued;
+        }
+    }
+    /** Counts a notification that never reached update(). Called from the host task, the
+     *  only writer of these counters
+     */
+    void dropped(uint8_t channel)
+    {
+        ++m_stats.dropped[channel];
+    }
+    void sent(size_t configFrames)
+    {
+        m_stats.configFramesOut += configFrames;
+    }
+    /** A latency of -1 means the response matched nothing outstanding */
+    void rpc(int32_t latency, size_t timeouts)
+    {
+        if (latency >= 0)
+        {
+            ++m_stats.rpcCompleted;
+            m_stats.rpcLatency.record((uint32_t)latency);
+        }
+        m_stats.rpcTimeouts += timeouts;
+    }
+    void config(int32_t latency)
+    {
+        if (latency >= 0)
+        {
+            m_stats.configLatency.record((uint32_t)latency);
+        }
+    }
+    void disconnected()
+    {
+        ++m_stats.disconnects;
+    }
+    /** Whether the invariants are due to be checked */
+    bool due(uint32_t now)
+    {
+        if (BLE_HEALTH_CHECK_MS > now - m_checkTS)
+        {
+            return false;
+        }
+        m_checkTS = now;
+        m_stats.minFreeHeap = ESP.getMinFreeHeap();
+        return true;
+    }
+    /** Checks the peer table against NimBLE's clients. Call when due() */
+    void check(BlePeerTable &peers)
+    {
+        for (size_t i = 0; i < peers.capacity(); ++i)
+        {
+            const BlePeer &peer = peers[i];
+            if (nullptr == peer.client || !peer.client->isConnected())
+            {
+                continue;
+            }
+            if (peer.conn != peer.client->getConnId())
+            {
+                violated(F("peer connection handle is stale"));
+            }
+            for (size_t j = i + 1; j < peers.capacity(); ++j)
+            {
+                if (peers[j].client == peer.client)
+                {
+                    violated(F("client holds two peer slots"));
+                }
+            }
+        }
+        std::list<NimBLEClient *> *pClients = NimBLEDevice::getClientList();
+        for (auto it = pClients->begin(); it != pClients->end(); ++it)
+        {
+            if ((*it)->isConnected() && nullptr == peers.find(*it))
+            {
+                violated(F("connected client has no peer slot"));
+            }
+        }
+    }
+    const BleHealthStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        uint32_t seconds = (BleClock::now() - m_stats.startTS) / 1000;
+        out.print(F("BLE Health over "));
+        out.print(seconds);
+        out.println(F("s"));
+        out.print(F("  in: "));
+        out.print(m_stats.framesIn);
+        out.print(F(" frames, "));
+        out.print(seconds ? m_stats.bytesIn / seconds : m_stats.bytesIn);
+        out.print(F(" B/s; config frames out: "));
+        out.print(m_stats.configFramesOut);
+        out.print(F("; disconnects: "));
+        out.println(m_stats.disconnects);
+        out.print(F("  rpc: "));
+        out.print(m_stats.rpcCompleted);
+        out.print(F(" completed, "));
+        out.print(m_stats.rpcTimeouts);
+        out.print(F(" timed out, "));
+        m_stats.rpcLatency.report(out, F("ms"));
+        out.print(F("  config ack "));
+        m_stats.configLatency.report(out, F("ms"));
+        out.print(F("  min free heap: "));
+        out.print(m_stats.minFreeHeap);
+        out.print(F(" B; inbox high water: "));
+        out.print(m_stats.inboxHighWater);
+        out.print(F("/"));
+        out.print(m_stats.inboxCapacity);
+        out.print(F("; invariant violations: "));
+        out.println(m_stats.invariantViolations);
+        out.print(F("  dropped: rpc "));
+        out.print(m_stats.dropped[BLE_FRAME_RPC]);
+        out.print(F(", config "));
+        out.print(m_stats.dropped[BLE_FRAME_CONFIG]);
+        out.print(F(", stored "));
+        out.print(m_stats.dropped[BLE_FRAME_DATA]);
+        out.print(F(", samples "));
+        out.println(m_stats.dropped[BLE_FRAME_SAMPLES]);
+    }
+};
+#endif // BLE_RADIO_CENTRAL
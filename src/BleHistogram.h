@@ -0,0 +1,62 @@
+#pragma once
+#include <Arduino.h>
+
+/** Bucket n holds values needing n bits, so the last covers 2^30 and up */
+#define BLE_HISTOGRAM_BUCKETS 32
+
+/** Power of two histogram of durations in whatever unit the caller records, with constant
+ *  time recording
+ */
+struct BleLatencyHistogram
+{
+    uint32_t buckets[BLE_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    void record(uint32_t value)
+    {
+        size_t bucket = 0;
+        while (value >> bucket && bucket < BLE_HISTOGRAM_BUCKETS - 1)
+        {
+            ++bucket;
+        }
+        ++buckets[bucket];
+        ++count;
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+    /** The upper bound of the bucket holding the given permille, e.g. 990 for p99 */
+    uint32_t percentile(uint32_t permille) const
+    {
+        if (0 == count)
+        {
+            return 0;
+        }
+        uint64_t rank = ((uint64_t)count * permille + 999) / 1000;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BLE_HISTOGRAM_BUCKETS; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank)
+            {
+                uint32_t bound = i ? (uint32_t)((1ull << i) - 1) : 0;
+                return bound < max ? bound : max;
+            }
+        }
+        return max;
+    }
+    /** Prints "p50/p90/p99/max a/b/c/d<unit>" and a line break */
+    void report(Print &out, const __FlashStringHelper *unit) const
+    {
+        out.print(F("p50/p90/p99/max "));
+        out.print(percentile(500));
+        out.print('/');
+        out.print(percentile(900));
+        out.print('/');
+        out.print(percentile(990));
+        out.print('/');
+        out.print(max);
+        out.println(unit);
+    }
+};
@@ -0,0 +1,195 @@
+#pragma once
+#include "BleRadioConfig.h"
+#if BLE_RADIO_CENTRAL
+
+/** Per-address link quality: a filtered RSSI fed from scan results and from periodic
+ *  samples of connected links, and loss counted from RPC requests that were never
+ *  answered. Each request id is either answered or expires, so loss doesn't depend on
+ *  the order responses arrive in, which traffic classes and BUSY replies reorder.
+ *  Everything lives in a fixed table; the least recently heard address is replaced.
+ */
+#ifndef BLE_LINK_ENTRIES
+#define BLE_LINK_ENTRIES 16
+#endif
+#ifndef BLE_LINK_SAMPLE_MS
+/** How often every connected link's RSSI is sampled, all in one pass */
+#define BLE_LINK_SAMPLE_MS 1000
+#endif
+#ifndef BLE_LINK_EWMA_SHIFT
+/** The filter weights each new sample by 1 / 2^shift */
+#define BLE_LINK_EWMA_SHIFT 3
+#endif
+#ifndef BLE_LINK_MIN_RSSI
+/** Advertisers filtered below this (dBm) aren't offered a connection */
+#define BLE_LINK_MIN_RSSI -90
+#endif
+/** Filter state is kept in 1/16 dBm */
+#define BLE_LINK_FRACTION 4
+
+struct BleLinkEntry
+{
+    ble_addr_t address;
+    /** Filtered RSSI and mean absolute deviation, 1/16 dBm */
+    int16_t rssi;
+    uint16_t jitter;
+    uint16_t samples;
+    /** Requests answered, and expired unanswered */
+    uint32_t received;
+    uint32_t lost;
+    uint32_t seenTS;
+    bool used;
+    /** Filtered RSSI in dBm */
+    int filteredRssi() const
+    {
+        return rssi / (1 << BLE_LINK_FRACTION);
+    }
+    /** Loss in permille of the requests that completed either way */
+    uint32_t lossRate() const
+    {
+        return (received + lost) ? (uint32_t)((uint64_t)lost * 1000 / (received + lost)) : 0;
+    }
+};
+
+class BleLinkQuality
+{
+    BleLinkEntry m_entries[BLE_LINK_ENTRIES];
+    uint32_t m_sampleTS;
+    /** Scan results arrive on the host task, samples and sequences on the loop */
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    /** Call with the lock held */
+    BleLinkEntry *find(const NimBLEAddress &address, bool create, uint32_t now)
+    {
+        BleLinkEntry *pOldest = nullptr;
+        for (size_t i = 0; i < BLE_LINK_ENTRIES; ++i)
+        {
+            BleLinkEntry &entry = m_entries[i];
+            if (entry.used && entry.address.type == address.getType() &&
+                0 == memcmp(entry.address.val, address.getNative(), sizeof(entry.address.val)))
+            {
+                return &entry;
+            }
+            if (nullptr == pOldest || !entry.used ||
+                (pOldest->used && now - entry.seenTS > now - pOldest->seenTS))
+            {
+                pOldest = &entry;
+            }
+        }
+        if (!create)
+        {
+            return nullptr;
+        }
+        memset(pOldest, 0, sizeof(BleLinkEntry));
+        pOldest->address.type = address.getType();
+        memcpy(pOldest->address.val, address.getNative(), sizeof(pOldest->address.val));
+        pOldest->used = true;
+        return pOldest;
+    }
+    /** Call with the lock held */
+    static void filter(BleLinkEntry &entry, int rssi, uint32_t now)
+    {
+        int16_t sample = (int16_t)(rssi * (1 << BLE_LINK_FRACTION));
+        if (0 == entry.samples)
+        {
+            entry.rssi = sample;
+            entry.jitter = 0;
+        }
+        else
+        {
+            int16_t error = sample - entry.rssi;
+            entry.rssi += error >> BLE_LINK_EWMA_SHIFT;
+            uint16_t deviation = (uint16_t)(error < 0 ? -error : error);
+            entry.jitter += ((int16_t)(deviation - entry.jitter)) >> BLE_LINK_EWMA_SHIFT;
+        }
+        if (entry.samples < UINT16_MAX)
+        {
+            ++entry.samples;
+        }
+        entry.seenTS = now;
+    }
+
+public:
+    void begin()
+    {
+        memset(m_entries, 0, sizeof(m_entries));
+        m_sampleTS = BleClock::now();
+    }
+    /** Folds in a scan result's RSSI. Called from the host task.
+     *  Returns the filtered RSSI in dBm
+     */
+    int scanned(const NimBLEAddress &address, int rssi, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleLinkEntry *pEntry = find(address, true, now);
+        filter(*pEntry, rssi, now);
+        int result = pEntry->filteredRssi();
+        portEXIT_CRITICAL(&m_lock);
+        return result;
+    }
+    /** Whether a batch of connected link samples is due */
+    bool due(uint32_t now) const
+    {
+        return BLE_LINK_SAMPLE_MS <= now - m_sampleTS;
+    }
+    /** Samples one connected link. Call for every connected peer once due() */
+    void sample(NimBLEClient *pClient, uint32_t now)
+    {
+        m_sampleTS = now;
+        int rssi = pClient->getRssi();
+        if (0 == rssi)
+        {
+            /** getRssi() returns 0 when the controller couldn't be asked */
+            return;
+        }
+        portENTER_CRITICAL(&m_lock);
+        filter(*find(pClient->getPeerAddress(), true, now), rssi, now);
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Counts requests to an address that were answered and that expired unanswered */
+    void requests(const NimBLEAddress &address, uint32_t answered, uint32_t expired, uint32_t now)
+    {
+        if (0 == answered && 0 == expired)
+        {
+            return;
+        }
+        portENTER_CRITICAL(&m_lock);
+        BleLinkEntry *pEntry = find(address, true, now);
+        pEntry->received += answered;
+        pEntry->lost += expired;
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** The filtered RSSI in dBm, or fallback if the address hasn't been heard */
+    int rssi(const NimBLEAddress &address, int fallback)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleLinkEntry *pEntry = find(address, false, 0);
+        int result = (nullptr != pEntry && pEntry->samples) ? pEntry->filteredRssi() : fallback;
+        portEXIT_CRITICAL(&m_lock);
+        return result;
+    }
+    /** Copies out an address's entry. Returns false if it isn't tracked */
+    bool get(const NimBLEAddress &address, BleLinkEntry *pEntry)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleLinkEntry *pFound = find(address, false, 0);
+        if (nullptr != pFound)
+        {
+            *pEntry = *pFound;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return nullptr != pFound;
+    }
+    /** Copies out an entry for diagnostics. Returns false past the end of the table */
+    bool get(size_t index, BleLinkEntry *pEntry)
+    {
+        if (index >= BLE_LINK_ENTRIES)
+        {
+            return false;
+        }
+        portENTER_CRITICAL(&m_lock);
+        *pEntry = m_entries[index];
+        portEXIT_CRITICAL(&m_lock);
+        return true;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
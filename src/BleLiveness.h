@@ -0,0 +1,139 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BlePeer.h"
+#include "BleHistogram.h"
+#if BLE_RADIO_CENTRAL
+
+/** Decides whether connected peers are still alive. Any traffic from a peer proves it is,
+ *  so busy links never see a keep-alive. Only a link quiet for its probe interval gets a
+ *  ping, sent as an RPC the peer answers from its loop, which also catches a hung
+ *  application the link layer would keep connected. Each answered probe doubles the link's
+ *  interval up to BLE_LIVENESS_MAX_MS; a missed one drops it back to the minimum, and
+ *  BLE_LIVENESS_MISSES in a row declare the peer dead.
+ */
+#ifndef BLE_LIVENESS_MIN_MS
+#define BLE_LIVENESS_MIN_MS 5000
+#endif
+#ifndef BLE_LIVENESS_MAX_MS
+#define BLE_LIVENESS_MAX_MS 60000
+#endif
+#ifndef BLE_LIVENESS_MISSES
+#define BLE_LIVENESS_MISSES 3
+#endif
+/** Bytes on air per probe: a request and a response header */
+#define BLE_LIVENESS_PROBE_BYTES (BLE_RPC_HEADER_SIZE * 2)
+
+struct BleLivenessStats
+{
+    uint32_t probes;
+    uint32_t probeBytes;
+    /** Keep-alive pings peripherals sent on their own, counted as traffic */
+    uint32_t keepAlives;
+    uint32_t dead;
+    /** From the last sign of life to the peer being declared dead, in ms */
+    BleLatencyHistogram detection;
+};
+
+class BleLiveness
+{
+    BleLivenessStats m_stats;
+
+    static void onProbe(uint8_t status, const uint8_t *data, size_t size, void *state)
+    {
+        (void)data;
+        (void)size;
+        BlePeer *pPeer = (BlePeer *)state;
+        pPeer->probing = false;
+        if (BLE_RPC_DISCONNECTED == status)
+        {
+            return;
+        }
+        if (BLE_RPC_TIMEOUT == status)
+        {
+            ++pPeer->misses;
+            pPeer->probeInterval = BLE_LIVENESS_MIN_MS;
+            return;
+        }
+        /** Any answer, even an error from a peer that doesn't know the ping, came from a
+         *  running peer
+         */
+        pPeer->misses = 0;
+        pPeer->heardTS = BleClock::now();
+        pPeer->probeInterval = pPeer->probeInterval < BLE_LIVENESS_MAX_MS / 2 ? pPeer->probeInterval * 2 : BLE_LIVENESS_MAX_MS;
+    }
+
+public:
+    void begin()
+    {
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    /** Records traffic from a client's peer. Called from the host task as notifications arrive */
+    void heard(BlePeerTable &peers, const NimBLEClient *pClient, bool keepAlive)
+    {
+        peers.heard(pClient, BleClock::now());
+        if (keepAlive)
+        {
+            ++m_stats.keepAlives;
+        }
+    }
+    /** Probes the peer if it has been idle too long. Returns false once, when the peer is
+     *  declared dead and should be disconnected
+     */
+    bool update(BlePeer &peer, uint32_t now)
+    {
+        if (peer.dead)
+        {
+            return true;
+        }
+        if (0 == peer.probeInterval)
+        {
+            peer.probeInterval = BLE_LIVENESS_MIN_MS;
+        }
+        /** The host task may have stamped it after now was taken */
+        uint32_t heard = peer.heardTS;
+        uint32_t idle = (int32_t)(now - heard) > 0 ? now - heard : 0;
+        if (peer.misses >= BLE_LIVENESS_MISSES)
+        {
+            peer.dead = true;
+            ++m_stats.dead;
+            m_stats.detection.record(idle);
+            return false;
+        }
+        if (peer.probing || !peer.rpc.ready() || idle < peer.probeInterval)
+        {
+            return true;
+        }
+        /** After a miss, wait out the interval again rather than probing every pass */
+        if (0 != peer.misses && now - peer.probeTS < peer.probeInterval)
+        {
+            return true;
+        }
+        peer.probeTS = now;
+        if (0 <= peer.rpc.call(BLE_RPC_PING, nullptr, 0, onProbe, &peer))
+        {
+            peer.probing = true;
+            ++m_stats.probes;
+            m_stats.probeBytes += BLE_LIVENESS_PROBE_BYTES;
+        }
+        return true;
+    }
+    const BleLivenessStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE liveness: "));
+        out.print(m_stats.probes);
+        out.print(F(" probes ("));
+        out.print(m_stats.probeBytes);
+        out.print(F(" bytes), "));
+        out.print(m_stats.keepAlives);
+        out.print(F(" peer keep-alives, "));
+        out.print(m_stats.dead);
+        out.println(F(" dead"));
+        out.print(F("BLE dead peer detection: "));
+        m_stats.detection.report(out, F("ms"));
+    }
+};
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,168 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleRpc.h"
+#include "BleConfig.h"
+#if BLE_RADIO_CENTRAL
+
+/** What the central keeps for each peripheral it is connected to */
+struct BlePeer
+{
+    /** Null when the slot is free */
+    NimBLEClient *client;
+    /** The connection handle, kept after the link drops so its state can be cleaned up */
+    uint16_t conn;
+    uint32_t connectedTS;
+    /** Last time the peer had traffic or data waiting, for the slot scheduler */
+    uint32_t activeTS;
+    /** Last time anything arrived from the peer. Stamped from the host task */
+    volatile uint32_t heardTS;
+    /** Liveness probing: the current idle interval, when the last probe went out and how
+     *  many in a row went unanswered
+     */
+    uint32_t probeInterval;
+    uint32_t probeTS;
+    uint8_t misses;
+    bool probing;
+    /** Declared dead and being disconnected */
+    bool dead;
+    /** Being disconnected to free its slot */
+    bool evicting;
+    BleRpcClient rpc;
+    BleConfigSync config;
+
+    /** Returns the slot to its unused state */
+    void clear()
+    {
+        client = nullptr;
+        conn = BLE_HS_CONN_HANDLE_NONE;
+        connectedTS = 0;
+        activeTS = 0;
+        heardTS = 0;
+        probeInterval = 0;
+        probeTS = 0;
+        misses = 0;
+        probing = false;
+        dead = false;
+        evicting = false;
+        rpc.begin(nullptr, nullptr);
+        config.begin(nullptr);
+    }
+};
+
+/** Fixed table of peers, one slot per connection NimBLE supports. Slots are claimed and
+ *  freed by the loop task; the host task only stamps heard() under the lock, so it never
+ *  sees a slot half claimed or half cleared
+ */
+class BlePeerTable
+{
+    BlePeer m_peers[NIMBLE_MAX_CONNECTIONS];
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+public:
+    void begin()
+    {
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            m_peers[i].clear();
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    static constexpr size_t capacity()
+    {
+        return NIMBLE_MAX_CONNECTIONS;
+    }
+    BlePeer &operator[](size_t index)
+    {
+        return m_peers[index];
+    }
+    /** Stamps traffic from a client's peer. Safe from the host task.
+     *  Returns false if the client has no slot
+     */
+    bool heard(const NimBLEClient *pClient, uint32_t now)
+    {
+        bool found = false;
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (nullptr != pClient && m_peers[i].client == pClient)
+            {
+                m_peers[i].heardTS = now;
+                found = true;
+                break;
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return found;
+    }
+    /** The lookups below are for the loop task */
+    BlePeer *find(const NimBLEClient *pClient)
+    {
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (nullptr != pClient && m_peers[i].client == pClient)
+            {
+                return &m_peers[i];
+            }
+        }
+        return nullptr;
+    }
+    BlePeer *find(const NimBLEAddress &address)
+    {
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (nullptr != m_peers[i].client && m_peers[i].client->getPeerAddress() == address)
+            {
+                return &m_peers[i];
+            }
+        }
+        return nullptr;
+    }
+    BlePeer *find(uint16_t conn)
+    {
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (nullptr != m_peers[i].client && m_peers[i].client->isConnected() && m_peers[i].client->getConnId() == conn)
+            {
+                return &m_peers[i];
+            }
+        }
+        return nullptr;
+    }
+    /** Returns the client's slot, claiming a free one if it has none */
+    BlePeer *add(NimBLEClient *pClient)
+    {
+        BlePeer *pPeer = find(pClient);
+        if (nullptr != pPeer)
+        {
+            return pPeer;
+        }
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (nullptr == m_peers[i].client)
+            {
+                BlePeer &peer = m_peers[i];
+                uint32_t now = BleClock::now();
+                /** Fill the slot before publishing the client the host task matches on */
+                peer.clear();
+                peer.conn = pClient->getConnId();
+                peer.connectedTS = now;
+                peer.activeTS = now;
+                peer.heardTS = now;
+                portENTER_CRITICAL(&m_lock);
+                peer.client = pClient;
+                portEXIT_CRITICAL(&m_lock);
+                return &peer;
+            }
+        }
+        return nullptr;
+    }
+    void remove(BlePeer *pPeer)
+    {
+        portENTER_CRITICAL(&m_lock);
+        pPeer->client = nullptr;
+        portEXIT_CRITICAL(&m_lock);
+        pPeer->clear();
+    }
+};
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,466 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleRpc.h"
+#include "BleBoundValue.h"
+#include "BleBatch.h"
+#include "BleProducer.h"
+#include "BleBeacon.h"
+#include "BleWatchdog.h"
+#include "BleStartup.h"
+#include "BleEnergy.h"
+#include "BleEvents.h"
+#if BLE_RADIO_PERIPHERAL
+
+/** The peripheral role: hosts the session service and advertises it */
+class BlePeripheral :
+    NimBLEServerCallbacks,
+    NimBLECharacteristicCallbacks,
+    NimBLEDescriptorCallbacks
+{
+    NimBLEServer *m_server;
+    BleSessionService::ServerTable m_session;
+    BleRpcServer m_rpc;
+    /** Characteristics served from application buffers */
+    BleBoundValue m_bound[BLE_BOUND_MAX];
+    size_t m_boundCount;
+    /** Diagnostics for collectors that don't connect */
+    BleBeaconEncoder m_beacon;
+    /** Application samples, notified in frames on the samples characteristic */
+    uint8_t m_batchFrame[BLE_FRAME_MAX_SIZE];
+    BleSampleBatcher m_batch;
+    /** Values produced only while subscribed */
+    BleProducers m_producers;
+
+    /** Tells the application's handlers, if any, about a peer's connection */
+    void dispatch(uint8_t type, ble_gap_conn_desc *desc, NimBLECharacteristic *pCharacteristic = nullptr,
+                  const std::string *pValue = nullptr, uint16_t subValue = 0)
+    {
+        BleEvents &events = BleEvents::instance();
+        if (!events.wanted(type))
+        {
+            return;
+        }
+        BleEvent event = ble_event(type, desc->conn_handle, false);
+        event.address = NimBLEAddress(desc->peer_ota_addr);
+        event.local = pCharacteristic;
+        if (nullptr != pValue)
+        {
+            event.data = (const uint8_t *)pValue->data();
+            event.size = pValue->length();
+        }
+        event.subscription = subValue;
+        events.dispatch(event);
+    }
+    BleBoundValue *bound(NimBLECharacteristic *pCharacteristic)
+    {
+        for (size_t i = 0; i < m_boundCount; ++i)
+        {
+            if (m_bound[i].characteristic() == pCharacteristic)
+            {
+                return &m_bound[i];
+            }
+        }
+        return nullptr;
+    }
+    void onConnect(NimBLEServer *pServer)
+    {
+        (void)pServer;
+        m_producers.changed();
+        Serial.println(F("BLE Client connected"));
+        BleStartup::instance().connected();
+        Serial.println(F("BLE Multi-connect support: start advertising"));
+        NimBLEDevice::startAdvertising();
+    };
+    /** Alternative onConnect() method to extract details of the connection. 
+     *  See: src/ble_gap.h for the details of the ble_gap_conn_desc struct.
+     */
+    void onConnect(NimBLEServer *pServer, ble_gap_conn_desc *desc)
+    {
+        Serial.print(F("BLE Client address: "));
+        Serial.println(NimBLEAddress(desc->peer_ota_addr).toString().c_str());
+        /** We can use the connection handle here to ask for different connection parameters.
+         *  Args: connection handle, min connection interval, max connection interval
+         *  latency, supervision timeout.
+         *  Units; Min/Max Intervals: 1.25 millisecond increments.
+         *  Latency: number of intervals allowed to skip.
+         *  Timeout: 10 millisecond increments, try for 5x interval time for best results.  
+         */
+        pServer->updateConnParams(desc->conn_handle, 24, 48, 0, 60);
+        dispatch(BLE_EVENT_CONNECTED, desc);
+    };
+    void onDisconnect(NimBLEServer *pServer)
+    {
+        (void)pServer;
+        Serial.println(F("BLE Client disconnected - start advertising"));
+        NimBLEDevice::startAdvertising();
+    };
+    void onDisconnect(NimBLEServer *pServer, ble_gap_conn_desc *desc)
+    {
+        (void)pServer;
+        m_rpc.disconnected(desc->conn_handle);
+        for (size_t i = 0; i < m_boundCount; ++i)
+        {
+            m_bound[i].subscribed(desc->conn_handle, 0);
+        }
+        m_producers.changed();
+        dispatch(BLE_EVENT_DISCONNECTED, desc);
+    };
+
+    void onAuthenticationComplete(ble_gap_conn_desc *desc)
+    {
+        /** Check that encryption was successful, if not we disconnect the client */
+        if (!desc->sec_state.encrypted)
+        {
+            NimBLEDevice::getServer()->disconnect(desc->conn_handle);
+            Serial.println(F("BLE Encrypt connection failed - disconnecting client"));
+            return;
+        }
+        Serial.println(F("BLE Starting BLE work!"));
+    };
+    void onRead(NimBLECharacteristic *pCharacteristic)
+    {
+        BleBoundValue *pBound = bound(pCharacteristic);
+        if (nullptr != pBound)
+        {
+            /** Load the application's buffer into the value NimBLE is about to send */
+            pBound->read();
+            return;
+        }
+        Serial.print(pCharacteristic->getUUID().toString().c_str());
+        Serial.print(F("BLE : onRead(), value: "));
+        Serial.println(pCharacteristic->getValue().c_str());
+    };
+
+    void onWrite(NimBLECharacteristic *pCharacteristic)
+    {
+        Serial.print(F("BLE "));
+        Serial.print(pCharacteristic->getUUID().toString().c_str());
+        Serial.print(F(": onWrite(), value: "));
+        Serial.println(pCharacteristic->getValue().c_str());
+    };
+    /** Writes to the session characteristic are RPC requests */
+    void onWrite(NimBLECharacteristic *pCharacteristic, ble_gap_conn_desc *desc)
+    {
+        std::string value = pCharacteristic->getValue();
+        BleEnergy::instance().transferred(desc->conn_handle, value.length(), false);
+        dispatch(BLE_EVENT_WRITTEN, desc, pCharacteristic, &value);
+        BleBoundValue *pBound = bound(pCharacteristic);
+        if (nullptr != pBound)
+        {
+            pBound->written(desc->conn_handle, (const uint8_t *)value.data(), value.length());
+            return;
+        }
+        if (pCharacteristic == m_session.get<BleSessionCharacteristic>())
+        {
+            if (m_rpc.received(pCharacteristic, desc->conn_handle, (const uint8_t *)value.data(), value.length()))
+            {
+                return;
+            }
+        }
+        onWrite(pCharacteristic);
+    };
+    /** Called before notification or indication is sent, 
+     *  the value can be changed here before sending if desired.
+     */
+    void onNotify(NimBLECharacteristic *pCharacteristic)
+    {
+        (void)pCharacteristic;
+        Serial.println(F("BLE Sending notification to clients"));
+    };
+
+    /** The status returned in status is defined in NimBLECharacteristic.h.
+     *  The value returned in code is the NimBLE host return code.
+     */
+    void onStatus(NimBLECharacteristic *pCharacteristic, Status status, int code)
+    {
+        (void)pCharacteristic;
+        Serial.print(F("BLE Notification/Indication status code: "));
+        Serial.print(status);
+        Serial.print(F(", return code: "));
+        Serial.print(code);
+        Serial.print(F(", "));
+        Serial.println(NimBLEUtils::returnCodeToString(code));
+    };
+
+    void onSubscribe(NimBLECharacteristic *pCharacteristic, ble_gap_conn_desc *desc, uint16_t subValue)
+    {
+        BleBoundValue *pBound = bound(pCharacteristic);
+        if (nullptr != pBound)
+        {
+            pBound->subscribed(desc->conn_handle, subValue);
+            m_producers.changed();
+        }
+        dispatch(BLE_EVENT_SUBSCRIBED, desc, pCharacteristic, nullptr, subValue);
+    };
+    void onWrite(NimBLEDescriptor *pDescriptor)
+    {
+        std::string dscVal((char *)pDescriptor->getValue(), pDescriptor->getLength());
+        Serial.print(F("BLE Descriptor witten value:"));
+        Serial.println(dscVal.c_str());
+    };
+
+    void onRead(NimBLEDescriptor *pDescriptor)
+    {
+        Serial.print(pDescriptor->getUUID().toString().c_str());
+        Serial.println(F("BLE  Descriptor read"));
+    };
+
+    /** Gathers the diagnostics summary and advertises its next page */
+    void beacon(uint32_t now)
+    {
+        BleWatchdog &watchdog = BleWatchdog::instance();
+        BleBeaconStatus status;
+        status.uptimeMinutes = now / 60000;
+        status.minFreeHeapKiB = (uint16_t)(ESP.getMinFreeHeap() / 1024);
+        status.connections = (uint8_t)m_server->getConnectedCount();
+        status.resetReason = (uint8_t)watchdog.resetReason();
+        status.stalls = (uint16_t)watchdog.stalls();
+        BleBeaconTraffic traffic;
+        traffic.rpcRequests = m_rpc.served();
+        traffic.rpcErrors = (uint16_t)m_rpc.failed();
+        traffic.notifications = 0;
+        for (size_t i = 0; i < m_boundCount; ++i)
+        {
+            traffic.notifications += m_bound[i].stats().notifications;
+        }
+        uint8_t flags = 0;
+        if (status.connections)
+        {
+            flags |= BLE_BEACON_CONNECTED;
+        }
+        if (ESP.getFreeHeap() < BLE_BEACON_LOW_HEAP)
+        {
+            flags |= BLE_BEACON_LOW_MEMORY;
+        }
+        if (status.stalls)
+        {
+            flags |= BLE_BEACON_STALLED;
+        }
+        if (traffic.rpcErrors)
+        {
+            flags |= BLE_BEACON_RPC_ERRORS;
+        }
+        switch (watchdog.resetReason())
+        {
+        case ESP_RST_PANIC:
+        case ESP_RST_INT_WDT:
+        case ESP_RST_TASK_WDT:
+        case ESP_RST_WDT:
+        case ESP_RST_BROWNOUT:
+            flags |= BLE_BEACON_BAD_RESET;
+            break;
+        default:
+            break;
+        }
+        m_beacon.update(now, flags, status, traffic);
+    }
+
+    /** Notification / Indication receiving handler callback */
+
+public:
+    bool begin()
+    {
+        m_server = nullptr;
+        memset(&m_session, 0, sizeof(m_session));
+        m_rpc.begin();
+        m_boundCount = 0;
+        m_beacon.begin();
+        m_batch.begin(nullptr, nullptr);
+        m_producers.begin();
+        return true;
+    }
+    bool on()
+    {
+        Serial.println(F("BLE Creating session server"));
+        BleStartup &startup = BleStartup::instance();
+        uint32_t startTS = micros();
+        m_server = NimBLEDevice::createServer();
+        if (nullptr == m_server)
+        {
+            Serial.println(F("BLE Error session creating server"));
+            return false;
+        }
+        m_server->setCallbacks((NimBLEServerCallbacks *)this, false);
+
+        /** The characteristics and descriptors all come from the BleSessionService schema */
+        NimBLEService *pDeadService = BleSessionService::create(m_server, m_session, (NimBLECharacteristicCallbacks *)this, (NimBLEDescriptorCallbacks *)this);
+        if (nullptr == pDeadService)
+        {
+            Serial.println(F("BLE Error creating session service"));
+            return false;
+        }
+        m_session.get<BleSessionCharacteristic>()->setValue("Burger");
+        m_batch.begin(bind<BleSessionService, BleSamplesCharacteristic>(m_batchFrame, sizeof(m_batchFrame), 0, nullptr, nullptr), m_server);
+
+        /** Start the services when finished creating all Characteristics and Descriptors */
+        if (!pDeadService->start())
+        {
+            Serial.println(F("BLE Error starting session service"));
+            return false;
+        }
+        startTS = startup.phase(BLE_BOOT_SERVER, startTS);
+        
+
+        NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
+        if (nullptr == pAdvertising)
+        {
+            Serial.println(F("BLE Error creating session advertising object"));
+            return false;
+        }
+        /** Add the services to the advertisment data **/
+        pAdvertising->addServiceUUID(pDeadService->getUUID());
+        
+        /** If your device is battery powered you may consider setting scan response
+         *  to false as it will extend battery life at the expense of less data sent.
+         */
+        pAdvertising->setScanResponse(true);
+        /** Set explicitly so the energy account knows it, in units of 0.625 ms */
+        pAdvertising->setMinInterval(BLE_ADV_INTERVAL_MIN_MS * 1000 / 625);
+        pAdvertising->setMaxInterval(BLE_ADV_INTERVAL_MAX_MS * 1000 / 625);
+        /** The scan response carries the diagnostics beacon, see BleBeacon.h */
+        beacon(BleClock::now());
+        if (!pAdvertising->start())
+        {
+            Serial.println(F("BLE Error starting advertising"));
+            return false;
+        }
+
+        startup.phase(BLE_BOOT_ADVERTISING, startTS);
+        startup.advertising();
+        Serial.println(F("BLE Advertising Started"));
+        return true;
+    }
+    /** Lets go of the server and the characteristics bound to it before
+     *  NimBLEDevice::deinit() deletes them. Bind values again after the next on()
+     */
+    void off()
+    {
+        if (nullptr == m_server)
+        {
+            return;
+        }
+        std::vector<uint16_t> peers = m_server->getPeerDevices();
+        for (size_t i = 0; i < peers.size(); ++i)
+        {
+            m_rpc.disconnected(peers[i]);
+            BleTraffic::instance().disconnected(peers[i]);
+        }
+        for (size_t i = 0; i < m_boundCount; ++i)
+        {
+            m_bound[i].bind(nullptr, nullptr, 0, 0, nullptr, nullptr);
+        }
+        /** With nobody subscribed the running producers stop, telling the application */
+        m_producers.changed();
+        m_producers.update(m_server, BleClock::now());
+        m_producers.begin();
+        m_boundCount = 0;
+        m_batch.begin(nullptr, nullptr);
+        memset(&m_session, 0, sizeof(m_session));
+        m_server = nullptr;
+    }
+    /** Serves a characteristic of one of our services from buffer, see BleBoundValue.h.
+     *  Call after on(). Returns null if the characteristic doesn't exist or too many are bound
+     */
+    template <typename Service, typename Chr>
+    BleBoundValue *bind(uint8_t *buffer, size_t capacity, size_t size, BleBoundWriteHandler onWrite, void *state)
+    {
+        NimBLEService *pSvc = (nullptr != m_server) ? m_server->getServiceByUUID(Service::uuid().toNimBLE()) : nullptr;
+        NimBLECharacteristic *pChr = (nullptr != pSvc) ? pSvc->getCharacteristic(Chr::uuid().toNimBLE()) : nullptr;
+        if (nullptr == pChr)
+        {
+            return nullptr;
+        }
+        BleBoundValue *pBound = bound(pChr);
+        if (nullptr == pBound)
+        {
+            if (m_boundCount >= BLE_BOUND_MAX)
+            {
+                return nullptr;
+            }
+            pBound = &m_bound[m_boundCount++];
+        }
+        pBound->bind(pChr, buffer, capacity, size, onWrite, state);
+        pChr->setCallbacks(this);
+        return pBound;
+    }
+    NimBLEServer *server() const
+    {
+        return m_server;
+    }
+    const BleCompressStats &compressStats() const
+    {
+        return m_rpc.compressStats();
+    }
+    /** Sets the application's page of the beacon, up to BLE_BEACON_BODY_SIZE bytes */
+    void beaconUser(const uint8_t *data, size_t size)
+    {
+        m_beacon.user(data, size);
+    }
+    const BleBeaconStats &beaconStats() const
+    {
+        return m_beacon.stats();
+    }
+    /** Runs produce for a bound characteristic while anyone is subscribed to it, no faster
+     *  than minPeriod ms or the fastest subscriber's connection interval. See BleProducer.h
+     */
+    BleProducer *produce(BleBoundValue *pBound, BleProduceHandler produce, uint32_t minPeriod, BleProducerControl control, void *state, uint8_t traffic)
+    {
+        return (nullptr != pBound) ? m_producers.add(pBound, produce, minPeriod, control, state, true, traffic) : nullptr;
+    }
+    /** Runs produce every period ms while anyone is subscribed to the samples
+     *  characteristic; it passes what it samples to sample()
+     */
+    BleProducer *produceSamples(BleProduceHandler produce, uint32_t period, BleProducerControl control, void *state)
+    {
+        return m_batch.enabled() ? m_producers.add(m_batch.bound(), produce, period, control, state, false, BLE_QOS_BULK) : nullptr;
+    }
+    /** Batches a sample for the samples characteristic's subscribers */
+    bool sample(int32_t value)
+    {
+        return m_batch.add(value, BleClock::now());
+    }
+    BleSampleBatcher &batch()
+    {
+        return m_batch;
+    }
+    /** Registers the handler the session service uses for an RPC method */
+    bool handle(uint8_t method, BleRpcHandler handler, void *state)
+    {
+        return m_rpc.handle(method, handler, state);
+    }
+    /** Reports advertising and every link's connection events over the last elapsed ms */
+    void account(uint32_t elapsed, uint32_t now)
+    {
+        if (nullptr == m_server)
+        {
+            return;
+        }
+        BleEnergy &energy = BleEnergy::instance();
+        if (NimBLEDevice::getAdvertising()->isAdvertising())
+        {
+            /** Our advertising data and scan response both come close to the 31 byte
+             *  maximum, plus the advertiser's address
+             */
+            energy.advertised(elapsed, (BLE_ADV_INTERVAL_MIN_MS + BLE_ADV_INTERVAL_MAX_MS) / 2, 6 + 31, 6 + 31);
+        }
+        std::vector<uint16_t> peers = m_server->getPeerDevices();
+        for (size_t i = 0; i < peers.size(); ++i)
+        {
+            energy.connected(peers[i], elapsed, now);
+        }
+    }
+    void update()
+    {
+        if (nullptr != m_server)
+        {
+            m_rpc.update(m_server, m_session.get<BleSessionCharacteristic>());
+            if (m_beacon.due(BleClock::now()))
+            {
+                beacon(BleClock::now());
+            }
+            m_producers.update(m_server, BleClock::now());
+            m_batch.update(BleClock::now());
+        }
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
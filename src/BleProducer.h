@@ -0,0 +1,218 @@
+#pragma once
+#include <atomic>
+#include "BleRadioConfig.h"
+#include "BleBoundValue.h"
+#if BLE_RADIO_PERIPHERAL
+
+/** Produces a bound characteristic's value only while someone listens. A producer runs
+ *  while at least one connection is subscribed to its characteristic, at its own minimum
+ *  period or the fastest subscriber's connection interval, whichever is slower: values
+ *  produced faster than a connection event can carry them would only be overwritten.
+ *  Producers feeding a batch, which carries many values per event, run at their own
+ *  period.
+ *  Subscriptions and connections change on the host task, which only flags the change;
+ *  producers are started, stopped and re-rated from update().
+ */
+#ifndef BLE_PRODUCER_MAX
+#define BLE_PRODUCER_MAX BLE_BOUND_MAX
+#endif
+#ifndef BLE_PRODUCER_RECHECK_MS
+/** Connection intervals change without a callback after a parameter update, so the rate
+ *  is also rechecked this often
+ */
+#define BLE_PRODUCER_RECHECK_MS 1000
+#endif
+
+/** Produces the next value, editing the bound buffer between edit() and commit().
+ *  Returns true to publish it, false if there was nothing new or it was sent otherwise
+ */
+typedef bool (*BleProduceHandler)(BleBoundValue *pBound, uint32_t now, void *state);
+/** Tells the application a producer started (with its period in ms) or stopped, to power
+ *  its sensor up or down. Runs from update()
+ */
+typedef void (*BleProducerControl)(bool running, uint32_t period, void *state);
+
+struct BleProducerStats
+{
+    uint32_t produced;
+    uint32_t starts;
+    uint32_t stops;
+    /** Current period in ms, 0 while stopped */
+    uint32_t period;
+};
+
+class BleProducer
+{
+    BleBoundValue *m_pBound;
+    BleProduceHandler m_produce;
+    BleProducerControl m_control;
+    void *m_state;
+    uint32_t m_minPeriod;
+    /** Slowed to the fastest subscriber's connection interval */
+    bool m_paced;
+    uint8_t m_traffic;
+    uint32_t m_dueTS;
+    BleProducerStats m_stats;
+
+    /** The slowest rate that still fills every subscriber's connection events, 0 if nobody
+     *  is subscribed
+     */
+    uint32_t period() const
+    {
+        uint16_t conns[NIMBLE_MAX_CONNECTIONS];
+        size_t count = m_pBound->subscribers(conns);
+        uint32_t fastest = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            ble_gap_conn_desc desc;
+            if (0 != ble_gap_conn_find(conns[i], &desc))
+            {
+                continue;
+            }
+            /** 1.25 ms units, rounded up to whole ms */
+            uint32_t interval = m_paced ? ((uint32_t)desc.conn_itvl * 5 + 3) / 4 : m_minPeriod;
+            if (0 == fastest || interval < fastest)
+            {
+                fastest = interval ? interval : 1;
+            }
+        }
+        if (0 == fastest)
+        {
+            return 0;
+        }
+        return fastest > m_minPeriod ? fastest : m_minPeriod;
+    }
+
+public:
+    void begin(BleBoundValue *pBound, BleProduceHandler produce, uint32_t minPeriod, BleProducerControl control, void *state, bool paced, uint8_t traffic)
+    {
+        m_pBound = pBound;
+        m_produce = produce;
+        m_control = control;
+        m_state = state;
+        m_minPeriod = minPeriod;
+        m_paced = paced;
+        m_traffic = traffic;
+        m_dueTS = 0;
+        memset(&m_stats, 0, sizeof(m_stats));
+    }
+    BleBoundValue *bound() const
+    {
+        return m_pBound;
+    }
+    bool running() const
+    {
+        return 0 != m_stats.period;
+    }
+    /** Starts, stops or re-rates the producer from its characteristic's subscribers */
+    void evaluate(uint32_t now)
+    {
+        uint32_t period = this->period();
+        if (period == m_stats.period)
+        {
+            return;
+        }
+        if (0 == m_stats.period)
+        {
+            ++m_stats.starts;
+            /** The first subscriber gets a value at once */
+            m_dueTS = now;
+        }
+        else if (0 == period)
+        {
+            ++m_stats.stops;
+        }
+        m_stats.period = period;
+        if (nullptr != m_control)
+        {
+            m_control(0 != period, period, m_state);
+        }
+    }
+    /** Produces and publishes a value if one is due */
+    void update(NimBLEServer *pServer, uint32_t now)
+    {
+        if (!running() || (int32_t)(now - m_dueTS) < 0)
+        {
+            return;
+        }
+        /** Keep to the period's grid, but don't try to catch up after a stall */
+        m_dueTS += m_stats.period;
+        if ((int32_t)(now - m_dueTS) >= 0)
+        {
+            m_dueTS = now + m_stats.period;
+        }
+        ++m_stats.produced;
+        if (m_produce(m_pBound, now, m_state))
+        {
+            m_pBound->publish(pServer, m_traffic);
+        }
+    }
+    const BleProducerStats &stats() const
+    {
+        return m_stats;
+    }
+};
+
+/** The peripheral's producers, and the flag the host task raises when they need a look */
+class BleProducers
+{
+    BleProducer m_producers[BLE_PRODUCER_MAX];
+    size_t m_count;
+    std::atomic<bool> m_changed;
+    uint32_t m_checkTS;
+
+public:
+    void begin()
+    {
+        m_count = 0;
+        m_changed = false;
+        m_checkTS = 0;
+    }
+    /** Registers or replaces the producer of a bound characteristic. Returns null if there
+     *  are too many
+     */
+    BleProducer *add(BleBoundValue *pBound, BleProduceHandler produce, uint32_t minPeriod, BleProducerControl control, void *state, bool paced, uint8_t traffic)
+    {
+        BleProducer *pProducer = nullptr;
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            if (m_producers[i].bound() == pBound)
+            {
+                pProducer = &m_producers[i];
+            }
+        }
+        if (nullptr == pProducer)
+        {
+            if (m_count >= BLE_PRODUCER_MAX)
+            {
+                return nullptr;
+            }
+            pProducer = &m_producers[m_count++];
+        }
+        pProducer->begin(pBound, produce, minPeriod, control, state, paced, traffic);
+        /** Someone may be subscribed already */
+        changed();
+        return pProducer;
+    }
+    /** A subscription or connection changed. Safe from the host task */
+    void changed()
+    {
+        m_changed.store(true, std::memory_order_release);
+    }
+    void update(NimBLEServer *pServer, uint32_t now)
+    {
+        if (m_changed.exchange(false, std::memory_order_acq_rel) || BLE_PRODUCER_RECHECK_MS <= now - m_checkTS)
+        {
+            m_checkTS = now;
+            for (size_t i = 0; i < m_count; ++i)
+            {
+                m_producers[i].evaluate(now);
+            }
+        }
+        for (size_t i = 0; i < m_count; ++i)
+        {
+            m_producers[i].update(pServer, now);
+        }
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
@@ -1,413 +1,47 @@
 #include <Arduino.h>
 #include <NimBLEDevice.h>
-#define BLE_CONFIGURATION_SERVICE_ID "5AB457FD-FBAD-475B-97A0-29900940A47B"
-#define BLE_CONFIGURATION_SERVICE_CHAR_ID "7F2D2A4E-BA58-4E8F-8B96-6C8BDCBA629E"
-#define BLE_SESSION_SERVICE_ID "176A2A43-0F84-4036-898A-768348A9EC3B"
-#define BLE_SESSION_SERVICE_CHAR_ID "78931A77-8177-4679-844A-89BFE2BD0FA9"
+#include "BleRadioConfig.h"
+#include "BleCentral.h"
+#include "BlePeripheral.h"
 
-class BleRadio : 
-    NimBLEClientCallbacks, 
-    NimBLEAdvertisedDeviceCallbacks, 
-    NimBLEServerCallbacks, 
-    NimBLECharacteristicCallbacks, 
-    NimBLEDescriptorCallbacks
+class BleRadio
 {
     bool m_initialized;
-    NimBLEAdvertisedDevice *m_advDevice;
-    bool m_doConnect;
-    uint32_t m_scanTime;
-    NimBLEServer *m_server;
-    uint32_t m_notifyTS;
-    void onResult(NimBLEAdvertisedDevice *advertisedDevice)
-    {
-        Serial.print(F("BLE Advertised Device found: "));
-        Serial.println(advertisedDevice->toString().c_str());
-        if (advertisedDevice->isAdvertisingService(NimBLEUUID(BLE_CONFIGURATION_SERVICE_ID)))
-        {
-            Serial.println(F("BLE Found Configuration Service"));
-            /** stop scan before connecting */
-            NimBLEDevice::getScan()->stop();
-            /** Save the device reference in a global for the client to use*/
-            m_advDevice = advertisedDevice;
-            /** Ready to connect now */
-            m_doConnect = true;
-        }
-    }
-    void onConnect(NimBLEClient *pClient)
-    {
-        Serial.println(F("BLE Connected"));
-        /** After connection we should change the parameters if we don't need fast response times.
-         *  These settings are 150ms interval, 0 latency, 450ms timout.
-         *  Timeout should be a multiple of the interval, minimum is 100ms.
-         *  I find a multiple of 3-5 * the interval works best for quick response/reconnect.
-         *  Min interval: 120 * 1.25ms = 150, Max interval: 120 * 1.25ms = 150, 0 latency, 60 * 10ms = 600ms timeout
-         */
-        pClient->updateConnParams(120, 120, 0, 60);
-    }
-
-    void onDisconnect(NimBLEClient *pClient)
-    {
-        Serial.print(pClient->getPeerAddress().toString().c_str());
-        Serial.println(F("BLE  Disconnected - Starting scan"));
-        NimBLEDevice::getScan()->start(m_scanTime, onScanEnded);
-    }
-
-    /** Called when the peripheral requests a change to the connection parameters.
-     *  Return true to accept and apply them or false to reject and keep
-     *  the currently used parameters. Default will return true.
-     */
-    bool onConnParamsUpdateRequest(NimBLEClient *pClient, const ble_gap_upd_params *params)
-    {
-        if (params->itvl_min < 24)
-        { /** 1.25ms units */
-            return false;
-        }
-        else if (params->itvl_max > 40)
-        { /** 1.25ms units */
-            return false;
-        }
-        else if (params->latency > 2)
-        { /** Number of intervals allowed to skip */
-            return false;
-        }
-        else if (params->supervision_timeout > 100)
-        { /** 10ms units */
-            return false;
-        }
-
-        return true;
-    }
-
-
-    void onConnect(NimBLEServer *pServer)
-    {
-        Serial.println(F("BLE Client connected"));
-        Serial.println(F("BLE Multi-connect support: start advertising"));
-        NimBLEDevice::startAdvertising();
-    };
-    /** Alternative onConnect() method to extract details of the connection. 
-     *  See: src/ble_gap.h for the details of the ble_gap_conn_desc struct.
-     */
-    void onConnect(NimBLEServer *pServer, ble_gap_conn_desc *desc)
-    {
-        Serial.print(F("BLE Client address: "));
-        Serial.println(NimBLEAddress(desc->peer_ota_addr).toString().c_str());
-        /** We can use the connection handle here to ask for different connection parameters.
-         *  Args: connection handle, min connection interval, max connection interval
-         *  latency, supervision timeout.
-         *  Units; Min/Max Intervals: 1.25 millisecond increments.
-         *  Latency: number of intervals allowed to skip.
-         *  Timeout: 10 millisecond increments, try for 5x interval time for best results.  
-         */
-        pServer->updateConnParams(desc->conn_handle, 24, 48, 0, 60);
-    };
-    void onDisconnect(NimBLEServer *pServer)
-    {
-        Serial.println(F("BLE Client disconnected - start advertising"));
-        NimBLEDevice::startAdvertising();
-    };
-
-
-    void onAuthenticationComplete(ble_gap_conn_desc *desc)
-    {
-        if( desc->role==BLE_GAP_ROLE_SLAVE) {
-            /** Check that encryption was successful, if not we disconnect the client */
-            if (!desc->sec_state.encrypted)
-            {
-                NimBLEDevice::getServer()->disconnect(desc->conn_handle);
-                Serial.println(F("BLE Encrypt connection failed - disconnecting client"));
-                return;
-            }
-            Serial.println(F("BLE Starting BLE work!"));
-        } else {
-            if (!desc->sec_state.encrypted)
-            {
-                Serial.println(F("BLE Encrypt connection failed - disconnecting"));
-                /** Find the client with the connection handle provided in desc */
-                NimBLEDevice::getClientByID(desc->conn_handle)->disconnect();
-                return;
-            }
-        }
-    };
-    void onRead(NimBLECharacteristic *pCharacteristic)
-    {
-        Serial.print(pCharacteristic->getUUID().toString().c_str());
-        Serial.print(F("BLE : onRead(), value: "));
-        Serial.println(pCharacteristic->getValue().c_str());
-    };
-
-    void onWrite(NimBLECharacteristic *pCharacteristic)
-    {
-        Serial.print(F("BLE "));
-        Serial.print(pCharacteristic->getUUID().toString().c_str());
-        Serial.print(F(": onWrite(), value: "));
-        Serial.println(pCharacteristic->getValue().c_str());
-    };
-    /** Called before notification or indication is sent, 
-     *  the value can be changed here before sending if desired.
-     */
-    void onNotify(NimBLECharacteristic *pCharacteristic)
-    {
-        Serial.println(F("BLE Sending notification to clients"));
-    };
-
-    /** The status returned in status is defined in NimBLECharacteristic.h.
-     *  The value returned in code is the NimBLE host return code.
-     */
-    void onStatus(NimBLECharacteristic *pCharacteristic, Status status, int code)
-    {
-        Serial.print(F("BLE Notification/Indication status code: "));
-        Serial.print(status);
-        Serial.print(F(", return code: "));
-        Serial.print(code);
-        Serial.print(F(", "));
-        Serial.println(NimBLEUtils::returnCodeToString(code));
-    };
+    BleEnergyModel m_energyModel = ble_energy_esp32();
+#if BLE_RADIO_CENTRAL
+    BleCentral m_central;
+#endif
+#if BLE_RADIO_PERIPHERAL
+    BlePeripheral m_peripheral;
+#endif
 
-    void onSubscribe(NimBLECharacteristic *pCharacteristic, ble_gap_conn_desc *desc, uint16_t subValue)
-    {
-        Serial.print(F("Client ID: "));
-        Serial.print(desc->conn_handle);
-        Serial.print(F(" Address: "));
-        Serial.print(std::string(NimBLEAddress(desc->peer_ota_addr)).c_str());
-        if (subValue == 0)
-        {
-            Serial.print(F(" Unsubscribed to "));
-        }
-        else if (subValue == 1)
-        {
-            Serial.print(F(" Subscribed to notfications for "));
-        }
-        else if (subValue == 2)
-        {
-            Serial.print(F(" Subscribed to indications for "));
-        }
-        else if (subValue == 3)
-        {
-            Serial.print(F(" Subscribed to notifications and indications for "));
-        }
-        Serial.println(std::string(pCharacteristic->getUUID()).c_str());
-    };
-    void onWrite(NimBLEDescriptor *pDescriptor)
-    {
-        std::string dscVal((char *)pDescriptor->getValue(), pDescriptor->getLength());
-        Serial.print(F("BLE Descriptor witten value:"));
-        Serial.println(dscVal.c_str());
-    };
-
-    void onRead(NimBLEDescriptor *pDescriptor)
-    {
-        Serial.print(pDescriptor->getUUID().toString().c_str());
-        Serial.println(F("BLE  Descriptor read"));
-    };
-
-    /** Notification / Indication receiving handler callback */
-    static void onSNotify(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify)
-    {
-        NimBLERemoteService* pSvc = pRemoteCharacteristic->getRemoteService();
-        if(pRemoteCharacteristic->getUUID()==NimBLEUUID(BLE_CONFIGURATION_SERVICE_CHAR_ID)) {
-            std::string val = pRemoteCharacteristic->getValue();
-            if(1==val.length() && val.data()[0]==0) {
-                Serial.println(F("BLE Keep-alive ping from configuration service"));
-                return;
-            }
-        }
-        if(isNotify) {
-            Serial.print(F("BLE Notification from "));
-        } else {
-            Serial.print(F("BLE Indication from "));
-        }
-        Serial.print(std::string(pSvc->getClient()->getPeerAddress()).c_str());
-        Serial.print(F(": Service = "));
-        Serial.print(std::string(pSvc->getUUID()).c_str());
-        Serial.print(F(", Characteristic = "));
-        Serial.print(std::string(pRemoteCharacteristic->getUUID()).c_str());
-        Serial.print(F(", Value = "));
-        Serial.println(std::string((char *)pData, length).c_str());
-    }
-
-    /** Callback to process the results of the last scan or restart it */
-    static void onScanEnded(NimBLEScanResults results)
-    {
-        Serial.println(F("BLE Scan Ended"));
-    }
-    /** Handles the provisioning of clients and connects / interfaces with the server */
-    bool connectToServer()
+public:
+    bool begin()
     {
-        NimBLEClient *pClient = nullptr;
-
-        /** Check if we have a client we should reuse first **/
-        if (NimBLEDevice::getClientListSize())
-        {
-            /** Special case when we already know this device, we send false as the
-         *  second argument in connect() to prevent refreshing the service database.
-         *  This saves considerable time and power.
-         */
-            pClient = NimBLEDevice::getClientByPeerAddress(m_advDevice->getAddress());
-            if (pClient)
-            {
-                if (!pClient->connect(m_advDevice, false))
-                {
-                    Serial.println(F("BLE Reconnect failed"));
-                    return false;
-                }
-                Serial.println(F("BLE Reconnected client"));
-            }
-            /** We don't already have a client that knows this device,
-         *  we will check for a client that is disconnected that we can use.
-         */
-            else
-            {
-                pClient = NimBLEDevice::getDisconnectedClient();
-            }
-        }
-
-        /** No client to reuse? Create a new one. */
-        if (!pClient)
-        {
-            if (NimBLEDevice::getClientListSize() >= NIMBLE_MAX_CONNECTIONS)
-            {
-                Serial.println(F("BLE Max clients reached - no more connections available"));
-                return false;
-            }
-
-            pClient = NimBLEDevice::createClient();
-
-            Serial.println(F("BLE New client created"));
-
-            pClient->setClientCallbacks((NimBLEClientCallbacks *)this, false);
-            /** Set initial connection parameters: These settings are 15ms interval, 0 latency, 120ms timout.
-         *  These settings are safe for 3 clients to connect reliably, can go faster if you have less
-         *  connections. Timeout should be a multiple of the interval, minimum is 100ms.
-         *  Min interval: 12 * 1.25ms = 15, Max interval: 12 * 1.25ms = 15, 0 latency, 51 * 10ms = 510ms timeout
-         */
-            pClient->setConnectionParams(12, 12, 0, 51);
-            /** Set how long we are willing to wait for the connection to complete (seconds), default is 30. */
-            pClient->setConnectTimeout(5);
-
-            if (!pClient->connect(m_advDevice))
-            {
-                /** Created a client but failed to connect, don't need to keep it as it has no data */
-                NimBLEDevice::deleteClient(pClient);
-                Serial.println(F("BLE Failed to connect, deleted client"));
-                return false;
-            }
-        }
-
-        if (!pClient->isConnected())
+        if (m_initialized)
         {
-            if (!pClient->connect(m_advDevice))
-            {
-                Serial.println(F("BLE Failed to connect"));
-                return false;
-            }
-        }
-
-        Serial.print(F("BLE Connected to: "));
-        Serial.println(pClient->getPeerAddress().toString().c_str());
-        Serial.print(F("BLE RSSI: "));
-        Serial.println(pClient->getRssi());
-
-        /** Now we can read/write/subscribe the charateristics of the services we are interested in */
-        NimBLERemoteService *pSvc = nullptr;
-        NimBLERemoteCharacteristic *pChr = nullptr;
-        NimBLERemoteDescriptor *pDsc = nullptr;
-
-        pSvc = pClient->getService(BLE_CONFIGURATION_SERVICE_ID);
-        if (pSvc)
-        { /** make sure it's not null */
-            pChr = pSvc->getCharacteristic(BLE_CONFIGURATION_SERVICE_CHAR_ID);
-
-            if (pChr)
-            { /** make sure it's not null */
-                if (pChr->canRead())
-                {
-                    Serial.print(F("BLE "));
-                    Serial.print(pChr->getUUID().toString().c_str());
-                    Serial.print(F(" Value: "));
-                    Serial.println(pChr->readValue().c_str());
-                }
-
-                pDsc = pChr->getDescriptor(NimBLEUUID("C01D"));
-                if (pDsc)
-                { /** make sure it's not null */
-                    Serial.print(F("BLE Descriptor: "));
-                    Serial.print(pDsc->getUUID().toString().c_str());
-                    Serial.print(F("BLE  Value: "));
-                    Serial.println(pDsc->readValue().c_str());
-                }
-
-                if (pChr->canWrite())
-                {
-                    if (pChr->writeValue("No tip!"))
-                    {
-                        Serial.print(F("BLE Wrote new value to: "));
-                        Serial.println(pChr->getUUID().toString().c_str());
-                    }
-                    else
-                    {
-                        /** Disconnect if write failed */
-                        pClient->disconnect();
-                        return false;
-                    }
-
-                    if (pChr->canRead())
-                    {
-                        Serial.print(F("BLE The value of: "));
-                        Serial.print(pChr->getUUID().toString().c_str());
-                        Serial.print(F(" is now: "));
-                        Serial.println(pChr->readValue().c_str());
-                    }
-                }
-
-                /** registerForNotify() has been deprecated and replaced with subscribe() / unsubscribe().
-             *  Subscribe parameter defaults are: notifications=true, notifyCallback=nullptr, response=false.
-             *  Unsubscribe parameter defaults are: response=false.
-             */
-                if (pChr->canNotify())
-                {
-                    //if(!pChr->registerForNotify(notifyCB)) {
-                    if (!pChr->subscribe(true, onSNotify))
-                    {
-                        /** Disconnect if subscribe failed */
-                        pClient->disconnect();
-                        return false;
-                    }
-                }
-                else if (pChr->canIndicate())
-                {
-                    /** Send false as first argument to subscribe to indications instead of notifications */
-                    //if(!pChr->registerForNotify(notifyCB, false)) {
-                    if (!pChr->subscribe(false, onSNotify))
-                    {
-                        /** Disconnect if subscribe failed */
-                        pClient->disconnect();
-                        return false;
-                    }
-                }
-            }
+            off();
         }
-        else
+        BleWatchdog::instance().begin();
+        BleEnergy::instance().begin(m_energyModel);
+        BleTraffic::instance().begin();
+        BleEvents::instance().begin();
+#if BLE_EVENT_LOG
+        BleEvents::instance().on(BLE_EVENT_SUBSCRIBED, ble_event_log, nullptr);
+        BleEvents::instance().on(BLE_EVENT_NOTIFIED, ble_event_log, nullptr);
+#endif
+#if BLE_RADIO_CENTRAL
+        if (!m_central.begin())
         {
-            Serial.println(F("BLE Configuration service not found."));
+            return false;
         }
-
-        return true;
-    }
-
-public:
-    bool begin()
-    {
-        if (m_initialized)
+#endif
+#if BLE_RADIO_PERIPHERAL
+        if (!m_peripheral.begin())
         {
-            NimBLEDevice::deinit(true);
+            return false;
         }
-        m_initialized = false;
-        m_scanTime = 0;
-        m_advDevice = nullptr;
-        m_doConnect = false;
-        m_server = nullptr;
-        m_notifyTS=0;
+#endif
         return true;
     }
     bool off()
@@ -417,6 +51,12 @@ public:
             Serial.println(F("BLE Radio not on"));
             return false;
         }
+#if BLE_RADIO_CENTRAL
+        m_central.off();
+#endif
+#if BLE_RADIO_PERIPHERAL
+        m_peripheral.off();
+#endif
         NimBLEDevice::deinit(true);
         m_initialized = false;
         Serial.println(F("BLE Radio off"));
@@ -431,7 +71,12 @@ public:
             Serial.println(F("BLE Radio already on"));
             return false;
         }
+        /** Advertising comes first; the central's scan waits for the first update() */
+        BleStartup &startup = BleStartup::instance();
+        uint32_t startTS = startup.start();
         NimBLEDevice::init(deviceName);
+        m_initialized = true;
+        uint32_t phaseTS = startup.phase(BLE_BOOT_INIT, startTS);
 
         NimBLEDevice::setPower(powerLevel);
 
@@ -450,144 +95,345 @@ public:
          */
         //NimBLEDevice::setSecurityAuth(false, false, true);
         NimBLEDevice::setSecurityAuth(authRec);
+        startup.phase(BLE_BOOT_SECURITY, phaseTS);
 
-        Serial.println(F("BLE Creating session server"));
-        m_server = NimBLEDevice::createServer();
-        if (nullptr == m_server)
+#if BLE_RADIO_PERIPHERAL
+        if (!m_peripheral.on())
         {
-            Serial.println(F("BLE Error session creating server"));
             return false;
         }
-        m_server->setCallbacks((NimBLEServerCallbacks *)this, false);
-
-        NimBLEService *pDeadService = m_server->createService(BLE_SESSION_SERVICE_ID);
-        if (nullptr == pDeadService)
+#endif
+#if BLE_RADIO_CENTRAL
+        if (!m_central.on(activeScan))
         {
-            Serial.println(F("BLE Error creating session service"));
-            return false;
-        }
-        NimBLECharacteristic *pBeefCharacteristic = pDeadService->createCharacteristic(
-            BLE_SESSION_SERVICE_CHAR_ID,
-            NIMBLE_PROPERTY::READ |
-                NIMBLE_PROPERTY::WRITE |
-                /** Require a secure connection for read and write access */
-                NIMBLE_PROPERTY::READ_ENC | // only allow reading if paired / encrypted
-                NIMBLE_PROPERTY::WRITE_ENC  // only allow writing if paired / encrypted
-        );
-
-        pBeefCharacteristic->setValue("Burger");
-        pBeefCharacteristic->setCallbacks((NimBLECharacteristicCallbacks *)this);
-
-        /** 2904 descriptors are a special case, when createDescriptor is called with
-         *  0x2904 a NimBLE2904 class is created with the correct properties and sizes.
-         *  However we must cast the returned reference to the correct type as the method
-         *  only returns a pointer to the base NimBLEDescriptor class.
-         */
-        NimBLE2904 *pBeef2904 = (NimBLE2904 *)pBeefCharacteristic->createDescriptor("2904");
-        pBeef2904->setFormat(NimBLE2904::FORMAT_UTF8);
-        pBeef2904->setCallbacks((NimBLEDescriptorCallbacks *)this);
-
-        /** Start the services when finished creating all Characteristics and Descriptors */
-        if (!pDeadService->start())
-        {
-            Serial.println(F("BLE Error starting session service"));
-            return false;
-        }
-        
-
-        NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
-        if (nullptr == pAdvertising)
-        {
-            Serial.println(F("BLE Error creating session advertising object"));
-            return false;
-        }
-        /** Add the services to the advertisment data **/
-        pAdvertising->addServiceUUID(pDeadService->getUUID());
-        
-        /** If your device is battery powered you may consider setting scan response
-         *  to false as it will extend battery life at the expense of less data sent.
-         */
-        pAdvertising->setScanResponse(true);
-        if (!pAdvertising->start())
-        {
-            Serial.println(F("BLE Error starting advertising"));
-            return false;
-        }
-
-        Serial.println(F("BLE Advertising Started"));
-
-        /** create new scan */
-        NimBLEScan *pScan = NimBLEDevice::getScan();
-        if (nullptr == pScan)
-        {
-            Serial.println(F("BLE Error creating scan object"));
-            return false;
-        }
-        /** create a callback that gets called when advertisers are found */
-        pScan->setAdvertisedDeviceCallbacks((NimBLEAdvertisedDeviceCallbacks *)this, false);
-
-        /** Set scan interval (how often) and window (how long) in milliseconds */
-        pScan->setInterval(45);
-        pScan->setWindow(15);
-
-        /** Active scan will gather scan response data from advertisers
-         *  but will use more energy from both devices
-         */
-        pScan->setActiveScan(activeScan);
-        /** Start scanning for advertisers for the scan time specified (in seconds) 0 = forever
-         *  Optional callback for when scanning stops.
-         */
-        if (pScan->start(m_scanTime, onScanEnded))
-        {
-            Serial.println(F("BLE Scan started"));
-        }
-        else
-        {
-            Serial.println(F("BLE Scan error"));
             return false;
         }
+#else
+        (void)activeScan;
+#endif
+        Serial.print(F("BLE Radio on in "));
+        Serial.print((micros() - startTS) / 1000);
+        Serial.println(F("ms"));
         return true;
     }
-    void update()
+#if BLE_RADIO_PERIPHERAL
+    /** Serves one of our characteristics from an application buffer with no copy per update:
+     *  change it between edit() and commit(), then publish() to notify subscribers.
+     *  Writes arrive at onWrite as spans. Call after on()
+     */
+    template <typename Service, typename Chr>
+    BleBoundValue *bind(uint8_t *buffer, size_t capacity, size_t size, BleBoundWriteHandler onWrite = nullptr, void *state = nullptr)
     {
-        if(m_doConnect) {
-            m_doConnect = false;
-            
-            /** Found a device we want to connect to, do it now */
-            if (connectToServer())
-            {
-                Serial.println(F("BLE Success! we should now be getting notifications, scanning for more!"));
-            }
-            else
+        return m_peripheral.bind<Service, Chr>(buffer, capacity, size, onWrite, state);
+    }
+    /** Queues a notification of a bound characteristic's buffer to its subscribers. It
+     *  goes with the value as it is then, or as it is now with copy
+     */
+    size_t publish(BleBoundValue *pBound, uint8_t traffic = BLE_QOS_INTERACTIVE, bool copy = false)
+    {
+        return pBound->publish(m_peripheral.server(), traffic, copy);
+    }
+    /** Registers a handler for RPC requests made to our session service */
+    bool handle(uint8_t method, BleRpcHandler handler, void *state = nullptr)
+    {
+        return m_peripheral.handle(method, handler, state);
+    }
+    /** Fills the application's page of the diagnostics beacon we advertise, up to
+     *  BLE_BEACON_BODY_SIZE bytes
+     */
+    void beaconUser(const uint8_t *data, size_t size)
+    {
+        m_peripheral.beaconUser(data, size);
+    }
+    const BleBeaconStats &beaconStats()
+    {
+        return m_peripheral.beaconStats();
+    }
+    /** Produces a bound characteristic's value only while a central is subscribed to it:
+     *  produce runs from update() no faster than minPeriod ms or the fastest subscriber's
+     *  connection interval, and control hears when it starts, stops or changes rate
+     */
+    BleProducer *produce(BleBoundValue *pBound, BleProduceHandler produce, uint32_t minPeriod, BleProducerControl control = nullptr, void *state = nullptr, uint8_t traffic = BLE_QOS_INTERACTIVE)
+    {
+        return m_peripheral.produce(pBound, produce, minPeriod, control, state, traffic);
+    }
+    /** Runs produce every period ms while a central is subscribed to our samples
+     *  characteristic. It passes what it samples to sample() and returns false
+     */
+    BleProducer *produceSamples(BleProduceHandler produce, uint32_t period, BleProducerControl control = nullptr, void *state = nullptr)
+    {
+        return m_peripheral.produceSamples(produce, period, control, state);
+    }
+    /** Queues a timestamped sample for the centrals subscribed to our samples
+     *  characteristic. Samples go out packed in frames, once a frame is full or its oldest
+     *  sample has waited BLE_BATCH_LATENCY_MS; see BleBatch.h. Returns false, without
+     *  encoding anything, while no central is subscribed
+     */
+    bool sample(int32_t value)
+    {
+        return m_peripheral.sample(value);
+    }
+    /** Samples and frames sent, bytes per frame and how long samples waited */
+    const BleBatchStats &batchStats()
+    {
+        return m_peripheral.batch().stats();
+    }
+    void batchReport(Print &out)
+    {
+        m_peripheral.batch().report(out);
+    }
+#endif
+#if BLE_RADIO_CENTRAL
+    /** Calls a method on a connected peer's session service without waiting for it.
+     *  Several calls may be outstanding per peer; callbacks run from update(). The request
+     *  goes out as traffic of the given class, see BleTraffic.h.
+     *  Returns the request id, or -1 if the request couldn't be queued
+     */
+    int call(const NimBLEAddress &peer, uint8_t method, const uint8_t *data, size_t size, BleRpcCallback callback, void *state = nullptr, uint8_t traffic = BLE_QOS_INTERACTIVE)
+    {
+        return m_central.call(peer, method, data, size, callback, state, traffic);
+    }
+    /** A peer's share of each traffic class against the other connections, 1 by default */
+    bool trafficWeight(const NimBLEAddress &peer, uint8_t weight)
+    {
+        return m_central.weight(peer, weight);
+    }
+    /** Sets a configuration entry and writes it to every connected peer in parallel.
+     *  Per-peer success, latency and attempts are reported to the callback from update().
+     *  Returns the number of peers written to, or -1 while a broadcast is still running
+     */
+    int broadcast(const char *key, const uint8_t *value, size_t size, BleBroadcastCallback callback, void *state = nullptr)
+    {
+        return m_central.broadcast(key, value, size, callback, state);
+    }
+    /** Reads a characteristic of a connected peer. A fresh cached value is returned without
+     *  a round trip; see BleAttributeCache.h
+     */
+    template <typename Service, typename Chr>
+    bool read(const NimBLEAddress &peer, std::string *value)
+    {
+        return m_central.read<Service, Chr>(peer, value);
+    }
+    /** Advertisements seen, new advertisers per hour and how long each connect left the
+     *  scan dark
+     */
+    const BleScanStats &scanStats()
+    {
+        return m_central.scanStats();
+    }
+    /** Attribute cache hits, misses and invalidations */
+    BleCacheStats cacheStats()
+    {
+        return m_central.cacheStats();
+    }
+    /** Attribute lookups, the discovery procedures they cost and the time spent in them,
+     *  overall and per connect
+     */
+    const BleDiscoveryStats &discoveryStats()
+    {
+        return BleDiscovery::instance().stats();
+    }
+    void discoveryReport(Print &out)
+    {
+        BleDiscovery::instance().report(out);
+    }
+    /** Favours a peripheral when connection slots are handed out. Higher is served first.
+     *  Peripherals without a priority get 0
+     */
+    bool priority(const NimBLEAddress &peer, int8_t priority)
+    {
+        return m_central.priority(peer, priority);
+    }
+    /** Connection slot utilisation, service latency and evictions */
+    BleSchedulerStats schedulerStats()
+    {
+        return m_central.scheduler().stats();
+    }
+    /** A peer's filtered RSSI, jitter and notification loss. Returns false if it hasn't been heard */
+    bool linkQuality(const NimBLEAddress &peer, BleLinkEntry *quality)
+    {
+        return m_central.link().get(peer, quality);
+    }
+    /** Throughput, RPC and configuration latency percentiles, heap and queue high water
+     *  marks and invariant violations since begin()
+     */
+    const BleHealthStats &healthStats()
+    {
+        return m_central.health().stats();
+    }
+    void healthReport(Print &out)
+    {
+        m_central.health().report(out);
+    }
+    /** Keep-alive probes sent to idle peers and how long dead peers took to detect */
+    const BleLivenessStats &livenessStats()
+    {
+        return m_central.liveness().stats();
+    }
+    void livenessReport(Print &out)
+    {
+        m_central.liveness().report(out);
+    }
+    /** Delivers the samples peers batch to us, decoded from update() and timed on our clock */
+    void onSample(BleSampleHandler handler, void *state = nullptr)
+    {
+        m_central.onSample(handler, state);
+    }
+    /** The latest diagnostics beacon heard from a peripheral, without connecting to it.
+     *  Needs an active scan
+     */
+    bool beacon(const NimBLEAddress &peripheral, BleBeaconReport *report)
+    {
+        return m_central.beacons().get(peripheral, report);
+    }
+    BleBeaconTable &beacons()
+    {
+        return m_central.beacons();
+    }
+    /** Logs notifications and beacons to segment files in dir on a mounted filesystem,
+     *  LittleFS unless BLE_TS_STDIO is set. See BleTimeSeries.h
+     */
+    bool store(BleTsFs &fs, const char *dir)
+    {
+        return m_central.store().begin(fs, dir);
+    }
+    /** Runs visitor over the stored records of one peer, or all if peer is null, between
+     *  fromTS and toTS in BleClock time. Returns how many it visited
+     */
+    size_t query(const NimBLEAddress *peer, uint32_t fromTS, uint32_t toTS, BleTsVisitor visitor, void *state = nullptr)
+    {
+        return m_central.store().query(peer, fromTS, toTS, visitor, state);
+    }
+    void storeReport(Print &out)
+    {
+        m_central.store().report(out);
+    }
+    /** The key/value configuration kept in sync on every connected configuration service peer */
+    BleConfig &config()
+    {
+        return m_central.config();
+    }
+#endif
+    /** What RPC payload compression has saved, both roles combined: ratio, encoder cost
+     *  per KiB and effective throughput against sending uncompressed
+     */
+    BleCompressStats compressStats()
+    {
+        BleCompressStats result;
+        memset(&result, 0, sizeof(result));
+        const BleCompressStats *sides[2] = {nullptr, nullptr};
+#if BLE_RADIO_CENTRAL
+        sides[0] = &m_central.compressStats();
+#endif
+#if BLE_RADIO_PERIPHERAL
+        sides[1] = &m_peripheral.compressStats();
+#endif
+        for (size_t i = 0; i < 2; ++i)
+        {
+            if (nullptr != sides[i])
             {
-                Serial.println(F("BLE Failed to connect, starting scan"));
+                result.plainBytes += sides[i]->plainBytes;
+                result.sentBytes += sides[i]->sentBytes;
+                result.compressed += sides[i]->compressed;
+                result.streamed += sides[i]->streamed;
+                result.incompressible += sides[i]->incompressible;
+                result.encodeMicros += sides[i]->encodeMicros;
+                result.decompressed += sides[i]->decompressed;
+                result.decodeErrors += sides[i]->decodeErrors;
             }
-
-            NimBLEDevice::getScan()->start(m_scanTime, onScanEnded);
-        
-        
-            
         }
-        
-
-        if (100 < millis() - m_notifyTS)
+        return result;
+    }
+    /** update() and callback duration percentiles, the worst stalls, and what the radio was
+     *  doing if the last boot ended in a reset
+     */
+    void stallReport(Print &out)
+    {
+        BleWatchdog::instance().report(out);
+    }
+    /** Calls handler with state on every event of a type, on the task the event happens on.
+     *  Register after begin() and before on(). Returns false if BLE_EVENT_HANDLERS are taken
+     */
+    bool onEvent(uint8_t type, BleEventHandler handler, void *state = nullptr)
+    {
+        return BleEvents::instance().on(type, handler, state);
+    }
+    /** Removes a handler, ble_event_log() included, before on() */
+    bool offEvent(uint8_t type, BleEventHandler handler)
+    {
+        return BleEvents::instance().off(type, handler);
+    }
+    /** Frames sent, dropped and over budget per traffic class, and their queueing delay */
+    const BleTrafficClassStats &trafficStats(uint8_t cls)
+    {
+        return BleTraffic::instance().stats(cls);
+    }
+    void trafficReport(Print &out)
+    {
+        BleTraffic::instance().report(out);
+    }
+    /** How long each phase of on() took and when, since boot, the radio advertised, scanned
+     *  and first connected
+     */
+    const BleStartupStats &startupStats()
+    {
+        return BleStartup::instance().stats();
+    }
+    void startupReport(Print &out)
+    {
+        BleStartup::instance().report(out);
+    }
+    /** The currents energy figures are worked out with, ESP32 datasheet values by default.
+     *  Takes effect at the next begin()
+     */
+    void energyModel(const BleEnergyModel &model)
+    {
+        m_energyModel = model;
+    }
+    /** Estimated radio-on time and charge per subsystem and per peer since begin(), projected
+     *  to a day. Modelled from what the radio did, not measured; see BleEnergy.h
+     */
+    BleEnergy &energy()
+    {
+        return BleEnergy::instance();
+    }
+    void energyReport(Print &out)
+    {
+        BleEnergy::instance().report(out);
+    }
+    /** What a configuration would draw per day by subsystem, in uAh, to compare settings
+     *  without running them
+     */
+    void estimate(const BleEnergyProfile &profile, uint32_t perDay[BLE_AIR_SUBSYSTEMS])
+    {
+        BleEnergy::instance().estimate(profile, perDay);
+    }
+    void update()
+    {
+        /** Between off() and on() there is no host to drive */
+        if (!m_initialized)
         {
-            m_notifyTS = millis();
             return;
-            /** Do your thing here, this just spams notifications to all connected clients */
-            if (m_server->getConnectedCount())
-            {
-                NimBLEService *pSvc = m_server->getServiceByUUID(BLE_SESSION_SERVICE_ID);
-                if (pSvc)
-                {
-                    NimBLECharacteristic *pChr = pSvc->getCharacteristic(BLE_SESSION_SERVICE_CHAR_ID);
-                    if (pChr)
-                    {
-                        pChr->notify(true);
-                    }
-                }
-            }
         }
+        BleWatchdogScope watch(BLE_OP_UPDATE);
+        uint32_t elapsed = BleEnergy::instance().sample(BleClock::now());
+        if (elapsed)
+        {
+#if BLE_RADIO_CENTRAL
+            m_central.account(elapsed, BleClock::now());
+#endif
+#if BLE_RADIO_PERIPHERAL
+            m_peripheral.account(elapsed, BleClock::now());
+#endif
+        }
+#if BLE_RADIO_CENTRAL
+        m_central.update();
+#endif
+#if BLE_RADIO_PERIPHERAL
+        m_peripheral.update();
+#endif
+        /** What both roles queued above goes out by class */
+        BleTraffic::instance().update();
     }
 };
 static BleRadio g_ble;
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include "BleSchema.h"
+#include "BleClock.h"
+
+/** Which roles this build includes. By default they follow NimBLE's own role flags, so
+ *  disabling a role in build_flags removes it from both the library and BleRadio:
+ *  -D CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED -D CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED gives a peripheral-only build
+ *  -D CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED -D CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED gives a central-only build
+ */
+#ifndef BLE_RADIO_CENTRAL
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED) || defined(CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED)
+#define BLE_RADIO_CENTRAL 0
+#else
+#define BLE_RADIO_CENTRAL 1
+#endif
+#endif
+#ifndef BLE_RADIO_PERIPHERAL
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED) || defined(CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED)
+#define BLE_RADIO_PERIPHERAL 0
+#else
+#define BLE_RADIO_PERIPHERAL 1
+#endif
+#endif
+#if !BLE_RADIO_CENTRAL && !BLE_RADIO_PERIPHERAL
+#error "BleRadio needs at least one of the central and peripheral roles"
+#endif
+
+#define BLE_CONFIGURATION_SERVICE_ID "5AB457FD-FBAD-475B-97A0-29900940A47B"
+#define BLE_CONFIGURATION_SERVICE_CHAR_ID "7F2D2A4E-BA58-4E8F-8B96-6C8BDCBA629E"
+#define BLE_CONFIGURATION_SERVICE_DESC_ID "C01D"
+#define BLE_SESSION_SERVICE_ID "176A2A43-0F84-4036-898A-768348A9EC3B"
+#define BLE_SESSION_SERVICE_CHAR_ID "78931A77-8177-4679-844A-89BFE2BD0FA9"
+#define BLE_SESSION_SAMPLES_CHAR_ID "951C60AD-602B-4B0C-89D9-C7980876D764"
+
+BLE_SCHEMA_UUID(BleConfigurationServiceUuid, BLE_CONFIGURATION_SERVICE_ID);
+BLE_SCHEMA_UUID(BleConfigurationCharUuid, BLE_CONFIGURATION_SERVICE_CHAR_ID);
+BLE_SCHEMA_UUID(BleConfigurationDescUuid, BLE_CONFIGURATION_SERVICE_DESC_ID);
+BLE_SCHEMA_UUID(BleSessionServiceUuid, BLE_SESSION_SERVICE_ID);
+BLE_SCHEMA_UUID(BleSessionCharUuid, BLE_SESSION_SERVICE_CHAR_ID);
+BLE_SCHEMA_UUID(BleSamplesCharUuid, BLE_SESSION_SAMPLES_CHAR_ID);
+
+/** The configuration service is hosted by the peripherals we connect to */
+typedef BleCharacteristicDef<BleConfigurationCharUuid,
+                             BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_NOTIFY,
+                             512,
+                             BleDescriptorDef<BleConfigurationDescUuid>>
+    BleConfigurationCharacteristic;
+typedef BleServiceDef<BleConfigurationServiceUuid, BleConfigurationCharacteristic> BleConfigurationService;
+
+/** The session service is hosted by us. It also carries RPC: requests are written
+ *  without response and answered by notification, see BleRpc.h
+ */
+typedef BleCharacteristicDef<BleSessionCharUuid,
+                             BLE_GATT_CHR_F_READ |
+                                 BLE_GATT_CHR_F_WRITE |
+                                 BLE_GATT_CHR_F_WRITE_NO_RSP |
+                                 BLE_GATT_CHR_F_NOTIFY |
+                                 /** Require a secure connection for read and write access */
+                                 BLE_GATT_CHR_F_READ_ENC | // only allow reading if paired / encrypted
+                                 BLE_GATT_CHR_F_WRITE_ENC, // only allow writing if paired / encrypted
+                             512,
+                             Ble2904Def<BLE_FORMAT_UTF8>>
+    BleSessionCharacteristic;
+/** Batched samples, notified a frame at a time, see BleBatch.h */
+typedef BleCharacteristicDef<BleSamplesCharUuid,
+                             BLE_GATT_CHR_F_READ |
+                                 BLE_GATT_CHR_F_NOTIFY |
+                                 BLE_GATT_CHR_F_READ_ENC,
+                             244>
+    BleSamplesCharacteristic;
+typedef BleServiceDef<BleSessionServiceUuid, BleSessionCharacteristic, BleSamplesCharacteristic> BleSessionService;
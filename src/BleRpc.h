@@ -0,0 +1,610 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleFrameQueue.h"
+#include "BleCompress.h"
+#include "BleWatchdog.h"
+#include "BleTraffic.h"
+
+/** Request/response RPC multiplexed over the session characteristic.
+ *  Requests are written without response and answered by notification, each frame
+ *  tagged with a request id, so a client can keep several requests in flight on one
+ *  connection and many of them share a connection event.
+ *
+ *  Frame: [kind][id lo][id hi][method (request) or status (response)][payload...]
+ *
+ *  Once both ends agree on it through the reserved BLE_RPC_NEGOTIATE method, payloads that
+ *  shrink under BleCompress.h's LZSS are sent compressed under the _LZ kinds. A compressed
+ *  payload may expand to more than one frame's worth, up to BLE_RPC_MAX_PAYLOAD.
+ *  Responses can also be compressed as a stream, BLE_RPC_RESPONSE_LZ_STREAM, matching into
+ *  the responses sent before them so a transfer split over many calls compresses as a whole.
+ *  Requests aren't: they go out in whatever traffic class the caller picks, so the order
+ *  they reach the peer in isn't the order they were compressed in.
+ */
+/** Largest frame. Frames are also limited by the connection's MTU - 3 */
+#define BLE_RPC_MAX_FRAME BLE_FRAME_MAX_SIZE
+#ifndef BLE_RPC_MAX_HANDLERS
+#define BLE_RPC_MAX_HANDLERS 8
+#endif
+#ifndef BLE_RPC_MAX_PENDING
+/** Outstanding requests per connection, one of them kept for liveness pings */
+#define BLE_RPC_MAX_PENDING 8
+#endif
+#ifndef BLE_RPC_QUEUE_SIZE
+/** RPC frames buffered between the host task and update(): a full window of pipelined
+ *  requests, or their responses, from every connection at once
+ */
+#define BLE_RPC_QUEUE_SIZE (BLE_RPC_MAX_PENDING * NIMBLE_MAX_CONNECTIONS)
+#endif
+#ifndef BLE_RPC_TIMEOUT_MS
+#define BLE_RPC_TIMEOUT_MS 2000
+#endif
+#ifndef BLE_RPC_COMPRESS
+/** Offer payload compression to peers. 0 keeps every frame uncompressed */
+#define BLE_RPC_COMPRESS 1
+#endif
+#define BLE_RPC_HEADER_SIZE 4
+#define BLE_RPC_MAX_PAYLOAD (BLE_RPC_MAX_FRAME - BLE_RPC_HEADER_SIZE)
+
+enum BleRpcKind : uint8_t
+{
+    BLE_RPC_REQUEST = 0xA5,
+    BLE_RPC_REQUEST_LZ = 0xA6,
+    BLE_RPC_RESPONSE = 0x5A,
+    BLE_RPC_RESPONSE_LZ = 0x5B,
+    BLE_RPC_RESPONSE_LZ_STREAM = 0x5C
+};
+/** Reserved method: the payload is the caller's capability bits, the response the ones
+ *  both ends share
+ */
+#define BLE_RPC_NEGOTIATE 0xFF
+/** Reserved method: answered with an empty response from the server's loop, to show it runs */
+#define BLE_RPC_PING 0xFE
+enum BleRpcCapability : uint8_t
+{
+    BLE_RPC_CAP_LZ = 0x01,
+    /** Responses compressed as a stream, on top of BLE_RPC_CAP_LZ */
+    BLE_RPC_CAP_LZ_STREAM = 0x02
+};
+#define BLE_RPC_CAPABILITIES (BLE_RPC_COMPRESS ? BLE_RPC_CAP_LZ | BLE_RPC_CAP_LZ_STREAM : 0)
+enum BleRpcStatus : uint8_t
+{
+    BLE_RPC_OK = 0,
+    BLE_RPC_UNKNOWN_METHOD,
+    BLE_RPC_BUSY,
+    BLE_RPC_TOO_LARGE,
+    BLE_RPC_ERROR,
+    /** Generated locally, never sent */
+    BLE_RPC_TIMEOUT,
+    BLE_RPC_DISCONNECTED
+};
+
+/** Answers a request. response holds *responseSize bytes on entry, set it to the bytes used */
+typedef uint8_t (*BleRpcHandler)(const uint8_t *request, size_t requestSize, uint8_t *response, size_t *responseSize, void *state);
+/** Receives the result of a call. data is only valid for the duration of the callback */
+typedef void (*BleRpcCallback)(uint8_t status, const uint8_t *data, size_t size, void *state);
+
+/** Whether data is a frame of kind, compressed or not */
+inline bool ble_rpc_is_frame(const uint8_t *data, size_t size, BleRpcKind kind)
+{
+    return size >= BLE_RPC_HEADER_SIZE && size <= BLE_RPC_MAX_FRAME &&
+           (data[0] == kind || data[0] == kind + 1 || (BLE_RPC_RESPONSE == kind && BLE_RPC_RESPONSE_LZ_STREAM == data[0]));
+}
+inline bool ble_rpc_is_compressed(const uint8_t *frame)
+{
+    return BLE_RPC_REQUEST_LZ == frame[0] || BLE_RPC_RESPONSE_LZ == frame[0] || BLE_RPC_RESPONSE_LZ_STREAM == frame[0];
+}
+/** Points *payload at a frame's payload, expanding it into buffer if it is compressed.
+ *  Stream frames need the receiving end of their stream, pStream
+ */
+inline bool ble_rpc_payload(const uint8_t *frame, size_t size, uint8_t *buffer, const uint8_t **payload, size_t *payloadSize,
+                            BleLzStream *pStream, BleCompressStats *pStats)
+{
+    *payload = frame + BLE_RPC_HEADER_SIZE;
+    *payloadSize = size - BLE_RPC_HEADER_SIZE;
+    if (!ble_rpc_is_compressed(frame))
+    {
+        return true;
+    }
+    bool decoded = BLE_RPC_RESPONSE_LZ_STREAM == frame[0]
+                       ? nullptr != pStream && ble_lz_stream_decode(pStream, *payload, *payloadSize, buffer, BLE_RPC_MAX_PAYLOAD, payloadSize)
+                       : ble_lz_decompress(*payload, *payloadSize, buffer, BLE_RPC_MAX_PAYLOAD, payloadSize);
+    if (!decoded)
+    {
+        ++pStats->decodeErrors;
+        return false;
+    }
+    ++pStats->decompressed;
+    *payload = buffer;
+    return true;
+}
+inline uint16_t ble_rpc_id(const uint8_t *frame)
+{
+    return (uint16_t)(frame[1] | (frame[2] << 8));
+}
+inline void ble_rpc_header(uint8_t *frame, BleRpcKind kind, uint16_t id, uint8_t methodOrStatus)
+{
+    frame[0] = kind;
+    frame[1] = (uint8_t)id;
+    frame[2] = (uint8_t)(id >> 8);
+    frame[3] = methodOrStatus;
+}
+
+#if BLE_RADIO_PERIPHERAL
+/** Dispatches requests written to our session characteristic to registered handlers */
+class BleRpcServer
+{
+    struct Handler
+    {
+        BleRpcHandler handler;
+        void *state;
+        uint8_t method;
+    };
+    /** Capabilities agreed with each connection, and the window of its response stream */
+    struct Link
+    {
+        uint16_t conn;
+        uint8_t capabilities;
+        BleLzStream stream;
+    };
+    Handler m_handlers[BLE_RPC_MAX_HANDLERS];
+    size_t m_handlerCount;
+    BleFrameRing<BLE_RPC_QUEUE_SIZE> m_requests;
+    Link m_links[NIMBLE_MAX_CONNECTIONS];
+    BleCompressStats m_compress;
+    /** Requests answered, and those answered with an error status */
+    uint32_t m_served;
+    uint32_t m_failed;
+    /** Requests whose connection was gone before update() got to them */
+    uint32_t m_dropped;
+
+    const Handler *find(uint8_t method) const
+    {
+        for (size_t i = 0; i < m_handlerCount; ++i)
+        {
+            if (m_handlers[i].method == method)
+            {
+                return &m_handlers[i];
+            }
+        }
+        return nullptr;
+    }
+    Link *link(uint16_t conn, bool create)
+    {
+        Link *pFree = nullptr;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            if (m_links[i].conn == conn)
+            {
+                return &m_links[i];
+            }
+            if (nullptr == pFree && BLE_HS_CONN_HANDLE_NONE == m_links[i].conn)
+            {
+                pFree = &m_links[i];
+            }
+        }
+        if (create && nullptr != pFree)
+        {
+            pFree->conn = conn;
+            pFree->capabilities = 0;
+            pFree->stream.restart();
+            return pFree;
+        }
+        return nullptr;
+    }
+    /** Answers from the host task, which can't queue on BleTraffic */
+    static void send(NimBLECharacteristic *pChr, uint16_t conn, const uint8_t *frame, size_t size)
+    {
+        /** Answer only the connection that asked, notify() would send to every subscriber */
+        os_mbuf *om = ble_hs_mbuf_from_flat(frame, (uint16_t)size);
+        if (nullptr == om || 0 != ble_gattc_notify_custom(conn, pChr->getHandle(), om))
+        {
+            Serial.println(F("BLE RPC response could not be sent"));
+            return;
+        }
+        BleEnergy::instance().transferred(conn, size, true);
+    }
+    /** A stream frame was dropped after it was queued, so the client's window won't have
+     *  it: the next response starts the stream afresh
+     */
+    static void onDropped(uint16_t conn, void *state)
+    {
+        Link *pLink = ((BleRpcServer *)state)->link(conn, false);
+        if (nullptr != pLink)
+        {
+            pLink->stream.restart();
+        }
+    }
+
+public:
+    void begin()
+    {
+        m_handlerCount = 0;
+        m_requests.clear();
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            m_links[i].conn = BLE_HS_CONN_HANDLE_NONE;
+        }
+        memset(&m_compress, 0, sizeof(m_compress));
+        m_served = 0;
+        m_failed = 0;
+        m_dropped = 0;
+    }
+    /** Forgets what was negotiated with a connection */
+    void disconnected(uint16_t conn)
+    {
+        Link *pLink = link(conn, false);
+        if (nullptr != pLink)
+        {
+            pLink->conn = BLE_HS_CONN_HANDLE_NONE;
+        }
+    }
+    const BleCompressStats &compressStats() const
+    {
+        return m_compress;
+    }
+    uint32_t served() const
+    {
+        return m_served;
+    }
+    uint32_t failed() const
+    {
+        return m_failed;
+    }
+    uint32_t dropped() const
+    {
+        return m_dropped;
+    }
+    /** Registers a handler for a method. Registering a method again replaces its handler */
+    bool handle(uint8_t method, BleRpcHandler handler, void *state)
+    {
+        if (BLE_RPC_NEGOTIATE == method || BLE_RPC_PING == method)
+        {
+            return false;
+        }
+        Handler *pHandler = (Handler *)find(method);
+        if (nullptr == pHandler)
+        {
+            if (m_handlerCount >= BLE_RPC_MAX_HANDLERS)
+            {
+                return false;
+            }
+            pHandler = &m_handlers[m_handlerCount++];
+        }
+        pHandler->method = method;
+        pHandler->handler = handler;
+        pHandler->state = state;
+        return true;
+    }
+    /** Called from the host task when the session characteristic is written.
+     *  Returns false if the write isn't an RPC request
+     */
+    bool received(NimBLECharacteristic *pChr, uint16_t conn, const uint8_t *data, size_t size)
+    {
+        if (!ble_rpc_is_frame(data, size, BLE_RPC_REQUEST))
+        {
+            return false;
+        }
+        if (!m_requests.push(BLE_FRAME_RPC, conn, data, size))
+        {
+            uint8_t busy[BLE_RPC_HEADER_SIZE];
+            ble_rpc_header(busy, BLE_RPC_RESPONSE, ble_rpc_id(data), BLE_RPC_BUSY);
+            send(pChr, conn, busy, sizeof(busy));
+        }
+        return true;
+    }
+    /** Runs the handlers for queued requests and notifies the responses */
+    void update(NimBLEServer *pServer, NimBLECharacteristic *pChr)
+    {
+        uint8_t request[BLE_RPC_MAX_PAYLOAD];
+        uint8_t plain[BLE_RPC_MAX_PAYLOAD];
+        uint8_t response[BLE_RPC_MAX_FRAME];
+        BleFrame *pFrame;
+        while (nullptr != (pFrame = m_requests.front()))
+        {
+            /** 0 once the link has dropped, leaving no room for even a header */
+            size_t mtu = pServer->getPeerMTU(pFrame->conn);
+            size_t capacity = (mtu > 3 ? mtu - 3 : 0);
+            if (capacity < BLE_RPC_HEADER_SIZE)
+            {
+                ++m_dropped;
+                m_requests.pop();
+                continue;
+            }
+            capacity -= BLE_RPC_HEADER_SIZE;
+            if (capacity > BLE_RPC_MAX_PAYLOAD)
+            {
+                capacity = BLE_RPC_MAX_PAYLOAD;
+            }
+            uint16_t id = ble_rpc_id(pFrame->data);
+            uint8_t method = pFrame->data[3];
+            Link *pLink = link(pFrame->conn, false);
+            uint8_t shared = (nullptr != pLink) ? pLink->capabilities : 0;
+            bool compress = 0 != (shared & BLE_RPC_CAP_LZ);
+            bool stream = compress && 0 != (shared & BLE_RPC_CAP_LZ_STREAM);
+            const Handler *pHandler = find(method);
+            const uint8_t *payload;
+            size_t payloadSize;
+            /** With compression the handler may fill more than a frame, if it then shrinks to fit */
+            size_t size = compress ? BLE_RPC_MAX_PAYLOAD : capacity;
+            uint8_t status = BLE_RPC_OK;
+            if (!ble_rpc_payload(pFrame->data, pFrame->size, request, &payload, &payloadSize, nullptr, &m_compress))
+            {
+                status = BLE_RPC_ERROR;
+                size = 0;
+            }
+            else if (BLE_RPC_NEGOTIATE == method)
+            {
+                pLink = link(pFrame->conn, true);
+                uint8_t agreed = payloadSize ? (payload[0] & BLE_RPC_CAPABILITIES) : 0;
+                if (nullptr != pLink)
+                {
+                    /** The client starts a new stream along with its session */
+                    pLink->capabilities = agreed;
+                    pLink->stream.restart();
+                }
+                plain[0] = agreed;
+                size = 1;
+            }
+            else if (BLE_RPC_PING == method)
+            {
+                size = 0;
+            }
+            else if (nullptr == pHandler)
+            {
+                status = BLE_RPC_UNKNOWN_METHOD;
+                size = 0;
+            }
+            else
+            {
+                BleWatchdogScope watch(BLE_OP_CALLBACK, pFrame->conn);
+                status = pHandler->handler(payload, payloadSize, plain, &size, pHandler->state);
+            }
+            bool compressed = false;
+            if (stream && size)
+            {
+                size = ble_lz_stream_encode(&pLink->stream, plain, size, response + BLE_RPC_HEADER_SIZE, capacity, &compressed, &m_compress);
+            }
+            else if (compress && size)
+            {
+                size = ble_lz_encode(plain, size, response + BLE_RPC_HEADER_SIZE, capacity, &compressed, &m_compress);
+            }
+            if (!compressed)
+            {
+                if (size > capacity)
+                {
+                    status = BLE_RPC_TOO_LARGE;
+                    size = 0;
+                }
+                memcpy(response + BLE_RPC_HEADER_SIZE, plain, size);
+            }
+            ble_rpc_header(response, compressed ? (stream ? BLE_RPC_RESPONSE_LZ_STREAM : BLE_RPC_RESPONSE_LZ) : BLE_RPC_RESPONSE, id, status);
+            /** Probes are answered as control traffic so bulk queued ahead doesn't fail them */
+            if (!BleTraffic::instance().send(pFrame->conn, BLE_RPC_PING == method ? BLE_QOS_CONTROL : BLE_QOS_INTERACTIVE,
+                                             ble_traffic_notify, pChr, response, BLE_RPC_HEADER_SIZE + size,
+                                             (compressed && stream) ? onDropped : nullptr, this))
+            {
+                Serial.println(F("BLE RPC response could not be queued"));
+                if (compressed && stream)
+                {
+                    /** The client's window won't have it, so the next response starts afresh */
+                    pLink->stream.restart();
+                }
+            }
+            ++m_served;
+            if (BLE_RPC_OK != status)
+            {
+                ++m_failed;
+            }
+            m_requests.pop();
+        }
+    }
+};
+#endif // BLE_RADIO_PERIPHERAL
+
+#if BLE_RADIO_CENTRAL
+/** Tracks the requests in flight to one peer's session characteristic */
+class BleRpcClient
+{
+    struct Pending
+    {
+        BleRpcCallback callback;
+        void *state;
+        uint32_t sentTS;
+        uint16_t id;
+        bool used;
+    };
+    Pending m_pending[BLE_RPC_MAX_PENDING];
+    uint16_t m_nextId;
+    NimBLERemoteCharacteristic *m_pChr;
+    /** Agreed with the peer, 0 until negotiate() is answered */
+    uint8_t m_capabilities;
+    BleCompressStats *m_pCompress;
+    /** The receiving end of the peer's response stream */
+    BleLzStream m_stream;
+
+    void complete(Pending &pending, uint8_t status, const uint8_t *data, size_t size)
+    {
+        pending.used = false;
+        if (nullptr != pending.callback)
+        {
+            BleWatchdogScope watch(BLE_OP_CALLBACK);
+            pending.callback(status, data, size, pending.state);
+        }
+    }
+    static void onNegotiated(uint8_t status, const uint8_t *data, size_t size, void *state)
+    {
+        if (BLE_RPC_OK == status && size)
+        {
+            ((BleRpcClient *)state)->m_capabilities = data[0] & BLE_RPC_CAPABILITIES;
+        }
+    }
+
+public:
+    /** pCompress accumulates compression statistics and must outlive the client */
+    void begin(NimBLERemoteCharacteristic *pChr, BleCompressStats *pCompress)
+    {
+        memset(m_pending, 0, sizeof(m_pending));
+        m_nextId = (uint16_t)BleClock::now();
+        m_pChr = pChr;
+        m_capabilities = 0;
+        m_pCompress = pCompress;
+        m_stream.restart();
+    }
+    /** Asks the peer which optional features it shares with us. Until it answers,
+     *  and with peers that predate negotiation, frames go uncompressed
+     */
+    bool negotiate()
+    {
+        uint8_t capabilities = BLE_RPC_CAPABILITIES;
+        return 0 != capabilities && 0 <= call(BLE_RPC_NEGOTIATE, &capabilities, 1, onNegotiated, this);
+    }
+    uint8_t capabilities() const
+    {
+        return m_capabilities;
+    }
+    bool ready() const
+    {
+        return nullptr != m_pChr;
+    }
+    NimBLERemoteCharacteristic *characteristic() const
+    {
+        return m_pChr;
+    }
+    /** Requests still waiting for a response */
+    size_t pending() const
+    {
+        size_t result = 0;
+        for (size_t i = 0; i < BLE_RPC_MAX_PENDING; ++i)
+        {
+            if (m_pending[i].used)
+            {
+                ++result;
+            }
+        }
+        return result;
+    }
+    /** Queues a request without waiting for the answer. Pings always go as control traffic.
+     *  Returns the request id, or -1 if the request couldn't be queued
+     */
+    int call(uint8_t method, const uint8_t *data, size_t size, BleRpcCallback callback, void *state, uint8_t traffic = BLE_QOS_INTERACTIVE)
+    {
+        if (nullptr == m_pChr)
+        {
+            return -1;
+        }
+        NimBLEClient *pClient = m_pChr->getRemoteService()->getClient();
+        size_t mtu = pClient->getMTU();
+        size_t capacity = mtu > 3 + BLE_RPC_HEADER_SIZE ? mtu - 3 - BLE_RPC_HEADER_SIZE : 0;
+        if (capacity > BLE_RPC_MAX_PAYLOAD)
+        {
+            capacity = BLE_RPC_MAX_PAYLOAD;
+        }
+        if (size > BLE_RPC_MAX_PAYLOAD || (0 == (m_capabilities & BLE_RPC_CAP_LZ) && size > capacity))
+        {
+            return -1;
+        }
+        /** The last free slot is kept for pings, so liveness can probe a link whose
+         *  window is full of calls the peer isn't answering
+         */
+        Pending *pPending = nullptr;
+        size_t free = 0;
+        for (size_t i = 0; i < BLE_RPC_MAX_PENDING; ++i)
+        {
+            if (!m_pending[i].used)
+            {
+                pPending = (nullptr == pPending) ? &m_pending[i] : pPending;
+                ++free;
+            }
+        }
+        if (nullptr == pPending || (1 == free && BLE_RPC_PING != method))
+        {
+            return -1;
+        }
+        uint8_t frame[BLE_RPC_MAX_FRAME];
+        /** Ids advance only once a request is queued, so each pending call keeps its own */
+        uint16_t id = m_nextId;
+        bool compressed = false;
+        if (size && (m_capabilities & BLE_RPC_CAP_LZ))
+        {
+            size = ble_lz_encode(data, size, frame + BLE_RPC_HEADER_SIZE, capacity, &compressed, m_pCompress);
+        }
+        if (!compressed && size)
+        {
+            if (size > capacity)
+            {
+                return -1;
+            }
+            memcpy(frame + BLE_RPC_HEADER_SIZE, data, size);
+        }
+        ble_rpc_header(frame, compressed ? BLE_RPC_REQUEST_LZ : BLE_RPC_REQUEST, id, method);
+        /** Write without response so several requests can go out in one connection event */
+        if (!BleTraffic::instance().send(pClient->getConnId(), BLE_RPC_PING == method ? (uint8_t)BLE_QOS_CONTROL : traffic,
+                                         ble_traffic_write, m_pChr, frame, BLE_RPC_HEADER_SIZE + size))
+        {
+            return -1;
+        }
+        ++m_nextId;
+        pPending->callback = callback;
+        pPending->state = state;
+        pPending->sentTS = BleClock::now();
+        pPending->id = id;
+        pPending->used = true;
+        return id;
+    }
+    /** Completes the request a response frame answers.
+     *  Returns the request's round trip in ms, or -1 if nothing was waiting for it
+     */
+    int32_t received(const uint8_t *frame, size_t size)
+    {
+        uint16_t id = ble_rpc_id(frame);
+        /** Expanded even if nothing waits for it any more, to keep the stream's window in step */
+        uint8_t buffer[BLE_RPC_MAX_PAYLOAD];
+        const uint8_t *payload;
+        size_t payloadSize;
+        bool decoded = ble_rpc_payload(frame, size, buffer, &payload, &payloadSize, &m_stream, m_pCompress);
+        for (size_t i = 0; i < BLE_RPC_MAX_PENDING; ++i)
+        {
+            if (m_pending[i].used && m_pending[i].id == id)
+            {
+                int32_t latency = (int32_t)(BleClock::now() - m_pending[i].sentTS);
+                if (decoded)
+                {
+                    complete(m_pending[i], frame[3], payload, payloadSize);
+                }
+                else
+                {
+                    complete(m_pending[i], BLE_RPC_ERROR, nullptr, 0);
+                }
+                return latency;
+            }
+        }
+        return -1;
+    }
+    /** Fails requests that have waited longer than BLE_RPC_TIMEOUT_MS. Returns how many */
+    size_t expire(uint32_t now)
+    {
+        size_t expired = 0;
+        for (size_t i = 0; i < BLE_RPC_MAX_PENDING; ++i)
+        {
+            if (m_pending[i].used && BLE_RPC_TIMEOUT_MS < now - m_pending[i].sentTS)
+            {
+                complete(m_pending[i], BLE_RPC_TIMEOUT, nullptr, 0);
+                ++expired;
+            }
+        }
+        return expired;
+    }
+    /** Fails every outstanding request, for when the link goes away */
+    void end()
+    {
+        for (size_t i = 0; i < BLE_RPC_MAX_PENDING; ++i)
+        {
+            if (m_pending[i].used)
+            {
+                complete(m_pending[i], BLE_RPC_DISCONNECTED, nullptr, 0);
+            }
+        }
+        m_pChr = nullptr;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,335 @@
+#pragma once
+#include "BleRadioConfig.h"
+#if BLE_RADIO_CENTRAL
+
+/** Decides which configuration service peripherals get our connection slots.
+ *  Advertisers are kept in a fixed candidate table and ranked by a configurable mix of
+ *  priority, RSSI, data backlog and time spent waiting. When every slot is busy a
+ *  clearly better candidate evicts the weakest connected peer, and peers left idle for
+ *  BLE_SCHED_MAX_IDLE_MS give up their slot, so more peripherals than slots are served
+ *  in rotation.
+ */
+#ifndef BLE_SCHED_CANDIDATES
+#define BLE_SCHED_CANDIDATES 16
+#endif
+#ifndef BLE_SCHED_STALE_MS
+/** Candidates not heard from for this long aren't connected to */
+#define BLE_SCHED_STALE_MS 10000
+#endif
+#ifndef BLE_SCHED_MIN_SERVICE_MS
+/** A peer keeps its slot at least this long before it can be evicted */
+#define BLE_SCHED_MIN_SERVICE_MS 5000
+#endif
+#ifndef BLE_SCHED_MAX_IDLE_MS
+/** A peer idle this long yields its slot to any waiting candidate */
+#define BLE_SCHED_MAX_IDLE_MS 30000
+#endif
+#ifndef BLE_SCHED_RETRY_MS
+/** How long a candidate that failed to connect is passed over */
+#define BLE_SCHED_RETRY_MS 2000
+#endif
+#ifndef BLE_SCHED_HYSTERESIS
+/** How much better than a connected peer a candidate must score to evict it */
+#define BLE_SCHED_HYSTERESIS 100
+#endif
+
+/** Score = priority * priority weight + RSSI dBm * rssi weight + backlog * backlog weight
+ *  + waiting seconds * waiting weight. Connected peers use their idle seconds as a penalty
+ */
+struct BleSchedulerWeights
+{
+    int32_t priority;
+    int32_t rssi;
+    int32_t backlog;
+    int32_t waiting;
+    int32_t idle;
+};
+
+struct BleSchedulerStats
+{
+    uint32_t connects;
+    uint32_t evictions;
+    /** Evictions of idle peers to serve waiting ones */
+    uint32_t rotations;
+    /** From a candidate becoming eligible to being connected */
+    uint32_t serviceLatencyTotal;
+    uint32_t serviceLatencyMax;
+    /** Occupied slot time against available slot time */
+    uint64_t busySlotMs;
+    uint64_t totalSlotMs;
+    uint32_t averageServiceLatency() const
+    {
+        return connects ? serviceLatencyTotal / connects : 0;
+    }
+    /** Slot utilisation in permille */
+    uint32_t utilisation() const
+    {
+        return totalSlotMs ? (uint32_t)(busySlotMs * 1000 / totalSlotMs) : 0;
+    }
+};
+
+struct BleCandidate
+{
+    ble_addr_t address;
+    uint32_t seenTS;
+    /** When it last started waiting for a slot */
+    uint32_t waitingTS;
+    uint32_t lastServiceLatency;
+    /** Not tried again before this after a failed connect */
+    uint32_t retryTS;
+    int8_t rssi;
+    int8_t priority;
+    bool used;
+    /** Has a priority set by the application, so it is never dropped from the table */
+    bool pinned;
+    bool connected;
+    bool hasBacklog;
+    NimBLEAddress getAddress() const
+    {
+        return NimBLEAddress(address);
+    }
+};
+
+class BleScheduler
+{
+    BleCandidate m_candidates[BLE_SCHED_CANDIDATES];
+    BleSchedulerWeights m_weights;
+    BleSchedulerStats m_stats;
+    uint32_t m_updateTS;
+    /** onResult() runs on the host task, update() on the loop */
+    portMUX_TYPE m_lock = portMUX_INITIALIZER_UNLOCKED;
+
+    static bool same(const ble_addr_t &lhs, const NimBLEAddress &rhs)
+    {
+        return lhs.type == rhs.getType() && 0 == memcmp(lhs.val, rhs.getNative(), sizeof(lhs.val));
+    }
+    /** Call with the lock held */
+    BleCandidate *find(const NimBLEAddress &address)
+    {
+        for (size_t i = 0; i < BLE_SCHED_CANDIDATES; ++i)
+        {
+            if (m_candidates[i].used && same(m_candidates[i].address, address))
+            {
+                return &m_candidates[i];
+            }
+        }
+        return nullptr;
+    }
+    /** Call with the lock held. Replaces the stalest unpinned, unconnected entry when full */
+    BleCandidate *add(const NimBLEAddress &address, uint32_t now)
+    {
+        BleCandidate *pCandidate = find(address);
+        if (nullptr != pCandidate)
+        {
+            return pCandidate;
+        }
+        for (size_t i = 0; i < BLE_SCHED_CANDIDATES; ++i)
+        {
+            BleCandidate &candidate = m_candidates[i];
+            if (!candidate.used)
+            {
+                pCandidate = &candidate;
+                break;
+            }
+            if (!candidate.pinned && !candidate.connected &&
+                (nullptr == pCandidate || now - candidate.seenTS > now - pCandidate->seenTS))
+            {
+                pCandidate = &candidate;
+            }
+        }
+        if (nullptr == pCandidate)
+        {
+            return nullptr;
+        }
+        memset(pCandidate, 0, sizeof(BleCandidate));
+        pCandidate->address.type = address.getType();
+        memcpy(pCandidate->address.val, address.getNative(), sizeof(pCandidate->address.val));
+        pCandidate->used = true;
+        pCandidate->waitingTS = now;
+        pCandidate->hasBacklog = true;
+        return pCandidate;
+    }
+    int32_t score(const BleCandidate &candidate, uint32_t now) const
+    {
+        return candidate.priority * m_weights.priority +
+               candidate.rssi * m_weights.rssi +
+               (candidate.hasBacklog ? m_weights.backlog : 0) +
+               (int32_t)((now - candidate.waitingTS) / 1000) * m_weights.waiting;
+    }
+
+public:
+    void begin()
+    {
+        memset(m_candidates, 0, sizeof(m_candidates));
+        memset(&m_stats, 0, sizeof(m_stats));
+        m_weights.priority = 1000;
+        m_weights.rssi = 10;
+        m_weights.backlog = 500;
+        m_weights.waiting = 20;
+        m_weights.idle = 20;
+        m_updateTS = BleClock::now();
+    }
+    void weights(const BleSchedulerWeights &weights)
+    {
+        m_weights = weights;
+    }
+    /** Sets a peripheral's priority. Higher is served first */
+    bool priority(const NimBLEAddress &address, int8_t priority)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = add(address, BleClock::now());
+        if (nullptr != pCandidate)
+        {
+            pCandidate->priority = priority;
+            pCandidate->pinned = true;
+            /** Not seen yet, so it won't be picked until it advertises */
+            pCandidate->seenTS = BleClock::now() - BLE_SCHED_STALE_MS;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return nullptr != pCandidate;
+    }
+    /** An advertiser was heard. Called from the host task.
+     *  Returns true if it wasn't in the table before
+     */
+    bool seen(const NimBLEAddress &address, int rssi, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        bool known = nullptr != find(address);
+        BleCandidate *pCandidate = add(address, now);
+        if (nullptr != pCandidate)
+        {
+            pCandidate->seenTS = now;
+            pCandidate->rssi = (int8_t)rssi;
+        }
+        portEXIT_CRITICAL(&m_lock);
+        return !known && nullptr != pCandidate;
+    }
+    /** The best candidate waiting for a slot and its score. Returns false if there is none */
+    bool next(uint32_t now, NimBLEAddress *address, int32_t *pScore)
+    {
+        bool found = false;
+        int32_t best = 0;
+        portENTER_CRITICAL(&m_lock);
+        for (size_t i = 0; i < BLE_SCHED_CANDIDATES; ++i)
+        {
+            const BleCandidate &candidate = m_candidates[i];
+            if (!candidate.used || candidate.connected || BLE_SCHED_STALE_MS <= now - candidate.seenTS ||
+                0 < (int32_t)(candidate.retryTS - now))
+            {
+                continue;
+            }
+            int32_t s = score(candidate, now);
+            if (!found || s > best)
+            {
+                found = true;
+                best = s;
+                *address = candidate.getAddress();
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+        *pScore = best;
+        return found;
+    }
+    /** A connected peer's score, lowered by the time it has been idle */
+    int32_t score(const NimBLEAddress &address, uint32_t idleMs, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = find(address);
+        int32_t result = (nullptr != pCandidate) ? score(*pCandidate, now) : 0;
+        portEXIT_CRITICAL(&m_lock);
+        return result - (int32_t)(idleMs / 1000) * m_weights.idle;
+    }
+    /** Whether a connected peer may be evicted in favour of a candidate scoring candidateScore */
+    bool evictable(int32_t peerScore, uint32_t servedMs, uint32_t idleMs, int32_t candidateScore)
+    {
+        if (servedMs < BLE_SCHED_MIN_SERVICE_MS)
+        {
+            return false;
+        }
+        return idleMs >= BLE_SCHED_MAX_IDLE_MS || candidateScore > peerScore + BLE_SCHED_HYSTERESIS;
+    }
+    void connected(const NimBLEAddress &address, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = add(address, now);
+        if (nullptr != pCandidate)
+        {
+            pCandidate->connected = true;
+            pCandidate->lastServiceLatency = now - pCandidate->waitingTS;
+            ++m_stats.connects;
+            m_stats.serviceLatencyTotal += pCandidate->lastServiceLatency;
+            if (pCandidate->lastServiceLatency > m_stats.serviceLatencyMax)
+            {
+                m_stats.serviceLatencyMax = pCandidate->lastServiceLatency;
+            }
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    void failed(const NimBLEAddress &address, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = find(address);
+        if (nullptr != pCandidate)
+        {
+            pCandidate->retryTS = now + BLE_SCHED_RETRY_MS;
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    void disconnected(const NimBLEAddress &address, bool hasBacklog, uint32_t now)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = find(address);
+        if (nullptr != pCandidate)
+        {
+            pCandidate->connected = false;
+            pCandidate->hasBacklog = hasBacklog;
+            pCandidate->waitingTS = now;
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    /** Updates whether a connected peer has data waiting for it and its link's RSSI */
+    void refresh(const NimBLEAddress &address, bool hasBacklog, int rssi)
+    {
+        portENTER_CRITICAL(&m_lock);
+        BleCandidate *pCandidate = find(address);
+        if (nullptr != pCandidate)
+        {
+            pCandidate->hasBacklog = hasBacklog;
+            pCandidate->rssi = (int8_t)rssi;
+        }
+        portEXIT_CRITICAL(&m_lock);
+    }
+    void evicted(bool idle)
+    {
+        ++m_stats.evictions;
+        if (idle)
+        {
+            ++m_stats.rotations;
+        }
+    }
+    /** Accounts slot utilisation since the last call */
+    void occupancy(size_t occupied, size_t capacity, uint32_t now)
+    {
+        uint32_t elapsed = now - m_updateTS;
+        m_updateTS = now;
+        m_stats.busySlotMs += (uint64_t)occupied * elapsed;
+        m_stats.totalSlotMs += (uint64_t)capacity * elapsed;
+    }
+    /** Copies out a candidate for diagnostics. Returns false past the end of the table */
+    bool candidate(size_t index, BleCandidate *pCandidate)
+    {
+        if (index >= BLE_SCHED_CANDIDATES)
+        {
+            return false;
+        }
+        portENTER_CRITICAL(&m_lock);
+        *pCandidate = m_candidates[index];
+        portEXIT_CRITICAL(&m_lock);
+        return true;
+    }
+    const BleSchedulerStats &stats() const
+    {
+        return m_stats;
+    }
+};
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,307 @@
+#pragma once
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+#include "BleDiscovery.h"
+
+/** Compile-time GATT schema.
+ *  UUID strings are parsed by the compiler into the little-endian byte layout NimBLE
+ *  uses internally, so nothing is parsed at startup. Services, characteristics and
+ *  descriptors are described as types; the server side creates its attribute table
+ *  from them and the client side looks the same attributes up from them, so both
+ *  ends are always built from one definition.
+ *  Properties are the BLE_GATT_CHR_F_* flags NIMBLE_PROPERTY is built from, since
+ *  NIMBLE_PROPERTY only exists in builds with the peripheral role.
+ */
+struct BleUuid
+{
+    /** Little-endian, as stored by NimBLE. Only the first size bytes are used */
+    uint8_t bytes[16];
+    /** 2 for a 16-bit UUID, 16 for a 128-bit UUID */
+    uint8_t size;
+    NimBLEUUID toNimBLE() const
+    {
+        return NimBLEUUID(bytes, size, false);
+    }
+};
+
+namespace ble_schema_detail
+{
+    template <size_t... I>
+    struct index_seq
+    {
+    };
+    template <size_t N, size_t... I>
+    struct make_index_seq : make_index_seq<N - 1, N - 1, I...>
+    {
+    };
+    template <size_t... I>
+    struct make_index_seq<0, I...>
+    {
+        typedef index_seq<I...> type;
+    };
+
+    constexpr bool isHex(char c)
+    {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    }
+    constexpr uint8_t nibble(char c)
+    {
+        return (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : c - 'A' + 10;
+    }
+    constexpr size_t length(const char *s)
+    {
+        return *s ? 1 + length(s + 1) : 0;
+    }
+    /** Position of the k-th (big-endian) byte inside "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" */
+    constexpr size_t offset128(size_t k)
+    {
+        return 2 * k + (k >= 4) + (k >= 6) + (k >= 8) + (k >= 10);
+    }
+    constexpr uint8_t hexByte(const char *s, size_t offset)
+    {
+        return (uint8_t)((nibble(s[offset]) << 4) | nibble(s[offset + 1]));
+    }
+    constexpr uint8_t byte128(const char *s, size_t i)
+    {
+        return hexByte(s, offset128(15 - i));
+    }
+    constexpr uint8_t byte16(const char *s, size_t i)
+    {
+        return i < 2 ? hexByte(s, 2 * (1 - i)) : 0;
+    }
+    constexpr bool valid128(const char *s, size_t i)
+    {
+        return i == 36 ? true : ((i == 8 || i == 13 || i == 18 || i == 23) ? s[i] == '-' : isHex(s[i])) && valid128(s, i + 1);
+    }
+    constexpr bool valid16(const char *s, size_t i)
+    {
+        return i == 4 ? true : isHex(s[i]) && valid16(s, i + 1);
+    }
+    template <size_t... I>
+    constexpr BleUuid make(const char *s, index_seq<I...>)
+    {
+        return length(s) == 36 ? BleUuid{{byte128(s, I)...}, 16} : BleUuid{{byte16(s, I)...}, 2};
+    }
+
+    /** Position of T in Ts, or sizeof...(Ts) if it isn't there */
+    template <typename T, typename... Ts>
+    struct typeIndex;
+    template <typename T>
+    struct typeIndex<T>
+    {
+        enum { value = 0 };
+    };
+    template <typename T, typename... Ts>
+    struct typeIndex<T, T, Ts...>
+    {
+        enum { value = 0 };
+    };
+    template <typename T, typename U, typename... Ts>
+    struct typeIndex<T, U, Ts...>
+    {
+        enum { value = 1 + typeIndex<T, Ts...>::value };
+    };
+}
+
+/** Is the string a 16-bit ("2904") or 128-bit UUID? */
+constexpr bool ble_uuid_valid(const char *uuid)
+{
+    return (ble_schema_detail::length(uuid) == 36 && ble_schema_detail::valid128(uuid, 0)) ||
+           (ble_schema_detail::length(uuid) == 4 && ble_schema_detail::valid16(uuid, 0));
+}
+/** Parses a UUID string at compile time */
+constexpr BleUuid ble_uuid(const char *uuid)
+{
+    return ble_schema_detail::make(uuid, ble_schema_detail::make_index_seq<16>::type());
+}
+
+/** Characteristic presentation formats (Bluetooth assigned numbers) for Ble2904Def */
+enum BleFormat : uint8_t
+{
+    BLE_FORMAT_UINT8 = 0x04,
+    BLE_FORMAT_UINT16 = 0x06,
+    BLE_FORMAT_UINT32 = 0x08,
+    BLE_FORMAT_UTF8 = 0x19,
+    BLE_FORMAT_OPAQUE = 0x1B
+};
+
+/** Declares a UUID type usable as a schema parameter */
+#define BLE_SCHEMA_UUID(name, uuid)                                                  \
+    struct name                                                                      \
+    {                                                                                \
+        static_assert(ble_uuid_valid(uuid), "BLE invalid UUID: " uuid);              \
+        static constexpr BleUuid value() { return ble_uuid(uuid); }                  \
+    }
+
+/** A plain descriptor */
+template <typename Uuid, uint32_t Properties = BLE_GATT_CHR_F_READ, uint16_t MaxLength = 100>
+struct BleDescriptorDef
+{
+    static constexpr BleUuid uuid() { return Uuid::value(); }
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    static NimBLEDescriptor *create(NimBLECharacteristic *pChr, NimBLEDescriptorCallbacks *pCallbacks)
+    {
+        NimBLEDescriptor *pDsc = pChr->createDescriptor(uuid().toNimBLE(), Properties, MaxLength);
+        if (nullptr != pDsc)
+        {
+            pDsc->setCallbacks(pCallbacks);
+        }
+        return pDsc;
+    }
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    static NimBLERemoteDescriptor *find(NimBLERemoteCharacteristic *pChr)
+    {
+        return BleDiscovery::instance().descriptor(pChr, uuid().toNimBLE());
+    }
+#endif
+};
+
+/** A 0x2904 presentation format descriptor.
+ *  createDescriptor() special cases 0x2904 and returns a NimBLE2904
+ */
+template <BleFormat Format>
+struct Ble2904Def
+{
+    static constexpr BleUuid uuid() { return BleUuid{{0x04, 0x29}, 2}; }
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    static NimBLEDescriptor *create(NimBLECharacteristic *pChr, NimBLEDescriptorCallbacks *pCallbacks)
+    {
+        NimBLE2904 *pDsc = (NimBLE2904 *)pChr->createDescriptor(uuid().toNimBLE());
+        if (nullptr != pDsc)
+        {
+            pDsc->setFormat(Format);
+            pDsc->setCallbacks(pCallbacks);
+        }
+        return pDsc;
+    }
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    static NimBLERemoteDescriptor *find(NimBLERemoteCharacteristic *pChr)
+    {
+        return BleDiscovery::instance().descriptor(pChr, uuid().toNimBLE());
+    }
+#endif
+};
+
+template <typename Uuid, uint32_t Properties, uint16_t MaxLength, typename... Descriptors>
+struct BleCharacteristicDef
+{
+    static constexpr BleUuid uuid() { return Uuid::value(); }
+    static constexpr uint32_t properties() { return Properties; }
+    /** The largest value this characteristic holds; NimBLE sizes its value buffer to it */
+    static constexpr uint16_t maxLength() { return MaxLength; }
+    static constexpr size_t descriptorCount() { return sizeof...(Descriptors); }
+
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    static NimBLECharacteristic *create(NimBLEService *pSvc, NimBLECharacteristicCallbacks *pCallbacks, NimBLEDescriptorCallbacks *pDscCallbacks)
+    {
+        NimBLECharacteristic *pChr = pSvc->createCharacteristic(uuid().toNimBLE(), Properties, MaxLength);
+        if (nullptr == pChr)
+        {
+            return nullptr;
+        }
+        pChr->setCallbacks(pCallbacks);
+        (void)pDscCallbacks; // unused when there are no descriptors
+        bool created[] = {true, (nullptr != Descriptors::create(pChr, pDscCallbacks))...};
+        for (size_t i = 0; i < sizeof(created) / sizeof(created[0]); ++i)
+        {
+            if (!created[i])
+            {
+                return nullptr;
+            }
+        }
+        return pChr;
+    }
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    static NimBLERemoteCharacteristic *find(NimBLERemoteService *pSvc)
+    {
+        return BleDiscovery::instance().characteristic(pSvc, uuid().toNimBLE());
+    }
+#endif
+};
+
+template <typename Uuid, typename... Characteristics>
+struct BleServiceDef
+{
+    static constexpr BleUuid uuid() { return Uuid::value(); }
+    static constexpr size_t characteristicCount() { return sizeof...(Characteristics); }
+    /** Slot of a characteristic in this service's tables. Fails to compile if it isn't part of the service */
+    template <typename Chr>
+    static constexpr size_t indexOf()
+    {
+        static_assert((size_t)ble_schema_detail::typeIndex<Chr, Characteristics...>::value < sizeof...(Characteristics), "BLE characteristic is not part of this service");
+        return ble_schema_detail::typeIndex<Chr, Characteristics...>::value;
+    }
+
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    /** Attributes created on the local server */
+    struct ServerTable
+    {
+        NimBLEService *service;
+        NimBLECharacteristic *characteristics[sizeof...(Characteristics)];
+        template <typename Chr>
+        NimBLECharacteristic *get() const
+        {
+            return characteristics[indexOf<Chr>()];
+        }
+    };
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    /** Attributes found on a remote server, each characteristic looked up the first time
+     *  it is asked for. Entries are null when the peer lacks them
+     */
+    struct ClientTable
+    {
+        static_assert(sizeof...(Characteristics) <= 32, "BLE service has too many characteristics");
+        NimBLERemoteService *service;
+        NimBLERemoteCharacteristic *characteristics[sizeof...(Characteristics)];
+        /** Bit n is set once characteristic n has been looked up */
+        uint32_t resolved;
+        template <typename Chr>
+        NimBLERemoteCharacteristic *get()
+        {
+            const size_t i = indexOf<Chr>();
+            if (0 == (resolved & (1ul << i)))
+            {
+                resolved |= 1ul << i;
+                characteristics[i] = (nullptr != service) ? Chr::find(service) : nullptr;
+            }
+            return characteristics[i];
+        }
+    };
+#endif
+
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    /** Creates the service and all its characteristics and descriptors. The service is not started */
+    static NimBLEService *create(NimBLEServer *pServer, ServerTable &table, NimBLECharacteristicCallbacks *pCallbacks, NimBLEDescriptorCallbacks *pDscCallbacks)
+    {
+        memset(&table, 0, sizeof(table));
+        table.service = pServer->createService(uuid().toNimBLE());
+        if (nullptr == table.service)
+        {
+            return nullptr;
+        }
+        NimBLECharacteristic *created[] = {Characteristics::create(table.service, pCallbacks, pDscCallbacks)...};
+        for (size_t i = 0; i < sizeof...(Characteristics); ++i)
+        {
+            if (nullptr == created[i])
+            {
+                return nullptr;
+            }
+            table.characteristics[i] = created[i];
+        }
+        return table.service;
+    }
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    /** Looks up the service on a connected peer. Its characteristics are looked up by get() */
+    static NimBLERemoteService *find(NimBLEClient *pClient, ClientTable &table)
+    {
+        memset(&table, 0, sizeof(table));
+        table.service = BleDiscovery::instance().service(pClient, uuid().toNimBLE());
+        return table.service;
+    }
+#endif
+};
@@ -0,0 +1,171 @@
+#pragma once
+#include "BleRadioConfig.h"
+
+/** Times BleRadio::on() phase by phase, and the milestones since boot that matter to a
+ *  device coming back from a reset: advertising, scanning and the first connection.
+ *  Everything here is real time from micros(), which counts from boot.
+ */
+enum BleStartupPhase : uint8_t
+{
+    /** NimBLEDevice::init(), which starts the controller and host task */
+    BLE_BOOT_INIT = 0,
+    BLE_BOOT_SECURITY,
+    /** Server, services and characteristics */
+    BLE_BOOT_SERVER,
+    BLE_BOOT_ADVERTISING,
+    /** Peers remembered across a warm reset, see BleWarmRecord */
+    BLE_BOOT_RESTORE,
+    BLE_BOOT_SCAN,
+    BLE_BOOT_PHASES
+};
+inline const __FlashStringHelper *ble_startup_phase_name(uint8_t phase)
+{
+    switch (phase)
+    {
+    case BLE_BOOT_INIT:
+        return F("init");
+    case BLE_BOOT_SECURITY:
+        return F("security");
+    case BLE_BOOT_SERVER:
+        return F("server");
+    case BLE_BOOT_ADVERTISING:
+        return F("advertising");
+    case BLE_BOOT_RESTORE:
+        return F("restore");
+    case BLE_BOOT_SCAN:
+        return F("scan");
+    default:
+        return F("?");
+    }
+}
+
+struct BleStartupStats
+{
+    /** How long each phase took, in us. 0 if it didn't run */
+    uint32_t phases[BLE_BOOT_PHASES];
+    /** Since boot, in us: on() called, advertising and scanning started, the first link up.
+     *  0 until it happens
+     */
+    uint32_t onTS;
+    uint32_t advertisingTS;
+    uint32_t scanningTS;
+    uint32_t connectedTS;
+    /** Peers restored from before a warm reset */
+    uint8_t restored;
+};
+
+class BleStartup
+{
+    BleStartupStats m_stats;
+
+    /** Records the first time only; later restarts of the radio aren't boot milestones */
+    static void milestone(uint32_t &ts)
+    {
+        if (0 == ts)
+        {
+            ts = micros();
+        }
+    }
+
+public:
+    /** The one startup record, shared by both roles */
+    static BleStartup &instance()
+    {
+        static BleStartup startup;
+        return startup;
+    }
+    /** Called as on() starts. Returns the timestamp to pass to the first phase */
+    uint32_t start()
+    {
+        uint32_t now = micros();
+        memset(m_stats.phases, 0, sizeof(m_stats.phases));
+        milestone(m_stats.onTS);
+        return now;
+    }
+    /** Ends a phase that started at startTS. Returns now, for the next phase */
+    uint32_t phase(uint8_t phase, uint32_t startTS)
+    {
+        uint32_t now = micros();
+        m_stats.phases[phase] += now - startTS;
+        return now;
+    }
+    void advertising()
+    {
+        milestone(m_stats.advertisingTS);
+    }
+    void scanning()
+    {
+        milestone(m_stats.scanningTS);
+    }
+    void connected()
+    {
+        milestone(m_stats.connectedTS);
+    }
+    void restored(size_t count)
+    {
+        m_stats.restored = (uint8_t)count;
+    }
+    const BleStartupStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE startup:"));
+        for (size_t i = 0; i < BLE_BOOT_PHASES; ++i)
+        {
+            out.print(F(" "));
+            out.print(ble_startup_phase_name(i));
+            out.print(F(" "));
+            out.print(m_stats.phases[i]);
+            out.print(F("us"));
+        }
+        out.println();
+        out.print(F("BLE since boot: on() "));
+        out.print(m_stats.onTS / 1000);
+        out.print(F("ms, advertising "));
+        out.print(m_stats.advertisingTS / 1000);
+        out.print(F("ms, scanning "));
+        out.print(m_stats.scanningTS / 1000);
+        out.print(F("ms, first connection "));
+        out.print(m_stats.connectedTS / 1000);
+        out.print(F("ms, "));
+        out.print(m_stats.restored);
+        out.println(F(" peers restored"));
+    }
+};
+
+#if BLE_RADIO_CENTRAL
+#define BLE_WARM_RECORD_MAGIC 0xB1E5BA57
+/** The peers connected when the radio last changed, kept in RTC memory so a central reset
+ *  by a watchdog or panic can reconnect at once instead of waiting to scan them again.
+ *  A power on leaves RTC memory undefined, which the magic and checksum reject
+ */
+struct BleWarmRecord
+{
+    uint32_t magic;
+    uint8_t count;
+    ble_addr_t peers[NIMBLE_MAX_CONNECTIONS];
+    int8_t rssi[NIMBLE_MAX_CONNECTIONS];
+    uint32_t checksum;
+};
+static RTC_NOINIT_ATTR BleWarmRecord g_bleWarmRecord;
+
+inline uint32_t ble_warm_checksum(const BleWarmRecord &record)
+{
+    /** FNV-1a over everything before the checksum */
+    const uint8_t *p = (const uint8_t *)&record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(BleWarmRecord, checksum); ++i)
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+inline bool ble_warm_valid()
+{
+    return BLE_WARM_RECORD_MAGIC == g_bleWarmRecord.magic &&
+           g_bleWarmRecord.count <= NIMBLE_MAX_CONNECTIONS &&
+           ble_warm_checksum(g_bleWarmRecord) == g_bleWarmRecord.checksum;
+}
+#endif // BLE_RADIO_CENTRAL
@@ -0,0 +1,688 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleFrameQueue.h"
+#include "BleHistogram.h"
+#include "BleBeacon.h"
+#include "BleBatch.h"
+#if BLE_RADIO_CENTRAL
+#if BLE_TS_STDIO
+#include <stdio.h>
+#else
+#include <FS.h>
+#include <LittleFS.h>
+#endif
+
+/** An append-only log of what the central receives, kept on flash so a collector that
+ *  loses its uplink keeps its data. Records are batched in RAM and appended to segment
+ *  files; a full segment is sealed with a small index (time range, peers) that lets queries
+ *  skip it without reading it, and the oldest segment is deleted to make room.
+ *
+ *  Segment: [magic][base timestamp] then records of
+ *  [varint ms since previous record][peer][kind][varint size][data].
+ *  Peers are numbered per segment by a BLE_TS_PEER record carrying the address, so data
+ *  records spend one byte on it. Timestamps are BleClock time: install a wall clock with
+ *  BleClock::use() to make them comparable across reboots.
+ *
+ *  Storage is any fs::FS, LittleFS by default, mounted by the application. Host builds set
+ *  BLE_TS_STDIO to use plain files instead.
+ */
+#ifndef BLE_TS_SEGMENT_SIZE
+#define BLE_TS_SEGMENT_SIZE 32768
+#endif
+#ifndef BLE_TS_SEGMENTS
+/** Segments kept. The oldest is deleted when a new one would exceed this */
+#define BLE_TS_SEGMENTS 16
+#endif
+#ifndef BLE_TS_BATCH
+/** Bytes gathered in RAM before a flash write */
+#define BLE_TS_BATCH 512
+#endif
+#ifndef BLE_TS_FLUSH_MS
+/** Longest a record waits in RAM */
+#define BLE_TS_FLUSH_MS 5000
+#endif
+#ifndef BLE_TS_PEERS
+/** Distinct peers per segment. A new peer beyond this starts a new segment */
+#define BLE_TS_PEERS 32
+#endif
+#define BLE_TS_MAGIC 0x31535442
+#define BLE_TS_HEADER_SIZE 8
+/** Longest record: timestamp, peer, kind, size and a frame */
+#define BLE_TS_MAX_RECORD (5 + 1 + 1 + 2 + BLE_FRAME_MAX_SIZE)
+#define BLE_TS_PATH 48
+
+enum BleTsKind : uint8_t
+{
+    /** Numbers a peer within its segment. Never passed to queries */
+    BLE_TS_PEER = 0,
+    /** A notification from a connected peer */
+    BLE_TS_NOTIFY,
+    /** A diagnostics beacon page, see BleBeacon.h */
+    BLE_TS_BEACON
+};
+
+struct BleTsRecord
+{
+    ble_addr_t address;
+    uint32_t ts;
+    uint8_t kind;
+    const uint8_t *data;
+    size_t size;
+};
+/** Receives each record a query matches. data is only valid for the call.
+ *  Return false to end the query
+ */
+typedef bool (*BleTsVisitor)(const BleTsRecord &record, void *state);
+
+/** A segment's index, kept in RAM and written beside the segment when it is sealed */
+struct BleTsSegment
+{
+    uint32_t number;
+    uint32_t firstTS;
+    uint32_t lastTS;
+    uint32_t records;
+    uint32_t bytes;
+    /** One bit per peer address hash, so a query for a peer skips segments without it */
+    uint64_t peers;
+};
+struct BleTsStats
+{
+    uint32_t records;
+    uint32_t bytes;
+    uint32_t flushes;
+    uint32_t segments;
+    /** Segments deleted to make room */
+    uint32_t expired;
+    /** Records lost to full queues or failed writes */
+    uint32_t dropped;
+    /** Segments queries read, and those their index let them skip */
+    uint32_t scanned;
+    uint32_t skipped;
+    /** Flash write and query durations, in us */
+    BleLatencyHistogram flush;
+    BleLatencyHistogram query;
+};
+
+#if BLE_TS_STDIO
+/** stdio needs no filesystem object */
+struct BleTsFs
+{
+};
+#else
+typedef fs::FS BleTsFs;
+#endif
+
+/** The few file operations the store needs */
+class BleTsFile
+{
+#if BLE_TS_STDIO
+    FILE *m_file = nullptr;
+
+public:
+    bool open(BleTsFs &fs, const char *path, char mode)
+    {
+        (void)fs;
+        m_file = fopen(path, 'r' == mode ? "rb" : ('a' == mode ? "ab" : "wb"));
+        return nullptr != m_file;
+    }
+    size_t read(uint8_t *data, size_t size)
+    {
+        return fread(data, 1, size, m_file);
+    }
+    size_t write(const uint8_t *data, size_t size)
+    {
+        return fwrite(data, 1, size, m_file);
+    }
+    size_t size()
+    {
+        long pos = ftell(m_file);
+        fseek(m_file, 0, SEEK_END);
+        long size = ftell(m_file);
+        fseek(m_file, pos, SEEK_SET);
+        return (size_t)size;
+    }
+    void close()
+    {
+        if (nullptr != m_file)
+        {
+            fclose(m_file);
+            m_file = nullptr;
+        }
+    }
+    static bool remove(BleTsFs &fs, const char *path)
+    {
+        (void)fs;
+        return 0 == ::remove(path);
+    }
+#else
+    fs::File m_file;
+
+public:
+    bool open(BleTsFs &fs, const char *path, char mode)
+    {
+        m_file = fs.open(path, 'r' == mode ? FILE_READ : ('a' == mode ? FILE_APPEND : FILE_WRITE));
+        return (bool)m_file;
+    }
+    size_t read(uint8_t *data, size_t size)
+    {
+        return m_file.read(data, size);
+    }
+    size_t write(const uint8_t *data, size_t size)
+    {
+        return m_file.write(data, size);
+    }
+    size_t size()
+    {
+        return m_file.size();
+    }
+    void close()
+    {
+        m_file.close();
+    }
+    static bool remove(BleTsFs &fs, const char *path)
+    {
+        return fs.remove(path);
+    }
+#endif
+    ~BleTsFile()
+    {
+        close();
+    }
+};
+
+inline uint64_t ble_ts_peer_bit(const ble_addr_t &address)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(address.val); ++i)
+    {
+        hash = (hash ^ address.val[i]) * 16777619u;
+    }
+    return (uint64_t)1 << (hash & 63);
+}
+inline bool ble_ts_same(const ble_addr_t &a, const ble_addr_t &b)
+{
+    return a.type == b.type && 0 == memcmp(a.val, b.val, sizeof(a.val));
+}
+
+class BleTimeSeries
+{
+    BleTsFs *m_fs;
+    char m_dir[BLE_TS_PATH - 16];
+    /** Oldest first, the last one is being appended to */
+    BleTsSegment m_segments[BLE_TS_SEGMENTS];
+    size_t m_count;
+    uint8_t m_batch[BLE_TS_BATCH];
+    size_t m_batched;
+    /** Records in the batch, lost if it can't be written */
+    uint32_t m_batchRecords;
+    uint32_t m_flushTS;
+    uint32_t m_lastTS;
+    ble_addr_t m_peers[BLE_TS_PEERS];
+    uint8_t m_peerCount;
+    /** The segment being appended to and its peer count as far as they reached flash, to
+     *  go back to when a write fails. bytes is 0 until the header is written
+     */
+    BleTsSegment m_flushed;
+    uint8_t m_flushedPeers;
+    /** A failed write left part of a batch in the segment, so the next record starts another */
+    bool m_torn;
+    BleTsStats m_stats;
+
+    void path(uint32_t number, const char *extension, char *out) const
+    {
+        snprintf(out, BLE_TS_PATH, "%s/%08lx.%s", m_dir, (unsigned long)number, extension);
+    }
+    bool saveMeta()
+    {
+        char name[BLE_TS_PATH];
+        snprintf(name, sizeof(name), "%s/meta", m_dir);
+        uint32_t meta[2] = {m_segments[0].number, m_segments[m_count - 1].number};
+        BleTsFile file;
+        return file.open(*m_fs, name, 'w') && sizeof(meta) == file.write((const uint8_t *)meta, sizeof(meta));
+    }
+    /** Reads a segment's records in order. f(record) returns false to stop.
+     *  Fills the segment's index and peer numbering as it goes. Returns the bytes of whole
+     *  records, less than the file if its tail was torn by a reset mid write
+     */
+    template <typename F>
+    size_t read(uint32_t number, BleTsSegment *pSegment, ble_addr_t *peers, uint8_t *pPeerCount, size_t *pFileSize, F f)
+    {
+        char name[BLE_TS_PATH];
+        path(number, "seg", name);
+        memset(pSegment, 0, sizeof(BleTsSegment));
+        pSegment->number = number;
+        *pPeerCount = 0;
+        BleTsFile file;
+        if (!file.open(*m_fs, name, 'r'))
+        {
+            return 0;
+        }
+        *pFileSize = file.size();
+        uint8_t buffer[2 * BLE_TS_MAX_RECORD];
+        size_t have = file.read(buffer, sizeof(buffer));
+        if (have < BLE_TS_HEADER_SIZE || BLE_TS_MAGIC != ble_beacon_get(buffer, 4))
+        {
+            return 0;
+        }
+        uint32_t ts = ble_beacon_get(buffer + 4, 4);
+        /** An empty segment's range is its base, which later records count from */
+        pSegment->firstTS = ts;
+        pSegment->lastTS = ts;
+        size_t pos = BLE_TS_HEADER_SIZE;
+        size_t offset = 0;
+        bool eof = false;
+        while (true)
+        {
+            if (!eof && have - pos < BLE_TS_MAX_RECORD)
+            {
+                memmove(buffer, buffer + pos, have - pos);
+                offset += pos;
+                have -= pos;
+                pos = 0;
+                size_t got = file.read(buffer + have, sizeof(buffer) - have);
+                have += got;
+                eof = 0 == got;
+            }
+            const uint8_t *end = buffer + have;
+            uint32_t delta = 0;
+            uint32_t size = 0;
+            size_t at = pos;
+            size_t used = ble_get_varint(buffer + at, end, &delta);
+            if (0 == used || at + used + 2 > have)
+            {
+                break;
+            }
+            at += used;
+            uint8_t peer = buffer[at++];
+            uint8_t kind = buffer[at++];
+            used = ble_get_varint(buffer + at, end, &size);
+            if (0 == used || at + used + size > have)
+            {
+                break;
+            }
+            at += used;
+            ts += delta;
+            BleTsRecord record;
+            record.ts = ts;
+            record.kind = kind;
+            record.data = buffer + at;
+            record.size = size;
+            pos = at + size;
+            if (BLE_TS_PEER == kind)
+            {
+                if (sizeof(ble_addr_t) == size && peer == *pPeerCount && *pPeerCount < BLE_TS_PEERS)
+                {
+                    peers[*pPeerCount].type = record.data[0];
+                    memcpy(peers[*pPeerCount].val, record.data + 1, sizeof(peers[0].val));
+                    pSegment->peers |= ble_ts_peer_bit(peers[*pPeerCount]);
+                    ++*pPeerCount;
+                }
+                continue;
+            }
+            if (peer >= *pPeerCount)
+            {
+                continue;
+            }
+            record.address = peers[peer];
+            if (0 == pSegment->records)
+            {
+                pSegment->firstTS = ts;
+            }
+            pSegment->lastTS = ts;
+            ++pSegment->records;
+            if (!f(record))
+            {
+                break;
+            }
+        }
+        pSegment->bytes = offset + pos;
+        return pSegment->bytes;
+    }
+    /** Seals the segment being appended to and starts the next, deleting the oldest if full */
+    bool roll(uint32_t now)
+    {
+        if (!flush(now))
+        {
+            return false;
+        }
+        char name[BLE_TS_PATH];
+        uint32_t number = 0;
+        if (m_count)
+        {
+            const BleTsSegment &last = m_segments[m_count - 1];
+            number = last.number + 1;
+            path(last.number, "idx", name);
+            BleTsFile file;
+            if (file.open(*m_fs, name, 'w'))
+            {
+                file.write((const uint8_t *)&last, sizeof(last));
+            }
+        }
+        if (BLE_TS_SEGMENTS == m_count)
+        {
+            path(m_segments[0].number, "seg", name);
+            BleTsFile::remove(*m_fs, name);
+            path(m_segments[0].number, "idx", name);
+            BleTsFile::remove(*m_fs, name);
+            memmove(m_segments, m_segments + 1, sizeof(BleTsSegment) * (BLE_TS_SEGMENTS - 1));
+            --m_count;
+            ++m_stats.expired;
+        }
+        BleTsSegment &segment = m_segments[m_count++];
+        segment.number = number;
+        restart(segment, now);
+        ++m_stats.segments;
+        return saveMeta();
+    }
+    /** Empties the segment being appended to and queues its header */
+    void restart(BleTsSegment &segment, uint32_t now)
+    {
+        uint32_t number = segment.number;
+        memset(&segment, 0, sizeof(segment));
+        segment.number = number;
+        segment.firstTS = now;
+        segment.lastTS = now;
+        segment.bytes = BLE_TS_HEADER_SIZE;
+        /** A leftover file of that number goes, from before the meta file was written or
+         *  a header that failed to
+         */
+        char name[BLE_TS_PATH];
+        path(number, "seg", name);
+        BleTsFile::remove(*m_fs, name);
+        ble_beacon_put(m_batch, BLE_TS_MAGIC, 4);
+        ble_beacon_put(m_batch + 4, now, 4);
+        m_batched = BLE_TS_HEADER_SIZE;
+        m_lastTS = now;
+        m_peerCount = 0;
+        m_flushed = segment;
+        m_flushed.bytes = 0;
+        m_flushedPeers = 0;
+        m_torn = false;
+    }
+    /** The peer's number in this segment, or -1 if the segment has no room for another */
+    int peer(const ble_addr_t &address)
+    {
+        for (uint8_t i = 0; i < m_peerCount; ++i)
+        {
+            if (ble_ts_same(m_peers[i], address))
+            {
+                return i;
+            }
+        }
+        return m_peerCount < BLE_TS_PEERS ? m_peerCount : -1;
+    }
+    void put(uint8_t peer, uint8_t kind, const uint8_t *data, size_t size, uint32_t now)
+    {
+        BleTsSegment &segment = m_segments[m_count - 1];
+        uint8_t *p = m_batch + m_batched;
+        size_t used = ble_put_varint(p, (int32_t)(now - m_lastTS) > 0 ? now - m_lastTS : 0);
+        p[used++] = peer;
+        p[used++] = kind;
+        used += ble_put_varint(p + used, (uint32_t)size);
+        memcpy(p + used, data, size);
+        used += size;
+        m_batched += used;
+        segment.bytes += used;
+        if ((int32_t)(now - m_lastTS) > 0)
+        {
+            m_lastTS = now;
+        }
+        if (BLE_TS_PEER == kind)
+        {
+            return;
+        }
+        if (0 == segment.records)
+        {
+            segment.firstTS = m_lastTS;
+        }
+        segment.lastTS = m_lastTS;
+        segment.peers |= ble_ts_peer_bit(m_peers[peer]);
+        ++segment.records;
+        ++m_batchRecords;
+        ++m_stats.records;
+        m_stats.bytes += used;
+    }
+
+public:
+    BleTimeSeries() : m_fs(nullptr)
+    {
+    }
+    /** Opens the store in dir, which must exist, picking up the segments already there.
+     *  The filesystem must be mounted. Returns false if the store can't be written
+     */
+    bool begin(BleTsFs &fs, const char *dir)
+    {
+        m_fs = nullptr;
+        memset(&m_stats, 0, sizeof(m_stats));
+        snprintf(m_dir, sizeof(m_dir), "%s", dir);
+        m_count = 0;
+        m_batched = 0;
+        m_batchRecords = 0;
+        m_peerCount = 0;
+        m_torn = false;
+        m_flushTS = BleClock::now();
+        m_fs = &fs;
+        char name[BLE_TS_PATH];
+        snprintf(name, sizeof(name), "%s/meta", m_dir);
+        uint32_t meta[2];
+        BleTsFile file;
+        if (!file.open(fs, name, 'r') || sizeof(meta) != file.read((uint8_t *)meta, sizeof(meta)) || meta[1] < meta[0])
+        {
+            return roll(BleClock::now());
+        }
+        file.close();
+        /** Keep the newest if there are more than this build keeps */
+        uint32_t first = meta[1] - meta[0] >= BLE_TS_SEGMENTS ? meta[1] - BLE_TS_SEGMENTS + 1 : meta[0];
+        bool torn = false;
+        for (uint32_t number = first; number <= meta[1]; ++number)
+        {
+            BleTsSegment &segment = m_segments[m_count];
+            path(number, "idx", name);
+            if (number != meta[1] && file.open(fs, name, 'r') &&
+                sizeof(segment) == file.read((uint8_t *)&segment, sizeof(segment)) && number == segment.number)
+            {
+                file.close();
+                ++m_count;
+                continue;
+            }
+            file.close();
+            /** The segment being appended to, or one whose index wasn't written */
+            size_t fileSize = 0;
+            size_t valid = read(number, &segment, m_peers, &m_peerCount, &fileSize, [](const BleTsRecord &)
+                                { return true; });
+            if (0 == valid)
+            {
+                continue;
+            }
+            ++m_count;
+            m_lastTS = segment.lastTS;
+            torn = valid != fileSize;
+        }
+        /** Appending after a torn record would misalign everything after it */
+        if (0 == m_count || torn || m_segments[m_count - 1].number != meta[1])
+        {
+            return roll(BleClock::now());
+        }
+        m_flushed = m_segments[m_count - 1];
+        m_flushedPeers = m_peerCount;
+        return true;
+    }
+    bool enabled() const
+    {
+        return nullptr != m_fs;
+    }
+    /** Logs a record. It reaches flash within BLE_TS_FLUSH_MS or when the batch fills */
+    bool append(const NimBLEAddress &address, uint8_t kind, const uint8_t *data, size_t size, uint32_t now)
+    {
+        if (nullptr == m_fs || BLE_TS_PEER == kind || size > BLE_FRAME_MAX_SIZE)
+        {
+            return false;
+        }
+        ble_addr_t addr;
+        addr.type = address.getType();
+        memcpy(addr.val, address.getNative(), sizeof(addr.val));
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            int index = peer(addr);
+            size_t needed = BLE_TS_MAX_RECORD - BLE_FRAME_MAX_SIZE + size;
+            if (index == m_peerCount)
+            {
+                needed += BLE_TS_MAX_RECORD - BLE_FRAME_MAX_SIZE + sizeof(ble_addr_t);
+            }
+            if (0 > index || m_torn || m_segments[m_count - 1].bytes + needed > BLE_TS_SEGMENT_SIZE)
+            {
+                if (0 == pass && roll(now))
+                {
+                    continue;
+                }
+                ++m_stats.dropped;
+                return false;
+            }
+            if (m_batched + needed > BLE_TS_BATCH)
+            {
+                flush(now);
+            }
+            if (index == m_peerCount)
+            {
+                uint8_t entry[sizeof(ble_addr_t)];
+                entry[0] = addr.type;
+                memcpy(entry + 1, addr.val, sizeof(addr.val));
+                m_peers[m_peerCount++] = addr;
+                put((uint8_t)index, BLE_TS_PEER, entry, sizeof(entry), now);
+            }
+            put((uint8_t)index, kind, data, size, now);
+            return true;
+        }
+        return false;
+    }
+    /** Writes the batch to flash */
+    bool flush(uint32_t now)
+    {
+        m_flushTS = now;
+        if (0 == m_batched)
+        {
+            return true;
+        }
+        uint32_t startTS = micros();
+        char name[BLE_TS_PATH];
+        path(m_segments[m_count - 1].number, "seg", name);
+        BleTsFile file;
+        size_t wrote = file.open(*m_fs, name, 'a') ? file.write(m_batch, m_batched) : 0;
+        file.close();
+        m_stats.flush.record(micros() - startTS);
+        ++m_stats.flushes;
+        bool written = m_batched == wrote;
+        m_batched = 0;
+        BleTsSegment &segment = m_segments[m_count - 1];
+        if (written)
+        {
+            m_batchRecords = 0;
+            m_flushed = segment;
+            m_flushedPeers = m_peerCount;
+            return true;
+        }
+        m_stats.dropped += m_batchRecords;
+        m_batchRecords = 0;
+        /** Later records would name peers the lost batch numbered, so the segment goes back
+         *  to what is on flash
+         */
+        if (0 == m_flushed.bytes)
+        {
+            restart(segment, now);
+            return false;
+        }
+        segment = m_flushed;
+        m_peerCount = m_flushedPeers;
+        m_lastTS = segment.lastTS;
+        m_torn = 0 != wrote;
+        return false;
+    }
+    /** Flushes a batch that has waited BLE_TS_FLUSH_MS */
+    void update(uint32_t now)
+    {
+        if (nullptr != m_fs && m_batched && BLE_TS_FLUSH_MS <= now - m_flushTS)
+        {
+            flush(now);
+        }
+    }
+    /** Calls visitor for each record from fromTS to toTS inclusive, oldest first, from one
+     *  peer or all of them if pPeer is null. Returns the number of records visited
+     */
+    size_t query(const NimBLEAddress *pPeer, uint32_t fromTS, uint32_t toTS, BleTsVisitor visitor, void *state)
+    {
+        if (nullptr == m_fs)
+        {
+            return 0;
+        }
+        flush(BleClock::now());
+        uint32_t startTS = micros();
+        ble_addr_t addr;
+        uint64_t bit = ~(uint64_t)0;
+        if (nullptr != pPeer)
+        {
+            addr.type = pPeer->getType();
+            memcpy(addr.val, pPeer->getNative(), sizeof(addr.val));
+            bit = ble_ts_peer_bit(addr);
+        }
+        size_t visited = 0;
+        bool more = true;
+        for (size_t i = 0; i < m_count && more; ++i)
+        {
+            const BleTsSegment &segment = m_segments[i];
+            if (0 == segment.records || segment.lastTS < fromTS || segment.firstTS > toTS || 0 == (segment.peers & bit))
+            {
+                ++m_stats.skipped;
+                continue;
+            }
+            ++m_stats.scanned;
+            BleTsSegment scanned;
+            ble_addr_t peers[BLE_TS_PEERS];
+            uint8_t peerCount;
+            size_t fileSize;
+            read(segment.number, &scanned, peers, &peerCount, &fileSize, [&](const BleTsRecord &record)
+                 {
+                     if (record.ts > toTS)
+                     {
+                         return false;
+                     }
+                     if (record.ts < fromTS || (nullptr != pPeer && !ble_ts_same(record.address, addr)))
+                     {
+                         return true;
+                     }
+                     ++visited;
+                     more = visitor(record, state);
+                     return more; });
+        }
+        m_stats.query.record(micros() - startTS);
+        return visited;
+    }
+    const BleTsStats &stats() const
+    {
+        return m_stats;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE store: "));
+        out.print(m_stats.records);
+        out.print(F(" records, "));
+        out.print(m_stats.bytes);
+        out.print(F(" bytes in "));
+        out.print(m_stats.flushes);
+        out.print(F(" writes, "));
+        out.print(m_count);
+        out.print(F(" segments ("));
+        out.print(m_stats.expired);
+        out.print(F(" expired), "));
+        out.print(m_stats.dropped);
+        out.println(F(" dropped"));
+        out.print(F("BLE store writes: "));
+        m_stats.flush.report(out, F("us"));
+        out.print(F("BLE store queries: "));
+        m_stats.query.report(out, F("us"));
+        out.print(F("  segments read "));
+        out.print(m_stats.scanned);
+        out.print(F(", skipped by index "));
+        out.println(m_stats.skipped);
+    }
+};
+#endif // BLE_RADIO_CENTRAL
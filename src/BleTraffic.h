@@ -0,0 +1,555 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleFrameQueue.h"
+#include "BleHistogram.h"
+#include "BleEnergy.h"
+
+/** Schedules everything the radio sends, both roles and every connection, so a bulk
+ *  transfer can't hold up a control message behind it. Frames are queued per connection
+ *  and traffic class and go out from update(), at most BLE_QOS_BURST per call:
+ *  - control is served first, always;
+ *  - otherwise a class whose oldest frame has waited past its latency budget goes next,
+ *    then the higher class;
+ *  - within a class, connections share by deficit round robin in bytes, weighted per
+ *    connection.
+ *  Queueing delay is measured per class against its budget. A frame the stack refuses
+ *  BLE_QOS_ATTEMPTS times is dropped, and whoever queued it can ask to be told.
+ *
+ *  Queue from the loop task only. The host task answers directly where it must.
+ */
+#ifndef BLE_QOS_QUEUE_SIZE
+/** Frames queued across all connections and classes */
+#define BLE_QOS_QUEUE_SIZE 16
+#endif
+#ifndef BLE_QOS_RESERVED
+/** Free frames bulk traffic can't take, so a dump can't crowd control out of the queue.
+ *  Interactive traffic leaves half as many
+ */
+#define BLE_QOS_RESERVED 4
+#endif
+#ifndef BLE_QOS_BURST
+/** Frames handed to the stack per update(); more would only run it out of buffers */
+#define BLE_QOS_BURST 8
+#endif
+#ifndef BLE_QOS_ATTEMPTS
+/** Tries to hand a frame to the stack before it is dropped */
+#define BLE_QOS_ATTEMPTS 3
+#endif
+#ifndef BLE_QOS_CONTROL_BUDGET_MS
+#define BLE_QOS_CONTROL_BUDGET_MS 20
+#endif
+#ifndef BLE_QOS_INTERACTIVE_BUDGET_MS
+#define BLE_QOS_INTERACTIVE_BUDGET_MS 100
+#endif
+#ifndef BLE_QOS_BULK_BUDGET_MS
+#define BLE_QOS_BULK_BUDGET_MS 2000
+#endif
+#define BLE_QOS_NONE 0xFF
+
+enum BleTrafficClass : uint8_t
+{
+    /** Configuration, liveness probes: small and urgent */
+    BLE_QOS_CONTROL = 0,
+    /** RPC and bound values someone is waiting on */
+    BLE_QOS_INTERACTIVE,
+    /** Sample frames and anything else that can wait */
+    BLE_QOS_BULK,
+    BLE_QOS_CLASSES
+};
+inline const __FlashStringHelper *ble_traffic_class_name(uint8_t cls)
+{
+    switch (cls)
+    {
+    case BLE_QOS_CONTROL:
+        return F("control");
+    case BLE_QOS_INTERACTIVE:
+        return F("interactive");
+    case BLE_QOS_BULK:
+        return F("bulk");
+    default:
+        return F("?");
+    }
+}
+inline uint32_t ble_traffic_budget_ms(uint8_t cls)
+{
+    switch (cls)
+    {
+    case BLE_QOS_CONTROL:
+        return BLE_QOS_CONTROL_BUDGET_MS;
+    case BLE_QOS_INTERACTIVE:
+        return BLE_QOS_INTERACTIVE_BUDGET_MS;
+    default:
+        return BLE_QOS_BULK_BUDGET_MS;
+    }
+}
+
+/** Hands a frame to the stack for conn. target is what the frame was queued with, and
+ *  data nothing for frames queued by reference. Returns false if the stack didn't take it
+ */
+typedef bool (*BleTrafficSend)(uint16_t conn, void *target, const uint8_t *data, size_t size);
+/** Tells whoever queued a frame for conn that it was dropped without going out: the stack
+ *  kept refusing it, or the connection went. state is what it was queued with. Runs from
+ *  update() or disconnected(); don't queue from it
+ */
+typedef void (*BleTrafficDropped)(uint16_t conn, void *state);
+
+#if BLE_RADIO_PERIPHERAL
+/** Notifies the NimBLECharacteristic target to conn only */
+inline bool ble_traffic_notify(uint16_t conn, void *target, const uint8_t *data, size_t size)
+{
+    os_mbuf *om = ble_hs_mbuf_from_flat(data, (uint16_t)size);
+    if (nullptr == om || 0 != ble_gattc_notify_custom(conn, ((NimBLECharacteristic *)target)->getHandle(), om))
+    {
+        return false;
+    }
+    BleEnergy::instance().transferred(conn, size, true);
+    return true;
+}
+#endif
+#if BLE_RADIO_CENTRAL
+/** Writes the NimBLERemoteCharacteristic target without response */
+inline bool ble_traffic_write(uint16_t conn, void *target, const uint8_t *data, size_t size)
+{
+    if (!((NimBLERemoteCharacteristic *)target)->writeValue(data, size, false))
+    {
+        return false;
+    }
+    BleEnergy::instance().transferred(conn, size, true);
+    return true;
+}
+/** Writes the NimBLERemoteCharacteristic target with response, without waiting for it, so
+ *  the loop doesn't stall a round trip per frame. A write the peer refuses shows where the
+ *  frame is confirmed, e.g. as a configuration delta that is never acked
+ */
+inline bool ble_traffic_write_response(uint16_t conn, void *target, const uint8_t *data, size_t size)
+{
+    uint16_t handle = ((NimBLERemoteCharacteristic *)target)->getHandle();
+    if (0 != ble_gattc_write_flat(conn, handle, data, (uint16_t)size, nullptr, nullptr))
+    {
+        return false;
+    }
+    BleEnergy::instance().transferred(conn, size, true);
+    return true;
+}
+#endif
+
+struct BleTrafficClassStats
+{
+    uint32_t queued;
+    uint32_t sent;
+    /** Refused because the queue was full */
+    uint32_t rejected;
+    /** Queued, but the stack wouldn't take them or their connection went first */
+    uint32_t dropped;
+    /** Sent after waiting longer than the class budget */
+    uint32_t overBudget;
+    /** Times the class went ahead of a higher one because it was over budget */
+    uint32_t promoted;
+    /** From queueing to the stack taking the frame, in us */
+    BleLatencyHistogram delay;
+};
+
+class BleTraffic
+{
+    struct Frame
+    {
+        BleTrafficSend send;
+        void *target;
+        BleTrafficDropped dropped;
+        void *state;
+        uint32_t queuedTS;
+        uint16_t conn;
+        uint16_t size;
+        uint8_t attempts;
+        uint8_t next;
+        uint8_t data[BLE_FRAME_MAX_SIZE];
+    };
+    /** A connection's queues, one per class */
+    struct Link
+    {
+        uint16_t conn;
+        uint8_t weight;
+        /** The stack refused a frame for it this update() */
+        bool blocked;
+        uint8_t head[BLE_QOS_CLASSES];
+        uint8_t tail[BLE_QOS_CLASSES];
+        int32_t deficit[BLE_QOS_CLASSES];
+    };
+    Frame m_frames[BLE_QOS_QUEUE_SIZE];
+    uint8_t m_free;
+    uint8_t m_freeCount;
+    Link m_links[NIMBLE_MAX_CONNECTIONS];
+    /** Where each class's round robin resumes */
+    uint8_t m_turn[BLE_QOS_CLASSES];
+    BleTrafficClassStats m_stats[BLE_QOS_CLASSES];
+
+    static bool idle(const Link &link)
+    {
+        for (size_t c = 0; c < BLE_QOS_CLASSES; ++c)
+        {
+            if (BLE_QOS_NONE != link.head[c])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    static void clear(Link &link, uint16_t conn)
+    {
+        link.conn = conn;
+        link.weight = 1;
+        link.blocked = false;
+        for (size_t c = 0; c < BLE_QOS_CLASSES; ++c)
+        {
+            link.head[c] = BLE_QOS_NONE;
+            link.tail[c] = BLE_QOS_NONE;
+            link.deficit[c] = 0;
+        }
+    }
+    /** Finds conn's link, or takes a free one for it, or an idle one whose connection went
+     *  unannounced. A live connection keeps its link, and its weight, until disconnected()
+     */
+    Link *link(uint16_t conn, bool create)
+    {
+        Link *pFree = nullptr;
+        Link *pIdle = nullptr;
+        ble_gap_conn_desc desc;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            Link &entry = m_links[i];
+            if (entry.conn == conn)
+            {
+                return &entry;
+            }
+            if (BLE_HS_CONN_HANDLE_NONE == entry.conn)
+            {
+                pFree = (nullptr == pFree) ? &entry : pFree;
+            }
+            else if (nullptr == pIdle && idle(entry) && 0 != ble_gap_conn_find(entry.conn, &desc))
+            {
+                pIdle = &entry;
+            }
+        }
+        Link *pSpare = (nullptr != pFree) ? pFree : pIdle;
+        if (create && nullptr != pSpare)
+        {
+            clear(*pSpare, conn);
+            return pSpare;
+        }
+        return nullptr;
+    }
+    /** How long the oldest frame of a class has waited, in us, on links not blocked. -1 if
+     *  there is none
+     */
+    int32_t oldest(uint8_t cls, uint32_t now) const
+    {
+        int32_t result = -1;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            uint8_t head = m_links[i].head[cls];
+            if (BLE_QOS_NONE != head && !m_links[i].blocked && (int32_t)(now - m_frames[head].queuedTS) > result)
+            {
+                result = (int32_t)(now - m_frames[head].queuedTS);
+            }
+        }
+        return result;
+    }
+    /** Control first, then any class over budget, then the highest with frames queued */
+    int pick(uint32_t now)
+    {
+        int32_t waited[BLE_QOS_CLASSES];
+        int first = -1;
+        for (size_t c = 0; c < BLE_QOS_CLASSES; ++c)
+        {
+            waited[c] = oldest(c, now);
+            if (first < 0 && waited[c] >= 0)
+            {
+                first = (int)c;
+            }
+        }
+        if (first <= BLE_QOS_CONTROL)
+        {
+            return first;
+        }
+        for (size_t c = first + 1; c < BLE_QOS_CLASSES; ++c)
+        {
+            if (waited[c] >= (int32_t)(ble_traffic_budget_ms(c) * 1000))
+            {
+                ++m_stats[c].promoted;
+                return (int)c;
+            }
+        }
+        return first;
+    }
+    /** The next link of a class to send from, by deficit round robin. Blocked links are
+     *  passed over without credit
+     */
+    Link *next(uint8_t cls)
+    {
+        while (true)
+        {
+            Link &entry = m_links[m_turn[cls]];
+            uint8_t head = entry.head[cls];
+            if (BLE_QOS_NONE != head && !entry.blocked)
+            {
+                if (entry.deficit[cls] >= (int32_t)m_frames[head].size)
+                {
+                    return &entry;
+                }
+                entry.deficit[cls] += (int32_t)entry.weight * BLE_FRAME_MAX_SIZE;
+            }
+            m_turn[cls] = (m_turn[cls] + 1) % NIMBLE_MAX_CONNECTIONS;
+        }
+    }
+    void pop(Link &entry, uint8_t cls)
+    {
+        uint8_t index = entry.head[cls];
+        entry.head[cls] = m_frames[index].next;
+        if (BLE_QOS_NONE == entry.head[cls])
+        {
+            entry.tail[cls] = BLE_QOS_NONE;
+            /** An emptied queue doesn't bank credit for later */
+            entry.deficit[cls] = 0;
+        }
+        m_frames[index].next = m_free;
+        m_free = index;
+        ++m_freeCount;
+    }
+    /** Drops the frame at the head of a link's queue and tells whoever queued it */
+    void drop(Link &entry, uint8_t cls)
+    {
+        const Frame &frame = m_frames[entry.head[cls]];
+        BleTrafficDropped dropped = frame.dropped;
+        void *state = frame.state;
+        uint16_t conn = frame.conn;
+        ++m_stats[cls].dropped;
+        pop(entry, cls);
+        if (nullptr != dropped)
+        {
+            dropped(conn, state);
+        }
+    }
+    /** Takes a free frame and appends it to conn's queue for cls, all but its data */
+    Frame *enqueue(uint16_t conn, uint8_t cls, BleTrafficSend send, void *target, size_t size, BleTrafficDropped dropped, void *state)
+    {
+        if (cls >= BLE_QOS_CLASSES)
+        {
+            cls = BLE_QOS_BULK;
+        }
+        Link *pLink = (size <= BLE_FRAME_MAX_SIZE && m_freeCount > reserved(cls)) ? link(conn, true) : nullptr;
+        if (nullptr == pLink)
+        {
+            ++m_stats[cls].rejected;
+            return nullptr;
+        }
+        uint8_t index = m_free;
+        Frame &frame = m_frames[index];
+        m_free = frame.next;
+        --m_freeCount;
+        frame.send = send;
+        frame.target = target;
+        frame.dropped = dropped;
+        frame.state = state;
+        frame.queuedTS = micros();
+        frame.conn = conn;
+        frame.size = (uint16_t)size;
+        frame.attempts = 0;
+        frame.next = BLE_QOS_NONE;
+        if (BLE_QOS_NONE == pLink->tail[cls])
+        {
+            pLink->head[cls] = index;
+        }
+        else
+        {
+            m_frames[pLink->tail[cls]].next = index;
+        }
+        pLink->tail[cls] = index;
+        ++m_stats[cls].queued;
+        return &frame;
+    }
+    /** Free frames a class has to leave for the ones above it */
+    static uint8_t reserved(uint8_t cls)
+    {
+        return BLE_QOS_BULK == cls ? BLE_QOS_RESERVED : (BLE_QOS_INTERACTIVE == cls ? BLE_QOS_RESERVED / 2 : 0);
+    }
+
+public:
+    /** The one scheduler, shared by both roles */
+    static BleTraffic &instance()
+    {
+        static BleTraffic traffic;
+        return traffic;
+    }
+    void begin()
+    {
+        for (size_t i = 0; i < BLE_QOS_QUEUE_SIZE; ++i)
+        {
+            m_frames[i].next = (i + 1 < BLE_QOS_QUEUE_SIZE) ? (uint8_t)(i + 1) : BLE_QOS_NONE;
+        }
+        m_free = 0;
+        m_freeCount = BLE_QOS_QUEUE_SIZE;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            clear(m_links[i], BLE_HS_CONN_HANDLE_NONE);
+        }
+        memset(m_turn, 0, sizeof(m_turn));
+        memset(m_stats, 0, sizeof(m_stats));
+    }
+    /** Queues a copy of a frame for conn. dropped, if set, is called should it never go
+     *  out. Returns false if it is too large or the queue is full for its class
+     */
+    bool send(uint16_t conn, uint8_t cls, BleTrafficSend send, void *target, const uint8_t *data, size_t size,
+              BleTrafficDropped dropped = nullptr, void *state = nullptr)
+    {
+        Frame *pFrame = enqueue(conn, cls, send, target, size, dropped, state);
+        if (nullptr == pFrame)
+        {
+            return false;
+        }
+        memcpy(pFrame->data, data, size);
+        return true;
+    }
+    /** Queues a frame by reference: send builds it from target when it goes out, so nothing
+     *  is copied now and what goes is current then. size is what it is expected to take.
+     *  While one for the same send and target is still waiting, there is nothing to queue
+     */
+    bool queue(uint16_t conn, uint8_t cls, BleTrafficSend send, void *target, size_t size,
+               BleTrafficDropped dropped = nullptr, void *state = nullptr)
+    {
+        cls = cls < BLE_QOS_CLASSES ? cls : (uint8_t)BLE_QOS_BULK;
+        Link *pLink = link(conn, false);
+        for (uint8_t index = (nullptr != pLink) ? pLink->head[cls] : BLE_QOS_NONE; BLE_QOS_NONE != index; index = m_frames[index].next)
+        {
+            if (m_frames[index].send == send && m_frames[index].target == target)
+            {
+                return true;
+            }
+        }
+        return nullptr != enqueue(conn, cls, send, target, size, dropped, state);
+    }
+    /** A connection's share of each class against the others, 1 by default. Lasts until
+     *  disconnected(), however long the connection has nothing queued
+     */
+    bool weight(uint16_t conn, uint8_t weight)
+    {
+        Link *pLink = link(conn, true);
+        if (nullptr == pLink || 0 == weight)
+        {
+            return false;
+        }
+        pLink->weight = weight;
+        return true;
+    }
+    /** Drops what was queued for a connection that has gone. Frames for a connection that
+     *  goes unannounced are dropped as they come up
+     */
+    void disconnected(uint16_t conn)
+    {
+        Link *pLink = link(conn, false);
+        if (nullptr == pLink)
+        {
+            return;
+        }
+        for (uint8_t c = 0; c < BLE_QOS_CLASSES; ++c)
+        {
+            while (BLE_QOS_NONE != pLink->head[c])
+            {
+                drop(*pLink, c);
+            }
+        }
+        clear(*pLink, BLE_HS_CONN_HANDLE_NONE);
+    }
+    /** Frames of a class waiting */
+    size_t queued(uint8_t cls) const
+    {
+        size_t result = 0;
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            for (uint8_t index = m_links[i].head[cls]; BLE_QOS_NONE != index; index = m_frames[index].next)
+            {
+                ++result;
+            }
+        }
+        return result;
+    }
+    /** Hands up to BLE_QOS_BURST frames to the stack. A link whose frame the stack refuses
+     *  waits for the next update() while the others go on. Returns how many it took
+     */
+    size_t update()
+    {
+        for (size_t i = 0; i < NIMBLE_MAX_CONNECTIONS; ++i)
+        {
+            m_links[i].blocked = false;
+        }
+        size_t sent = 0;
+        while (sent < BLE_QOS_BURST)
+        {
+            uint32_t now = micros();
+            int cls = pick(now);
+            if (cls < 0)
+            {
+                break;
+            }
+            Link *pLink = next((uint8_t)cls);
+            Frame &frame = m_frames[pLink->head[cls]];
+            BleTrafficClassStats &stats = m_stats[cls];
+            ble_gap_conn_desc desc;
+            if (0 != ble_gap_conn_find(frame.conn, &desc))
+            {
+                /** The connection went before its frames did */
+                drop(*pLink, (uint8_t)cls);
+                continue;
+            }
+            if (!frame.send(frame.conn, frame.target, frame.data, frame.size))
+            {
+                /** Most likely out of buffers for this connection */
+                pLink->blocked = true;
+                if (++frame.attempts >= BLE_QOS_ATTEMPTS)
+                {
+                    drop(*pLink, (uint8_t)cls);
+                }
+                continue;
+            }
+            uint32_t delay = micros() - frame.queuedTS;
+            stats.delay.record(delay);
+            if (delay > ble_traffic_budget_ms(cls) * 1000)
+            {
+                ++stats.overBudget;
+            }
+            ++stats.sent;
+            pLink->deficit[cls] -= frame.size;
+            pop(*pLink, (uint8_t)cls);
+            ++sent;
+        }
+        return sent;
+    }
+    const BleTrafficClassStats &stats(uint8_t cls) const
+    {
+        return m_stats[cls];
+    }
+    void report(Print &out)
+    {
+        for (size_t c = 0; c < BLE_QOS_CLASSES; ++c)
+        {
+            const BleTrafficClassStats &stats = m_stats[c];
+            out.print(F("BLE traffic "));
+            out.print(ble_traffic_class_name(c));
+            out.print(F(": "));
+            out.print(stats.sent);
+            out.print(F(" sent, "));
+            out.print(queued(c));
+            out.print(F(" queued, "));
+            out.print(stats.rejected);
+            out.print(F(" rejected, "));
+            out.print(stats.dropped);
+            out.print(F(" dropped, "));
+            out.print(stats.overBudget);
+            out.print(F(" over "));
+            out.print(ble_traffic_budget_ms(c));
+            out.print(F("ms budget, "));
+            out.print(stats.promoted);
+            out.print(F(" promoted, delay "));
+            stats.delay.report(out, F("us"));
+        }
+    }
+};
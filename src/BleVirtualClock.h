@@ -0,0 +1,179 @@
+#pragma once
+#include "BleClock.h"
+
+/** A discrete-event simulation clock. Time only moves when run() jumps to the next
+ *  scheduled event, so hours of timer driven behaviour complete as fast as the events
+ *  can be processed. Events due at the same time fire in the order they were scheduled,
+ *  and random() is seeded, so a run is repeatable.
+ *
+ *  Drive BleRadio::update() from an every() event and install() the clock so BleClock
+ *  reads virtual time.
+ */
+#ifndef BLE_SIM_MAX_EVENTS
+#define BLE_SIM_MAX_EVENTS 64
+#endif
+
+/** Runs a scheduled event. Return a period in ms to fire again after it, or 0 to stop */
+typedef uint32_t (*BleSimEvent)(uint32_t now, void *state);
+
+class BleVirtualClock
+{
+    struct Event
+    {
+        uint32_t time;
+        /** Breaks ties between events due at the same time */
+        uint32_t order;
+        BleSimEvent event;
+        void *state;
+    };
+    /** Binary min-heap on (time, order) */
+    Event m_events[BLE_SIM_MAX_EVENTS];
+    size_t m_count;
+    uint32_t m_now;
+    uint32_t m_order;
+    uint32_t m_random;
+    uint32_t m_fired;
+
+    static uint32_t read(void *state)
+    {
+        return ((BleVirtualClock *)state)->m_now;
+    }
+    bool before(size_t lhs, size_t rhs) const
+    {
+        /** Wrapping compare so a run may cross the 49 day rollover */
+        int32_t delta = (int32_t)(m_events[lhs].time - m_events[rhs].time);
+        return delta < 0 || (0 == delta && (int32_t)(m_events[lhs].order - m_events[rhs].order) < 0);
+    }
+    void swap(size_t lhs, size_t rhs)
+    {
+        Event event = m_events[lhs];
+        m_events[lhs] = m_events[rhs];
+        m_events[rhs] = event;
+    }
+    void push(uint32_t time, BleSimEvent event, void *state)
+    {
+        size_t i = m_count++;
+        m_events[i].time = time;
+        m_events[i].order = m_order++;
+        m_events[i].event = event;
+        m_events[i].state = state;
+        while (i > 0 && before(i, (i - 1) / 2))
+        {
+            swap(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+    void pop()
+    {
+        m_events[0] = m_events[--m_count];
+        size_t i = 0;
+        while (true)
+        {
+            size_t smallest = i;
+            size_t left = i * 2 + 1;
+            size_t right = left + 1;
+            if (left < m_count && before(left, smallest))
+            {
+                smallest = left;
+            }
+            if (right < m_count && before(right, smallest))
+            {
+                smallest = right;
+            }
+            if (smallest == i)
+            {
+                return;
+            }
+            swap(i, smallest);
+            i = smallest;
+        }
+    }
+
+public:
+    void begin(uint32_t seed, uint32_t start = 0)
+    {
+        m_count = 0;
+        m_now = start;
+        m_order = 0;
+        /** xorshift never leaves 0 */
+        m_random = seed ? seed : 0x9E3779B9;
+        m_fired = 0;
+    }
+    /** Makes BleClock read this clock */
+    void install()
+    {
+        BleClock::use(read, this);
+    }
+    void uninstall()
+    {
+        BleClock::use(nullptr);
+    }
+    uint32_t now() const
+    {
+        return m_now;
+    }
+    /** Events run so far */
+    uint32_t fired() const
+    {
+        return m_fired;
+    }
+    size_t pending() const
+    {
+        return m_count;
+    }
+    /** Schedules an event delay ms from now. Returns false if the queue is full */
+    bool after(uint32_t delay, BleSimEvent event, void *state = nullptr)
+    {
+        if (m_count >= BLE_SIM_MAX_EVENTS)
+        {
+            return false;
+        }
+        push(m_now + delay, event, state);
+        return true;
+    }
+    /** Schedules an event every period ms, starting one period from now */
+    bool every(uint32_t period, BleSimEvent event, void *state = nullptr)
+    {
+        return 0 != period && after(period, event, state);
+    }
+    /** Runs events in time order until the next one is due after until, then sets the
+     *  time to until. Returns false if it stopped early because the queue ran dry
+     */
+    bool run(uint32_t until)
+    {
+        while (m_count && (int32_t)(m_events[0].time - until) <= 0)
+        {
+            Event event = m_events[0];
+            pop();
+            m_now = event.time;
+            ++m_fired;
+            uint32_t period = event.event(m_now, event.state);
+            if (period && m_count < BLE_SIM_MAX_EVENTS)
+            {
+                push(m_now + period, event.event, event.state);
+            }
+        }
+        bool ran = 0 != m_count;
+        m_now = until;
+        return ran;
+    }
+    /** Runs for duration ms of virtual time */
+    bool advance(uint32_t duration)
+    {
+        return run(m_now + duration);
+    }
+    /** Seeded xorshift32 */
+    uint32_t random()
+    {
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        return m_random;
+    }
+    /** Uniform in [low, high] */
+    uint32_t random(uint32_t low, uint32_t high)
+    {
+        uint32_t span = high - low + 1;
+        return low + (span ? random() % span : random());
+    }
+};
@@ -0,0 +1,341 @@
+#pragma once
+#include "BleRadioConfig.h"
+#include "BleHistogram.h"
+
+/** Times every update(), user callback and blocking GATT operation. Anything over budget is
+ *  logged as a stall, the worst kept for the report. The operation in progress is mirrored
+ *  to RTC memory that survives a watchdog or panic reset, so the next boot can say what the
+ *  radio was stuck in. An optional hard limit aborts a GATT operation that runs too long.
+ */
+#ifndef BLE_WATCHDOG_BUDGET_US
+/** An operation taking longer than this is a stall */
+#define BLE_WATCHDOG_BUDGET_US 50000
+#endif
+#ifndef BLE_WATCHDOG_HARD_LIMIT_MS
+/** Abort GATT operations running longer than this. 0 leaves them to NimBLE's own timeouts */
+#define BLE_WATCHDOG_HARD_LIMIT_MS 0
+#endif
+#ifndef BLE_WATCHDOG_STALLS
+/** How many of the worst stalls are kept */
+#define BLE_WATCHDOG_STALLS 4
+#endif
+
+enum BleOperation : uint8_t
+{
+    BLE_OP_NONE = 0,
+    BLE_OP_UPDATE,
+    BLE_OP_CALLBACK,
+    BLE_OP_CONNECT,
+    BLE_OP_DISCOVER,
+    BLE_OP_READ,
+    BLE_OP_WRITE,
+    BLE_OP_SUBSCRIBE,
+    BLE_OP_SECURE
+};
+inline const __FlashStringHelper *ble_operation_name(uint8_t operation)
+{
+    switch (operation)
+    {
+    case BLE_OP_UPDATE:
+        return F("update");
+    case BLE_OP_CALLBACK:
+        return F("callback");
+    case BLE_OP_CONNECT:
+        return F("connect");
+    case BLE_OP_DISCOVER:
+        return F("discover");
+    case BLE_OP_READ:
+        return F("read");
+    case BLE_OP_WRITE:
+        return F("write");
+    case BLE_OP_SUBSCRIBE:
+        return F("subscribe");
+    case BLE_OP_SECURE:
+        return F("secure");
+    default:
+        return F("none");
+    }
+}
+
+struct BleStall
+{
+    uint32_t duration;
+    uint32_t ts;
+    uint16_t conn;
+    uint8_t operation;
+    uint8_t address[6];
+};
+
+#define BLE_STALL_RECORD_MAGIC 0xB1E57A11
+/** Kept in RTC memory, which resets don't clear */
+struct BleStallRecord
+{
+    uint32_t magic;
+    /** The operation running when the record was last written, BLE_OP_NONE between them */
+    BleStall active;
+    /** The worst stall of that boot */
+    BleStall worst;
+};
+static RTC_NOINIT_ATTR BleStallRecord g_bleStallRecord;
+
+class BleWatchdog
+{
+    BleLatencyHistogram m_update;
+    BleLatencyHistogram m_callbacks;
+    BleLatencyHistogram m_operations;
+    BleStall m_stalls[BLE_WATCHDOG_STALLS];
+    /** What the last boot was doing when it reset, if anything */
+    BleStallRecord m_previous;
+    esp_reset_reason_t m_resetReason;
+    esp_timer_handle_t m_timer;
+    uint32_t m_aborts;
+    uint32_t m_stallCount;
+    /** The last boot's record is only taken once, a later begin() keeps it */
+    bool m_begun;
+
+    static void onHardLimit(void *arg)
+    {
+        BleWatchdog *pThis = (BleWatchdog *)arg;
+        const BleStall &active = g_bleStallRecord.active;
+        /** Runs on the esp_timer task while the loop is blocked in NimBLE. Cancelling or
+         *  dropping the link completes the blocked procedure with an error
+         */
+#if BLE_RADIO_CENTRAL
+        if (BLE_OP_CONNECT == active.operation)
+        {
+            ble_gap_conn_cancel();
+        }
+        else
+#endif
+        if (BLE_HS_CONN_HANDLE_NONE != active.conn)
+        {
+            ble_gap_terminate(active.conn, BLE_ERR_REM_USER_CONN_TERM);
+        }
+        ++pThis->m_aborts;
+    }
+    void stalled(const BleStall &stall)
+    {
+        Serial.print(F("BLE Stall: "));
+        Serial.print(ble_operation_name(stall.operation));
+        Serial.print(F(" took "));
+        Serial.print(stall.duration / 1000);
+        Serial.println(F("ms"));
+        ++m_stallCount;
+        size_t shortest = 0;
+        for (size_t i = 1; i < BLE_WATCHDOG_STALLS; ++i)
+        {
+            if (m_stalls[i].duration < m_stalls[shortest].duration)
+            {
+                shortest = i;
+            }
+        }
+        if (stall.duration > m_stalls[shortest].duration)
+        {
+            m_stalls[shortest] = stall;
+        }
+        if (stall.duration > g_bleStallRecord.worst.duration)
+        {
+            g_bleStallRecord.worst = stall;
+        }
+    }
+
+public:
+    /** The one watchdog, shared by every component */
+    static BleWatchdog &instance()
+    {
+        static BleWatchdog watchdog;
+        return watchdog;
+    }
+    void begin()
+    {
+        memset(&m_update, 0, sizeof(m_update));
+        memset(&m_callbacks, 0, sizeof(m_callbacks));
+        memset(&m_operations, 0, sizeof(m_operations));
+        memset(m_stalls, 0, sizeof(m_stalls));
+        m_aborts = 0;
+        m_stallCount = 0;
+        if (m_begun)
+        {
+            return;
+        }
+        m_begun = true;
+        m_resetReason = esp_reset_reason();
+        if (BLE_STALL_RECORD_MAGIC == g_bleStallRecord.magic)
+        {
+            m_previous = g_bleStallRecord;
+        }
+        else
+        {
+            memset(&m_previous, 0, sizeof(m_previous));
+        }
+        memset(&g_bleStallRecord, 0, sizeof(g_bleStallRecord));
+        g_bleStallRecord.magic = BLE_STALL_RECORD_MAGIC;
+        m_timer = nullptr;
+#if BLE_WATCHDOG_HARD_LIMIT_MS
+        esp_timer_create_args_t args;
+        memset(&args, 0, sizeof(args));
+        args.callback = onHardLimit;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "ble_watchdog";
+        if (ESP_OK != esp_timer_create(&args, &m_timer))
+        {
+            Serial.println(F("BLE Watchdog hard limit unavailable"));
+            m_timer = nullptr;
+        }
+#endif
+        if (BLE_OP_NONE != m_previous.active.operation)
+        {
+            Serial.print(F("BLE Last boot reset during "));
+            Serial.print(ble_operation_name(m_previous.active.operation));
+            Serial.print(F(", reason "));
+            Serial.println((int)m_resetReason);
+        }
+    }
+    /** Marks an operation as running. Returns what was running before, for leave() */
+    BleStall enter(uint8_t operation, uint16_t conn, const uint8_t *address)
+    {
+        BleStall previous = g_bleStallRecord.active;
+        BleStall &active = g_bleStallRecord.active;
+        active.operation = operation;
+        active.conn = conn;
+        active.ts = micros();
+        if (nullptr != address)
+        {
+            memcpy(active.address, address, sizeof(active.address));
+        }
+        else
+        {
+            memset(active.address, 0, sizeof(active.address));
+        }
+        if (nullptr != m_timer && operation >= BLE_OP_CONNECT)
+        {
+            esp_timer_stop(m_timer);
+            esp_timer_start_once(m_timer, (uint64_t)BLE_WATCHDOG_HARD_LIMIT_MS * 1000);
+        }
+        return previous;
+    }
+    /** Ends the running operation and restores the one it interrupted */
+    void leave(const BleStall &previous)
+    {
+        BleStall stall = g_bleStallRecord.active;
+        stall.duration = micros() - stall.ts;
+        stall.ts = BleClock::now();
+        if (nullptr != m_timer && stall.operation >= BLE_OP_CONNECT)
+        {
+            esp_timer_stop(m_timer);
+        }
+        switch (stall.operation)
+        {
+        case BLE_OP_UPDATE:
+            m_update.record(stall.duration);
+            break;
+        case BLE_OP_CALLBACK:
+            m_callbacks.record(stall.duration);
+            break;
+        default:
+            m_operations.record(stall.duration);
+            break;
+        }
+        if (stall.duration > BLE_WATCHDOG_BUDGET_US)
+        {
+            stalled(stall);
+        }
+        g_bleStallRecord.active = previous;
+        /** An interrupted GATT operation is still blocking, rearm its limit */
+        if (nullptr != m_timer && previous.operation >= BLE_OP_CONNECT)
+        {
+            esp_timer_start_once(m_timer, (uint64_t)BLE_WATCHDOG_HARD_LIMIT_MS * 1000);
+        }
+    }
+    /** The worst stalls this boot. Unused slots have a duration of 0 */
+    const BleStall &stall(size_t index) const
+    {
+        return m_stalls[index];
+    }
+    uint32_t aborts() const
+    {
+        return m_aborts;
+    }
+    /** Operations over budget this boot */
+    uint32_t stalls() const
+    {
+        return m_stallCount;
+    }
+    esp_reset_reason_t resetReason() const
+    {
+        return m_resetReason;
+    }
+    void report(Print &out)
+    {
+        out.print(F("BLE update(): "));
+        m_update.report(out, F("us"));
+        out.print(F("BLE callbacks: "));
+        m_callbacks.report(out, F("us"));
+        out.print(F("BLE GATT operations: "));
+        m_operations.report(out, F("us"));
+        out.print(F("BLE hard limit aborts: "));
+        out.println(m_aborts);
+        for (size_t i = 0; i < BLE_WATCHDOG_STALLS; ++i)
+        {
+            const BleStall &stall = m_stalls[i];
+            if (0 == stall.duration)
+            {
+                continue;
+            }
+            out.print(F("  stall: "));
+            out.print(ble_operation_name(stall.operation));
+            out.print(F(" conn "));
+            out.print(stall.conn);
+            out.print(F(" "));
+            out.print(stall.duration / 1000);
+            out.print(F("ms at "));
+            out.println(stall.ts);
+        }
+        if (BLE_OP_NONE != m_previous.active.operation || 0 != m_previous.worst.duration)
+        {
+            out.print(F("  last boot: reset reason "));
+            out.print((int)m_resetReason);
+            out.print(F(" during "));
+            out.print(ble_operation_name(m_previous.active.operation));
+            out.print(F(", worst stall "));
+            out.print(ble_operation_name(m_previous.worst.operation));
+            out.print(F(" "));
+            out.print(m_previous.worst.duration / 1000);
+            out.println(F("ms"));
+        }
+    }
+};
+
+/** Times the enclosing block as one operation */
+class BleWatchdogScope
+{
+    BleStall m_previous;
+
+public:
+    BleWatchdogScope(uint8_t operation, uint16_t conn = BLE_HS_CONN_HANDLE_NONE)
+    {
+        m_previous = BleWatchdog::instance().enter(operation, conn, nullptr);
+    }
+    BleWatchdogScope(uint8_t operation, const NimBLEAddress &address)
+    {
+        m_previous = BleWatchdog::instance().enter(operation, BLE_HS_CONN_HANDLE_NONE, address.getNative());
+    }
+    ~BleWatchdogScope()
+    {
+        BleWatchdog::instance().leave(m_previous);
+    }
+};
+/** Runs f() as one watched operation and returns its result */
+template <typename F>
+auto ble_watched(uint8_t operation, uint16_t conn, F f) -> decltype(f())
+{
+    BleWatchdogScope scope(operation, conn);
+    return f();
+}
+template <typename F>
+auto ble_watched(uint8_t operation, const NimBLEAddress &address, F f) -> decltype(f())
+{
+    BleWatchdogScope scope(operation, address);
+    return f();
+}
@@ -0,0 +1,168 @@
+#pragma once
+/** Host stand-in for the parts of the Arduino core the library uses, for the native
+ *  test environment. Each test is a single translation unit, so globals live here.
+ *  Tests run on one thread, so critical sections are no-ops.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+
+class __FlashStringHelper;
+#define F(x) (reinterpret_cast<const __FlashStringHelper *>(x))
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            write(buffer[i]);
+        }
+        return size;
+    }
+    size_t print(const __FlashStringHelper *s) { return print((const char *)s); }
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n, int base = 10) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = 10) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = 10) { return format(base == 16 ? "%lx" : "%ld", n); }
+    size_t print(unsigned long n, int base = 10) { return format(base == 16 ? "%lx" : "%lu", n); }
+    size_t print(long long n, int base = 10) { return format(base == 16 ? "%llx" : "%lld", n); }
+    size_t print(unsigned long long n, int base = 10) { return format(base == 16 ? "%llx" : "%llu", n); }
+    size_t print(double n, int digits = 2) { return format("%.*f", digits, n); }
+    template <typename T>
+    size_t println(T value)
+    {
+        size_t n = print(value);
+        return n + println();
+    }
+    template <typename T>
+    size_t println(T value, int base)
+    {
+        size_t n = print(value, base);
+        return n + println();
+    }
+    size_t println() { return print("\r\n"); }
+    template <typename... Args>
+    size_t printf(const char *format, Args... args) { return this->format(format, args...); }
+
+private:
+    template <typename... Args>
+    size_t format(const char *format, Args... args)
+    {
+        char buffer[128];
+        int n = snprintf(buffer, sizeof(buffer), format, args...);
+        return (n > 0) ? write((const uint8_t *)buffer, strlen(buffer)) : 0;
+    }
+};
+
+/** Discards what is printed unless echo is set, so test output stays readable */
+class HardwareSerial : public Print
+{
+public:
+    bool echo = false;
+    size_t write(uint8_t c)
+    {
+        if (echo)
+        {
+            putchar(c);
+        }
+        return 1;
+    }
+    using Print::write;
+    void begin(unsigned long) {}
+};
+HardwareSerial Serial;
+
+inline unsigned long micros()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+inline void delay(uint32_t) {}
+inline void yield() {}
+
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+class EspClass
+{
+public:
+    uint32_t getFreeHeap() { return 200000; }
+    uint32_t getMinFreeHeap() { return 180000; }
+    uint32_t getHeapSize() { return 300000; }
+};
+EspClass ESP;
+
+typedef enum
+{
+    ESP_RST_UNKNOWN,
+    ESP_RST_POWERON,
+    ESP_RST_EXT,
+    ESP_RST_SW,
+    ESP_RST_PANIC,
+    ESP_RST_INT_WDT,
+    ESP_RST_TASK_WDT,
+    ESP_RST_WDT,
+    ESP_RST_DEEPSLEEP,
+    ESP_RST_BROWNOUT,
+    ESP_RST_SDIO
+} esp_reset_reason_t;
+inline esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef enum
+{
+    ESP_TIMER_TASK
+} esp_timer_dispatch_t;
+typedef struct
+{
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+/** Timers are created but never fire on the host */
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t *, esp_timer_handle_t *handle)
+{
+    *handle = nullptr;
+    return ESP_OK;
+}
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t) { return ESP_OK; }
+inline esp_err_t esp_timer_stop(esp_timer_handle_t) { return ESP_OK; }
+inline esp_err_t esp_timer_delete(esp_timer_handle_t) { return ESP_OK; }
+inline int64_t esp_timer_get_time() { return (int64_t)micros(); }
+inline uint32_t esp_random()
+{
+    static uint32_t state = 0x2545F491;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+typedef struct
+{
+    volatile uint32_t owner;
+    uint32_t count;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+inline void vPortCPUInitializeMutex(portMUX_TYPE *) {}
+inline void portENTER_CRITICAL(portMUX_TYPE *mux) { ++mux->count; }
+inline void portEXIT_CRITICAL(portMUX_TYPE *mux) { --mux->count; }
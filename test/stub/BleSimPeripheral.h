@@ -0,0 +1,92 @@
+#pragma once
+/** A configuration service peripheral in the simulated air of NimBLESim.h: it advertises
+ *  the configuration service, keeps a BleConfig replica that acks the deltas written to it,
+ *  answers RPC requests on the session characteristic, every one with BLE_RPC_OK, and
+ *  notifies sample frames on request. The write handler points back at the object, so it
+ *  must not move after begin().
+ */
+#include "NimBLESim.h"
+#include "BleRadioConfig.h"
+#include "BleConfig.h"
+#include "BleRpc.h"
+#include "BleBatch.h"
+
+class BleSimPeripheral : public NimBLESimPeer
+{
+    bool received(NimBLESimCharacteristic &chr, const uint8_t *data, size_t size)
+    {
+        if (hung)
+        {
+            return true;
+        }
+        if (chr.uuid == BleConfigurationCharacteristic::uuid().toNimBLE())
+        {
+            uint8_t ack[BLE_CONFIG_ACK_SIZE];
+            if (0 != config.apply(data, size, ack))
+            {
+                notify(chr.uuid, ack, sizeof(ack));
+            }
+            return true;
+        }
+        if (!ble_rpc_is_frame(data, size, BLE_RPC_REQUEST))
+        {
+            return true;
+        }
+        ++requests;
+        /** Nothing to negotiate: the answer shares no capabilities, so frames stay plain */
+        uint8_t response[BLE_RPC_HEADER_SIZE + 1];
+        ble_rpc_header(response, BLE_RPC_RESPONSE, ble_rpc_id(data), BLE_RPC_OK);
+        response[BLE_RPC_HEADER_SIZE] = 0;
+        notify(chr.uuid, response, BLE_RPC_NEGOTIATE == data[3] ? sizeof(response) : BLE_RPC_HEADER_SIZE);
+        ++answered;
+        return true;
+    }
+
+public:
+    BleConfig config;
+    /** Stops answering writes, as a hung application behind a link that stays up */
+    bool hung = false;
+    uint32_t requests = 0;
+    uint32_t answered = 0;
+
+    void begin(uint64_t address, int rssi)
+    {
+        this->address = NimBLEAddress(address);
+        this->rssi = rssi;
+        advertised.push_back(BleConfigurationService::uuid().toNimBLE());
+        add(BleConfigurationService::uuid().toNimBLE(), BleConfigurationCharacteristic::uuid().toNimBLE(),
+            BleConfigurationCharacteristic::properties());
+        add(BleSessionService::uuid().toNimBLE(), BleSessionCharacteristic::uuid().toNimBLE(),
+            BleSessionCharacteristic::properties());
+        add(BleSessionService::uuid().toNimBLE(), BleSamplesCharacteristic::uuid().toNimBLE(),
+            BleSamplesCharacteristic::properties());
+        config.begin();
+        uint8_t ack[BLE_CONFIG_ACK_SIZE];
+        config.ack(ack);
+        characteristic(BleConfigurationCharacteristic::uuid().toNimBLE())->value.assign((const char *)ack, sizeof(ack));
+        onWrite = [this](NimBLESimPeer &, NimBLESimCharacteristic &chr, const uint8_t *data, size_t size)
+        { return received(chr, data, size); };
+    }
+    /** Notifies one sample taken at ts in a frame sent at now. Returns whether it was
+     *  delivered
+     */
+    bool sample(int32_t value, uint32_t ts, uint32_t now)
+    {
+        uint8_t frame[BLE_BATCH_HEADER_SIZE + 10];
+        frame[0] = BLE_BATCH_VERSION;
+        frame[1] = 1;
+        ble_batch_put_u32(frame + 2, ts);
+        ble_batch_put_u32(frame + 6, now);
+        size_t size = BLE_BATCH_HEADER_SIZE;
+        size += ble_put_varint(frame + size, 0);
+        size += ble_put_varint(frame + size, ble_zigzag(value));
+        return notify(BleSamplesCharacteristic::uuid().toNimBLE(), frame, size);
+    }
+    /** Whether the replica holds key with value */
+    bool holds(const char *key, const char *value)
+    {
+        const uint8_t *stored;
+        int length = config.get(key, &stored);
+        return length == (int)strlen(value) && 0 == memcmp(stored, value, length);
+    }
+};
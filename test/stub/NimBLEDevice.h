@@ -0,0 +1,436 @@
+#pragma once
+/** Host stand-in for NimBLE-Arduino, for the native test environment. Declares the API
+ *  the library uses; what a test exercises is defined inline. NimBLESim.h defines the
+ *  central side over simulated peripherals, keeping its state in the members below.
+ */
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <functional>
+typedef enum { ESP_PWR_LVL_N12, ESP_PWR_LVL_P9 } esp_power_level_t;
+#define NIMBLE_MAX_CONNECTIONS 3
+#define BLE_SM_PAIR_AUTHREQ_SC 0x08
+#define BLE_GAP_ROLE_SLAVE 1
+#define BLE_GAP_ROLE_MASTER 0
+#define BLE_ATT_MTU_DFLT 23
+#define BLE_GATT_CHR_F_BROADCAST 0x0001
+#define BLE_GATT_CHR_F_READ 0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP 0x0004
+#define BLE_GATT_CHR_F_WRITE 0x0008
+#define BLE_GATT_CHR_F_NOTIFY 0x0010
+#define BLE_GATT_CHR_F_INDICATE 0x0020
+#define BLE_GATT_CHR_F_READ_ENC 0x0200
+#define BLE_GATT_CHR_F_WRITE_ENC 0x1000
+#ifndef CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_CENTRAL
+#endif
+#ifndef CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_OBSERVER
+#endif
+#ifndef CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_PERIPHERAL
+#endif
+#ifndef CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_BROADCASTER
+#endif
+struct ble_addr_t { uint8_t type; uint8_t val[6]; };
+struct ble_gap_sec_state { unsigned encrypted:1; unsigned authenticated:1; unsigned bonded:1; };
+struct ble_gap_conn_desc { ble_gap_sec_state sec_state; ble_addr_t our_id_addr, peer_id_addr, our_ota_addr, peer_ota_addr; uint16_t conn_handle; uint16_t conn_itvl; uint16_t conn_latency; uint16_t supervision_timeout; uint8_t role; uint8_t master_clock_accuracy; };
+struct ble_gap_upd_params { uint16_t itvl_min, itvl_max, latency, supervision_timeout, min_ce_len, max_ce_len; };
+struct ble_uuid_t { uint8_t type; };
+struct ble_uuid128_t { ble_uuid_t u; uint8_t value[16]; };
+struct os_mbuf;
+struct os_mbuf* ble_hs_mbuf_from_flat(const void* buf, uint16_t len);
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, struct os_mbuf* om);
+struct ble_gatt_error { uint16_t status; uint16_t att_handle; };
+struct ble_gatt_attr { uint16_t handle; uint16_t offset; struct os_mbuf* om; };
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg);
+int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len, ble_gatt_attr_fn* cb, void* cb_arg);
+int ble_gattc_write_no_rsp_flat(uint16_t conn_handle, uint16_t attr_handle, const void* data, uint16_t data_len);
+#define BLE_HS_EREJECT 6
+#define BLE_HS_ENOTCONN 7
+#define BLE_HS_ETIMEOUT 13
+#define BLE_HS_CONN_HANDLE_NONE 0xffff
+int ble_gap_conn_cancel(void);
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason);
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc);
+int ble_gap_conn_active(void);
+#define BLE_ERR_REM_USER_CONN_TERM 0x13
+/** Addresses and UUIDs hold their bytes so tests can compare them */
+class NimBLEAddress
+{
+    uint8_t m_address[6];
+    uint8_t m_type;
+
+public:
+    NimBLEAddress() : m_address(), m_type(0) {}
+    NimBLEAddress(ble_addr_t address) : m_type(address.type) { memcpy(m_address, address.val, 6); }
+    NimBLEAddress(const uint8_t address[6], uint8_t type = 0) : m_type(type) { memcpy(m_address, address, 6); }
+    NimBLEAddress(const uint64_t &address, uint8_t type = 0) : m_type(type)
+    {
+        for (size_t i = 0; i < 6; ++i)
+        {
+            m_address[i] = (uint8_t)(address >> (8 * i));
+        }
+    }
+    NimBLEAddress(const std::string &, uint8_t type = 0) : m_address(), m_type(type) {}
+    bool equals(const NimBLEAddress &other) const { return *this == other; }
+    const uint8_t *getNative() const { return m_address; }
+    uint8_t getType() const { return m_type; }
+    std::string toString() const
+    {
+        char buffer[18];
+        snprintf(buffer, sizeof(buffer), "%02x:%02x:%02x:%02x:%02x:%02x",
+                 m_address[5], m_address[4], m_address[3], m_address[2], m_address[1], m_address[0]);
+        return buffer;
+    }
+    bool operator==(const NimBLEAddress &other) const { return 0 == memcmp(m_address, other.m_address, 6); }
+    bool operator!=(const NimBLEAddress &other) const { return !(*this == other); }
+    operator std::string() const { return toString(); }
+    operator uint64_t() const
+    {
+        uint64_t address = 0;
+        for (size_t i = 0; i < 6; ++i)
+        {
+            address |= (uint64_t)m_address[i] << (8 * i);
+        }
+        return address;
+    }
+};
+/** Little-endian like NimBLE; only the first size bytes are used */
+class NimBLEUUID
+{
+    uint8_t m_bytes[16];
+    uint8_t m_size;
+
+public:
+    NimBLEUUID() : m_bytes(), m_size(0) {}
+    NimBLEUUID(uint16_t uuid) : m_bytes(), m_size(2)
+    {
+        m_bytes[0] = (uint8_t)uuid;
+        m_bytes[1] = (uint8_t)(uuid >> 8);
+    }
+    NimBLEUUID(const uint8_t *pData, size_t size, bool msbFirst) : m_bytes(), m_size((uint8_t)size)
+    {
+        for (size_t i = 0; i < size && i < 16; ++i)
+        {
+            m_bytes[i] = msbFirst ? pData[size - 1 - i] : pData[i];
+        }
+    }
+    uint8_t bitSize() const { return m_size * 8; }
+    const uint8_t *bytes() const { return m_bytes; }
+    bool equals(const NimBLEUUID &other) const { return *this == other; }
+    std::string toString() const
+    {
+        std::string text;
+        char digits[3];
+        for (size_t i = m_size; i-- > 0;)
+        {
+            snprintf(digits, sizeof(digits), "%02x", m_bytes[i]);
+            text += digits;
+        }
+        return text;
+    }
+    bool operator==(const NimBLEUUID &other) const { return m_size == other.m_size && 0 == memcmp(m_bytes, other.m_bytes, m_size); }
+    bool operator!=(const NimBLEUUID &other) const { return !(*this == other); }
+    operator std::string() const { return toString(); }
+};
+class NimBLEAttValue;
+class NimBLEClient; class NimBLERemoteService; class NimBLERemoteCharacteristic; class NimBLERemoteDescriptor;
+class NimBLESim; class NimBLESimPeer;
+#if defined(CONFIG_BT_NIMBLE_ROLE_OBSERVER)
+class NimBLEScanResults {};
+class NimBLEAdvertisedDevice {
+public:
+    NimBLEAddress getAddress();
+    std::string getName();
+    int getRSSI();
+    std::string getServiceData(uint8_t index = 0);
+    std::string getServiceData(const NimBLEUUID&);
+    NimBLEUUID getServiceDataUUID(uint8_t index = 0);
+    size_t getServiceDataCount();
+    bool haveServiceData();
+    bool haveRSSI();
+    bool isAdvertisingService(const NimBLEUUID&);
+    bool isConnectable();
+    std::string toString();
+
+    /** Simulation state, see NimBLESim.h */
+    NimBLESimPeer *m_peer = nullptr;
+};
+class NimBLEAdvertisedDeviceCallbacks { public: virtual ~NimBLEAdvertisedDeviceCallbacks(){} virtual void onResult(NimBLEAdvertisedDevice*)=0; };
+class NimBLEScan {
+public:
+    bool start(uint32_t duration, void (*scanCompleteCB)(NimBLEScanResults), bool is_continue = false);
+    NimBLEScanResults start(uint32_t duration, bool is_continue = false);
+    bool isScanning();
+    void setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks*, bool wantDuplicates = false);
+    void setActiveScan(bool);
+    void setInterval(uint16_t);
+    void setWindow(uint16_t);
+    void setDuplicateFilter(bool);
+    void setMaxResults(uint8_t);
+    void clearResults();
+    bool stop();
+
+    /** Simulation state, see NimBLESim.h */
+    NimBLEAdvertisedDeviceCallbacks *m_callbacks = nullptr;
+    bool m_scanning = false;
+    bool m_active = false;
+    uint16_t m_interval = 0;
+    uint16_t m_window = 0;
+    uint32_t m_starts = 0;
+};
+#endif
+
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+class NimBLEClientCallbacks {
+public:
+    virtual ~NimBLEClientCallbacks(){}
+    virtual void onConnect(NimBLEClient*){}
+    virtual void onDisconnect(NimBLEClient*){}
+    virtual bool onConnParamsUpdateRequest(NimBLEClient*, const ble_gap_upd_params*){return true;}
+    virtual uint32_t onPassKeyRequest(){return 0;}
+    virtual void onAuthenticationComplete(ble_gap_conn_desc*){}
+    virtual bool onConfirmPIN(uint32_t){return true;}
+};
+typedef std::function<void (NimBLERemoteCharacteristic*, uint8_t*, size_t, bool)> notify_callback;
+class NimBLERemoteDescriptor {
+public:
+    NimBLEUUID getUUID();
+    uint16_t getHandle();
+    std::string readValue();
+    bool writeValue(const uint8_t*, size_t, bool response = false);
+    bool writeValue(const std::string&, bool response = false);
+};
+class NimBLERemoteCharacteristic {
+public:
+    bool canBroadcast(); bool canIndicate(); bool canNotify(); bool canRead(); bool canWrite(); bool canWriteNoResponse();
+    std::vector<NimBLERemoteDescriptor*>::iterator begin();
+    NimBLERemoteDescriptor* getDescriptor(const NimBLEUUID&);
+    std::vector<NimBLERemoteDescriptor*>* getDescriptors(bool refresh = false);
+    uint16_t getHandle();
+    uint16_t getDefHandle();
+    NimBLEUUID getUUID();
+    std::string readValue(time_t* timestamp = nullptr);
+    std::string getValue(time_t* timestamp = nullptr);
+    NimBLERemoteService* getRemoteService();
+    bool subscribe(bool notifications = true, notify_callback notifyCallback = nullptr, bool response = false);
+    bool unsubscribe(bool response = false);
+    bool writeValue(const uint8_t*, size_t, bool response = false);
+    bool writeValue(const std::string&, bool response = false);
+    std::string toString();
+
+    /** Simulation state, see NimBLESim.h */
+    NimBLERemoteService *m_service = nullptr;
+    NimBLEUUID m_uuid;
+    uint32_t m_properties = 0;
+    uint16_t m_handle = 0;
+    bool m_subscribed = false;
+    notify_callback m_notify;
+    std::vector<NimBLERemoteDescriptor*> m_descriptors;
+};
+class NimBLERemoteService {
+public:
+    NimBLERemoteCharacteristic* getCharacteristic(const char*);
+    NimBLERemoteCharacteristic* getCharacteristic(const NimBLEUUID&);
+    std::vector<NimBLERemoteCharacteristic*>* getCharacteristics(bool refresh = false);
+    NimBLEClient* getClient();
+    uint16_t getHandle();
+    NimBLEUUID getUUID();
+    ~NimBLERemoteService();
+
+    /** Simulation state, see NimBLESim.h */
+    NimBLEClient *m_client = nullptr;
+    NimBLEUUID m_uuid;
+    std::vector<NimBLERemoteCharacteristic*> m_characteristics;
+};
+class NimBLEClient {
+public:
+    bool connect(NimBLEAdvertisedDevice*, bool deleteAttributes = true);
+    bool connect(const NimBLEAddress&, bool deleteAttributes = true);
+    bool connect(bool deleteAttributes = true);
+    int disconnect(uint8_t reason = BLE_ERR_REM_USER_CONN_TERM);
+    NimBLEAddress getPeerAddress() const;
+    void setPeerAddress(const NimBLEAddress&);
+    int getRssi();
+    std::vector<NimBLERemoteService*>* getServices(bool refresh = false);
+    NimBLERemoteService* getService(const char*);
+    NimBLERemoteService* getService(const NimBLEUUID&);
+    void deleteServices();
+    size_t deleteService(const NimBLEUUID&);
+    bool discoverAttributes();
+    bool isConnected();
+    void setClientCallbacks(NimBLEClientCallbacks*, bool deleteCallbacks = true);
+    std::string toString();
+    uint16_t getConnId();
+    uint16_t getMTU();
+    bool secureConnection();
+    void setConnectTimeout(uint8_t);
+    void setConnectionParams(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t scanInterval = 16, uint16_t scanWindow = 16);
+    void updateConnParams(uint16_t, uint16_t, uint16_t, uint16_t);
+    ble_gap_conn_desc getConnInfo();
+    ~NimBLEClient();
+
+    /** Simulation state, see NimBLESim.h */
+    NimBLEAddress m_peerAddress;
+    NimBLESimPeer *m_peer = nullptr;
+    NimBLEClientCallbacks *m_callbacks = nullptr;
+    std::vector<NimBLERemoteService*> m_services;
+    uint16_t m_conn = BLE_HS_CONN_HANDLE_NONE;
+    uint16_t m_mtu = BLE_ATT_MTU_DFLT;
+    bool m_connected = false;
+};
+#endif
+
+class NimBLEDescriptor; class NimBLECharacteristic; class NimBLEService; class NimBLEServer;
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+class NimBLEDescriptorCallbacks { public: virtual ~NimBLEDescriptorCallbacks(){} virtual void onRead(NimBLEDescriptor*){} virtual void onWrite(NimBLEDescriptor*){} };
+class NimBLEDescriptor {
+public:
+    uint16_t getHandle(); size_t getLength(); NimBLEUUID getUUID(); uint8_t* getValue(); std::string getStringValue();
+    void setCallbacks(NimBLEDescriptorCallbacks*);
+    void setValue(const uint8_t*, size_t); void setValue(const std::string&);
+};
+class NimBLE2904 : public NimBLEDescriptor { public: static const uint8_t FORMAT_UTF8 = 25; static const uint8_t FORMAT_OPAQUE = 27; void setFormat(uint8_t); void setDescription(uint16_t); void setExponent(int8_t); void setNamespace(uint8_t); void setUnit(uint16_t); };
+namespace NIMBLE_PROPERTY { enum { BROADCAST = 0x1, READ = 0x2, READ_ENC = 0x200, READ_AUTHEN = 0x400, READ_AUTHOR = 0x800, WRITE = 0x8, WRITE_NR = 0x4, WRITE_ENC = 0x1000, WRITE_AUTHEN = 0x2000, WRITE_AUTHOR = 0x4000, NOTIFY = 0x10, INDICATE = 0x20 }; }
+class NimBLECharacteristicCallbacks {
+public:
+    typedef enum { SUCCESS_INDICATE, SUCCESS_NOTIFY, ERROR_INDICATE_DISABLED, ERROR_NOTIFY_DISABLED, ERROR_GATT, ERROR_NO_CLIENT, ERROR_INDICATE_TIMEOUT, ERROR_INDICATE_FAILURE } Status;
+    virtual ~NimBLECharacteristicCallbacks(){}
+    virtual void onRead(NimBLECharacteristic*){}
+    virtual void onRead(NimBLECharacteristic*, ble_gap_conn_desc*){}
+    virtual void onWrite(NimBLECharacteristic*){}
+    virtual void onWrite(NimBLECharacteristic*, ble_gap_conn_desc*){}
+    virtual void onNotify(NimBLECharacteristic*){}
+    virtual void onStatus(NimBLECharacteristic*, Status, int){}
+    virtual void onSubscribe(NimBLECharacteristic*, ble_gap_conn_desc*, uint16_t){}
+};
+class NimBLECharacteristic {
+public:
+    NimBLEDescriptor* createDescriptor(const char*, uint32_t properties = 0x2|0x8, uint16_t max_len = 100);
+    NimBLEDescriptor* createDescriptor(const NimBLEUUID&, uint32_t properties = 0x2|0x8, uint16_t max_len = 100);
+    NimBLEDescriptor* getDescriptorByUUID(const char*);
+    NimBLEDescriptor* getDescriptorByUUID(const NimBLEUUID&);
+    std::string getValue(time_t* timestamp = nullptr);
+    size_t getDataLength();
+    void indicate();
+    void notify(bool is_notification = true);
+    void setValue(const uint8_t*, size_t);
+    void setValue(const std::string&);
+    template<typename T> void setValue(const T& s) { setValue((uint8_t*)&s, sizeof(T)); }
+    NimBLEUUID getUUID();
+    uint16_t getHandle();
+    uint16_t getProperties();
+    NimBLEService* getService();
+    size_t getSubscribedCount();
+    void setCallbacks(NimBLECharacteristicCallbacks*);
+};
+class NimBLEService {
+public:
+    NimBLECharacteristic* createCharacteristic(const char*, uint32_t properties = 0x2|0x8, uint16_t max_len = 512);
+    NimBLECharacteristic* createCharacteristic(const NimBLEUUID&, uint32_t properties = 0x2|0x8, uint16_t max_len = 512);
+    NimBLECharacteristic* getCharacteristic(const char*, uint16_t instanceId = 0);
+    NimBLECharacteristic* getCharacteristic(const NimBLEUUID&, uint16_t instanceId = 0);
+    NimBLEUUID getUUID();
+    NimBLEServer* getServer();
+    bool start();
+};
+class NimBLEServerCallbacks {
+public:
+    virtual ~NimBLEServerCallbacks(){}
+    virtual void onConnect(NimBLEServer*){}
+    virtual void onConnect(NimBLEServer*, ble_gap_conn_desc*){}
+    virtual void onDisconnect(NimBLEServer*){}
+    virtual void onDisconnect(NimBLEServer*, ble_gap_conn_desc*){}
+    virtual void onMTUChange(uint16_t, ble_gap_conn_desc*){}
+    virtual uint32_t onPassKeyRequest(){return 0;}
+    virtual void onAuthenticationComplete(ble_gap_conn_desc*){}
+    virtual bool onConfirmPIN(uint32_t){return true;}
+};
+class NimBLEServer {
+public:
+    size_t getConnectedCount();
+    NimBLEService* createService(const char*);
+    NimBLEService* createService(const NimBLEUUID&, uint32_t numHandles = 15, uint8_t inst_id = 0);
+    NimBLEService* getServiceByUUID(const char*, uint16_t instanceId = 0);
+    NimBLEService* getServiceByUUID(const NimBLEUUID&, uint16_t instanceId = 0);
+    int disconnect(uint16_t connID, uint8_t reason = BLE_ERR_REM_USER_CONN_TERM);
+    void setCallbacks(NimBLEServerCallbacks*, bool deleteCallbacks = true);
+    void updateConnParams(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t);
+    uint16_t getPeerMTU(uint16_t conn_id);
+    std::vector<uint16_t> getPeerDevices();
+    ble_gap_conn_desc getPeerIDInfo(uint16_t id);
+    void advertiseOnDisconnect(bool);
+    void start();
+};
+#endif
+
+#if defined(CONFIG_BT_NIMBLE_ROLE_BROADCASTER)
+class NimBLEAdvertisementData {
+public:
+    void setFlags(uint8_t);
+    void setName(const std::string&);
+    void setCompleteServices(const NimBLEUUID&);
+    void setServiceData(const NimBLEUUID&, const std::string&);
+    void addData(const std::string&);
+    void addData(char*, size_t);
+    std::string getPayload();
+};
+class NimBLEAdvertising {
+public:
+    void addServiceUUID(const NimBLEUUID&);
+    void addServiceUUID(const char*);
+    void removeServiceUUID(const NimBLEUUID&);
+    bool start(uint32_t duration = 0, void (*advCompleteCB)(NimBLEAdvertising*) = nullptr);
+    void stop();
+    void setAppearance(uint16_t);
+    void setAdvertisementType(uint8_t);
+    void setMaxInterval(uint16_t);
+    void setMinInterval(uint16_t);
+    void setAdvertisementData(NimBLEAdvertisementData&);
+    void setScanResponseData(NimBLEAdvertisementData&);
+    void setScanResponse(bool);
+    void setServiceData(const NimBLEUUID&, const std::string&);
+    void setName(const std::string&);
+    bool isAdvertising();
+};
+#endif
+
+class NimBLEUtils { public: static const char* returnCodeToString(int); };
+class NimBLEDevice {
+public:
+    static void init(const std::string&);
+    static void deinit(bool clearAll = false);
+    static bool getInitialized();
+    static NimBLEAddress getAddress();
+#if defined(CONFIG_BT_NIMBLE_ROLE_OBSERVER)
+    static NimBLEScan* getScan();
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_PERIPHERAL)
+    static NimBLEServer* createServer();
+    static NimBLEServer* getServer();
+#endif
+    static void setPower(esp_power_level_t, int powerType = 0);
+    static int getPower(int powerType = 0);
+    static int setMTU(uint16_t);
+    static uint16_t getMTU();
+    static void setSecurityAuth(bool, bool, bool);
+    static void setSecurityAuth(uint8_t);
+    static void setSecurityIOCap(uint8_t);
+#if defined(CONFIG_BT_NIMBLE_ROLE_BROADCASTER)
+    static NimBLEAdvertising* getAdvertising();
+    static bool startAdvertising();
+    static bool stopAdvertising();
+#endif
+#if defined(CONFIG_BT_NIMBLE_ROLE_CENTRAL)
+    static NimBLEClient* createClient(NimBLEAddress peerAddress = NimBLEAddress(""));
+    static bool deleteClient(NimBLEClient*);
+    static NimBLEClient* getClientByID(uint16_t);
+    static NimBLEClient* getClientByPeerAddress(const NimBLEAddress&);
+    static NimBLEClient* getDisconnectedClient();
+    static size_t getClientListSize();
+    static std::list<NimBLEClient*>* getClientList();
+#endif
+};
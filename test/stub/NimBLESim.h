@@ -0,0 +1,570 @@
+#pragma once
+/** Host stand-in for the air around a central: simulated peripherals that advertise,
+ *  accept connections and answer writes, and the central side of NimBLEDevice.h defined
+ *  over them, so one test can run BleRadio's central against hundreds of them.
+ *  Everything happens on the calling thread. A write reaches the peer's handler at once,
+ *  and whatever the handler notifies back reaches the subscribed callback before the write
+ *  returns, as the host task would have delivered it a moment later.
+ */
+#include <NimBLEDevice.h>
+#include <algorithm>
+
+struct NimBLESimCharacteristic
+{
+    NimBLEUUID service;
+    NimBLEUUID uuid;
+    uint32_t properties;
+    uint16_t handle;
+    std::string value;
+};
+
+/** One simulated peripheral. Tests set it up, then change its fields as the scenario goes */
+class NimBLESimPeer
+{
+public:
+    /** Answers a write to one of the peer's characteristics. Return false to fail it */
+    typedef std::function<bool(NimBLESimPeer &, NimBLESimCharacteristic &, const uint8_t *, size_t)> WriteHandler;
+
+    NimBLEAddress address;
+    int rssi = -60;
+    /** Advertising and within reach. Out of range peers neither advertise nor connect */
+    bool inRange = true;
+    bool connectable = true;
+    /** Connects fail while false, as to a peer that is busy with another central */
+    bool accepting = true;
+    uint16_t mtu = 247;
+    /** Percent of notifications lost on the air */
+    uint8_t loss = 0;
+    std::vector<NimBLEUUID> advertised;
+    NimBLEUUID serviceDataUuid;
+    std::string serviceData;
+    std::vector<NimBLESimCharacteristic> characteristics;
+    WriteHandler onWrite;
+    /** The central's client while connected */
+    NimBLEClient *client = nullptr;
+    uint32_t connects = 0;
+    uint32_t writes = 0;
+    uint32_t notifications = 0;
+    uint32_t lost = 0;
+
+    NimBLESimCharacteristic &add(const NimBLEUUID &service, const NimBLEUUID &uuid, uint32_t properties)
+    {
+        NimBLESimCharacteristic chr = {service, uuid, properties, (uint16_t)(2 * characteristics.size() + 3), std::string()};
+        characteristics.push_back(chr);
+        return characteristics.back();
+    }
+    NimBLESimCharacteristic *characteristic(const NimBLEUUID &uuid)
+    {
+        for (NimBLESimCharacteristic &chr : characteristics)
+        {
+            if (chr.uuid == uuid)
+            {
+                return &chr;
+            }
+        }
+        return nullptr;
+    }
+    NimBLESimCharacteristic *characteristic(uint16_t handle)
+    {
+        for (NimBLESimCharacteristic &chr : characteristics)
+        {
+            if (chr.handle == handle)
+            {
+                return &chr;
+            }
+        }
+        return nullptr;
+    }
+    bool hasService(const NimBLEUUID &service) const
+    {
+        for (const NimBLESimCharacteristic &chr : characteristics)
+        {
+            if (chr.service == service)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    /** A write from the connected central */
+    bool write(uint16_t handle, const uint8_t *data, size_t size)
+    {
+        NimBLESimCharacteristic *pChr = characteristic(handle);
+        if (nullptr == pChr)
+        {
+            return false;
+        }
+        ++writes;
+        if (onWrite)
+        {
+            return onWrite(*this, *pChr, data, size);
+        }
+        pChr->value.assign((const char *)data, size);
+        return true;
+    }
+    /** Sets a characteristic's value and notifies the central if it subscribed to it,
+     *  unless the notification is lost. Returns whether it was delivered
+     */
+    bool notify(const NimBLEUUID &uuid, const uint8_t *data, size_t size);
+    /** The link drops from the peer's side, as if it reset or went out of range */
+    void drop();
+};
+
+/** The simulated air: peers in it, the central's clients and its scan */
+class NimBLESim
+{
+public:
+    std::vector<NimBLESimPeer *> peers;
+    std::list<NimBLEClient *> clients;
+    NimBLEScan scan;
+    uint16_t nextConn = 1;
+    uint32_t connects = 0;
+    uint32_t failedConnects = 0;
+    uint32_t disconnects = 0;
+    /** Seeds random(), which decides losses */
+    uint32_t seed = 0x9E3779B9;
+
+    static NimBLESim &instance()
+    {
+        static NimBLESim sim;
+        return sim;
+    }
+    /** Deletes the central's clients, as NimBLEDevice::deinit() does. The peers stay */
+    void release()
+    {
+        while (!clients.empty())
+        {
+            NimBLEDevice::deleteClient(clients.front());
+        }
+        scan = NimBLEScan();
+    }
+    /** Deletes the central's clients and forgets the peers, which the test owns */
+    void reset()
+    {
+        release();
+        std::vector<NimBLESimPeer *>().swap(peers);
+        nextConn = 1;
+        connects = 0;
+        failedConnects = 0;
+        disconnects = 0;
+        seed = 0x9E3779B9;
+    }
+    /** Seeded xorshift32, so a run is repeatable */
+    uint32_t random()
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    void add(NimBLESimPeer *pPeer)
+    {
+        peers.push_back(pPeer);
+    }
+    NimBLESimPeer *find(const NimBLEAddress &address)
+    {
+        for (NimBLESimPeer *pPeer : peers)
+        {
+            if (pPeer->address == address)
+            {
+                return pPeer;
+            }
+        }
+        return nullptr;
+    }
+    NimBLEClient *client(uint16_t conn)
+    {
+        for (NimBLEClient *pClient : clients)
+        {
+            if (pClient->m_connected && pClient->m_conn == conn)
+            {
+                return pClient;
+            }
+        }
+        return nullptr;
+    }
+    size_t connected() const
+    {
+        size_t count = 0;
+        for (const NimBLEClient *pClient : clients)
+        {
+            count += pClient->m_connected ? 1 : 0;
+        }
+        return count;
+    }
+    bool scanning() const
+    {
+        return scan.m_scanning;
+    }
+    uint32_t scanStarts() const
+    {
+        return scan.m_starts;
+    }
+    uint16_t scanInterval() const
+    {
+        return scan.m_interval;
+    }
+    /** Reports one advertisement from every peer in range and not connected to the scan,
+     *  if it runs. Returns how many were reported
+     */
+    size_t advertise()
+    {
+        if (!scan.m_scanning || nullptr == scan.m_callbacks)
+        {
+            return 0;
+        }
+        size_t reported = 0;
+        for (size_t i = 0; i < peers.size(); ++i)
+        {
+            if (peers[i]->inRange && nullptr == peers[i]->client)
+            {
+                NimBLEAdvertisedDevice device;
+                device.m_peer = peers[i];
+                scan.m_callbacks->onResult(&device);
+                ++reported;
+            }
+        }
+        return reported;
+    }
+    /** Ends a connection from either side and tells the central */
+    void disconnect(NimBLEClient *pClient)
+    {
+        pClient->m_connected = false;
+        pClient->m_peer->client = nullptr;
+        pClient->m_peer = nullptr;
+        for (NimBLERemoteService *pSvc : pClient->m_services)
+        {
+            for (NimBLERemoteCharacteristic *pChr : pSvc->m_characteristics)
+            {
+                pChr->m_subscribed = false;
+            }
+        }
+        ++disconnects;
+        if (nullptr != pClient->m_callbacks)
+        {
+            pClient->m_callbacks->onDisconnect(pClient);
+        }
+    }
+};
+
+inline bool NimBLESimPeer::notify(const NimBLEUUID &uuid, const uint8_t *data, size_t size)
+{
+    NimBLESimCharacteristic *pChr = characteristic(uuid);
+    if (nullptr == pChr)
+    {
+        return false;
+    }
+    pChr->value.assign((const char *)data, size);
+    if (nullptr == client)
+    {
+        return false;
+    }
+    ++notifications;
+    if (loss && NimBLESim::instance().random() % 100 < loss)
+    {
+        ++lost;
+        return false;
+    }
+    for (NimBLERemoteService *pSvc : client->m_services)
+    {
+        for (NimBLERemoteCharacteristic *pRemote : pSvc->m_characteristics)
+        {
+            if (pRemote->m_handle == pChr->handle && pRemote->m_subscribed && pRemote->m_notify)
+            {
+                std::vector<uint8_t> copy(data, data + size);
+                pRemote->m_notify(pRemote, copy.data(), size, true);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+inline void NimBLESimPeer::drop()
+{
+    if (nullptr != client)
+    {
+        NimBLESim::instance().disconnect(client);
+    }
+}
+
+inline NimBLEAddress NimBLEAdvertisedDevice::getAddress() { return m_peer->address; }
+inline int NimBLEAdvertisedDevice::getRSSI() { return m_peer->rssi; }
+inline bool NimBLEAdvertisedDevice::isConnectable() { return m_peer->connectable; }
+inline bool NimBLEAdvertisedDevice::haveServiceData() { return !m_peer->serviceData.empty(); }
+inline std::string NimBLEAdvertisedDevice::getServiceData(const NimBLEUUID &uuid)
+{
+    return uuid == m_peer->serviceDataUuid ? m_peer->serviceData : std::string();
+}
+inline bool NimBLEAdvertisedDevice::isAdvertisingService(const NimBLEUUID &uuid)
+{
+    return std::find(m_peer->advertised.begin(), m_peer->advertised.end(), uuid) != m_peer->advertised.end();
+}
+inline std::string NimBLEAdvertisedDevice::toString() { return "Address: " + m_peer->address.toString(); }
+
+inline bool NimBLEScan::start(uint32_t, void (*)(NimBLEScanResults), bool)
+{
+    m_scanning = true;
+    ++m_starts;
+    return true;
+}
+inline bool NimBLEScan::isScanning() { return m_scanning; }
+inline bool NimBLEScan::stop()
+{
+    m_scanning = false;
+    return true;
+}
+inline void NimBLEScan::setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks *pCallbacks, bool) { m_callbacks = pCallbacks; }
+inline void NimBLEScan::setActiveScan(bool active) { m_active = active; }
+inline void NimBLEScan::setInterval(uint16_t interval) { m_interval = interval; }
+inline void NimBLEScan::setWindow(uint16_t window) { m_window = window; }
+inline void NimBLEScan::setDuplicateFilter(bool) {}
+
+inline bool NimBLERemoteCharacteristic::canBroadcast() { return m_properties & BLE_GATT_CHR_F_BROADCAST; }
+inline bool NimBLERemoteCharacteristic::canIndicate() { return m_properties & BLE_GATT_CHR_F_INDICATE; }
+inline bool NimBLERemoteCharacteristic::canNotify() { return m_properties & BLE_GATT_CHR_F_NOTIFY; }
+inline bool NimBLERemoteCharacteristic::canRead() { return m_properties & BLE_GATT_CHR_F_READ; }
+inline bool NimBLERemoteCharacteristic::canWrite() { return m_properties & BLE_GATT_CHR_F_WRITE; }
+inline bool NimBLERemoteCharacteristic::canWriteNoResponse() { return m_properties & BLE_GATT_CHR_F_WRITE_NO_RSP; }
+inline uint16_t NimBLERemoteCharacteristic::getHandle() { return m_handle; }
+inline NimBLEUUID NimBLERemoteCharacteristic::getUUID() { return m_uuid; }
+inline NimBLERemoteService *NimBLERemoteCharacteristic::getRemoteService() { return m_service; }
+inline std::vector<NimBLERemoteDescriptor *> *NimBLERemoteCharacteristic::getDescriptors(bool) { return &m_descriptors; }
+inline NimBLERemoteDescriptor *NimBLERemoteCharacteristic::getDescriptor(const NimBLEUUID &) { return nullptr; }
+inline std::string NimBLERemoteCharacteristic::readValue(time_t *)
+{
+    NimBLESimPeer *pPeer = m_service->m_client->m_peer;
+    NimBLESimCharacteristic *pChr = (nullptr != pPeer) ? pPeer->characteristic(m_handle) : nullptr;
+    return (nullptr != pChr) ? pChr->value : std::string();
+}
+inline bool NimBLERemoteCharacteristic::subscribe(bool, notify_callback notifyCallback, bool)
+{
+    if (!m_service->m_client->m_connected)
+    {
+        return false;
+    }
+    m_notify = notifyCallback;
+    m_subscribed = true;
+    return true;
+}
+inline bool NimBLERemoteCharacteristic::writeValue(const uint8_t *data, size_t size, bool)
+{
+    NimBLESimPeer *pPeer = m_service->m_client->m_peer;
+    return nullptr != pPeer && pPeer->write(m_handle, data, size);
+}
+
+inline NimBLERemoteService::~NimBLERemoteService()
+{
+    for (NimBLERemoteCharacteristic *pChr : m_characteristics)
+    {
+        delete pChr;
+    }
+}
+inline NimBLEClient *NimBLERemoteService::getClient() { return m_client; }
+inline NimBLEUUID NimBLERemoteService::getUUID() { return m_uuid; }
+inline std::vector<NimBLERemoteCharacteristic *> *NimBLERemoteService::getCharacteristics(bool) { return &m_characteristics; }
+/** Discovers the characteristic on the peer unless it was found before */
+inline NimBLERemoteCharacteristic *NimBLERemoteService::getCharacteristic(const NimBLEUUID &uuid)
+{
+    for (NimBLERemoteCharacteristic *pChr : m_characteristics)
+    {
+        if (pChr->m_uuid == uuid)
+        {
+            return pChr;
+        }
+    }
+    NimBLESimPeer *pPeer = m_client->m_peer;
+    NimBLESimCharacteristic *pFound = (nullptr != pPeer) ? pPeer->characteristic(uuid) : nullptr;
+    if (nullptr == pFound || pFound->service != m_uuid)
+    {
+        return nullptr;
+    }
+    NimBLERemoteCharacteristic *pChr = new NimBLERemoteCharacteristic();
+    pChr->m_service = this;
+    pChr->m_uuid = uuid;
+    pChr->m_properties = pFound->properties;
+    pChr->m_handle = pFound->handle;
+    m_characteristics.push_back(pChr);
+    return pChr;
+}
+
+inline NimBLEClient::~NimBLEClient()
+{
+    deleteServices();
+}
+inline void NimBLEClient::deleteServices()
+{
+    for (NimBLERemoteService *pSvc : m_services)
+    {
+        delete pSvc;
+    }
+    m_services.clear();
+}
+inline bool NimBLEClient::connect(const NimBLEAddress &address, bool deleteAttributes)
+{
+    NimBLESim &sim = NimBLESim::instance();
+    if (m_connected)
+    {
+        return false;
+    }
+    if (deleteAttributes)
+    {
+        deleteServices();
+    }
+    m_peerAddress = address;
+    NimBLESimPeer *pPeer = sim.find(address);
+    if (nullptr == pPeer || !pPeer->inRange || !pPeer->connectable || !pPeer->accepting ||
+        nullptr != pPeer->client || sim.connected() >= NIMBLE_MAX_CONNECTIONS)
+    {
+        ++sim.failedConnects;
+        return false;
+    }
+    m_peer = pPeer;
+    pPeer->client = this;
+    ++pPeer->connects;
+    ++sim.connects;
+    m_conn = sim.nextConn++;
+    if (BLE_HS_CONN_HANDLE_NONE == sim.nextConn)
+    {
+        sim.nextConn = 1;
+    }
+    m_mtu = pPeer->mtu;
+    m_connected = true;
+    if (nullptr != m_callbacks)
+    {
+        m_callbacks->onConnect(this);
+    }
+    return true;
+}
+inline int NimBLEClient::disconnect(uint8_t)
+{
+    if (!m_connected)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    NimBLESim::instance().disconnect(this);
+    return 0;
+}
+inline NimBLEAddress NimBLEClient::getPeerAddress() const { return m_peerAddress; }
+inline int NimBLEClient::getRssi() { return (nullptr != m_peer) ? m_peer->rssi : 0; }
+inline std::vector<NimBLERemoteService *> *NimBLEClient::getServices(bool) { return &m_services; }
+/** Discovers the service on the peer unless it was found before */
+inline NimBLERemoteService *NimBLEClient::getService(const NimBLEUUID &uuid)
+{
+    for (NimBLERemoteService *pSvc : m_services)
+    {
+        if (pSvc->m_uuid == uuid)
+        {
+            return pSvc;
+        }
+    }
+    if (!m_connected || !m_peer->hasService(uuid))
+    {
+        return nullptr;
+    }
+    NimBLERemoteService *pSvc = new NimBLERemoteService();
+    pSvc->m_client = this;
+    pSvc->m_uuid = uuid;
+    m_services.push_back(pSvc);
+    return pSvc;
+}
+inline bool NimBLEClient::isConnected() { return m_connected; }
+inline void NimBLEClient::setClientCallbacks(NimBLEClientCallbacks *pCallbacks, bool) { m_callbacks = pCallbacks; }
+inline uint16_t NimBLEClient::getConnId() { return m_conn; }
+inline uint16_t NimBLEClient::getMTU() { return m_connected ? m_mtu : 0; }
+inline bool NimBLEClient::secureConnection() { return m_connected; }
+inline void NimBLEClient::setConnectTimeout(uint8_t) {}
+inline void NimBLEClient::setConnectionParams(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t, uint16_t) {}
+inline void NimBLEClient::updateConnParams(uint16_t, uint16_t, uint16_t, uint16_t) {}
+
+inline void NimBLEDevice::init(const std::string &) {}
+inline void NimBLEDevice::deinit(bool clearAll)
+{
+    if (clearAll)
+    {
+        NimBLESim::instance().release();
+    }
+}
+inline void NimBLEDevice::setPower(esp_power_level_t, int) {}
+inline void NimBLEDevice::setSecurityAuth(uint8_t) {}
+inline NimBLEScan *NimBLEDevice::getScan() { return &NimBLESim::instance().scan; }
+inline NimBLEClient *NimBLEDevice::createClient(NimBLEAddress peerAddress)
+{
+    NimBLEClient *pClient = new NimBLEClient();
+    pClient->m_peerAddress = peerAddress;
+    NimBLESim::instance().clients.push_back(pClient);
+    return pClient;
+}
+inline bool NimBLEDevice::deleteClient(NimBLEClient *pClient)
+{
+    NimBLESim &sim = NimBLESim::instance();
+    std::list<NimBLEClient *>::iterator it = std::find(sim.clients.begin(), sim.clients.end(), pClient);
+    if (it == sim.clients.end())
+    {
+        return false;
+    }
+    pClient->disconnect();
+    sim.clients.erase(it);
+    delete pClient;
+    return true;
+}
+inline NimBLEClient *NimBLEDevice::getClientByID(uint16_t conn) { return NimBLESim::instance().client(conn); }
+inline NimBLEClient *NimBLEDevice::getClientByPeerAddress(const NimBLEAddress &address)
+{
+    for (NimBLEClient *pClient : NimBLESim::instance().clients)
+    {
+        if (pClient->m_peerAddress == address)
+        {
+            return pClient;
+        }
+    }
+    return nullptr;
+}
+inline NimBLEClient *NimBLEDevice::getDisconnectedClient()
+{
+    for (NimBLEClient *pClient : NimBLESim::instance().clients)
+    {
+        if (!pClient->m_connected)
+        {
+            return pClient;
+        }
+    }
+    return nullptr;
+}
+inline size_t NimBLEDevice::getClientListSize() { return NimBLESim::instance().clients.size(); }
+inline std::list<NimBLEClient *> *NimBLEDevice::getClientList() { return &NimBLESim::instance().clients; }
+
+inline int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc *out_desc)
+{
+    if (nullptr == NimBLESim::instance().client(handle))
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    memset(out_desc, 0, sizeof(*out_desc));
+    out_desc->conn_handle = handle;
+    out_desc->conn_itvl = 12;
+    out_desc->supervision_timeout = 51;
+    out_desc->role = BLE_GAP_ROLE_MASTER;
+    return 0;
+}
+inline int ble_gattc_write_flat(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t data_len, ble_gatt_attr_fn *cb, void *cb_arg)
+{
+    NimBLEClient *pClient = NimBLESim::instance().client(conn_handle);
+    if (nullptr == pClient)
+    {
+        return BLE_HS_ENOTCONN;
+    }
+    bool written = pClient->m_peer->write(attr_handle, (const uint8_t *)data, data_len);
+    if (nullptr != cb)
+    {
+        ble_gatt_error error = {(uint16_t)(written ? 0 : BLE_HS_EREJECT), attr_handle};
+        cb(conn_handle, &error, nullptr, cb_arg);
+    }
+    return 0;
+}
+inline int ble_gap_conn_cancel(void) { return 0; }
+inline int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason)
+{
+    NimBLEClient *pClient = NimBLESim::instance().client(conn_handle);
+    return (nullptr != pClient) ? pClient->disconnect(hci_reason) : BLE_HS_ENOTCONN;
+}
+inline int ble_gap_conn_active(void) { return 0; }
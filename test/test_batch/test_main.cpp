@@ -0,0 +1,264 @@
+/** Sample batching: the varint frame format, the peripheral's batcher and the central's
+ *  reader. The stand-in NimBLE only needs the few server calls a notification makes
+ */
+#define CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED
+#include <unity.h>
+#include <chrono>
+#include <vector>
+#include "BleBatch.h"
+
+#define CONN 1
+
+static NimBLEServer server;
+static NimBLECharacteristic characteristic;
+static uint16_t mtu;
+static uint32_t nowMs;
+static uint8_t buffer[BLE_FRAME_MAX_SIZE];
+static BleBoundValue bound;
+static BleSampleBatcher batcher;
+/** What the central decoded from the frames notified so far */
+static std::vector<BleSample> received;
+static std::vector<uint8_t> notified;
+static uint32_t frames;
+struct os_mbuf
+{
+    int unused;
+};
+static os_mbuf mbuf;
+
+os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    notified.assign((const uint8_t *)buf, (const uint8_t *)buf + len);
+    return &mbuf;
+}
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, os_mbuf *om)
+{
+    (void)conn_handle;
+    (void)att_handle;
+    (void)om;
+    BleBatchReader reader;
+    if (!reader.begin(notified.data(), notified.size()))
+    {
+        return BLE_HS_EREJECT;
+    }
+    BleSample sample;
+    while (reader.next(&sample))
+    {
+        received.push_back(sample);
+    }
+    ++frames;
+    return 0;
+}
+int ble_gap_conn_find(uint16_t handle, ble_gap_conn_desc *out_desc)
+{
+    (void)out_desc;
+    return CONN == handle ? 0 : BLE_HS_ENOTCONN;
+}
+uint16_t NimBLEServer::getPeerMTU(uint16_t conn_id)
+{
+    return CONN == conn_id ? mtu : 0;
+}
+uint16_t NimBLECharacteristic::getHandle()
+{
+    return 3;
+}
+static uint32_t testClock(void *state)
+{
+    (void)state;
+    return nowMs;
+}
+/** Lets BleTraffic hand everything queued to the stand-in stack */
+static void send()
+{
+    while (BleTraffic::instance().update())
+    {
+    }
+}
+
+void setUp()
+{
+    nowMs = 1000;
+    mtu = 247;
+    BleClock::use(testClock);
+    BleTraffic::instance().begin();
+    bound.bind(&characteristic, buffer, sizeof(buffer), 0, nullptr, nullptr);
+    bound.subscribed(CONN, 1);
+    batcher.begin(&bound, &server);
+    received.clear();
+    frames = 0;
+}
+void tearDown()
+{
+    BleClock::use(nullptr);
+}
+
+void test_varint_sizes()
+{
+    const uint32_t values[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456, UINT32_MAX};
+    const size_t sizes[] = {1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        uint8_t encoded[5];
+        size_t size = ble_put_varint(encoded, values[i]);
+        TEST_ASSERT_EQUAL(sizes[i], size);
+        uint32_t decoded;
+        TEST_ASSERT_EQUAL(size, ble_get_varint(encoded, encoded + size, &decoded));
+        TEST_ASSERT_EQUAL_UINT32(values[i], decoded);
+        /** One byte short is no varint */
+        TEST_ASSERT_EQUAL(0, ble_get_varint(encoded, encoded + size - 1, &decoded));
+    }
+    /** Nor is one that never ends */
+    const uint8_t endless[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    uint32_t decoded;
+    TEST_ASSERT_EQUAL(0, ble_get_varint(endless, endless + sizeof(endless), &decoded));
+}
+
+void test_zigzag()
+{
+    TEST_ASSERT_EQUAL_UINT32(0, ble_zigzag(0));
+    TEST_ASSERT_EQUAL_UINT32(1, ble_zigzag(-1));
+    TEST_ASSERT_EQUAL_UINT32(2, ble_zigzag(1));
+    TEST_ASSERT_EQUAL_UINT32(3, ble_zigzag(-2));
+    const int32_t values[] = {0, 1, -1, 63, -64, 64, INT32_MAX, INT32_MIN};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        TEST_ASSERT_EQUAL_INT32(values[i], ble_unzigzag(ble_zigzag(values[i])));
+    }
+}
+
+void test_reader_stops_at_truncation()
+{
+    uint8_t frame[BLE_BATCH_HEADER_SIZE + 4];
+    frame[0] = BLE_BATCH_VERSION;
+    frame[1] = 3;
+    ble_batch_put_u32(frame + 2, 100);
+    ble_batch_put_u32(frame + 6, 130);
+    /** Three samples claimed, one and a half present */
+    frame[10] = 5;
+    frame[11] = ble_zigzag(-7);
+    frame[12] = 10;
+    frame[13] = 0x80;
+    BleBatchReader reader;
+    TEST_ASSERT_TRUE(reader.begin(frame, sizeof(frame)));
+    BleSample sample;
+    TEST_ASSERT_TRUE(reader.next(&sample));
+    TEST_ASSERT_EQUAL_UINT32(105, sample.ts);
+    TEST_ASSERT_EQUAL_INT32(-7, sample.value);
+    TEST_ASSERT_EQUAL_UINT32(25, reader.age(sample));
+    TEST_ASSERT_FALSE(reader.next(&sample));
+    TEST_ASSERT_EQUAL(0, reader.count());
+    frame[0] = BLE_BATCH_VERSION + 1;
+    TEST_ASSERT_FALSE(reader.begin(frame, sizeof(frame)));
+}
+
+void test_sends_full_frames()
+{
+    /** 20 byte payloads: the header and five small samples */
+    mtu = 23;
+    for (int32_t i = 0; i < 12; ++i)
+    {
+        nowMs += 1;
+        TEST_ASSERT_TRUE(batcher.add(i * 10, nowMs));
+        batcher.update(nowMs);
+    }
+    send();
+    TEST_ASSERT_EQUAL_UINT32(2, frames);
+    TEST_ASSERT_EQUAL_UINT32(2, batcher.stats().full);
+    batcher.flush(nowMs);
+    send();
+    TEST_ASSERT_EQUAL(12, received.size());
+    for (size_t i = 0; i < received.size(); ++i)
+    {
+        TEST_ASSERT_EQUAL_UINT32(1001 + i, received[i].ts);
+        TEST_ASSERT_EQUAL_INT32((int32_t)i * 10, received[i].value);
+    }
+}
+
+void test_sends_on_deadline()
+{
+    batcher.add(1, nowMs);
+    batcher.add(2, nowMs + 10);
+    batcher.update(nowMs + BLE_BATCH_LATENCY_MS - 1);
+    send();
+    TEST_ASSERT_EQUAL_UINT32(0, frames);
+    batcher.update(nowMs + BLE_BATCH_LATENCY_MS);
+    send();
+    TEST_ASSERT_EQUAL_UINT32(1, frames);
+    TEST_ASSERT_EQUAL(2, received.size());
+    TEST_ASSERT_EQUAL_UINT32(BLE_BATCH_LATENCY_MS, batcher.stats().latency.max);
+}
+
+void test_frames_queued_together_stay_whole()
+{
+    /** Frames wait in BleTraffic while the next one fills the same buffer */
+    mtu = 23;
+    for (int32_t i = 0; i < 30; ++i)
+    {
+        batcher.add(i, nowMs + i);
+    }
+    batcher.flush(nowMs + 30);
+    send();
+    TEST_ASSERT_EQUAL(30, received.size());
+    for (size_t i = 0; i < received.size(); ++i)
+    {
+        TEST_ASSERT_EQUAL_INT32((int32_t)i, received[i].value);
+    }
+}
+
+void test_idle_without_subscribers()
+{
+    bound.subscribed(CONN, 0);
+    TEST_ASSERT_FALSE(batcher.add(1, nowMs));
+    TEST_ASSERT_EQUAL_UINT32(0, batcher.stats().samples);
+}
+
+/** Samples per second through batcher and reader, bytes per sample and per-sample latency,
+ *  at the smallest and the usual MTU. Run with -v to see the figures
+ */
+void test_benchmark()
+{
+    const uint16_t mtus[] = {23, 247};
+    for (size_t m = 0; m < 2; ++m)
+    {
+        setUp();
+        mtu = mtus[m];
+        const uint32_t count = 200000;
+        int32_t value = 20000;
+        uint32_t seed = 1;
+        auto startTS = std::chrono::steady_clock::now();
+        /** 4 kHz of a slowly wandering value */
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            nowMs += (0 == i % 4) ? 1 : 0;
+            seed = seed * 1103515245 + 12345;
+            value += (int32_t)((seed >> 16) % 21) - 10;
+            batcher.add(value, nowMs);
+            batcher.update(nowMs);
+            send();
+        }
+        batcher.flush(nowMs);
+        send();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTS).count();
+        const BleBatchStats &stats = batcher.stats();
+        printf("  batch: MTU %u, %.2f M samples/s, %.1f per frame, %.2f bytes each, latency p50 %u ms, max %u ms\n",
+               (unsigned)mtu, count / elapsed / 1e6, (double)count / stats.frames, (double)stats.bytes / count,
+               (unsigned)stats.latency.percentile(500), (unsigned)stats.latency.max);
+        TEST_ASSERT_EQUAL(count, received.size());
+        TEST_ASSERT_EQUAL_INT32(value, received.back().value);
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_varint_sizes);
+    RUN_TEST(test_zigzag);
+    RUN_TEST(test_reader_stops_at_truncation);
+    RUN_TEST(test_sends_full_frames);
+    RUN_TEST(test_sends_on_deadline);
+    RUN_TEST(test_frames_queued_together_stay_whole);
+    RUN_TEST(test_idle_without_subscribers);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,304 @@
+#include <unity.h>
+#include <stdlib.h>
+#include "BleCompress.h"
+
+/** A diagnostic log, the kind of repetitive text the session characteristic carries */
+static const char *LOG_LINES[] = {
+    "I (1234) BLE: conn=1 rssi=-61 mtu=247\n",
+    "I (1240) BLE: conn=2 rssi=-67 mtu=247\n",
+    "W (1300) BLE: retry conn=3 reason=0x13\n",
+    "I (1310) BLE: conn=2 rssi=-66 mtu=247\n",
+    "I (1322) BLE: rpc id=812 status=0 rtt=18ms\n",
+    "I (1330) BLE: conn=1 rssi=-62 mtu=247\n"};
+#define LOG_LINE_COUNT (sizeof(LOG_LINES) / sizeof(LOG_LINES[0]))
+
+static uint32_t nowMs;
+static uint32_t testClock(void *state)
+{
+    (void)state;
+    return nowMs;
+}
+
+/** Fills frame with size bytes of log, starting at line */
+static size_t logFrame(uint8_t *frame, size_t size, size_t line)
+{
+    size_t used = 0;
+    while (used < size)
+    {
+        const char *text = LOG_LINES[line++ % LOG_LINE_COUNT];
+        size_t length = strlen(text);
+        length = (used + length > size) ? size - used : length;
+        memcpy(frame + used, text, length);
+        used += length;
+    }
+    return line;
+}
+static bool roundTrips(const uint8_t *in, size_t size)
+{
+    uint8_t packed[512];
+    uint8_t unpacked[512];
+    size_t packedSize;
+    size_t unpackedSize;
+    return ble_lz_compress(in, size, packed, sizeof(packed), &packedSize) &&
+           ble_lz_decompress(packed, packedSize, unpacked, sizeof(unpacked), &unpackedSize) &&
+           unpackedSize == size && 0 == memcmp(in, unpacked, size);
+}
+
+void setUp()
+{
+    nowMs = 0;
+    BleClock::use(testClock);
+}
+void tearDown()
+{
+    BleClock::use(nullptr);
+}
+
+void test_round_trip()
+{
+    uint8_t frame[240];
+    logFrame(frame, sizeof(frame), 0);
+    TEST_ASSERT_TRUE(roundTrips(frame, sizeof(frame)));
+    uint32_t counters[60];
+    for (size_t i = 0; i < 60; ++i)
+    {
+        counters[i] = 1000 + i * 3;
+    }
+    TEST_ASSERT_TRUE(roundTrips((const uint8_t *)counters, sizeof(counters)));
+    TEST_ASSERT_TRUE(roundTrips(frame, 0));
+    TEST_ASSERT_TRUE(roundTrips(frame, 1));
+}
+
+void test_runs_overlap()
+{
+    uint8_t run[240];
+    memset(run, 'A', sizeof(run));
+    uint8_t packed[16];
+    size_t packedSize;
+    /** One literal, then a match that copies from the bytes it writes */
+    TEST_ASSERT_TRUE(ble_lz_compress(run, sizeof(run), packed, sizeof(packed), &packedSize));
+    TEST_ASSERT_EQUAL(4, packedSize);
+    TEST_ASSERT_TRUE(roundTrips(run, sizeof(run)));
+}
+
+void test_capacity_refuses()
+{
+    uint8_t noise[64];
+    srand(7);
+    for (size_t i = 0; i < sizeof(noise); ++i)
+    {
+        noise[i] = (uint8_t)rand();
+    }
+    uint8_t packed[80];
+    size_t packedSize;
+    TEST_ASSERT_FALSE(ble_lz_compress(noise, sizeof(noise), packed, sizeof(noise) - 1, &packedSize));
+
+    BleCompressStats stats;
+    memset(&stats, 0, sizeof(stats));
+    bool compressed;
+    TEST_ASSERT_EQUAL(sizeof(noise), ble_lz_encode(noise, sizeof(noise), packed, sizeof(packed), &compressed, &stats));
+    TEST_ASSERT_FALSE(compressed);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.incompressible);
+    /** Too small to try */
+    TEST_ASSERT_EQUAL(BLE_LZ_MIN_SIZE - 1, ble_lz_encode(noise, BLE_LZ_MIN_SIZE - 1, packed, sizeof(packed), &compressed, &stats));
+    TEST_ASSERT_EQUAL_UINT32(sizeof(noise), stats.plainBytes);
+}
+
+void test_malformed_rejected()
+{
+    uint8_t out[64];
+    size_t outSize;
+    /** A match before anything was written */
+    const uint8_t early[] = {0x01, 0x00, 0x00};
+    TEST_ASSERT_FALSE(ble_lz_decompress(early, sizeof(early), out, sizeof(out), &outSize));
+    /** A match cut short */
+    const uint8_t truncated[] = {0x02, 'a', 0x00};
+    TEST_ASSERT_FALSE(ble_lz_decompress(truncated, sizeof(truncated), out, sizeof(out), &outSize));
+    /** Expanding past capacity */
+    const uint8_t large[] = {0x02, 'a', 0x00, 0xFF};
+    TEST_ASSERT_FALSE(ble_lz_decompress(large, sizeof(large), out, sizeof(out), &outSize));
+}
+
+void test_random_round_trips()
+{
+    srand(1);
+    uint8_t in[240];
+    for (int i = 0; i < 2000; ++i)
+    {
+        size_t size = (size_t)rand() % sizeof(in);
+        int alphabet = 1 + rand() % 255;
+        for (size_t j = 0; j < size; ++j)
+        {
+            in[j] = (uint8_t)(rand() % alphabet);
+        }
+        TEST_ASSERT_TRUE(roundTrips(in, size));
+        /** Garbage must fail cleanly, never overrun */
+        uint8_t out[240];
+        size_t outSize;
+        ble_lz_decompress(in, size % 64, out, sizeof(out), &outSize);
+    }
+}
+
+void test_stream_matches_earlier_frames()
+{
+    BleLzStream sender;
+    BleLzStream receiver;
+    sender.restart();
+    receiver.restart();
+    BleCompressStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint8_t frame[120];
+    uint8_t packed[sizeof(frame)];
+    uint8_t unpacked[sizeof(frame)];
+    size_t line = 0;
+    size_t first = 0;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        line = logFrame(frame, sizeof(frame), line);
+        bool compressed;
+        size_t size = ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+        TEST_ASSERT_TRUE(compressed);
+        TEST_ASSERT_EQUAL_UINT8(0 == i ? 0 : i, packed[0]);
+        first = (0 == i) ? size : first;
+        if (i)
+        {
+            /** The window already holds lines like these */
+            TEST_ASSERT_LESS_THAN(first, size);
+        }
+        size_t unpackedSize;
+        TEST_ASSERT_TRUE(ble_lz_stream_decode(&receiver, packed, size, unpacked, sizeof(unpacked), &unpackedSize));
+        TEST_ASSERT_EQUAL(sizeof(frame), unpackedSize);
+        TEST_ASSERT_EQUAL_MEMORY(frame, unpacked, sizeof(frame));
+        nowMs += 10;
+    }
+    TEST_ASSERT_EQUAL_UINT32(8, stats.compressed);
+    TEST_ASSERT_EQUAL_UINT32(7, stats.streamed);
+}
+
+void test_stream_refuses_after_loss()
+{
+    BleLzStream sender;
+    BleLzStream receiver;
+    sender.restart();
+    receiver.restart();
+    BleCompressStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint8_t frame[120];
+    uint8_t packed[4][sizeof(frame)];
+    size_t sizes[4];
+    size_t line = 0;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        line = logFrame(frame, sizeof(frame), line);
+        bool compressed;
+        sizes[i] = ble_lz_stream_encode(&sender, frame, sizeof(frame), packed[i], sizeof(packed[i]), &compressed, &stats);
+    }
+    uint8_t out[sizeof(frame)];
+    size_t outSize;
+    TEST_ASSERT_TRUE(ble_lz_stream_decode(&receiver, packed[0], sizes[0], out, sizeof(out), &outSize));
+    /** Frame 1 never arrived: 2 is refused, and so is 3 although it follows 2 */
+    TEST_ASSERT_FALSE(ble_lz_stream_decode(&receiver, packed[2], sizes[2], out, sizeof(out), &outSize));
+    TEST_ASSERT_FALSE(ble_lz_stream_decode(&receiver, packed[3], sizes[3], out, sizeof(out), &outSize));
+
+    /** Until the sender restarts */
+    sender.restart();
+    logFrame(frame, sizeof(frame), line);
+    bool compressed;
+    size_t size = ble_lz_stream_encode(&sender, frame, sizeof(frame), packed[0], sizeof(packed[0]), &compressed, &stats);
+    TEST_ASSERT_EQUAL_UINT8(0, packed[0][0]);
+    TEST_ASSERT_TRUE(ble_lz_stream_decode(&receiver, packed[0], size, out, sizeof(out), &outSize));
+    TEST_ASSERT_EQUAL_MEMORY(frame, out, sizeof(frame));
+}
+
+void test_stream_restarts()
+{
+    BleLzStream sender;
+    sender.restart();
+    BleCompressStats stats;
+    memset(&stats, 0, sizeof(stats));
+    uint8_t frame[120];
+    uint8_t packed[sizeof(frame)];
+    bool compressed;
+    logFrame(frame, sizeof(frame), 0);
+    ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+    ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+    TEST_ASSERT_EQUAL_UINT8(1, packed[0]);
+    /** A pause ends the transfer */
+    nowMs += BLE_LZ_STREAM_IDLE_MS;
+    ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+    TEST_ASSERT_EQUAL_UINT8(0, packed[0]);
+    /** So does a long run of frames */
+    for (size_t i = 1; i < BLE_LZ_STREAM_FRAMES; ++i)
+    {
+        ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+        TEST_ASSERT_EQUAL_UINT8(i, packed[0]);
+    }
+    ble_lz_stream_encode(&sender, frame, sizeof(frame), packed, sizeof(packed), &compressed, &stats);
+    TEST_ASSERT_EQUAL_UINT8(0, packed[0]);
+    /** A frame that doesn't shrink stays out of the window */
+    uint8_t noise[120];
+    srand(3);
+    for (size_t i = 0; i < sizeof(noise); ++i)
+    {
+        noise[i] = (uint8_t)rand();
+    }
+    uint16_t length = sender.length;
+    TEST_ASSERT_EQUAL(sizeof(noise), ble_lz_stream_encode(&sender, noise, sizeof(noise), packed, sizeof(packed), &compressed, &stats));
+    TEST_ASSERT_FALSE(compressed);
+    TEST_ASSERT_EQUAL_UINT16(length, sender.length);
+}
+
+/** Compression ratio, host encoder cost and throughput gain of a log transfer, per frame
+ *  against streamed, at the payload size of a 247 byte MTU. Run with -v to see the figures
+ */
+void test_benchmark()
+{
+    const size_t frames = 400;
+    const size_t payload = 240;
+    BleCompressStats single;
+    BleCompressStats streamed;
+    memset(&single, 0, sizeof(single));
+    memset(&streamed, 0, sizeof(streamed));
+    BleLzStream sender;
+    BleLzStream receiver;
+    sender.restart();
+    receiver.restart();
+    uint8_t frame[payload];
+    uint8_t packed[payload];
+    uint8_t out[payload];
+    size_t line = 0;
+    for (size_t i = 0; i < frames; ++i)
+    {
+        line = logFrame(frame, payload, line);
+        /** Vary the numbers so frames aren't copies of each other */
+        for (size_t j = 0; j < payload; j += 37)
+        {
+            frame[j] = (uint8_t)('0' + (i + j) % 10);
+        }
+        bool compressed;
+        ble_lz_encode(frame, payload, packed, payload, &compressed, &single);
+        size_t size = ble_lz_stream_encode(&sender, frame, payload, packed, payload, &compressed, &streamed);
+        size_t outSize;
+        TEST_ASSERT_TRUE(!compressed || ble_lz_stream_decode(&receiver, packed, size, out, sizeof(out), &outSize));
+        nowMs += 5;
+    }
+    printf("  compress: per frame %u permille, %u us/KiB, %u permille throughput\n", single.ratio(), single.microsPerKiB(), single.gain());
+    printf("  compress: streamed  %u permille, %u us/KiB, %u permille throughput\n", streamed.ratio(), streamed.microsPerKiB(), streamed.gain());
+    TEST_ASSERT_LESS_THAN(1000, single.ratio());
+    TEST_ASSERT_LESS_THAN(single.ratio(), streamed.ratio());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_runs_overlap);
+    RUN_TEST(test_capacity_refuses);
+    RUN_TEST(test_malformed_rejected);
+    RUN_TEST(test_random_round_trips);
+    RUN_TEST(test_stream_matches_earlier_frames);
+    RUN_TEST(test_stream_refuses_after_loss);
+    RUN_TEST(test_stream_restarts);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
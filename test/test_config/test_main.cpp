@@ -0,0 +1,354 @@
+#include <unity.h>
+#include "BleConfig.h"
+
+static BleConfig master;
+static BleConfig replica;
+static uint8_t frame[BLE_FRAME_MAX_SIZE];
+static uint8_t ack[BLE_CONFIG_ACK_SIZE];
+
+/** Sends the delta for a replica at since through apply() as frames of capacity bytes.
+ *  Returns the frames sent, or 0 if one was rejected or a frame couldn't be built
+ */
+static size_t push(uint32_t since, size_t capacity)
+{
+    size_t cursor = 0;
+    size_t frames = 0;
+    while (true)
+    {
+        size_t size = master.delta(since, &cursor, (uint8_t)frames, frame, capacity);
+        if (0 == size)
+        {
+            return 0;
+        }
+        ++frames;
+        int result = replica.apply(frame, size, ack);
+        if (result < 0)
+        {
+            return 0;
+        }
+        if (frame[BLE_CONFIG_FLAGS] & BLE_CONFIG_LAST)
+        {
+            return 1 == result ? frames : 0;
+        }
+        if (0 != result)
+        {
+            return 0;
+        }
+    }
+}
+
+static bool holds(BleConfig &config, const char *key, const char *value)
+{
+    const uint8_t *stored;
+    int length = config.get(key, &stored);
+    return length == (int)strlen(value) && 0 == memcmp(stored, value, length);
+}
+
+void setUp()
+{
+    master.begin();
+    replica.begin();
+}
+void tearDown() {}
+
+void test_epochs_differ()
+{
+    TEST_ASSERT_TRUE(0 != master.epoch());
+    TEST_ASSERT_TRUE(master.epoch() != replica.epoch());
+}
+
+void test_set_get()
+{
+    const uint8_t *value;
+    TEST_ASSERT_TRUE(master.set("rate", "10"));
+    TEST_ASSERT_EQUAL_UINT32(1, master.version());
+    TEST_ASSERT_TRUE(holds(master, "rate", "10"));
+    /** Setting the same value again is not a change */
+    TEST_ASSERT_TRUE(master.set("rate", "10"));
+    TEST_ASSERT_EQUAL_UINT32(1, master.version());
+    TEST_ASSERT_TRUE(master.remove("rate"));
+    TEST_ASSERT_EQUAL_UINT32(2, master.version());
+    TEST_ASSERT_EQUAL(-1, master.get("rate", &value));
+    TEST_ASSERT_EQUAL(-1, master.get("none", &value));
+}
+
+void test_set_rejects_oversized()
+{
+    char key[BLE_CONFIG_MAX_KEY + 2];
+    memset(key, 'k', sizeof(key) - 1);
+    key[sizeof(key) - 1] = 0;
+    uint8_t value[BLE_CONFIG_MAX_VALUE + 1] = {0};
+    TEST_ASSERT_FALSE(master.set(key, "1"));
+    TEST_ASSERT_FALSE(master.set("key", value, sizeof(value)));
+    TEST_ASSERT_TRUE(master.set("key", value, BLE_CONFIG_MAX_VALUE));
+    TEST_ASSERT_FALSE(master.set("", "1"));
+}
+
+void test_full_sync()
+{
+    master.set("rate", "10");
+    master.set("mode", "fast");
+    TEST_ASSERT_EQUAL(1, push(0, 100));
+    TEST_ASSERT_TRUE(holds(replica, "rate", "10"));
+    TEST_ASSERT_TRUE(holds(replica, "mode", "fast"));
+    TEST_ASSERT_EQUAL_UINT32(master.version(), replica.version());
+    TEST_ASSERT_EQUAL_UINT32(master.epoch(), replica.epoch());
+
+    TEST_ASSERT_TRUE(ble_config_is_ack(ack, sizeof(ack)));
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_ACK, ack[0]);
+    TEST_ASSERT_EQUAL_UINT32(master.epoch(), ble_config_ack_epoch(ack));
+    TEST_ASSERT_EQUAL_UINT32(master.version(), ble_config_ack_version(ack));
+}
+
+void test_empty_resync_clears()
+{
+    master.set("rate", "10");
+    push(0, 100);
+    /** The master restarts with nothing set: a full resync still clears the replica */
+    master.begin();
+    TEST_ASSERT_EQUAL(1, push(0, 100));
+    const uint8_t *value;
+    TEST_ASSERT_EQUAL(-1, replica.get("rate", &value));
+    TEST_ASSERT_EQUAL_UINT32(0, replica.version());
+    TEST_ASSERT_EQUAL_UINT32(master.epoch(), replica.epoch());
+}
+
+void test_incremental_sends_only_changes()
+{
+    master.set("rate", "10");
+    master.set("mode", "fast");
+    push(0, 100);
+    uint32_t acked = replica.version();
+    master.set("mode", "slow");
+
+    size_t cursor = 0;
+    size_t size = master.delta(acked, &cursor, 0, frame, 100);
+    /** One entry: [4]["mode"][4]["slow"] */
+    TEST_ASSERT_EQUAL(BLE_CONFIG_DELTA_HEADER + 2 + 4 + 4, size);
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_FIRST | BLE_CONFIG_LAST, frame[BLE_CONFIG_FLAGS]);
+    TEST_ASSERT_EQUAL(1, replica.apply(frame, size, ack));
+    TEST_ASSERT_TRUE(holds(replica, "mode", "slow"));
+    TEST_ASSERT_TRUE(holds(replica, "rate", "10"));
+    TEST_ASSERT_EQUAL_UINT32(master.version(), ble_config_ack_version(ack));
+}
+
+void test_removal_reaches_replica()
+{
+    master.set("rate", "10");
+    master.set("mode", "fast");
+    push(0, 100);
+    uint32_t acked = replica.version();
+    master.remove("rate");
+    TEST_ASSERT_EQUAL(1, push(acked, 100));
+    const uint8_t *value;
+    TEST_ASSERT_EQUAL(-1, replica.get("rate", &value));
+    TEST_ASSERT_TRUE(holds(replica, "mode", "fast"));
+}
+
+void test_multi_frame_acks_last_only()
+{
+    char key[16];
+    for (int i = 0; i < 20; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        master.set(key, "value");
+    }
+    /** 20 entries of 12 bytes in 40 byte frames: two per frame */
+    size_t cursor = 0;
+    size_t frames = 0;
+    int result = 0;
+    while (true)
+    {
+        size_t size = master.delta(0, &cursor, (uint8_t)frames, frame, 40);
+        TEST_ASSERT_TRUE(size > 0);
+        ++frames;
+        memset(ack, 0, sizeof(ack));
+        result = replica.apply(frame, size, ack);
+        if (frame[BLE_CONFIG_FLAGS] & BLE_CONFIG_LAST)
+        {
+            break;
+        }
+        /** Nothing to notify until the last frame */
+        TEST_ASSERT_EQUAL(0, result);
+        TEST_ASSERT_EQUAL_UINT8(1 == frames ? BLE_CONFIG_FIRST : 0, frame[BLE_CONFIG_FLAGS]);
+    }
+    TEST_ASSERT_EQUAL(10, frames);
+    TEST_ASSERT_EQUAL(1, result);
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_ACK, ack[0]);
+    TEST_ASSERT_TRUE(holds(replica, "key0", "value"));
+    TEST_ASSERT_TRUE(holds(replica, "key19", "value"));
+    TEST_ASSERT_EQUAL_UINT32(20, replica.version());
+}
+
+void test_lost_frame_is_naked()
+{
+    master.set("rate", "10");
+    push(0, 100);
+    uint32_t acked = replica.version();
+    char key[16];
+    for (int i = 0; i < 20; ++i)
+    {
+        snprintf(key, sizeof(key), "key%d", i);
+        master.set(key, "value");
+    }
+    /** Two entries per 40 byte frame; the fourth never arrives */
+    size_t cursor = 0;
+    size_t naks = 0;
+    size_t acks = 0;
+    for (uint8_t index = 0; cursor < 21; ++index)
+    {
+        size_t size = master.delta(acked, &cursor, index, frame, 40);
+        TEST_ASSERT_TRUE(size > 0);
+        if (3 == index)
+        {
+            continue;
+        }
+        int result = replica.apply(frame, size, ack);
+        naks += (result < 0) ? 1 : 0;
+        acks += (result > 0) ? 1 : 0;
+    }
+    /** One nak for the lot, reporting the version the replica still holds */
+    TEST_ASSERT_EQUAL(1, naks);
+    TEST_ASSERT_EQUAL(0, acks);
+    TEST_ASSERT_EQUAL_UINT32(acked, replica.version());
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_NAK, ack[0]);
+    TEST_ASSERT_EQUAL_UINT32(acked, ble_config_ack_version(ack));
+    /** The delta sent again from there completes it */
+    TEST_ASSERT_TRUE(push(ble_config_ack_version(ack), 40) > 0);
+    TEST_ASSERT_EQUAL_UINT32(master.version(), replica.version());
+    TEST_ASSERT_TRUE(holds(replica, "key6", "value"));
+    TEST_ASSERT_TRUE(holds(replica, "key7", "value"));
+    TEST_ASSERT_TRUE(holds(replica, "rate", "10"));
+}
+
+void test_entry_too_big_for_capacity()
+{
+    master.set("mode", "fast");
+    size_t cursor = 0;
+    TEST_ASSERT_EQUAL(0, master.delta(0, &cursor, 0, frame, BLE_CONFIG_DELTA_HEADER));
+    TEST_ASSERT_EQUAL(0, master.delta(0, &cursor, 0, frame, BLE_CONFIG_DELTA_HEADER + 9));
+    TEST_ASSERT_EQUAL(BLE_CONFIG_DELTA_HEADER + 10, master.delta(0, &cursor, 0, frame, BLE_CONFIG_DELTA_HEADER + 10));
+}
+
+void test_other_epoch_is_rejected()
+{
+    master.set("rate", "10");
+    push(0, 100);
+    uint32_t acked = replica.version();
+    /** The master reboots and reaches the same version number with other values */
+    uint32_t oldEpoch = master.epoch();
+    master.begin();
+    master.set("mode", "slow");
+    master.set("mode", "fast");
+    TEST_ASSERT_TRUE(master.version() > acked);
+
+    size_t cursor = 0;
+    size_t size = master.delta(acked, &cursor, 0, frame, 100);
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, size, ack));
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_NAK, ack[0]);
+    TEST_ASSERT_EQUAL_UINT32(oldEpoch, ble_config_ack_epoch(ack));
+
+    /** The resync drops what the old epoch set */
+    TEST_ASSERT_EQUAL(1, push(0, 100));
+    const uint8_t *value;
+    TEST_ASSERT_EQUAL(-1, replica.get("rate", &value));
+    TEST_ASSERT_TRUE(holds(replica, "mode", "fast"));
+}
+
+void test_missing_base_is_rejected()
+{
+    master.set("rate", "10");
+    push(0, 100);
+    master.set("rate", "20");
+    master.set("rate", "30");
+    size_t cursor = 0;
+    /** A delta from version 2, which the replica never got */
+    size_t size = master.delta(2, &cursor, 0, frame, 100);
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, size, ack));
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_NAK, ack[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, ble_config_ack_version(ack));
+    TEST_ASSERT_TRUE(holds(replica, "rate", "10"));
+}
+
+void test_malformed_frames_are_rejected()
+{
+    master.set("mode", "fast");
+    size_t cursor = 0;
+    size_t size = master.delta(0, &cursor, 0, frame, 100);
+    /** Cut short inside the value, then inside the key */
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, size - 1, ack));
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, BLE_CONFIG_DELTA_HEADER + 3, ack));
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, BLE_CONFIG_DELTA_HEADER - 1, ack));
+    frame[0] = 'X';
+    TEST_ASSERT_EQUAL(-1, replica.apply(frame, size, ack));
+    TEST_ASSERT_EQUAL_UINT8(BLE_CONFIG_NAK, ack[0]);
+}
+
+void test_ack_recognition()
+{
+    master.ack(ack);
+    TEST_ASSERT_TRUE(ble_config_is_ack(ack, sizeof(ack)));
+    TEST_ASSERT_FALSE(ble_config_is_ack(ack, sizeof(ack) - 1));
+    /** The old five byte ack, or any text starting with 'A', isn't one */
+    const uint8_t legacy[] = {'A', 1, 0, 0, 0};
+    TEST_ASSERT_FALSE(ble_config_is_ack(legacy, sizeof(legacy)));
+    const char *text = "Alarm: 42";
+    TEST_ASSERT_FALSE(ble_config_is_ack((const uint8_t *)text, strlen(text)));
+    ack[1] ^= 0xFF;
+    TEST_ASSERT_FALSE(ble_config_is_ack(ack, sizeof(ack)));
+}
+
+void test_sync_tracks_acks()
+{
+    BleConfigSync sync;
+    sync.begin(nullptr);
+    master.set("rate", "10");
+    TEST_ASSERT_FALSE(sync.synced(master));
+
+    /** The replica's readable value before any sync carries its own epoch */
+    replica.ack(ack);
+    TEST_ASSERT_EQUAL(-1, sync.received(master, ack, sizeof(ack)));
+    TEST_ASSERT_FALSE(sync.synced(master));
+
+    push(0, 100);
+    sync.received(master, ack, sizeof(ack));
+    TEST_ASSERT_TRUE(sync.synced(master));
+    TEST_ASSERT_EQUAL_UINT32(master.version(), sync.acked());
+
+    master.set("rate", "20");
+    TEST_ASSERT_FALSE(sync.synced(master));
+
+    /** A nak from the same epoch moves the resend point */
+    uint8_t nak[BLE_CONFIG_ACK_SIZE];
+    memcpy(nak, ack, sizeof(nak));
+    nak[0] = BLE_CONFIG_NAK;
+    ble_config_put_u32(nak + 6, 0);
+    sync.received(master, nak, sizeof(nak));
+    TEST_ASSERT_EQUAL_UINT32(0, sync.acked());
+
+    /** Other notifications are ignored */
+    const char *text = "Alarm: 42";
+    TEST_ASSERT_EQUAL(-1, sync.received(master, (const uint8_t *)text, strlen(text)));
+    TEST_ASSERT_EQUAL_UINT32(0, sync.acked());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_epochs_differ);
+    RUN_TEST(test_set_get);
+    RUN_TEST(test_set_rejects_oversized);
+    RUN_TEST(test_full_sync);
+    RUN_TEST(test_empty_resync_clears);
+    RUN_TEST(test_incremental_sends_only_changes);
+    RUN_TEST(test_removal_reaches_replica);
+    RUN_TEST(test_multi_frame_acks_last_only);
+    RUN_TEST(test_lost_frame_is_naked);
+    RUN_TEST(test_entry_too_big_for_capacity);
+    RUN_TEST(test_other_epoch_is_rejected);
+    RUN_TEST(test_missing_base_is_rejected);
+    RUN_TEST(test_malformed_frames_are_rejected);
+    RUN_TEST(test_ack_recognition);
+    RUN_TEST(test_sync_tracks_acks);
+    return UNITY_END();
+}
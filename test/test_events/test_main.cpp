@@ -0,0 +1,176 @@
+/** The event handler table: registration, removal and dispatch */
+#include <unity.h>
+#include <chrono>
+#include <functional>
+#include "BleEvents.h"
+
+static uint32_t calls;
+static uint32_t order;
+
+static void count(const BleEvent &event, void *state)
+{
+    (void)event;
+    calls += (uint32_t)(uintptr_t)state;
+}
+static void first(const BleEvent &event, void *state)
+{
+    (void)event;
+    (void)state;
+    order = order * 10 + 1;
+}
+static void second(const BleEvent &event, void *state)
+{
+    (void)event;
+    (void)state;
+    order = order * 10 + 2;
+}
+
+void setUp()
+{
+    calls = 0;
+    order = 0;
+    BleEvents::instance().begin();
+}
+void tearDown()
+{
+}
+
+void test_dispatches_in_registration_order()
+{
+    BleEvents &events = BleEvents::instance();
+    TEST_ASSERT_FALSE(events.wanted(BLE_EVENT_CONNECTED));
+    TEST_ASSERT_TRUE(events.on(BLE_EVENT_CONNECTED, first, nullptr));
+    TEST_ASSERT_TRUE(events.on(BLE_EVENT_CONNECTED, second, nullptr));
+    TEST_ASSERT_TRUE(events.wanted(BLE_EVENT_CONNECTED));
+    TEST_ASSERT_FALSE(events.wanted(BLE_EVENT_DISCONNECTED));
+    events.dispatch(ble_event(BLE_EVENT_CONNECTED, 1, true));
+    TEST_ASSERT_EQUAL_UINT32(12, order);
+    /** Other types reach nobody */
+    events.dispatch(ble_event(BLE_EVENT_DISCONNECTED, 1, true));
+    TEST_ASSERT_EQUAL_UINT32(12, order);
+}
+
+void test_removes_handlers()
+{
+    BleEvents &events = BleEvents::instance();
+    events.on(BLE_EVENT_CONNECTED, first, nullptr);
+    events.on(BLE_EVENT_CONNECTED, second, nullptr);
+    TEST_ASSERT_TRUE(events.off(BLE_EVENT_CONNECTED, first));
+    TEST_ASSERT_FALSE(events.off(BLE_EVENT_CONNECTED, first));
+    TEST_ASSERT_FALSE(events.off(BLE_EVENTS, second));
+    events.dispatch(ble_event(BLE_EVENT_CONNECTED, 1, true));
+    TEST_ASSERT_EQUAL_UINT32(2, order);
+    TEST_ASSERT_TRUE(events.off(BLE_EVENT_CONNECTED, second));
+    TEST_ASSERT_FALSE(events.wanted(BLE_EVENT_CONNECTED));
+}
+
+void test_refuses_past_capacity()
+{
+    BleEvents &events = BleEvents::instance();
+    for (size_t i = 0; i < BLE_EVENT_HANDLERS; ++i)
+    {
+        TEST_ASSERT_TRUE(events.on(BLE_EVENT_DISCOVERED, count, (void *)1));
+    }
+    TEST_ASSERT_FALSE(events.on(BLE_EVENT_DISCOVERED, count, (void *)1));
+    TEST_ASSERT_FALSE(events.on(BLE_EVENTS, count, (void *)1));
+    TEST_ASSERT_FALSE(events.on(BLE_EVENT_CONNECTED, nullptr, nullptr));
+    events.dispatch(ble_event(BLE_EVENT_DISCOVERED, BLE_HS_CONN_HANDLE_NONE, true));
+    TEST_ASSERT_EQUAL_UINT32(BLE_EVENT_HANDLERS, calls);
+    /** begin() clears the table */
+    events.begin();
+    TEST_ASSERT_FALSE(events.wanted(BLE_EVENT_DISCOVERED));
+}
+
+/** The ways an application could hook a discovery: overriding the NimBLE callback, a
+ *  std::function registered behind the override, and the table behind the override
+ */
+struct Callbacks
+{
+    virtual void onResult(int rssi) = 0;
+    virtual ~Callbacks() {}
+};
+struct Override : Callbacks
+{
+    __attribute__((noinline)) void onResult(int rssi) override
+    {
+        calls += (uint32_t)-rssi;
+    }
+};
+struct Forward : Callbacks
+{
+    std::function<void(int)> fn;
+    __attribute__((noinline)) void onResult(int rssi) override
+    {
+        if (fn)
+        {
+            fn(rssi);
+        }
+    }
+};
+struct Table : Callbacks
+{
+    __attribute__((noinline)) void onResult(int rssi) override
+    {
+        BleEvents &events = BleEvents::instance();
+        if (events.wanted(BLE_EVENT_DISCOVERED))
+        {
+            BleEvent event = ble_event(BLE_EVENT_DISCOVERED, BLE_HS_CONN_HANDLE_NONE, true);
+            event.rssi = rssi;
+            events.dispatch(event);
+        }
+    }
+};
+static void discovered(const BleEvent &event, void *state)
+{
+    (void)state;
+    calls += (uint32_t)-event.rssi;
+}
+static double nanosPerEvent(Callbacks *pCallbacks, uint32_t count)
+{
+    auto startTS = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        pCallbacks->onResult(-60 - (int)(i & 7));
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTS).count() / count;
+}
+
+/** Cost per discovery of each way to hook it, and of the table with 0, 1 and
+ *  BLE_EVENT_HANDLERS handlers. Run with -v to see the figures
+ */
+void test_benchmark()
+{
+    const uint32_t count = 2000000;
+    Override override;
+    Forward forward;
+    forward.fn = [](int rssi)
+    { calls += (uint32_t)-rssi; };
+    Table table;
+    Callbacks *volatile pCallbacks = &override;
+    printf("  events: virtual override %.2f ns\n", nanosPerEvent(pCallbacks, count));
+    pCallbacks = &forward;
+    printf("  events: override and std::function %.2f ns\n", nanosPerEvent(pCallbacks, count));
+    pCallbacks = &table;
+    calls = 0;
+    printf("  events: override and table, no handler %.2f ns\n", nanosPerEvent(pCallbacks, count));
+    TEST_ASSERT_EQUAL_UINT32(0, calls);
+    BleEvents::instance().on(BLE_EVENT_DISCOVERED, discovered, nullptr);
+    printf("  events: override and table, 1 handler %.2f ns\n", nanosPerEvent(pCallbacks, count));
+    TEST_ASSERT_TRUE(calls >= 60 * count);
+    for (size_t i = 1; i < BLE_EVENT_HANDLERS; ++i)
+    {
+        BleEvents::instance().on(BLE_EVENT_DISCOVERED, discovered, nullptr);
+    }
+    printf("  events: override and table, %u handlers %.2f ns\n", (unsigned)BLE_EVENT_HANDLERS, nanosPerEvent(pCallbacks, count));
+    printf("  events: table %u bytes, event %u bytes\n", (unsigned)sizeof(BleEvents), (unsigned)sizeof(BleEvent));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_dispatches_in_registration_order);
+    RUN_TEST(test_removes_handlers);
+    RUN_TEST(test_refuses_past_capacity);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
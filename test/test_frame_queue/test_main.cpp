@@ -0,0 +1,155 @@
+#include <unity.h>
+#include <thread>
+#include "BleFrameQueue.h"
+
+static BleFrameRing<4> ring;
+
+void setUp()
+{
+    ring.clear();
+}
+void tearDown() {}
+
+void test_empty()
+{
+    TEST_ASSERT_EQUAL(0, ring.size());
+    TEST_ASSERT_NULL(ring.front());
+    TEST_ASSERT_EQUAL(4, ring.capacity());
+}
+
+void test_fifo()
+{
+    const uint8_t a[] = {1, 2, 3};
+    const uint8_t b[] = {4};
+    TEST_ASSERT_TRUE(ring.push(BLE_FRAME_RPC, 7, a, sizeof(a)));
+    TEST_ASSERT_TRUE(ring.push(BLE_FRAME_CONFIG, 9, b, sizeof(b)));
+    TEST_ASSERT_EQUAL(2, ring.size());
+
+    BleFrame *pFrame = ring.front();
+    TEST_ASSERT_NOT_NULL(pFrame);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_RPC, pFrame->channel);
+    TEST_ASSERT_EQUAL_UINT16(7, pFrame->conn);
+    TEST_ASSERT_EQUAL_UINT16(sizeof(a), pFrame->size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(a, pFrame->data, sizeof(a));
+    ring.pop();
+
+    pFrame = ring.front();
+    TEST_ASSERT_NOT_NULL(pFrame);
+    TEST_ASSERT_EQUAL_UINT8(BLE_FRAME_CONFIG, pFrame->channel);
+    TEST_ASSERT_EQUAL_UINT16(9, pFrame->conn);
+    TEST_ASSERT_EQUAL_UINT8(4, pFrame->data[0]);
+    ring.pop();
+    TEST_ASSERT_NULL(ring.front());
+}
+
+void test_full_rejects()
+{
+    const uint8_t data[] = {0};
+    for (size_t i = 0; i < ring.capacity(); ++i)
+    {
+        TEST_ASSERT_TRUE(ring.push(BLE_FRAME_DATA, (uint16_t)i, data, sizeof(data)));
+    }
+    TEST_ASSERT_EQUAL(ring.capacity(), ring.size());
+    TEST_ASSERT_FALSE(ring.push(BLE_FRAME_DATA, 99, data, sizeof(data)));
+    /** The rejected frame didn't overwrite the oldest */
+    TEST_ASSERT_EQUAL_UINT16(0, ring.front()->conn);
+    ring.pop();
+    TEST_ASSERT_TRUE(ring.push(BLE_FRAME_DATA, 99, data, sizeof(data)));
+}
+
+void test_frame_sizes()
+{
+    uint8_t data[BLE_FRAME_MAX_SIZE + 1];
+    memset(data, 0xA5, sizeof(data));
+    TEST_ASSERT_TRUE(ring.push(BLE_FRAME_DATA, 1, data, 0));
+    TEST_ASSERT_TRUE(ring.push(BLE_FRAME_DATA, 1, data, BLE_FRAME_MAX_SIZE));
+    TEST_ASSERT_FALSE(ring.push(BLE_FRAME_DATA, 1, data, BLE_FRAME_MAX_SIZE + 1));
+    TEST_ASSERT_EQUAL(2, ring.size());
+    TEST_ASSERT_EQUAL_UINT16(0, ring.front()->size);
+    ring.pop();
+    TEST_ASSERT_EQUAL_UINT16(BLE_FRAME_MAX_SIZE, ring.front()->size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, ring.front()->data, BLE_FRAME_MAX_SIZE);
+}
+
+void test_wraps()
+{
+    for (uint16_t i = 0; i < 1000; ++i)
+    {
+        uint8_t data[2] = {(uint8_t)i, (uint8_t)(i >> 8)};
+        TEST_ASSERT_TRUE(ring.push(BLE_FRAME_RPC, i, data, sizeof(data)));
+        if (i % 3 == 0)
+        {
+            /** Keep a frame or two queued across the wrap */
+            continue;
+        }
+        while (ring.size() > 1)
+        {
+            ring.pop();
+        }
+        TEST_ASSERT_EQUAL_UINT16(i, ring.front()->conn);
+    }
+}
+
+void test_clear()
+{
+    const uint8_t data[] = {0};
+    ring.push(BLE_FRAME_RPC, 1, data, sizeof(data));
+    ring.push(BLE_FRAME_RPC, 2, data, sizeof(data));
+    ring.clear();
+    TEST_ASSERT_EQUAL(0, ring.size());
+    TEST_ASSERT_NULL(ring.front());
+}
+
+/** One producer and one consumer thread, as the host task and update() use it */
+void test_concurrent()
+{
+    static BleFrameRing<BLE_FRAME_QUEUE_SIZE> queue;
+    const uint32_t frames = 20000;
+    queue.clear();
+    std::thread producer([&]
+                         {
+                             for (uint32_t i = 0; i < frames;)
+                             {
+                                 uint8_t data[4];
+                                 memcpy(data, &i, sizeof(i));
+                                 if (queue.push(BLE_FRAME_SAMPLES, (uint16_t)i, data, 1 + i % sizeof(data)))
+                                 {
+                                     ++i;
+                                 }
+                                 else
+                                 {
+                                     std::this_thread::yield();
+                                 }
+                             } });
+    uint32_t expected = 0;
+    bool ordered = true;
+    while (expected < frames)
+    {
+        BleFrame *pFrame = queue.front();
+        if (nullptr == pFrame)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        ordered = ordered && pFrame->conn == (uint16_t)expected && pFrame->size == 1 + expected % 4 &&
+                  pFrame->data[0] == (uint8_t)expected;
+        queue.pop();
+        ++expected;
+    }
+    producer.join();
+    TEST_ASSERT_TRUE(ordered);
+    TEST_ASSERT_EQUAL(0, queue.size());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty);
+    RUN_TEST(test_fifo);
+    RUN_TEST(test_full_rejects);
+    RUN_TEST(test_frame_sizes);
+    RUN_TEST(test_wraps);
+    RUN_TEST(test_clear);
+    RUN_TEST(test_concurrent);
+    return UNITY_END();
+}
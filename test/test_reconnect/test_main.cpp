@@ -0,0 +1,235 @@
+/** Reconnects and timeouts of BleRadio's central, in virtual time against simulated
+ *  peripherals. The stand-in NimBLE only has a central side
+ */
+#define CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED
+#include <unity.h>
+#include "BleRadio.h"
+#include "BleVirtualClock.h"
+#include "BleSimPeripheral.h"
+
+#define UPDATE_MS 10
+#define ADVERTISE_MS 100
+
+static BleVirtualClock simClock;
+static BleRadio radio;
+static BleSimPeripheral peer;
+static uint32_t connectedEvents;
+static uint32_t disconnectedEvents;
+static uint32_t connectedTS;
+static uint32_t disconnectedTS;
+
+static uint32_t onUpdate(uint32_t now, void *state)
+{
+    (void)now;
+    (void)state;
+    radio.update();
+    return UPDATE_MS;
+}
+static uint32_t onAdvertise(uint32_t now, void *state)
+{
+    (void)now;
+    (void)state;
+    NimBLESim::instance().advertise();
+    return ADVERTISE_MS;
+}
+static uint8_t callStatus;
+static size_t broadcastResults;
+static void onCallResult(uint8_t status, const uint8_t *data, size_t size, void *state)
+{
+    (void)data;
+    (void)size;
+    (void)state;
+    callStatus = status;
+}
+static void onBroadcastDone(const BleBroadcastResult *results, size_t count, void *state)
+{
+    (void)results;
+    (void)state;
+    broadcastResults = count;
+}
+static void onLink(const BleEvent &event, void *state)
+{
+    (void)state;
+    if (BLE_EVENT_CONNECTED == event.type)
+    {
+        ++connectedEvents;
+        connectedTS = simClock.now();
+    }
+    else
+    {
+        /** Only the first, later ones follow reconnects */
+        if (0 == disconnectedEvents++)
+        {
+            disconnectedTS = simClock.now();
+        }
+    }
+}
+
+void setUp()
+{
+    NimBLESim::instance().reset();
+    simClock.begin(1);
+    simClock.install();
+    peer = BleSimPeripheral();
+    peer.begin(0x0000A1B2C3D4E5F6ull, -60);
+    NimBLESim::instance().add(&peer);
+    connectedEvents = 0;
+    disconnectedEvents = 0;
+    connectedTS = 0;
+    disconnectedTS = 0;
+    callStatus = BLE_RPC_OK;
+    broadcastResults = SIZE_MAX;
+    TEST_ASSERT_TRUE(radio.begin());
+    radio.onEvent(BLE_EVENT_CONNECTED, onLink);
+    radio.onEvent(BLE_EVENT_DISCONNECTED, onLink);
+    TEST_ASSERT_TRUE(radio.on("central"));
+    simClock.every(UPDATE_MS, onUpdate);
+    simClock.every(ADVERTISE_MS, onAdvertise);
+}
+void tearDown()
+{
+    radio.off();
+    simClock.uninstall();
+}
+
+void test_connects_and_syncs()
+{
+    radio.config().set("rate", "10");
+    simClock.run(2000);
+    TEST_ASSERT_EQUAL_UINT32(1, connectedEvents);
+    TEST_ASSERT_EQUAL_UINT32(1, peer.connects);
+    TEST_ASSERT_TRUE(peer.holds("rate", "10"));
+    /** Negotiation was answered */
+    TEST_ASSERT_TRUE(peer.answered >= 1);
+    TEST_ASSERT_TRUE(NimBLESim::instance().scanning());
+}
+
+void test_reconnects_dropped_peer()
+{
+    radio.config().set("rate", "10");
+    simClock.run(2000);
+    TEST_ASSERT_EQUAL_UINT32(1, connectedEvents);
+    uint32_t procedures = radio.discoveryStats().procedures;
+    TEST_ASSERT_TRUE(procedures > 0);
+
+    peer.drop();
+    uint32_t dropTS = simClock.now();
+    /** Edits made while the link is down reach the peer once it is back */
+    radio.config().set("rate", "20");
+    simClock.run(dropTS + 10000);
+    TEST_ASSERT_EQUAL_UINT32(1, disconnectedEvents);
+    TEST_ASSERT_EQUAL_UINT32(2, connectedEvents);
+    TEST_ASSERT_EQUAL_UINT32(2, peer.connects);
+    TEST_ASSERT_TRUE(disconnectedTS - dropTS <= UPDATE_MS);
+    TEST_ASSERT_TRUE(connectedTS > dropTS);
+    TEST_ASSERT_TRUE(peer.holds("rate", "20"));
+    /** The client kept the peer's attributes, so the reconnect discovered nothing */
+    TEST_ASSERT_EQUAL_UINT32(procedures, radio.discoveryStats().procedures);
+    TEST_ASSERT_EQUAL_UINT32(1, NimBLESim::instance().clients.size());
+    TEST_ASSERT_EQUAL_UINT32(1, NimBLESim::instance().connected());
+}
+
+void test_retries_refused_connect()
+{
+    peer.accepting = false;
+    simClock.run(5000);
+    TEST_ASSERT_EQUAL_UINT32(0, connectedEvents);
+    TEST_ASSERT_TRUE(NimBLESim::instance().failedConnects >= 1);
+    /** Failed attempts back off rather than retrying on every advertisement */
+    TEST_ASSERT_TRUE(NimBLESim::instance().failedConnects <= 5000 / BLE_SCHED_RETRY_MS + 1);
+    /** Nor do they leave the scan stopped or the failed client allocated */
+    TEST_ASSERT_TRUE(NimBLESim::instance().scanning());
+    TEST_ASSERT_EQUAL_UINT32(0, NimBLESim::instance().clients.size());
+
+    peer.accepting = true;
+    simClock.run(10000);
+    TEST_ASSERT_EQUAL_UINT32(1, connectedEvents);
+    TEST_ASSERT_TRUE(connectedTS > 5000);
+}
+
+void test_disconnects_hung_peer()
+{
+    simClock.run(2000);
+    TEST_ASSERT_EQUAL_UINT32(1, connectedEvents);
+    /** The link stays up but the application stops answering */
+    peer.hung = true;
+    uint32_t hungTS = simClock.now();
+    simClock.run(hungTS + 60000);
+    TEST_ASSERT_TRUE(disconnectedEvents >= 1);
+    TEST_ASSERT_TRUE(radio.livenessStats().dead >= 1);
+    TEST_ASSERT_TRUE(radio.livenessStats().probes >= BLE_LIVENESS_MISSES);
+    /** Each miss waits out the minimum interval, the last one a request timeout too */
+    uint32_t bound = BLE_LIVENESS_MISSES * BLE_LIVENESS_MIN_MS + BLE_RPC_TIMEOUT_MS + 2 * UPDATE_MS;
+    TEST_ASSERT_TRUE(disconnectedTS - hungTS <= bound);
+    TEST_ASSERT_TRUE(disconnectedTS - hungTS >= BLE_LIVENESS_MISSES * BLE_RPC_TIMEOUT_MS);
+}
+
+void test_recovered_peer_stays_connected()
+{
+    simClock.run(2000);
+    peer.hung = true;
+    simClock.run(2000 + BLE_LIVENESS_MIN_MS + BLE_RPC_TIMEOUT_MS + 100);
+    /** One miss doesn't declare it dead */
+    TEST_ASSERT_EQUAL_UINT32(0, disconnectedEvents);
+    peer.hung = false;
+    simClock.run(120000);
+    TEST_ASSERT_EQUAL_UINT32(0, disconnectedEvents);
+    TEST_ASSERT_EQUAL_UINT32(0, radio.livenessStats().dead);
+    TEST_ASSERT_EQUAL_UINT32(1, peer.connects);
+}
+
+void test_disconnect_leaves_scan_to_update()
+{
+    simClock.run(2000);
+    NimBLESim &sim = NimBLESim::instance();
+    uint32_t starts = sim.scanStarts();
+    /** The disconnect arrives on the host task, which doesn't start the scan itself */
+    peer.drop();
+    TEST_ASSERT_EQUAL_UINT32(starts, sim.scanStarts());
+    /** A scan stopped behind the central's back runs again after an update */
+    sim.scan.stop();
+    simClock.run(simClock.now() + UPDATE_MS);
+    TEST_ASSERT_TRUE(sim.scanning());
+    TEST_ASSERT_TRUE(sim.scanStarts() > starts);
+}
+
+void test_off_releases_peers_and_on_reconnects()
+{
+    simClock.run(2000);
+    TEST_ASSERT_EQUAL_UINT32(1, connectedEvents);
+    /** A call the peer never answers and a broadcast not yet reported */
+    peer.hung = true;
+    TEST_ASSERT_TRUE(0 <= radio.call(peer.address, 0x01, nullptr, 0, onCallResult));
+    const uint8_t value[] = {'3', '0'};
+    TEST_ASSERT_TRUE(0 <= radio.broadcast("rate", value, sizeof(value), onBroadcastDone));
+    TEST_ASSERT_TRUE(radio.off());
+    TEST_ASSERT_EQUAL_UINT8(BLE_RPC_DISCONNECTED, callStatus);
+    TEST_ASSERT_EQUAL(1, broadcastResults);
+    TEST_ASSERT_EQUAL_UINT32(1, disconnectedEvents);
+    /** Updates while off touch none of the deleted clients */
+    simClock.run(simClock.now() + 1000);
+    TEST_ASSERT_EQUAL_UINT32(0, NimBLESim::instance().clients.size());
+
+    peer.hung = false;
+    TEST_ASSERT_TRUE(radio.on("central"));
+    simClock.run(simClock.now() + 5000);
+    TEST_ASSERT_EQUAL_UINT32(2, connectedEvents);
+    TEST_ASSERT_EQUAL_UINT32(2, peer.connects);
+    TEST_ASSERT_TRUE(peer.holds("rate", "30"));
+    /** Nothing of the first session is left to hold up the next broadcast */
+    TEST_ASSERT_TRUE(0 <= radio.broadcast("rate", value, 1, onBroadcastDone));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_connects_and_syncs);
+    RUN_TEST(test_reconnects_dropped_peer);
+    RUN_TEST(test_retries_refused_connect);
+    RUN_TEST(test_disconnects_hung_peer);
+    RUN_TEST(test_recovered_peer_stays_connected);
+    RUN_TEST(test_disconnect_leaves_scan_to_update);
+    RUN_TEST(test_off_releases_peers_and_on_reconnects);
+    return UNITY_END();
+}
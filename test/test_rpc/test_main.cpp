@@ -0,0 +1,165 @@
+/** The RPC server's responses as the client sees them, through BleTraffic and a stand-in
+ *  stack that can refuse notifications
+ */
+#define CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED
+#include <unity.h>
+#include <vector>
+#include "BleRpc.h"
+
+#define CONN 1
+#define METHOD_LOG 0x01
+
+static NimBLEServer server;
+static NimBLECharacteristic characteristic;
+static BleRpcServer rpc;
+/** The client's end of the response stream */
+static BleLzStream stream;
+static BleCompressStats compress;
+static std::vector<uint8_t> notified;
+/** Responses the client could read, by id, and those it couldn't */
+static std::vector<uint16_t> answered;
+static uint32_t unreadable;
+static bool refusing;
+static uint16_t nextId;
+struct os_mbuf
+{
+    int unused;
+};
+static os_mbuf mbuf;
+
+os_mbuf *ble_hs_mbuf_from_flat(const void *buf, uint16_t len)
+{
+    notified.assign((const uint8_t *)buf, (const uint8_t *)buf + len);
+    return &mbuf;
+}
+int ble_gattc_notify_custom(uint16_t conn_handle, uint16_t att_handle, os_mbuf *om)
+{
+    (void)conn_handle;
+    (void)att_handle;
+    (void)om;
+    if (refusing)
+    {
+        return BLE_HS_EREJECT;
+    }
+    uint8_t buffer[BLE_RPC_MAX_PAYLOAD];
+    const uint8_t *payload;
+    size_t payloadSize;
+    if (ble_rpc_is_frame(notified.data(), notified.size(), BLE_RPC_RESPONSE) &&
+        ble_rpc_payload(notified.data(), notified.size(), buffer, &payload, &payloadSize, &stream, &compress))
+    {
+        answered.push_back(ble_rpc_id(notified.data()));
+    }
+    else
+    {
+        ++unreadable;
+    }
+    return 0;
+}
+int ble_gap_conn_find(uint16_t handle, ble_gap_conn_desc *out_desc)
+{
+    (void)out_desc;
+    return CONN == handle ? 0 : BLE_HS_ENOTCONN;
+}
+uint16_t NimBLEServer::getPeerMTU(uint16_t conn_id)
+{
+    return CONN == conn_id ? 247 : 0;
+}
+uint16_t NimBLECharacteristic::getHandle()
+{
+    return 3;
+}
+
+/** Answers with lines of a log, which compress well against each other */
+static uint8_t logLines(const uint8_t *request, size_t requestSize, uint8_t *response, size_t *responseSize, void *state)
+{
+    (void)request;
+    (void)requestSize;
+    (void)state;
+    size_t size = 0;
+    for (unsigned line = 0; size + 40 < *responseSize && line < 4; ++line)
+    {
+        size += snprintf((char *)response + size, *responseSize - size, "I (%05u) sensor: reading %u ok\n", nextId * 4 + line, line);
+    }
+    *responseSize = size;
+    return BLE_RPC_OK;
+}
+/** Writes a request and runs the server and BleTraffic once */
+static uint16_t call(uint8_t method, const uint8_t *data, size_t size)
+{
+    uint8_t frame[BLE_RPC_MAX_FRAME];
+    uint16_t id = nextId++;
+    ble_rpc_header(frame, BLE_RPC_REQUEST, id, method);
+    if (size)
+    {
+        memcpy(frame + BLE_RPC_HEADER_SIZE, data, size);
+    }
+    rpc.received(&characteristic, CONN, frame, BLE_RPC_HEADER_SIZE + size);
+    rpc.update(&server, &characteristic);
+    BleTraffic::instance().update();
+    return id;
+}
+
+void setUp()
+{
+    BleTraffic::instance().begin();
+    rpc.begin();
+    rpc.handle(METHOD_LOG, logLines, nullptr);
+    stream.restart();
+    memset(&compress, 0, sizeof(compress));
+    answered.clear();
+    unreadable = 0;
+    refusing = false;
+    nextId = 1;
+    uint8_t capabilities = BLE_RPC_CAPABILITIES;
+    call(BLE_RPC_NEGOTIATE, &capabilities, 1);
+    answered.clear();
+}
+void tearDown()
+{
+}
+
+void test_responses_stream()
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        call(METHOD_LOG, nullptr, 0);
+    }
+    TEST_ASSERT_EQUAL(4, answered.size());
+    TEST_ASSERT_EQUAL_UINT32(0, unreadable);
+    /** All but the first matched into the ones before */
+    TEST_ASSERT_EQUAL_UINT32(3, rpc.compressStats().streamed);
+}
+
+void test_dropped_stream_frame_restarts_stream()
+{
+    call(METHOD_LOG, nullptr, 0);
+    /** The stack refuses the next response until BleTraffic gives up on it */
+    refusing = true;
+    uint16_t lost = call(METHOD_LOG, nullptr, 0);
+    for (int i = 1; i < BLE_QOS_ATTEMPTS; ++i)
+    {
+        BleTraffic::instance().update();
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, BleTraffic::instance().stats(BLE_QOS_INTERACTIVE).dropped);
+    refusing = false;
+    /** Only the lost call goes unanswered; the next one starts the stream again */
+    for (int i = 0; i < 4; ++i)
+    {
+        call(METHOD_LOG, nullptr, 0);
+    }
+    TEST_ASSERT_EQUAL(5, answered.size());
+    TEST_ASSERT_EQUAL_UINT32(0, unreadable);
+    for (size_t i = 0; i < answered.size(); ++i)
+    {
+        TEST_ASSERT_TRUE(lost != answered[i]);
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_responses_stream);
+    RUN_TEST(test_dropped_stream_frame_restarts_stream);
+    return UNITY_END();
+}
@@ -0,0 +1,102 @@
+#include <unity.h>
+#include "BleSchema.h"
+
+BLE_SCHEMA_UUID(TestServiceUuid, "5AB457FD-FBAD-475B-97A0-29900940A47B");
+BLE_SCHEMA_UUID(TestCharUuid, "7f2d2a4e-ba58-4e8f-8b96-6c8bdcba629e");
+BLE_SCHEMA_UUID(TestOtherCharUuid, "951C60AD-602B-4B0C-89D9-C7980876D764");
+BLE_SCHEMA_UUID(TestDescUuid, "C01D");
+
+typedef BleCharacteristicDef<TestCharUuid, BLE_GATT_CHR_F_READ, 512, BleDescriptorDef<TestDescUuid>> TestCharacteristic;
+typedef BleCharacteristicDef<TestOtherCharUuid, BLE_GATT_CHR_F_NOTIFY, 244> TestOtherCharacteristic;
+typedef BleServiceDef<TestServiceUuid, TestCharacteristic, TestOtherCharacteristic> TestService;
+
+/** Parsing happens in the compiler */
+static_assert(ble_uuid("C01D").size == 2, "16-bit UUID");
+static_assert(ble_uuid("C01D").bytes[0] == 0x1D && ble_uuid("C01D").bytes[1] == 0xC0, "16-bit UUID is little-endian");
+static_assert(TestService::indexOf<TestOtherCharacteristic>() == 1, "characteristic slot");
+
+void setUp() {}
+void tearDown() {}
+
+void test_uuid_128_is_little_endian()
+{
+    const uint8_t expected[16] = {0x7B, 0xA4, 0x40, 0x09, 0x90, 0x29, 0xA0, 0x97,
+                                  0x5B, 0x47, 0xAD, 0xFB, 0xFD, 0x57, 0xB4, 0x5A};
+    BleUuid uuid = TestServiceUuid::value();
+    TEST_ASSERT_EQUAL_UINT8(16, uuid.size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, uuid.bytes, 16);
+}
+
+void test_uuid_case_insensitive()
+{
+    BleUuid lower = ble_uuid("5ab457fd-fbad-475b-97a0-29900940a47b");
+    BleUuid upper = ble_uuid("5AB457FD-FBAD-475B-97A0-29900940A47B");
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(upper.bytes, lower.bytes, 16);
+}
+
+void test_uuid_16_leaves_the_rest_zero()
+{
+    BleUuid uuid = ble_uuid("2904");
+    TEST_ASSERT_EQUAL_UINT8(2, uuid.size);
+    TEST_ASSERT_EQUAL_UINT8(0x04, uuid.bytes[0]);
+    TEST_ASSERT_EQUAL_UINT8(0x29, uuid.bytes[1]);
+    for (size_t i = 2; i < 16; ++i)
+    {
+        TEST_ASSERT_EQUAL_UINT8(0, uuid.bytes[i]);
+    }
+}
+
+void test_uuid_valid()
+{
+    TEST_ASSERT_TRUE(ble_uuid_valid("2904"));
+    TEST_ASSERT_TRUE(ble_uuid_valid("abcd"));
+    TEST_ASSERT_TRUE(ble_uuid_valid("00000000-0000-0000-0000-000000000000"));
+    TEST_ASSERT_TRUE(ble_uuid_valid("FFFFFFFF-FFFF-FFFF-FFFF-FFFFFFFFFFFF"));
+}
+
+void test_uuid_invalid()
+{
+    TEST_ASSERT_FALSE(ble_uuid_valid(""));
+    TEST_ASSERT_FALSE(ble_uuid_valid("290"));
+    TEST_ASSERT_FALSE(ble_uuid_valid("29045"));
+    TEST_ASSERT_FALSE(ble_uuid_valid("29g4"));
+    /** 32-bit UUIDs are not supported */
+    TEST_ASSERT_FALSE(ble_uuid_valid("00002904"));
+    /** Hyphens in the wrong place, or missing */
+    TEST_ASSERT_FALSE(ble_uuid_valid("5AB457F-DFBAD-475B-97A0-29900940A47B"));
+    TEST_ASSERT_FALSE(ble_uuid_valid("5AB457FDFBAD475B97A029900940A47B"));
+    TEST_ASSERT_FALSE(ble_uuid_valid("5AB457FD-FBAD-475B-97A0-29900940A47B0"));
+    TEST_ASSERT_FALSE(ble_uuid_valid("5AB457FD-FBAD-475B-97A0-29900940A47Z"));
+}
+
+void test_uuid_matches_nimble()
+{
+    const uint8_t msbFirst[2] = {0x29, 0x04};
+    TEST_ASSERT_TRUE(ble_uuid("2904").toNimBLE() == NimBLEUUID((uint16_t)0x2904));
+    TEST_ASSERT_TRUE(ble_uuid("2904").toNimBLE() == NimBLEUUID(msbFirst, 2, true));
+    TEST_ASSERT_TRUE(TestServiceUuid::value().toNimBLE() != TestCharUuid::value().toNimBLE());
+}
+
+void test_characteristic_definition()
+{
+    TEST_ASSERT_EQUAL_UINT16(512, TestCharacteristic::maxLength());
+    TEST_ASSERT_EQUAL_UINT16(244, TestOtherCharacteristic::maxLength());
+    TEST_ASSERT_EQUAL_UINT32(BLE_GATT_CHR_F_READ, TestCharacteristic::properties());
+    TEST_ASSERT_EQUAL(1, TestCharacteristic::descriptorCount());
+    TEST_ASSERT_EQUAL(0, TestOtherCharacteristic::descriptorCount());
+    TEST_ASSERT_EQUAL(2, TestService::characteristicCount());
+    TEST_ASSERT_EQUAL(0, TestService::indexOf<TestCharacteristic>());
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_uuid_128_is_little_endian);
+    RUN_TEST(test_uuid_case_insensitive);
+    RUN_TEST(test_uuid_16_leaves_the_rest_zero);
+    RUN_TEST(test_uuid_valid);
+    RUN_TEST(test_uuid_invalid);
+    RUN_TEST(test_uuid_matches_nimble);
+    RUN_TEST(test_characteristic_definition);
+    return UNITY_END();
+}
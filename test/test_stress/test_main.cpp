@@ -0,0 +1,491 @@
+/** Fleet stress harness: BleRadio's central, unmodified, against hundreds of simulated
+ *  configuration service peripherals in virtual time, with scripted churn, notification
+ *  loss, sample traffic, RPC calls, configuration edits and broadcasts going on at once.
+ *  Prints throughput, latency percentiles and memory high water marks, and fails on any
+ *  invariant violation. Scale it with -D STRESS_PEERS=1000 -D STRESS_MINUTES=240 and the
+ *  other STRESS_ settings below.
+ */
+#define CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include "BleRadio.h"
+#include "BleVirtualClock.h"
+#include "BleSimPeripheral.h"
+
+#ifndef STRESS_PEERS
+#define STRESS_PEERS 300
+#endif
+#ifndef STRESS_MINUTES
+/** Virtual time the fleet churns for, before it settles */
+#define STRESS_MINUTES 10
+#endif
+#ifndef STRESS_SEED
+#define STRESS_SEED 1
+#endif
+#ifndef STRESS_IN_RANGE_PERCENT
+/** Peers in range at the start */
+#define STRESS_IN_RANGE_PERCENT 80
+#endif
+#ifndef STRESS_CHURN_MS
+/** One churn event per period: a link drops, a peer leaves or returns, hangs or recovers,
+ *  or its RSSI moves
+ */
+#define STRESS_CHURN_MS 250
+#endif
+#ifndef STRESS_LOSS_PERCENT
+/** Notifications lost on the air */
+#define STRESS_LOSS_PERCENT 5
+#endif
+#ifndef STRESS_SAMPLE_MS
+/** Every connected peer notifies a sample per period */
+#define STRESS_SAMPLE_MS 200
+#endif
+#ifndef STRESS_CALL_MS
+/** The application calls a random connected peer per period */
+#define STRESS_CALL_MS 50
+#endif
+#ifndef STRESS_EDIT_MS
+#define STRESS_EDIT_MS 15000
+#endif
+#ifndef STRESS_BROADCAST_MS
+#define STRESS_BROADCAST_MS 40000
+#endif
+#define STRESS_SETTLE_MS 60000
+#define UPDATE_MS 10
+#define ADVERTISE_MS 250
+#define CHECK_MS 1000
+#define ADDRESS_BASE 0x0000C0DE00000000ull
+/** Longest a hung peer may stay connected: a probe interval grown to the maximum, the
+ *  misses at the minimum, a timeout, and another for a probe queued behind timed out calls
+ */
+#define HUNG_BOUND_MS (BLE_LIVENESS_MAX_MS + (BLE_LIVENESS_MISSES - 1) * BLE_LIVENESS_MIN_MS + 2 * BLE_RPC_TIMEOUT_MS + 10 * UPDATE_MS)
+
+/** Live heap, counted by the replaced global operator new */
+static size_t heapLive;
+static size_t heapPeak;
+
+void *operator new(size_t size)
+{
+    max_align_t *p = (max_align_t *)malloc(sizeof(max_align_t) + size);
+    if (nullptr == p)
+    {
+        throw std::bad_alloc();
+    }
+    *(size_t *)p = size;
+    heapLive += size;
+    heapPeak = heapLive > heapPeak ? heapLive : heapPeak;
+    return p + 1;
+}
+void operator delete(void *ptr) noexcept
+{
+    if (nullptr != ptr)
+    {
+        max_align_t *p = (max_align_t *)ptr - 1;
+        heapLive -= *(size_t *)p;
+        free(p);
+    }
+}
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+struct PeerState
+{
+    uint32_t connectedTS;
+    uint32_t hungTS;
+    uint16_t sentSeq;
+    uint16_t seenSeq;
+    bool seen;
+};
+
+static BleVirtualClock simClock;
+static BleRadio radio;
+static BleSimPeripheral *peers;
+static PeerState states[STRESS_PEERS];
+static bool churning;
+
+static uint32_t violations;
+static uint32_t calls;
+static uint32_t callResults[BLE_RPC_DISCONNECTED + 1];
+static std::vector<uint8_t> callDone;
+static uint32_t samplesSent;
+static uint32_t samplesReceived;
+static uint32_t broadcastsStarted;
+static uint32_t broadcastsFinished;
+static uint32_t broadcastWrites;
+static uint32_t churnEvents;
+static uint32_t connectedEvents;
+static uint32_t maxConnected;
+/** Before the fleet, with the fleet set up, and once it settled */
+static size_t heapBaseline;
+static size_t heapFleet;
+static size_t heapSettled;
+
+static void violation(const char *what)
+{
+    if (violations++ < 10)
+    {
+        printf("violation at %u: %s\n", simClock.now(), what);
+    }
+}
+static size_t indexOf(const NimBLEAddress &address)
+{
+    return (size_t)((uint64_t)address - ADDRESS_BASE);
+}
+static bool connected(size_t i)
+{
+    return nullptr != peers[i].client;
+}
+
+static uint32_t onUpdate(uint32_t now, void *state)
+{
+    (void)now;
+    (void)state;
+    radio.update();
+    return UPDATE_MS;
+}
+static uint32_t onAdvertise(uint32_t now, void *state)
+{
+    (void)now;
+    (void)state;
+    NimBLESim::instance().advertise();
+    return ADVERTISE_MS;
+}
+static uint32_t onChurn(uint32_t now, void *state)
+{
+    (void)state;
+    if (!churning)
+    {
+        return 0;
+    }
+    ++churnEvents;
+    BleSimPeripheral &peer = peers[simClock.random(0, STRESS_PEERS - 1)];
+    PeerState &peerState = states[&peer - peers];
+    uint32_t dice = simClock.random(0, 99);
+    if (dice < 35)
+    {
+        peer.drop();
+    }
+    else if (dice < 60)
+    {
+        peer.inRange = !peer.inRange;
+        if (!peer.inRange)
+        {
+            peer.drop();
+        }
+    }
+    else if (dice < 70)
+    {
+        peer.hung = !peer.hung;
+        peerState.hungTS = now;
+    }
+    else if (dice < 85)
+    {
+        peer.rssi = -(int)simClock.random(45, 95);
+    }
+    /** Otherwise a quiet period */
+    return STRESS_CHURN_MS;
+}
+static uint32_t onSample(uint32_t now, void *state)
+{
+    (void)state;
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        if (connected(i) && !peers[i].hung)
+        {
+            uint16_t seq = ++states[i].sentSeq;
+            ++samplesSent;
+            peers[i].sample((int32_t)(i << 16 | seq), now - simClock.random(0, 50), now);
+        }
+    }
+    return STRESS_SAMPLE_MS;
+}
+static void onSampleReceived(const NimBLEAddress &peer, const BleSample &sample, void *state)
+{
+    (void)state;
+    size_t i = indexOf(peer);
+    if (i >= STRESS_PEERS || (size_t)(sample.value >> 16) != i)
+    {
+        violation("sample from the wrong peer");
+        return;
+    }
+    ++samplesReceived;
+    PeerState &peerState = states[i];
+    uint16_t seq = (uint16_t)sample.value;
+    if (peerState.seen && (int16_t)(seq - peerState.seenSeq) <= 0)
+    {
+        violation("sample repeated or out of order");
+    }
+    peerState.seen = true;
+    peerState.seenSeq = seq;
+    if ((int32_t)(simClock.now() - sample.ts) < 0)
+    {
+        violation("sample from the future");
+    }
+}
+static void onCallResult(uint8_t status, const uint8_t *data, size_t size, void *state)
+{
+    (void)data;
+    (void)size;
+    size_t call = (size_t)(uintptr_t)state;
+    if (call >= callDone.size() || callDone[call])
+    {
+        violation("call completed twice");
+        return;
+    }
+    callDone[call] = 1;
+    ++callResults[status <= BLE_RPC_DISCONNECTED ? status : (uint8_t)BLE_RPC_ERROR];
+}
+static uint32_t onCall(uint32_t now, void *state)
+{
+    (void)now;
+    (void)state;
+    size_t start = simClock.random(0, STRESS_PEERS - 1);
+    for (size_t n = 0; n < STRESS_PEERS; ++n)
+    {
+        size_t i = (start + n) % STRESS_PEERS;
+        if (connected(i))
+        {
+            uint8_t payload[8];
+            memset(payload, (int)i, sizeof(payload));
+            if (0 <= radio.call(peers[i].address, 0x01, payload, sizeof(payload), onCallResult, (void *)(uintptr_t)callDone.size()))
+            {
+                ++calls;
+                callDone.push_back(0);
+            }
+            break;
+        }
+    }
+    return churning ? STRESS_CALL_MS : 0;
+}
+static uint32_t onEdit(uint32_t now, void *state)
+{
+    (void)state;
+    char key[8];
+    char value[16];
+    snprintf(key, sizeof(key), "k%u", (unsigned)(simClock.random() % 8));
+    snprintf(value, sizeof(value), "%u", (unsigned)now);
+    radio.config().set(key, value);
+    return churning ? STRESS_EDIT_MS : 0;
+}
+/** Whether a replica holds what the master does for every key the edits and broadcasts use */
+static bool sameEntries(BleConfig &master, BleConfig &replica)
+{
+    char key[8];
+    for (unsigned k = 0; k <= 8; ++k)
+    {
+        snprintf(key, sizeof(key), "k%u", k);
+        const char *name = k < 8 ? key : "b";
+        const uint8_t *expected = nullptr;
+        const uint8_t *held = nullptr;
+        int length = master.get(name, &expected);
+        if (length != replica.get(name, &held) || (length > 0 && 0 != memcmp(expected, held, length)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static void onBroadcastDone(const BleBroadcastResult *results, size_t count, void *state)
+{
+    (void)results;
+    (void)state;
+    ++broadcastsFinished;
+    broadcastWrites += count;
+}
+static uint32_t onBroadcast(uint32_t now, void *state)
+{
+    (void)state;
+    uint8_t value[4];
+    ble_config_put_u32(value, now);
+    if (0 <= radio.broadcast("b", value, sizeof(value), onBroadcastDone))
+    {
+        ++broadcastsStarted;
+    }
+    return churning ? STRESS_BROADCAST_MS : 0;
+}
+static void onLink(const BleEvent &event, void *state)
+{
+    (void)state;
+    size_t i = indexOf(event.address);
+    if (i >= STRESS_PEERS)
+    {
+        violation("event for an unknown peer");
+        return;
+    }
+    if (BLE_EVENT_CONNECTED == event.type)
+    {
+        ++connectedEvents;
+        states[i].connectedTS = simClock.now();
+        if (!connected(i))
+        {
+            violation("connected event for a peer without a link");
+        }
+    }
+}
+/** Checks what the central did against the simulated air */
+static uint32_t onCheck(uint32_t now, void *state)
+{
+    (void)state;
+    NimBLESim &sim = NimBLESim::instance();
+    size_t links = sim.connected();
+    maxConnected = links > maxConnected ? links : maxConnected;
+    if (links > NIMBLE_MAX_CONNECTIONS || sim.clients.size() > NIMBLE_MAX_CONNECTIONS)
+    {
+        violation("more links or clients than NimBLE allows");
+    }
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        if (!connected(i))
+        {
+            continue;
+        }
+        if (peers[i].client->getPeerAddress() != peers[i].address)
+        {
+            violation("client linked to another peer");
+        }
+        uint32_t since = (int32_t)(states[i].hungTS - states[i].connectedTS) > 0 ? states[i].hungTS : states[i].connectedTS;
+        if (peers[i].hung && now - since > HUNG_BOUND_MS)
+        {
+            violation("hung peer kept connected");
+            /** Once per hang */
+            states[i].hungTS = now;
+        }
+    }
+    if (!sim.scanning())
+    {
+        violation("scan left stopped");
+    }
+    return CHECK_MS;
+}
+static void report()
+{
+    NimBLESim &sim = NimBLESim::instance();
+    uint32_t lost = 0;
+    uint32_t notifications = 0;
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        lost += peers[i].lost;
+        notifications += peers[i].notifications;
+    }
+    printf("stress: %u peers, %u min, %u churn events, %u links made, %u refused, %u dropped, at most %u at once\n",
+           STRESS_PEERS, STRESS_MINUTES, churnEvents, sim.connects, sim.failedConnects, sim.disconnects, (unsigned)maxConnected);
+    printf("stress: %u notifications, %u lost on air; samples %u sent, %u received\n",
+           notifications, lost, samplesSent, samplesReceived);
+    printf("stress: %u calls: %u ok, %u timed out, %u disconnected, %u other\n", calls, callResults[BLE_RPC_OK],
+           callResults[BLE_RPC_TIMEOUT], callResults[BLE_RPC_DISCONNECTED],
+           calls - callResults[BLE_RPC_OK] - callResults[BLE_RPC_TIMEOUT] - callResults[BLE_RPC_DISCONNECTED]);
+    printf("stress: %u broadcasts, %u finished, %u writes\n", broadcastsStarted, broadcastsFinished, broadcastWrites);
+    printf("stress: heap %u bytes for the simulated fleet, central peak %u, settled %u\n", (unsigned)(heapFleet - heapBaseline),
+           (unsigned)(heapPeak - heapFleet), (unsigned)(heapSettled - heapFleet));
+    BleSchedulerStats scheduler = radio.schedulerStats();
+    printf("stress: slot utilisation %u permille, service latency %u ms average, %u max, %u evictions\n",
+           scheduler.utilisation(), scheduler.averageServiceLatency(), scheduler.serviceLatencyMax, scheduler.evictions);
+    Serial.echo = true;
+    radio.healthReport(Serial);
+    radio.livenessReport(Serial);
+    radio.trafficReport(Serial);
+    radio.discoveryReport(Serial);
+    Serial.echo = false;
+}
+
+void setUp()
+{
+    NimBLESim::instance().reset();
+    NimBLESim::instance().seed = STRESS_SEED;
+    simClock.begin(STRESS_SEED);
+    simClock.install();
+}
+void tearDown()
+{
+    radio.off();
+    simClock.uninstall();
+}
+
+void test_fleet()
+{
+    heapBaseline = heapLive;
+    peers = new BleSimPeripheral[STRESS_PEERS];
+    memset(states, 0, sizeof(states));
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        peers[i].begin(ADDRESS_BASE + i, -(int)simClock.random(45, 95));
+        peers[i].inRange = simClock.random(0, 99) < STRESS_IN_RANGE_PERCENT;
+        peers[i].loss = STRESS_LOSS_PERCENT;
+        NimBLESim::instance().add(&peers[i]);
+    }
+    TEST_ASSERT_TRUE(radio.begin());
+    radio.onEvent(BLE_EVENT_CONNECTED, onLink);
+    radio.onSample(onSampleReceived);
+    TEST_ASSERT_TRUE(radio.on("central"));
+    /** So the harness allocates nothing while it runs */
+    callDone.reserve(STRESS_MINUTES * 60000u / STRESS_CALL_MS + 1);
+    heapFleet = heapLive;
+    heapPeak = heapLive;
+    churning = true;
+    simClock.every(UPDATE_MS, onUpdate);
+    simClock.every(ADVERTISE_MS, onAdvertise);
+    simClock.every(STRESS_CHURN_MS, onChurn);
+    simClock.every(STRESS_SAMPLE_MS, onSample);
+    simClock.every(STRESS_CALL_MS, onCall);
+    simClock.every(STRESS_EDIT_MS, onEdit);
+    simClock.every(STRESS_BROADCAST_MS, onBroadcast);
+    simClock.every(CHECK_MS, onCheck);
+    simClock.run(STRESS_MINUTES * 60000u);
+
+    /** Settle: churn, calls and edits stop, every peer recovers, and whatever was in
+     *  flight has to complete
+     */
+    churning = false;
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        peers[i].hung = false;
+        peers[i].loss = 0;
+    }
+    simClock.advance(STRESS_SETTLE_MS);
+    heapSettled = heapLive;
+    report();
+
+    TEST_ASSERT_EQUAL_UINT32(0, violations);
+    TEST_ASSERT_EQUAL_UINT32(0, radio.healthStats().invariantViolations);
+    TEST_ASSERT_TRUE(NimBLESim::instance().connects > STRESS_MINUTES);
+    TEST_ASSERT_EQUAL_UINT32(NIMBLE_MAX_CONNECTIONS, maxConnected);
+    /** Every call completed exactly once */
+    TEST_ASSERT_EQUAL_UINT32(calls, callResults[BLE_RPC_OK] + callResults[BLE_RPC_TIMEOUT] +
+                                        callResults[BLE_RPC_DISCONNECTED] + callResults[BLE_RPC_ERROR]);
+    TEST_ASSERT_TRUE(callResults[BLE_RPC_OK] > calls / 2);
+    TEST_ASSERT_EQUAL_UINT32(broadcastsStarted, broadcastsFinished);
+    TEST_ASSERT_TRUE(samplesReceived > 0 && samplesReceived <= samplesSent);
+    /** The peers connected once the fleet settled hold the master configuration, every
+     *  entry of it and not just its version
+     */
+    BleConfig &master = radio.config();
+    for (size_t i = 0; i < STRESS_PEERS; ++i)
+    {
+        if (connected(i))
+        {
+            TEST_ASSERT_EQUAL_UINT32(master.epoch(), peers[i].config.epoch());
+            TEST_ASSERT_EQUAL_UINT32(master.version(), peers[i].config.version());
+            TEST_ASSERT_TRUE(sameEntries(master, peers[i].config));
+        }
+    }
+    radio.off();
+    /** The simulated air keeps its peers past deinit(), so forget them before they go */
+    NimBLESim::instance().reset();
+    delete[] peers;
+    peers = nullptr;
+    std::vector<uint8_t>().swap(callDone);
+    /** Nothing the central allocated outlives its links */
+    TEST_ASSERT_TRUE(heapLive <= heapBaseline);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fleet);
+    return UNITY_END();
+}
@@ -0,0 +1,296 @@
+/** The flash log of received notifications, on plain files under a temporary directory */
+#define CONFIG_BT_NIMBLE_ROLE_PERIPHERAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_BROADCASTER_DISABLED
+#include <unity.h>
+#include <chrono>
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "BleTimeSeries.h"
+
+#define RECORD_MS 50
+#define PEERS 8
+
+static char dir[32];
+static BleTsFs fs;
+static uint32_t nowMs;
+
+static uint32_t testClock(void *state)
+{
+    (void)state;
+    return nowMs;
+}
+static void removeDir()
+{
+    DIR *pDir = opendir(dir);
+    if (nullptr == pDir)
+    {
+        return;
+    }
+    char name[BLE_TS_PATH + 256];
+    for (dirent *pEntry = readdir(pDir); nullptr != pEntry; pEntry = readdir(pDir))
+    {
+        if ('.' != pEntry->d_name[0])
+        {
+            snprintf(name, sizeof(name), "%s/%s", dir, pEntry->d_name);
+            remove(name);
+        }
+    }
+    closedir(pDir);
+    rmdir(dir);
+}
+static NimBLEAddress peer(uint8_t index)
+{
+    return NimBLEAddress(0x0000AA0000000000ull | index);
+}
+/** Appends count records, one every RECORD_MS, round robin over the peers. Each carries
+ *  its sequence number
+ */
+static uint32_t ingest(BleTimeSeries &store, uint32_t first, uint32_t count)
+{
+    uint8_t payload[20];
+    uint32_t appended = 0;
+    for (uint32_t i = first; i < first + count; ++i)
+    {
+        nowMs += RECORD_MS;
+        memcpy(payload, &i, sizeof(i));
+        memset(payload + sizeof(i), (uint8_t)i, sizeof(payload) - sizeof(i));
+        appended += store.append(peer((uint8_t)(i % PEERS)), BLE_TS_NOTIFY, payload, sizeof(payload), nowMs) ? 1 : 0;
+        store.update(nowMs);
+    }
+    return appended;
+}
+
+/** Puts a directory where segment 0 is, so appending to it fails, or takes it away again */
+static void blockSegment(bool blocked)
+{
+    char name[BLE_TS_PATH + 32];
+    char moved[BLE_TS_PATH + 32];
+    snprintf(name, sizeof(name), "%s/%08lx.seg", dir, 0ul);
+    snprintf(moved, sizeof(moved), "%s.moved", name);
+    if (blocked)
+    {
+        rename(name, moved);
+        mkdir(name, 0700);
+    }
+    else
+    {
+        rmdir(name);
+        rename(moved, name);
+    }
+}
+
+struct Visit
+{
+    uint32_t count;
+    uint32_t lastTS;
+    uint32_t lastSequence;
+    int peer;
+    bool ordered;
+};
+static bool visit(const BleTsRecord &record, void *state)
+{
+    Visit *pVisit = (Visit *)state;
+    uint32_t sequence;
+    memcpy(&sequence, record.data, sizeof(sequence));
+    if (record.ts < pVisit->lastTS || (pVisit->count && sequence <= pVisit->lastSequence) ||
+        (pVisit->peer >= 0 && record.address.val[0] != pVisit->peer) || BLE_TS_NOTIFY != record.kind)
+    {
+        pVisit->ordered = false;
+    }
+    pVisit->lastTS = record.ts;
+    pVisit->lastSequence = sequence;
+    ++pVisit->count;
+    return true;
+}
+static Visit query(BleTimeSeries &store, int peerIndex, uint32_t fromTS, uint32_t toTS)
+{
+    Visit result = {0, 0, 0, peerIndex, true};
+    NimBLEAddress address = peer((uint8_t)(peerIndex < 0 ? 0 : peerIndex));
+    store.query(peerIndex < 0 ? nullptr : &address, fromTS, toTS, visit, &result);
+    return result;
+}
+
+void setUp()
+{
+    nowMs = 1000;
+    BleClock::use(testClock);
+    snprintf(dir, sizeof(dir), "/tmp/ble_ts_XXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+}
+void tearDown()
+{
+    removeDir();
+    BleClock::use(nullptr);
+}
+
+void test_append_and_query()
+{
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    uint32_t startTS = nowMs;
+    TEST_ASSERT_EQUAL_UINT32(1000, ingest(store, 0, 1000));
+    Visit all = query(store, -1, 0, UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(1000, all.count);
+    TEST_ASSERT_TRUE(all.ordered);
+    Visit one = query(store, 3, 0, UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(1000 / PEERS, one.count);
+    TEST_ASSERT_TRUE(one.ordered);
+    /** Bounds are inclusive: records 100 to 199 */
+    Visit range = query(store, -1, startTS + 101 * RECORD_MS, startTS + 200 * RECORD_MS);
+    TEST_ASSERT_EQUAL_UINT32(100, range.count);
+    TEST_ASSERT_EQUAL_UINT32(199, range.lastSequence);
+    /** Delta timestamps and one byte peers keep records small */
+    TEST_ASSERT_LESS_THAN(1000 * 30, store.stats().bytes);
+}
+
+void test_batches_writes()
+{
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    ingest(store, 0, 10);
+    TEST_ASSERT_EQUAL_UINT32(0, store.stats().flushes);
+    /** A batch that waited long enough goes out on update() */
+    nowMs += BLE_TS_FLUSH_MS;
+    store.update(nowMs);
+    TEST_ASSERT_EQUAL_UINT32(1, store.stats().flushes);
+    ingest(store, 10, 1000);
+    /** Far fewer writes than records */
+    TEST_ASSERT_LESS_THAN(1000 / 10, store.stats().flushes);
+}
+
+void test_reopens()
+{
+    {
+        BleTimeSeries store;
+        TEST_ASSERT_TRUE(store.begin(fs, dir));
+        ingest(store, 0, 500);
+        store.flush(nowMs);
+    }
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    TEST_ASSERT_EQUAL_UINT32(500, query(store, -1, 0, UINT32_MAX).count);
+    ingest(store, 500, 100);
+    Visit all = query(store, -1, 0, UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(600, all.count);
+    TEST_ASSERT_TRUE(all.ordered);
+}
+
+void test_torn_tail()
+{
+    {
+        BleTimeSeries store;
+        TEST_ASSERT_TRUE(store.begin(fs, dir));
+        ingest(store, 0, 100);
+        store.flush(nowMs);
+    }
+    /** A reset in the middle of the last write */
+    char name[BLE_TS_PATH + 32];
+    snprintf(name, sizeof(name), "%s/%08lx.seg", dir, 0ul);
+    FILE *pFile = fopen(name, "rb+");
+    TEST_ASSERT_NOT_NULL(pFile);
+    fseek(pFile, 0, SEEK_END);
+    long size = ftell(pFile);
+    fclose(pFile);
+    TEST_ASSERT_EQUAL_INT(0, truncate(name, size - 5));
+
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    TEST_ASSERT_EQUAL_UINT32(99, query(store, -1, 0, UINT32_MAX).count);
+    /** New records go to a fresh segment rather than after the torn one */
+    ingest(store, 100, 10);
+    store.flush(nowMs);
+    BleTimeSeries reopened;
+    TEST_ASSERT_TRUE(reopened.begin(fs, dir));
+    Visit all = query(reopened, -1, 0, UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(109, all.count);
+    TEST_ASSERT_TRUE(all.ordered);
+}
+
+void test_failed_write_loses_only_its_batch()
+{
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    /** The segment's first write, with its header, fails */
+    blockSegment(true);
+    ingest(store, 0, 4);
+    TEST_ASSERT_FALSE(store.flush(nowMs));
+    blockSegment(false);
+    ingest(store, 4, 4);
+    TEST_ASSERT_TRUE(store.flush(nowMs));
+    /** A later one fails, having numbered peers the next records name again */
+    ingest(store, 8, 2);
+    TEST_ASSERT_TRUE(store.flush(nowMs));
+    blockSegment(true);
+    ingest(store, 10, 4);
+    TEST_ASSERT_FALSE(store.flush(nowMs));
+    blockSegment(false);
+    ingest(store, 14, 16);
+    TEST_ASSERT_EQUAL_UINT32(8, store.stats().dropped);
+    Visit all = query(store, -1, 0, UINT32_MAX);
+    TEST_ASSERT_EQUAL_UINT32(22, all.count);
+    TEST_ASSERT_TRUE(all.ordered);
+    TEST_ASSERT_EQUAL_UINT32(29, all.lastSequence);
+    /** Records 5, 21 and 29, the last two numbered after the failure */
+    TEST_ASSERT_EQUAL_UINT32(3, query(store, 5, 0, UINT32_MAX).count);
+}
+
+void test_expires_oldest_segments()
+{
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    /** About twice what the store keeps */
+    uint32_t count = 2 * BLE_TS_SEGMENTS * BLE_TS_SEGMENT_SIZE / 26;
+    TEST_ASSERT_EQUAL_UINT32(count, ingest(store, 0, count));
+    const BleTsStats &stats = store.stats();
+    TEST_ASSERT_TRUE(stats.expired > 0);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.dropped);
+    Visit all = query(store, -1, 0, UINT32_MAX);
+    TEST_ASSERT_TRUE(all.ordered);
+    TEST_ASSERT_TRUE(all.count < count);
+    TEST_ASSERT_EQUAL_UINT32(count - 1, all.lastSequence);
+    /** The time index skips segments outside the range */
+    uint32_t skipped = stats.skipped;
+    Visit last = query(store, -1, nowMs - 1000 + 1, nowMs);
+    TEST_ASSERT_EQUAL_UINT32(1000 / RECORD_MS, last.count);
+    TEST_ASSERT_TRUE(stats.skipped >= skipped + BLE_TS_SEGMENTS - 2);
+}
+
+/** Sustained ingest rate and query latency on the host's file system. Run with -v to see
+ *  the figures
+ */
+void test_benchmark()
+{
+    BleTimeSeries store;
+    TEST_ASSERT_TRUE(store.begin(fs, dir));
+    const uint32_t count = 100000;
+    auto startTS = std::chrono::steady_clock::now();
+    TEST_ASSERT_EQUAL_UINT32(count, ingest(store, 0, count));
+    store.flush(nowMs);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTS).count();
+    const BleTsStats &stats = store.stats();
+    printf("  store: %u records in %.3f s, %.0f records/s, %.1f bytes each, %u writes, p99 %u us\n", (unsigned)count, elapsed,
+           count / elapsed, (double)stats.bytes / stats.records, (unsigned)stats.flushes, (unsigned)stats.flush.percentile(990));
+    for (int i = 0; i < 20; ++i)
+    {
+        query(store, i % PEERS, nowMs - 60000, nowMs);
+        query(store, -1, nowMs - 5000, nowMs);
+    }
+    printf("  store: query p50 %u us, max %u us, %u segments read, %u skipped by index\n", (unsigned)stats.query.percentile(500),
+           (unsigned)stats.query.max, (unsigned)stats.scanned, (unsigned)stats.skipped);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.dropped);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_append_and_query);
+    RUN_TEST(test_batches_writes);
+    RUN_TEST(test_reopens);
+    RUN_TEST(test_torn_tail);
+    RUN_TEST(test_failed_write_loses_only_its_batch);
+    RUN_TEST(test_expires_oldest_segments);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,175 @@
+/** The traffic scheduler, with send functions that record what goes out instead of a stack */
+#define CONFIG_BT_NIMBLE_ROLE_CENTRAL_DISABLED
+#define CONFIG_BT_NIMBLE_ROLE_OBSERVER_DISABLED
+#include <unity.h>
+#include <vector>
+#include "BleTraffic.h"
+
+/** Connections 1 to 3 are up */
+static bool connected[4];
+/** Connections whose frames the stand-in stack refuses */
+static bool refusing[4];
+static std::vector<uint16_t> sent;
+static std::vector<uint16_t> dropped;
+
+int ble_gap_conn_find(uint16_t handle, ble_gap_conn_desc *out_desc)
+{
+    (void)out_desc;
+    return (handle < 4 && connected[handle]) ? 0 : BLE_HS_ENOTCONN;
+}
+static bool record(uint16_t conn, void *target, const uint8_t *data, size_t size)
+{
+    (void)target;
+    (void)data;
+    (void)size;
+    if (refusing[conn])
+    {
+        return false;
+    }
+    sent.push_back(conn);
+    return true;
+}
+static void recordDrop(uint16_t conn, void *state)
+{
+    TEST_ASSERT_EQUAL_PTR(&dropped, state);
+    dropped.push_back(conn);
+}
+static bool queue(uint16_t conn, uint8_t cls, size_t count)
+{
+    uint8_t frame[BLE_FRAME_MAX_SIZE] = {0};
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!BleTraffic::instance().send(conn, cls, record, nullptr, frame, sizeof(frame), recordDrop, &dropped))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+/** Frames sent to conn among the first ones sent */
+static size_t count(uint16_t conn, size_t first = SIZE_MAX)
+{
+    size_t result = 0;
+    for (size_t i = 0; i < sent.size() && i < first; ++i)
+    {
+        result += (sent[i] == conn) ? 1 : 0;
+    }
+    return result;
+}
+
+void setUp()
+{
+    for (size_t i = 0; i < 4; ++i)
+    {
+        connected[i] = (i > 0);
+        refusing[i] = false;
+    }
+    sent.clear();
+    dropped.clear();
+    BleTraffic::instance().begin();
+}
+void tearDown()
+{
+}
+
+void test_control_goes_first()
+{
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_BULK, 2));
+    TEST_ASSERT_TRUE(queue(2, BLE_QOS_CONTROL, 1));
+    TEST_ASSERT_EQUAL(3, BleTraffic::instance().update());
+    TEST_ASSERT_EQUAL_UINT16(2, sent[0]);
+}
+
+void test_refused_link_does_not_hold_others()
+{
+    refusing[1] = true;
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_INTERACTIVE, 2));
+    TEST_ASSERT_TRUE(queue(2, BLE_QOS_INTERACTIVE, 2));
+    TEST_ASSERT_TRUE(queue(3, BLE_QOS_BULK, 2));
+    TEST_ASSERT_EQUAL(4, BleTraffic::instance().update());
+    TEST_ASSERT_EQUAL(0, count(1));
+    TEST_ASSERT_EQUAL(2, count(2));
+    TEST_ASSERT_EQUAL(2, count(3));
+    /** One attempt per update(): the refused frame is still there */
+    TEST_ASSERT_EQUAL(2, BleTraffic::instance().queued(BLE_QOS_INTERACTIVE));
+    refusing[1] = false;
+    TEST_ASSERT_EQUAL(2, BleTraffic::instance().update());
+    TEST_ASSERT_EQUAL(0, BleTraffic::instance().stats(BLE_QOS_INTERACTIVE).dropped);
+}
+
+void test_refused_frame_dropped_after_attempts()
+{
+    refusing[1] = true;
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_BULK, 1));
+    for (size_t i = 0; i < BLE_QOS_ATTEMPTS; ++i)
+    {
+        TEST_ASSERT_EQUAL(0, BleTraffic::instance().update());
+    }
+    TEST_ASSERT_EQUAL(0, BleTraffic::instance().queued(BLE_QOS_BULK));
+    TEST_ASSERT_EQUAL_UINT32(1, BleTraffic::instance().stats(BLE_QOS_BULK).dropped);
+    /** Whoever queued it is told */
+    TEST_ASSERT_EQUAL(1, dropped.size());
+    TEST_ASSERT_EQUAL_UINT16(1, dropped[0]);
+}
+
+void test_tells_of_frames_dropped_with_their_connection()
+{
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_CONTROL, 1));
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_BULK, 2));
+    TEST_ASSERT_TRUE(queue(2, BLE_QOS_BULK, 1));
+    BleTraffic::instance().disconnected(1);
+    TEST_ASSERT_EQUAL(3, dropped.size());
+    /** Unannounced, as its frames come up */
+    connected[2] = false;
+    TEST_ASSERT_EQUAL(0, BleTraffic::instance().update());
+    TEST_ASSERT_EQUAL(4, dropped.size());
+    TEST_ASSERT_EQUAL_UINT16(2, dropped[3]);
+}
+
+void test_weight_lasts_until_disconnected()
+{
+    TEST_ASSERT_TRUE(BleTraffic::instance().weight(1, 3));
+    /** Connections that go unannounced cycle through the other links meanwhile */
+    for (uint16_t conn = 7; conn < 10; ++conn)
+    {
+        TEST_ASSERT_TRUE(queue(conn, BLE_QOS_BULK, 1));
+        BleTraffic::instance().update();
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, BleTraffic::instance().stats(BLE_QOS_BULK).dropped);
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_BULK, 6));
+    TEST_ASSERT_TRUE(queue(2, BLE_QOS_BULK, 2));
+    TEST_ASSERT_EQUAL(8, BleTraffic::instance().update());
+    /** Three of connection 1's frames for each of connection 2's */
+    TEST_ASSERT_EQUAL(3, count(1, 4));
+
+    BleTraffic::instance().disconnected(1);
+    sent.clear();
+    TEST_ASSERT_TRUE(queue(1, BLE_QOS_BULK, 2));
+    TEST_ASSERT_TRUE(queue(2, BLE_QOS_BULK, 2));
+    TEST_ASSERT_EQUAL(4, BleTraffic::instance().update());
+    TEST_ASSERT_EQUAL(1, count(1, 2));
+}
+
+void test_link_of_vanished_connection_is_reused()
+{
+    for (uint16_t conn = 1; conn <= NIMBLE_MAX_CONNECTIONS; ++conn)
+    {
+        TEST_ASSERT_TRUE(BleTraffic::instance().weight(conn, 2));
+    }
+    TEST_ASSERT_FALSE(BleTraffic::instance().weight(9, 1));
+    /** Connection 3 goes without disconnected() */
+    connected[3] = false;
+    TEST_ASSERT_TRUE(BleTraffic::instance().weight(9, 1));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_control_goes_first);
+    RUN_TEST(test_refused_link_does_not_hold_others);
+    RUN_TEST(test_refused_frame_dropped_after_attempts);
+    RUN_TEST(test_tells_of_frames_dropped_with_their_connection);
+    RUN_TEST(test_weight_lasts_until_disconnected);
+    RUN_TEST(test_link_of_vanished_connection_is_reused);
+    return UNITY_END();
+}